@@ -4,6 +4,17 @@
       "target_name": "mfrc522-mi",
       "sources": [
         "src/MFRC522.cpp",
+        "src/SPITransport.cpp",
+        "src/IRQLine.cpp",
+        "src/PollScheduler.cpp",
+        "src/PresenceTracker.cpp",
+        "src/TapRing.cpp",
+        "src/Desfire.cpp",
+        "src/DesfireCipher.cpp",
+        "src/DesfireDirectory.cpp",
+        "src/CardOperation.cpp",
+        "src/KeyRing.cpp",
+        "src/AccessPlanner.cpp",
         "src/accessor.cc"
       ],
       "libraries": [
@@ -1,61 +1,354 @@
-var spawn = require('child_process').spawn;
-var readline = require('readline');
-var registeredCallback = null;
-var child = null;
+var EventEmitter = require('events');
+var rc522 = require('./build/Release/mfrc522-mi');
+var events = new EventEmitter();
+var layout = rc522.tapLayout;
+var littleEndian = require('os').endianness() == "LE";	// The records are in host byte order
+var HEX = [];
+for(var i = 0; i < 256; i++)
+{
+	HEX.push((i < 16 ? "0" : "") + i.toString(16).toUpperCase());
+}
+
+// One event in binary mode, read straight out of the native slab. A single view is moved over every record, so it is
+// only valid inside the callback; copy what you keep (Buffer.from(tap.uidBytes), tap.uid).
+// Nothing is decoded until asked for: tap.uid builds the hex string on access, tap.uidBytes is a view, not a copy.
+function TapView(slab)
+{
+	this.slab = slab;
+	this.offset = 0;
+}
+
+Object.defineProperties(TapView.prototype, {
+	type: { get: function() { return this.slab[this.offset + layout.event] == layout.removed ? "remove" : "arrive"; } },
+	uidBytes: { get: function() {
+		var start = this.offset + layout.uid;
+		return this.slab.subarray(start, start + this.slab[this.offset + layout.uidSize]);
+	} },
+	uid: { get: function() {
+		var hex = "";
+		for(var i = 0, start = this.offset + layout.uid, n = this.slab[this.offset + layout.uidSize]; i < n; i++)
+		{
+			hex += HEX[this.slab[start + i]];
+		}
+		return hex;
+	} },
+	dwell: { get: function() { return littleEndian ? this.slab.readUInt32LE(this.offset + layout.dwell) : this.slab.readUInt32BE(this.offset + layout.dwell); } },
+	sak: { get: function() { return this.slab[this.offset + layout.sak]; } },
+	atqa: { get: function() { return [this.slab[this.offset + layout.atqa], this.slab[this.offset + layout.atqa + 1]]; } },
+	readerId: { get: function() { return littleEndian ? this.slab.readUInt32LE(this.offset + layout.readerId) : this.slab.readUInt32BE(this.offset + layout.readerId); } },
+	status: { get: function() { return this.slab[this.offset + layout.status]; } },
+	timestamp: { get: function() { return littleEndian ? this.slab.readBigUInt64LE(this.offset + layout.timestamp) : this.slab.readBigUInt64BE(this.offset + layout.timestamp); } }
+});
+
+// options: { spiClock: <Hz, default 1000000>, calibrate: <raise the SPI clock as far as the wiring allows>,
+//            irqPin: <GPIO line of the MFRC522 IRQ pin on /dev/gpiochip0, polls over SPI if omitted>,
+//            fastInterval: <ms between polls while cards come and go, default 5>,
+//            slowInterval: <ms between polls once the field is idle, default 20>,
+//            idleTimeout: <ms without activity before slowing down, default 2000>,
+//            cpuBudget: <percent of one CPU polling may use, default 10>,
+//            readerId: <number passed back in the event info, 0 to 4294967295, default 0>,
+//            queueSize: <events buffered while the callbacks are busy, default 64>,
+//            overflow: <"dropOldest" (default) or "dropNewest", which event to lose when the buffer is full>,
+//            binary: <hand out TapView objects instead of hex strings, see TapView>,
+//            keys: <MIFARE Classic keys to try when no key is given: [Buffer (tried as key A and B) or
+//                   { key: <Buffer of 6>, keyType: 0 (A) or 1 (B) }, ...], default the factory key FFFFFFFFFFFF>,
+//            maxBitRate: <kbit/s DESFire operations may switch to with PPS: 106, 212, 424 or 848 (default). The card's
+//                         rates cap it, and a rate that loses frames is dropped for the rest of the card's stay> }
+// The reader polls on a native thread; the callback runs on the main thread with the UID in hex and the event info
+// (see below) when a card arrives.
+// A card that stays in the field is not reported again, its removal comes as a "remove" event (there is no "nocard").
+// In binary mode the callback and both events get a TapView instead: callback(tap), on("arrive"|"remove", tap).
+// Calling it again restarts the reader with the new callback and options.
+// Throws if /dev/spidev0.0 cannot be opened, eg SPI is not enabled or the user may not access it.
+module.exports = exports = function(givenCallback, options){
+	options = options || {};
+	if(options.binary)
+	{
+		var tap = null;
+		rc522.start(function(slab, count) {
+			if(tap === null || tap.slab !== slab)
+			{
+				tap = new TapView(slab);
+			}
+			for(var i = 0; i < count; i++)
+			{
+				tap.offset = i * layout.size;
+				if(tap.type == "arrive" && givenCallback instanceof Function)
+				{
+					givenCallback(tap);
+				}
+				events.emit(tap.type, tap);
+			}
+		}, options);
+		return;
+	}
+	rc522.start(function(type, rfidTagSerialNumber, dwell, info) {
+		if(type == "arrive")
+		{
+			if(givenCallback instanceof Function)
+			{
+				givenCallback(rfidTagSerialNumber, info);
+			}
+			events.emit(type, rfidTagSerialNumber, info);
+		}
+		else
+		{
+			events.emit(type, rfidTagSerialNumber, dwell, info);
+		}
+	}, options);
+};
+
+// Presence events: on("arrive", function(uid, info) {...}), on("remove", function(uid, dwell, info) {...}) with dwell in ms.
+// info: { sak, atqa: [byte, byte], readerId, status: <0 when the card answered>, timestamp: <BigInt, monotonic ns of the SELECT> }
+exports.on = function(type, listener){
+	events.on(type, listener);
+	return exports;
+};
 
+exports.removeListener = function(type, listener){
+	events.removeListener(type, listener);
+	return exports;
+};
 
-module.exports = exports = function(givenCallback){
-	registeredCallback = givenCallback;
+// Scheduler figures: { p50, p99: tap-to-callback latency in ms (upper bounds), events, pollCost: ms of CPU per poll,
+//                      dropped: events lost to a full buffer,
+//                      keyHits: authentications the remembered key of the sector did on the first try,
+//                      keyMisses: authentications that had to search the keys,
+//                      directoryHits, directoryMisses, directoryHitRate: DESFire commands answered from the remembered card
+//                      structure (repeat taps skip GetVersion, GetApplicationIds, GetFileIDs, ...) and the ones that went to the card,
+//                      savedFrames: response frames the hits saved, estimated,
+//                      cipher: AES implementation of DESFire secure messaging }
+exports.stats = function(){
+	return rc522.stats();
 };
 
-var mainProcessShutdown = false;
+// Card operations. They run on the reader thread between two polls, on the card the presence events last reported
+// (the one after "arrive" and before "remove"). Every call returns a Promise.
+// A transaction runs its operations back to back in one session and stops at the first that fails, so an
+// authenticate carries over to the reads and writes after it:
+//   transaction([{ op: "authenticate", block: 4, key: Buffer.from("FFFFFFFFFFFF", "hex") }, { op: "read", block: 4 }])
+// op: authenticate, read, write, ultralightWrite, increment, decrement, restore, transfer, getValue, setValue,
+//     ntag216Auth, readCard, writeCard, plan, desfireGetVersion, desfireGetApplicationIds, desfireSelectApplication, desfireGetKeySettings,
+//     desfireGetKeyVersion, desfireGetFileIds, desfireGetFileSettings, desfireReadData, desfireGetValue, desfireAuthenticate
+// Parameters: block (block, page, key number or file), keyType ("A" or "B"), key (Buffer of 6), data (Buffer),
+//             mask (Buffer), value, offset, length
+// desfireAuthenticate takes the key number in block, the key in data and keyType "des", "2k3des", "3k3des" or "aes"
+// (by default from the size of the key). The DESFire operations after it in the transaction use secure messaging.
+// Resolves with one result per operation: { op, status: 0, code: "OK", message, data: <Buffer>, value, version,
+// fileSettings, desfireStatus, desfireMessage } as far as the operation returns them.
+// Rejects with an Error carrying code ("NO_CARD", "STOPPED" or the status code of the failed operation, eg "TIMEOUT";
+// "DESFIRE" if the DESFire card refused), status, desfireStatus, index (of the failed operation) and results.
+function transaction(operations)
+{
+	return new Promise(function(resolve, reject) {
+		var ops = operations.map(function(operation) {
+			var op = Object.assign({}, operation);
+			if(op.op != "desfireAuthenticate")
+			{
+				op.keyType = op.keyType == "B" || op.keyType == 1 ? 1 : 0;
+			}
+			return op;
+		});
+		rc522.submit(ops, function(error, results) {
+			var failed = results.length > 0 ? results[results.length - 1] : null;
+			if(!error && (results.length < ops.length || (failed && (failed.status != 0 || (failed.desfireStatus || 0) != 0))))
+			{
+				error = {
+					code: failed.status != 0 ? failed.code : "DESFIRE",
+					status: failed.status,
+					message: failed.status != 0 ? failed.message : failed.desfireMessage
+				};
+				error.desfireStatus = failed.desfireStatus;
+				error.index = results.length - 1;
+			}
+			if(error)
+			{
+				var exception = new Error(error.message);
+				Object.assign(exception, error);
+				exception.results = results;
+				reject(exception);
+				return;
+			}
+			resolve(results);
+		});
+	});
+}
 
-var initChildProcess = function()
+// Runs a single operation, resolving with its result.
+function single(operation)
 {
-	child = spawn("node", [__dirname + "/" + "rc522_output.js"]);
-	var linereader = readline.createInterface(child.stdout, child.stdin);
+	return transaction([operation]).then(function(results) { return results[0]; });
+}
 
-	linereader.on('line', function (rfidTagSerialNumber) {
-		if(registeredCallback instanceof Function)
-		{
-			registeredCallback(rfidTagSerialNumber);
-		}
+// Authenticates first if options.key is given: { key: <Buffer of 6>, keyType: "A" (default) or "B" }, or with
+// { keyRing: true } with the first of the start() keys that works.
+function authenticated(block, options, operation)
+{
+	var ops = [];
+	if(options && (options.key || options.keyRing))
+	{
+		ops.push({ op: "authenticate", block: block, key: options.key, keyType: options.keyType });
+	}
+	ops.push(operation);
+	return transaction(ops).then(function(results) { return results[results.length - 1]; });
+}
+
+exports.transaction = transaction;
+
+// MIFARE Classic, Ultralight and NTAG. authenticate() alone only lasts for its own transaction; pass { key } to the
+// other calls, or use transaction(), to authenticate and access in one go.
+// Without a key the start() keys are tried, the one the sector used last time first. Resolves with { keyIndex, ... }.
+exports.authenticate = function(block, key, keyType){
+	return single({ op: "authenticate", block: block, key: key, keyType: keyType });
+};
+
+// Resolves with the 16 bytes of the block (4 pages on Ultralight and NTAG).
+exports.read = function(block, options){
+	return authenticated(block, options, { op: "read", block: block }).then(function(result) { return result.data; });
+};
+
+exports.write = function(block, data, options){
+	return authenticated(block, options, { op: "write", block: block, data: data });
+};
+
+exports.ultralightWrite = function(page, data){
+	return single({ op: "ultralightWrite", block: page, data: data });
+};
+
+exports.increment = function(block, delta, options){
+	return authenticated(block, options, { op: "increment", block: block, value: delta });
+};
+
+exports.decrement = function(block, delta, options){
+	return authenticated(block, options, { op: "decrement", block: block, value: delta });
+};
+
+exports.restore = function(block, options){
+	return authenticated(block, options, { op: "restore", block: block });
+};
+
+exports.transfer = function(block, options){
+	return authenticated(block, options, { op: "transfer", block: block });
+};
+
+exports.getValue = function(block, options){
+	return authenticated(block, options, { op: "getValue", block: block }).then(function(result) { return result.value; });
+};
+
+exports.setValue = function(block, value, options){
+	return authenticated(block, options, { op: "setValue", block: block, value: value });
+};
+
+// Resolves with the 2 byte PACK.
+exports.ntagAuth = function(password){
+	return single({ op: "ntag216Auth", data: password }).then(function(result) { return result.data; });
+};
+
+// Dumps a whole MIFARE Classic Mini, 1K or 4K, authenticating once per sector with the same key.
+// options: { key: <Buffer of 6, default FFFFFFFFFFFF>, keyType: "A" (default) or "B" }
+// Resolves with { image: <Buffer, 16 bytes per block, unreadable sectors zeroed>, sectors: [<code per sector, "OK" if read>],
+// dumpTime: <ms> }.
+exports.readCard = function(options){
+	options = options || {};
+	return single({ op: "readCard", key: options.key, keyType: options.keyType }).then(function(result) {
+		return { image: result.data, sectors: result.sectors, dumpTime: result.dumpTime };
 	});
+};
 
-	child.on('close', function(code) {
-		if(!mainProcessShutdown)
-		{
-			initChildProcess();
-		}
+// Brings a MIFARE Classic Mini, 1K or 4K to the given image, writing only the blocks that differ and verifying them.
+// Sector trailers are written after the data blocks of their sector. Block 0 is never written.
+// A key that does not read back (key A, key B unless the access bits let key A read it) is not known: a trailer that
+// changes is only written if the mask covers that key, otherwise its sector is INVALID and nothing of it is written.
+// options: { key: <Buffer of 6, default FFFFFFFFFFFF>, keyType: "A" (default) or "B",
+//            mask: <Buffer as long as image, the bits of image to write, default all> }
+// Resolves with { sectors: [<code per sector, "OK" if it holds the image now>], blocksWritten }.
+exports.writeCard = function(image, options){
+	options = options || {};
+	return single({ op: "writeCard", data: image, mask: options.mask, key: options.key, keyType: options.keyType }).then(function(result) {
+		return { sectors: result.sectors, blocksWritten: result.blocksWritten };
 	});
 };
 
-// SIGTERM AND SIGINT will trigger the exit event.
-process.once("SIGTERM", function () {
-	process.exit(0);
-});
-process.once("SIGINT", function () {
-	process.exit(0);
-});
+// Runs MIFARE Classic block operations with the fewest authentications the access bits of their sectors allow. The
+// steps are grouped by sector, keeping their order within a sector, and each run of steps is done with a key that
+// may do all of them; access bits not given are read from the sector trailers first. Steps no key may do fail with
+// "INVALID" without being sent.
+// steps: [{ op: "read" | "write" | "increment" | "decrement" | "restore" | "transfer", block, data: <Buffer of 16>, value }]
+// options: { keyA: <Buffer of 6>, keyB: <Buffer of 6> }, a key not given is not used; without both FFFFFFFFFFFF is
+// taken for A and B.
+// Resolves with { steps: [{ op, block, code: "OK" if done, data: <Buffer, reads> }], roundTrips: <exchanges with the
+// card, including the trailer reads and reselects>, authentications }.
+exports.plan = function(steps, options){
+	options = options || {};
+	return single({ op: "plan", steps: steps, keyA: options.keyA, keyB: options.keyB }).then(function(result) {
+		return { steps: result.steps, roundTrips: result.roundTrips, authentications: result.authentications };
+	});
+};
 
-// And the exit event shuts down the child.
-process.once("exit", function () {
-	mainProcessShutdown = true;
-	child.kill();
-});
+// MIFARE DESFire. Calls that take an aid (Buffer of 3) select that application first, and with auth
+// ({ keyNo, key: <Buffer of 8, 16 or 24>, keyType }, see desfireAuthenticate) authenticate before the command.
+function inApplication(aid, operation, auth)
+{
+	var ops = aid ? [{ op: "desfireSelectApplication", data: aid }] : [];
+	if(auth)
+	{
+		ops.push({ op: "desfireAuthenticate", block: auth.keyNo || 0, data: auth.key, keyType: auth.keyType });
+	}
+	ops.push(operation);
+	return transaction(ops).then(function(results) { return results[results.length - 1]; });
+}
 
-// This is a somewhat ugly approach, but it has the advantage of working
-// in conjunction with most of what third parties might choose to do with
-// uncaughtException listeners, while preserving whatever the exception is.
-process.once("uncaughtException", function (error) {
-	// If this was the last of the listeners, then shut down the child and rethrow.
-	// Our assumption here is that any other code listening for an uncaught
-	// exception is going to do the sensible thing and call process.exit().
-	if (process.listeners("uncaughtException").length === 0) {
-		mainProcessShutdown = true;
-		child.kill();
-		throw error;
+exports.desfire = {
+	getVersion: function(){
+		return single({ op: "desfireGetVersion" }).then(function(result) { return result.version; });
+	},
+	// Resolves with an array of 3 byte Buffers.
+	getApplicationIds: function(){
+		return single({ op: "desfireGetApplicationIds" }).then(function(result) {
+			var aids = [];
+			for(var i = 0; i + 3 <= result.data.length; i += 3)
+			{
+				aids.push(result.data.subarray(i, i + 3));
+			}
+			return aids;
+		});
+	},
+	selectApplication: function(aid){
+		return single({ op: "desfireSelectApplication", data: aid });
+	},
+	// Resolves with { settings, maxKeys }.
+	getKeySettings: function(aid, auth){
+		return inApplication(aid, { op: "desfireGetKeySettings" }, auth).then(function(result) {
+			return { settings: result.data[0], maxKeys: result.data[1] };
+		});
+	},
+	getKeyVersion: function(aid, keyNo, auth){
+		return inApplication(aid, { op: "desfireGetKeyVersion", block: keyNo }, auth).then(function(result) { return result.value; });
+	},
+	// Resolves with a Buffer of file ids.
+	getFileIds: function(aid, auth){
+		return inApplication(aid, { op: "desfireGetFileIds" }, auth).then(function(result) { return result.data; });
+	},
+	getFileSettings: function(aid, file, auth){
+		return inApplication(aid, { op: "desfireGetFileSettings", block: file }, auth).then(function(result) { return result.fileSettings; });
+	},
+	// Reads length bytes from offset on, the rest of the file if length is 0 or omitted. Resolves with a Buffer.
+	// On a failure error.results[error.index].data has what was read, a read from offset + its length resumes.
+	// offset and length are 3 byte fields: larger ones, and reads past the end of a file whose size is known, fail with "INVALID".
+	readData: function(aid, file, offset, length, auth){
+		return inApplication(aid, { op: "desfireReadData", block: file, offset: offset || 0, length: length || 0 }, auth).then(function(result) { return result.data; });
+	},
+	getValue: function(aid, file, auth){
+		return inApplication(aid, { op: "desfireGetValue", block: file }, auth).then(function(result) { return result.value; });
 	}
-});
+};
 
-initChildProcess();
+// Stops the reader thread. Node can exit once nothing else is pending.
+exports.stop = function(){
+	rc522.stop();
+};
+
+// Let the reader thread finish its current SPI exchange before the process goes away.
+process.once("exit", function () {
+	rc522.stop();
+});
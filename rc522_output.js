@@ -1,5 +0,0 @@
-var rc522 = require('./build/Release/mfrc522-mi');
-
-rc522(function(rfidTagSerialNumber) {
-	console.log(rfidTagSerialNumber);
-});
\ No newline at end of file
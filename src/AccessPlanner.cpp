@@ -0,0 +1,326 @@
+/*
+* AccessPlanner.cpp - Runs a list of MIFARE Classic block operations with as few authentications as the access bits allow.
+* NOTE: Please also check the comments in AccessPlanner.h.
+* Released into the public domain.
+*/
+
+#include <string.h>
+#include <vector>
+#include "AccessPlanner.h"
+
+// The keys allowed by each access condition, indexed by C1 C2 C3 (C1 is bit 2). See the MIFARE Classic datasheets,
+// section "Access conditions".
+static const byte dataRead[8]		= { 3, 3, 3, 2, 3, 2, 3, 0 };
+static const byte dataWrite[8]		= { 3, 0, 0, 2, 2, 0, 2, 0 };
+static const byte dataIncrement[8]	= { 3, 0, 0, 0, 0, 0, 2, 0 };
+static const byte dataDecrement[8]	= { 3, 3, 0, 0, 0, 0, 3, 0 };	// Also transfer and restore
+static const byte trailerRead[8]	= { 1, 1, 1, 3, 3, 3, 3, 3 };	// The access bits, key A always reads as zeros
+static const byte trailerWrite[8]	= { 0, 1, 0, 2, 0, 2, 0, 0 };	// The access bits
+
+/**
+ * Constructor.
+ */
+AccessPlanner::AccessPlanner(	MFRC522 *reader,			///< The reader the PICCs are selected with.
+								MFRC522::MIFARE_Key *keyA,	///< Key A of the sectors. NULL if not known.
+								MFRC522::MIFARE_Key *keyB	///< Key B of the sectors. NULL if not known.
+							) {
+	_reader = reader;
+	_keys[0] = keyA;
+	_keys[1] = keyB;
+	memset(_source, ACCESS_UNKNOWN, sizeof(_source));
+	memset(&_lastUid, 0, sizeof(_lastUid));
+	_activeKey = KEY_NONE;
+	_activeSector = 0;
+	_lost = MFRC522::STATUS_OK;
+	_roundTrips = 0;
+	_authentications = 0;
+} // End constructor
+
+/**
+ * Sets the access bits of a sector, it is not read from the PICC then.
+ *
+ * @return false if the sector does not exist or the inverted copies in the access bits do not match.
+ */
+bool AccessPlanner::SetAccessBits(	byte sector,					///< The sector, 0-39.
+									const byte *accessBitBuffer		///< Bytes 6 to 8 of the sector trailer.
+								) {
+	if (sector >= MFRC522::MF_MAX_SECTORS || !MFRC522::MIFARE_GetAccessBits(accessBitBuffer, _groups[sector])) {
+		return false;
+	}
+	_source[sector] = ACCESS_GIVEN;
+	return true;
+} // End SetAccessBits()
+
+/**
+ * Forgets all access bits, also the ones set with SetAccessBits().
+ */
+void AccessPlanner::Forget() {
+	memset(_source, ACCESS_UNKNOWN, sizeof(_source));
+} // End Forget()
+
+/**
+ * Runs the requests, sector by sector in the order the sectors first appear, and sets their status.
+ *
+ * A request that fails leaves the PICC in state IDLE; it is selected again and the requests after it are still run.
+ * The access bits read from a card are kept for the next Run() with the same UID.
+ * The PICC must be selected - ie in state ACTIVE - before calling this function.
+ * Remember to call PCD_StopCrypto1() after communicating with the authenticated PICC.
+ *
+ * @return STATUS_OK if all requests succeeded, the status of the first one that failed otherwise.
+ */
+MFRC522::StatusCode AccessPlanner::Run(	MFRC522::Uid *uid,		///< The UID of the selected PICC.
+										Request *requests,		///< The requests, each gets its status.
+										size_t count			///< Number of requests.
+									) {
+	uint32_t exchanges = _reader->PCD_GetExchangeCount();
+	_authentications = 0;
+	_activeKey = KEY_NONE;
+	if (uid->size != _lastUid.size || memcmp(uid->uidByte, _lastUid.uidByte, uid->size) != 0) {
+		for (byte sector = 0; sector < MFRC522::MF_MAX_SECTORS; sector++) {
+			if (_source[sector] == ACCESS_LEARNED) {
+				_source[sector] = ACCESS_UNKNOWN;
+			}
+		}
+		_lastUid = *uid;
+	}
+
+	std::vector<bool> done(count, false);
+	std::vector<Request *> sectorRequests;
+	_lost = MFRC522::STATUS_OK;
+	for (size_t i = 0; i < count; i++) {
+		if (done[i]) {
+			continue;
+		}
+		byte sector = MFRC522::MIFARE_GetSector(requests[i].block);
+		sectorRequests.clear();
+		for (size_t j = i; j < count; j++) {
+			if (!done[j] && MFRC522::MIFARE_GetSector(requests[j].block) == sector) {
+				sectorRequests.push_back(&requests[j]);
+				done[j] = true;
+			}
+		}
+		for (size_t j = 0; j < sectorRequests.size(); j++) {
+			sectorRequests[j]->status = _lost;
+		}
+		if (_lost == MFRC522::STATUS_OK) {
+			RunSector(uid, &sectorRequests[0], sectorRequests.size());
+		}
+	}
+	_roundTrips = _reader->PCD_GetExchangeCount() - exchanges;
+
+	for (size_t i = 0; i < count; i++) {
+		if (requests[i].status != MFRC522::STATUS_OK) {
+			return requests[i].status;
+		}
+	}
+	return MFRC522::STATUS_OK;
+} // End Run()
+
+/**
+ * Runs the requests of one sector in their order, switching keys only where the next request needs the other one.
+ * At a switch the key that can do the most requests in a row is taken, which keeps the switches to the minimum.
+ */
+void AccessPlanner::RunSector(	MFRC522::Uid *uid,		///< The UID of the selected PICC.
+								Request **requests,		///< The requests, all in one sector.
+								size_t count			///< Number of requests.
+							) {
+	byte sector = MFRC522::MIFARE_GetSector(requests[0]->block);
+	if (_activeSector != sector) {
+		_activeKey = KEY_NONE;
+	}
+	if (_source[sector] == ACCESS_UNKNOWN) {
+		MFRC522::StatusCode result = LearnAccessBits(uid, sector);
+		if (result != MFRC522::STATUS_OK) {
+			for (size_t i = 0; i < count; i++) {
+				requests[i]->status = result;
+			}
+			return;
+		}
+	}
+
+	std::vector<byte> allowed(count);
+	for (size_t i = 0; i < count; i++) {
+		allowed[i] = AllowedKeys(requests[i]);
+	}
+	for (size_t i = 0; i + 1 < count; i++) {
+		// A value operation fills the transfer buffer, which a new authentication would clear before the transfer
+		Operation op = requests[i]->op;
+		if ((op == OP_INCREMENT || op == OP_DECREMENT || op == OP_RESTORE) && requests[i + 1]->op == OP_TRANSFER) {
+			allowed[i] &= allowed[i + 1];
+			allowed[i + 1] = allowed[i];
+		}
+	}
+
+	byte usable = KEY_AB;			// Keys that did not fail to authenticate
+	MFRC522::StatusCode keyStatus = MFRC522::STATUS_INVALID;	// Why a request has no usable key
+	size_t i;
+	for (i = 0; i < count; i++) {
+		Request *request = requests[i];
+		if (allowed[i] == KEY_NONE) {
+			request->status = MFRC522::STATUS_INVALID;
+			continue;
+		}
+		if ((allowed[i] & usable) == KEY_NONE) {
+			request->status = keyStatus;
+			continue;
+		}
+		if ((_activeKey & allowed[i]) == KEY_NONE) {
+			// Pick the key that covers the longest run of requests from here on
+			size_t runA = 0, runB = 0;
+			for (size_t j = i; j < count && (allowed[j] == KEY_NONE || (allowed[j] & KEY_A)); j++) {
+				runA++;
+			}
+			for (size_t j = i; j < count && (allowed[j] == KEY_NONE || (allowed[j] & KEY_B)); j++) {
+				runB++;
+			}
+			byte key = (allowed[i] & usable & KEY_A) && (runA >= runB || !(allowed[i] & usable & KEY_B)) ? KEY_A : KEY_B;
+			MFRC522::StatusCode result = Authenticate(uid, sector, key);
+			if (result != MFRC522::STATUS_OK) {
+				usable &= ~key;
+				keyStatus = result;
+				request->status = result;
+				if (Recover(uid) != MFRC522::STATUS_OK) {
+					break;
+				}
+				continue;
+			}
+		}
+		request->status = Execute(request);
+		if (request->status != MFRC522::STATUS_OK) {
+			if (request->op >= OP_INCREMENT && request->op != OP_TRANSFER && i + 1 < count && requests[i + 1]->op == OP_TRANSFER) {
+				// Nothing to transfer
+				requests[++i]->status = request->status;
+			}
+			if (Recover(uid) != MFRC522::STATUS_OK) {
+				break;
+			}
+		}
+	}
+	// If the PICC left the field, the requests not run yet fail with the status of the selection
+	while (++i < count) {
+		requests[i]->status = _lost;
+	}
+} // End RunSector()
+
+/**
+ * The keys that may do a request according to the access bits of its sector.
+ *
+ * @return A KeySet, KEY_NONE if no known key may.
+ */
+byte AccessPlanner::AllowedKeys(const Request *request) const {
+	const byte *groups = _groups[MFRC522::MIFARE_GetSector(request->block)];
+	byte group = MFRC522::MIFARE_GetAccessGroup(request->block);
+	byte condition = groups[group];
+	byte keys = KEY_NONE;
+
+	if (group == 3) {
+		if (request->op == OP_READ) {
+			keys = trailerRead[condition];
+		}
+		else if (request->op == OP_WRITE) {
+			keys = trailerWrite[condition];
+		}
+	}
+	else if (request->block != 0 || request->op == OP_READ) {	// Block 0 holds the manufacturer data and is read only
+		switch (request->op) {
+			case OP_READ:		keys = dataRead[condition];			break;
+			case OP_WRITE:		keys = dataWrite[condition];		break;
+			case OP_INCREMENT:	keys = dataIncrement[condition];	break;
+			default:			keys = dataDecrement[condition];	break;
+		}
+	}
+	if (groups[3] <= 2) {
+		keys &= ~KEY_B;		// Key B is readable, it is data then
+	}
+	if (!_keys[0]) {
+		keys &= ~KEY_A;
+	}
+	if (!_keys[1]) {
+		keys &= ~KEY_B;
+	}
+	return keys;
+} // End AllowedKeys()
+
+/**
+ * Reads the access bits of a sector from its trailer. Key A is tried first, as it may always read them.
+ * The sector stays authenticated with the key that worked.
+ *
+ * @return STATUS_OK on success, STATUS_INVALID if the access bits are malformed, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode AccessPlanner::LearnAccessBits(MFRC522::Uid *uid, byte sector) {
+	MFRC522::StatusCode result = MFRC522::STATUS_INVALID;
+	byte trailer = MFRC522::MIFARE_GetSectorFirstBlock(sector) + MFRC522::MIFARE_GetSectorBlockCount(sector) - 1;
+	for (byte key = KEY_A; key <= KEY_B; key++) {
+		if (!_keys[key - 1]) {
+			continue;
+		}
+		result = _activeKey == key ? MFRC522::STATUS_OK : Authenticate(uid, sector, key);
+		if (result == MFRC522::STATUS_OK) {
+			byte buffer[18];
+			byte bufferSize = sizeof(buffer);
+			result = _reader->MIFARE_Read(trailer, buffer, &bufferSize);
+			if (result == MFRC522::STATUS_OK) {
+				if (!MFRC522::MIFARE_GetAccessBits(&buffer[6], _groups[sector])) {
+					return MFRC522::STATUS_INVALID;
+				}
+				_source[sector] = ACCESS_LEARNED;
+				return MFRC522::STATUS_OK;
+			}
+		}
+		if (Recover(uid) != MFRC522::STATUS_OK) {
+			return _lost;
+		}
+	}
+	return result;
+} // End LearnAccessBits()
+
+/**
+ * Authenticates a sector with key A or B.
+ */
+MFRC522::StatusCode AccessPlanner::Authenticate(MFRC522::Uid *uid, byte sector, byte key) {
+	byte trailer = MFRC522::MIFARE_GetSectorFirstBlock(sector) + MFRC522::MIFARE_GetSectorBlockCount(sector) - 1;
+	_authentications++;
+	MFRC522::StatusCode result = _reader->PCD_Authenticate(key == KEY_A ? MFRC522::PICC_CMD_MF_AUTH_KEY_A : MFRC522::PICC_CMD_MF_AUTH_KEY_B,
+														   trailer, _keys[key - 1], uid);
+	if (result == MFRC522::STATUS_OK) {
+		_activeKey = key;
+		_activeSector = sector;
+	}
+	return result;
+} // End Authenticate()
+
+/**
+ * Sends one request to the authenticated PICC.
+ */
+MFRC522::StatusCode AccessPlanner::Execute(Request *request) {
+	byte buffer[18];
+	byte bufferSize = sizeof(buffer);
+	MFRC522::StatusCode result;
+
+	switch (request->op) {
+		case OP_READ:
+			result = _reader->MIFARE_Read(request->block, buffer, &bufferSize);
+			if (result == MFRC522::STATUS_OK) {
+				memcpy(request->data, buffer, 16);
+			}
+			return result;
+		case OP_WRITE:		return _reader->MIFARE_Write(request->block, request->data, 16);
+		case OP_INCREMENT:	return _reader->MIFARE_Increment(request->block, request->value);
+		case OP_DECREMENT:	return _reader->MIFARE_Decrement(request->block, request->value);
+		case OP_RESTORE:	return _reader->MIFARE_Restore(request->block);
+		case OP_TRANSFER:	return _reader->MIFARE_Transfer(request->block);
+	}
+	return MFRC522::STATUS_INVALID;
+} // End Execute()
+
+/**
+ * Selects the PICC again after it dropped out of the ACTIVE state. If that fails the PICC is gone, see _lost.
+ *
+ * @return The status of the selection.
+ */
+MFRC522::StatusCode AccessPlanner::Recover(MFRC522::Uid *uid) {
+	_reader->PCD_StopCrypto1();
+	_activeKey = KEY_NONE;
+	_lost = _reader->PICC_Reselect(uid);
+	return _lost;
+} // End Recover()
@@ -0,0 +1,84 @@
+/**
+ * AccessPlanner.h - Runs a list of MIFARE Classic block operations with as few authentications as the access bits allow.
+ *
+ * Which key may read, write, increment or decrement a block is set per block group by the access bits C1 C2 C3 in the
+ * sector trailer. AccessPlanner decodes them (from SetAccessBits(), or by reading the trailer the first time a sector
+ * is used), groups the requests by sector and picks for each run of requests the key that is allowed to do all of them,
+ * switching keys only where the access conditions force it. Requests no key may do fail with STATUS_INVALID without
+ * being sent. The order of the requests within a sector is kept, so a value operation and the transfer after it stay
+ * together.
+ * Key B cannot be used while the trailer makes it readable (access conditions 000, 001 and 010 of the trailer), as the
+ * PICC ignores it then.
+ *
+ * Released into the public domain.
+ */
+#ifndef ACCESSPLANNER_h
+#define ACCESSPLANNER_h
+
+#include "MFRC522.h"
+
+class AccessPlanner {
+public:
+	enum Operation : byte {
+		OP_READ			,	// data (16 bytes) <- block
+		OP_WRITE		,	// data (16 bytes) -> block
+		OP_INCREMENT	,	// value
+		OP_DECREMENT	,	// value
+		OP_RESTORE		,
+		OP_TRANSFER
+	};
+
+	// One block operation and, once run, its result.
+	typedef struct {
+		Operation op;
+		byte block;
+		byte *data;					// OP_READ, OP_WRITE: 16 bytes
+		int32_t value;				// OP_INCREMENT, OP_DECREMENT: the delta
+		MFRC522::StatusCode status;
+	} Request;
+
+	AccessPlanner(MFRC522 *reader, MFRC522::MIFARE_Key *keyA, MFRC522::MIFARE_Key *keyB);
+
+	bool SetAccessBits(byte sector, const byte *accessBitBuffer);
+	void Forget();
+
+	MFRC522::StatusCode Run(MFRC522::Uid *uid, Request *requests, size_t count);
+
+	uint32_t GetRoundTrips() const { return _roundTrips; };
+	uint32_t GetAuthentications() const { return _authentications; };
+
+protected:
+	// Keys as a set of bits
+	enum KeySet : byte {
+		KEY_NONE	= 0,
+		KEY_A		= 1,
+		KEY_B		= 2,
+		KEY_AB		= 3
+	};
+
+	enum AccessSource : byte {
+		ACCESS_UNKNOWN	,
+		ACCESS_GIVEN	,			// From SetAccessBits(), kept for every card
+		ACCESS_LEARNED				// Read from the trailer of the last card
+	};
+
+	MFRC522 *_reader;
+	MFRC522::MIFARE_Key *_keys[2];	// Key A, key B. NULL if not known.
+	byte _groups[MFRC522::MF_MAX_SECTORS][4];	// Access conditions C1 C2 C3 of the block groups
+	AccessSource _source[MFRC522::MF_MAX_SECTORS];
+	MFRC522::Uid _lastUid;			// The card the learned access bits are from
+	byte _activeKey;				// KEY_A or KEY_B the sector _activeSector is authenticated with, KEY_NONE if none
+	byte _activeSector;
+	MFRC522::StatusCode _lost;		// The status of the selection that failed during Run(), STATUS_OK while the PICC is there
+	uint32_t _roundTrips;			// Exchanges with the PICC during the last Run()
+	uint32_t _authentications;		// PCD_Authenticate() calls during the last Run()
+
+	byte AllowedKeys(const Request *request) const;
+	MFRC522::StatusCode LearnAccessBits(MFRC522::Uid *uid, byte sector);
+	MFRC522::StatusCode Authenticate(MFRC522::Uid *uid, byte sector, byte key);
+	MFRC522::StatusCode Execute(Request *request);
+	MFRC522::StatusCode Recover(MFRC522::Uid *uid);
+	void RunSector(MFRC522::Uid *uid, Request **requests, size_t count);
+};
+
+#endif
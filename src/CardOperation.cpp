@@ -0,0 +1,698 @@
+/*
+* CardOperation.cpp - Runs queued card commands on the tracked card.
+* NOTE: Please also check the comments in CardOperation.h.
+* Released into the public domain.
+*/
+
+#include <string.h>
+#include "CardOperation.h"
+
+/**
+ * Constructor.
+ */
+CardSession::CardSession(	DESFire *reader,			///< The reader the tracker polls with.
+							PresenceTracker *tracker,	///< Knows the card the operations are for.
+							KeyRing *keyRing,			///< Candidate keys for authentications without a key. NULL if there are none.
+							DesfireDirectory *directory	///< Remembers the structure of DESFire cards. NULL to ask the card every time.
+						) {
+	_reader = reader;
+	_tracker = tracker;
+	_keyRing = keyRing;
+	_directory = directory;
+	_cachedSettings = false;
+	memset(&_aid, 0, sizeof(_aid));
+	_authenticated = false;
+	_isoDep = false;
+	memset(&_tag, 0, sizeof(_tag));
+	_maxBitRate = MFRC522::BITRATE_848;
+	memset(&_lastUid, 0, sizeof(_lastUid));
+	_authKeySize = 0;
+} // End constructor
+
+/**
+ * Wakes and selects the tracked card.
+ *
+ * @return STATUS_OK if the card is ready for Run(), STATUS_??? otherwise. STATUS_TIMEOUT if there is no card.
+ */
+MFRC522::StatusCode CardSession::Begin() {
+	return _tracker->Activate();
+} // End Begin()
+
+/**
+ * Runs one operation and stores its results in *op.
+ *
+ * @return true if the PICC accepted the operation. Stop the batch otherwise, the PICC may have dropped its state.
+ */
+bool CardSession::Run(CardOperation *op) {
+	op->status = MFRC522::STATUS_OK;
+	op->desfireStatus = DESFire::MF_OPERATION_OK;
+	if (op->IsDesfire()) {
+		if (!_isoDep) {
+			op->status = ActivateIsoDep();
+			if (op->status != MFRC522::STATUS_OK) {
+				return false;
+			}
+		}
+		if (op->type == CardOperation::OP_DESFIRE_READ_DATA) {
+			op->data.clear();	// A retry below resumes after the data the first run got
+		}
+		RunDesfire(op);
+		// A raised bit rate that loses frames is dropped for the rest of the card's stay. The operations only read,
+		// so one that failed in transport runs again at the lower rate.
+		bool failed = IsTransportError(op->status);
+		if (_tag.bitRate != 0 && (failed || DESFire::PICC_IsBitRateFailing(&_tag)) && DESFire::PICC_LowerBitRate(&_tag)) {
+			MFRC522::StatusCode result = ReactivateIsoDep();
+			if (result != MFRC522::STATUS_OK) {
+				op->status = result;
+				return false;
+			}
+			if (failed) {
+				RunDesfire(op);
+			}
+		}
+	}
+	else {
+		RunMifare(op);
+	}
+	return op->Succeeded();
+} // End Run()
+
+/**
+ * Puts the card back to sleep: DESELECT after ISO/IEC 14443-4, HLTA otherwise, and ends Crypto1.
+ */
+void CardSession::End() {
+	if (!_isoDep || _reader->PICC_Deselect(_tag.cid) != MFRC522::STATUS_OK) {
+		_reader->PICC_HaltA();
+	}
+	if (_authenticated) {
+		_reader->PCD_StopCrypto1();
+	}
+	_authenticated = false;
+	_isoDep = false;
+	memset(_authKey, 0, sizeof(_authKey));
+	_authKeySize = 0;
+	memset(&_aid, 0, sizeof(_aid));		// The next activation starts at the PICC level
+} // End End()
+
+/**
+ * Requests the ATS, the card enters the ISO/IEC 14443-4 protocol state, and raises the bit rate as far as the card,
+ * _maxBitRate and earlier fallbacks on this card allow.
+ * A failed PPS leaves the card at an unknown rate: it is selected again and stays at 106 kbit/s, where no PPS is sent.
+ */
+MFRC522::StatusCode CardSession::ActivateIsoDep() {
+	MFRC522::Uid uid = _tracker->GetUid();
+	if (uid.size != _lastUid.size || memcmp(uid.uidByte, _lastUid.uidByte, uid.size) != 0) {
+		_tag.rateCeiling = 0;	// A new card, nothing known about its link
+		_lastUid = uid;
+	}
+
+	MFRC522::StatusCode result = _reader->PICC_ActivateIsoDep(&_tag);
+	if (result != MFRC522::STATUS_OK) {
+		return result;
+	}
+	_isoDep = true;
+	if (_reader->PICC_SelectBitRate(&_tag, _maxBitRate) == MFRC522::STATUS_OK) {
+		return MFRC522::STATUS_OK;
+	}
+
+	_tag.rateCeiling = MFRC522::BITRATE_106 + 1;
+	LeaveIsoDep();
+	result = Begin();
+	if (result == MFRC522::STATUS_OK) {
+		result = _reader->PICC_ActivateIsoDep(&_tag);
+	}
+	_isoDep = result == MFRC522::STATUS_OK;
+	return result;
+} // End ActivateIsoDep()
+
+/**
+ * Ends the ISO/IEC 14443-4 session and starts a new one, eg after PICC_LowerBitRate(). The selected application is
+ * selected again, and the last DESFire authentication repeated.
+ */
+MFRC522::StatusCode CardSession::ReactivateIsoDep() {
+	DESFire::mifare_desfire_aid_t aid;
+	memcpy(aid.data, _tag.selected_application, MIFARE_AID_SIZE);
+	LeaveIsoDep();
+	MFRC522::StatusCode result = Begin();
+	if (result == MFRC522::STATUS_OK) {
+		result = ActivateIsoDep();
+	}
+	if (result != MFRC522::STATUS_OK) {
+		return result;
+	}
+	DESFire::StatusCode status;
+	status.mfrc522 = MFRC522::STATUS_OK;
+	status.desfire = DESFire::MF_OPERATION_OK;
+	// The PICC level is selected after the activation
+	if (aid.data[0] != 0 || aid.data[1] != 0 || aid.data[2] != 0) {
+		status = _reader->MIFARE_DESFIRE_SelectApplication(&_tag, &aid);
+	}
+	if (_reader->IsStatusCodeOK(status) && _authKeySize != 0) {
+		status = _reader->MIFARE_DESFIRE_Authenticate(&_tag, _authKeyNo, _authKeyType, _authKey);
+	}
+	if (status.mfrc522 != MFRC522::STATUS_OK) {
+		return status.mfrc522;
+	}
+	return _reader->IsStatusCodeOK(status) ? MFRC522::STATUS_OK : MFRC522::STATUS_ERROR;
+} // End ReactivateIsoDep()
+
+/**
+ * Takes the card out of the ISO/IEC 14443-4 protocol state so that it can be selected again. A card that does not
+ * take the DESELECT, eg because it is at another bit rate, only leaves it with a field reset.
+ */
+void CardSession::LeaveIsoDep() {
+	if (_reader->PICC_Deselect(_tag.cid) != MFRC522::STATUS_OK) {
+		_reader->PCD_SetBitRate(MFRC522::BITRATE_106, MFRC522::BITRATE_106);
+		_reader->PCD_AntennaOff();
+		delay(CARD_FIELD_RESET_MS);
+		_reader->PCD_AntennaOn();
+	}
+	_isoDep = false;
+} // End LeaveIsoDep()
+
+/**
+ * Tells if the PICC's answer was lost or garbled, as opposed to an answer reporting an error.
+ */
+bool CardSession::IsTransportError(MFRC522::StatusCode status) const {
+	return status == MFRC522::STATUS_TIMEOUT || status == MFRC522::STATUS_ERROR || status == MFRC522::STATUS_COLLISION
+		|| status == MFRC522::STATUS_CRC_WRONG;
+} // End IsTransportError()
+
+/**
+ * MIFARE Classic, Ultralight and NTAG commands.
+ */
+void CardSession::RunMifare(CardOperation *op) {
+	byte buffer[18];
+	byte bufferSize = sizeof(buffer);
+	MFRC522::Uid uid = _tracker->GetUid();
+
+	switch (op->type) {
+		case CardOperation::OP_AUTHENTICATE:
+			if (op->useKeyRing) {
+				byte keyIndex = 0;
+				op->status = _keyRing ? _keyRing->Authenticate(&uid, op->block, &keyIndex) : MFRC522::STATUS_INVALID;
+				op->value = keyIndex;
+			}
+			else {
+				op->status = _reader->PCD_Authenticate(op->keyType, op->block, &op->key, &uid);
+			}
+			_authenticated = _authenticated || op->status == MFRC522::STATUS_OK;
+			break;
+
+		case CardOperation::OP_READ:
+			op->status = _reader->MIFARE_Read(op->block, buffer, &bufferSize);
+			if (op->status == MFRC522::STATUS_OK) {
+				op->data.assign(buffer, buffer + 16);	// Without the CRC_A
+			}
+			break;
+
+		case CardOperation::OP_WRITE:
+			if (op->data.size() != 16) {
+				op->status = MFRC522::STATUS_INVALID;
+				break;
+			}
+			op->status = _reader->MIFARE_Write(op->block, &op->data[0], 16);
+			break;
+
+		case CardOperation::OP_ULTRALIGHT_WRITE:
+			if (op->data.size() != 4) {
+				op->status = MFRC522::STATUS_INVALID;
+				break;
+			}
+			op->status = _reader->MIFARE_Ultralight_Write(op->block, &op->data[0], 4);
+			break;
+
+		case CardOperation::OP_INCREMENT:
+			op->status = _reader->MIFARE_Increment(op->block, op->value);
+			break;
+
+		case CardOperation::OP_DECREMENT:
+			op->status = _reader->MIFARE_Decrement(op->block, op->value);
+			break;
+
+		case CardOperation::OP_RESTORE:
+			op->status = _reader->MIFARE_Restore(op->block);
+			break;
+
+		case CardOperation::OP_TRANSFER:
+			op->status = _reader->MIFARE_Transfer(op->block);
+			break;
+
+		case CardOperation::OP_GET_VALUE:
+			op->status = _reader->MIFARE_GetValue(op->block, &op->value);
+			break;
+
+		case CardOperation::OP_SET_VALUE:
+			op->status = _reader->MIFARE_SetValue(op->block, op->value);
+			break;
+
+		case CardOperation::OP_NTAG216_AUTH:
+			if (op->data.size() != 4) {
+				op->status = MFRC522::STATUS_INVALID;
+				break;
+			}
+			op->status = _reader->PCD_NTAG216_AUTH(&op->data[0], buffer);
+			if (op->status == MFRC522::STATUS_OK) {
+				op->data.assign(buffer, buffer + 2);	// PACK
+			}
+			break;
+
+		case CardOperation::OP_READ_CARD: {
+			// A sector that fails does not fail the operation, see sectorStatus
+			MFRC522::StatusCode sectorStatus[MFRC522::MF_MAX_SECTORS];
+			byte sectorCount = MFRC522::MF_MAX_SECTORS;
+			uint16_t imageSize = MFRC522::MF_MAX_IMAGE_SIZE;
+			uint32_t dumpTimeUs = 0;
+			op->data.resize(imageSize);
+			MFRC522::StatusCode result = _reader->MIFARE_ReadCard(op->keyType, &op->key, &uid, &op->data[0], &imageSize, sectorStatus, &sectorCount, &dumpTimeUs);
+			if (result == MFRC522::STATUS_INVALID || result == MFRC522::STATUS_NO_ROOM) {
+				op->status = result;
+				op->data.clear();
+				break;
+			}
+			_authenticated = true;
+			op->data.resize(imageSize);
+			op->sectorStatus.assign(sectorStatus, sectorStatus + sectorCount);
+			op->value = dumpTimeUs;
+			break;
+		}
+
+		case CardOperation::OP_WRITE_CARD: {
+			// Like OP_READ_CARD, a sector that fails does not fail the operation
+			MFRC522::StatusCode sectorStatus[MFRC522::MF_MAX_SECTORS];
+			byte sectorCount = MFRC522::MF_MAX_SECTORS;
+			uint16_t blocksWritten = 0;
+			if (op->data.empty() || (!op->mask.empty() && op->mask.size() != op->data.size())) {
+				op->status = MFRC522::STATUS_INVALID;
+				break;
+			}
+			MFRC522::StatusCode result = _reader->MIFARE_WriteCardImage(op->keyType, &op->key, &uid, &op->data[0], op->mask.empty() ? NULL : &op->mask[0],
+																		op->data.size(), sectorStatus, &sectorCount, &blocksWritten);
+			if (result == MFRC522::STATUS_INVALID || result == MFRC522::STATUS_NO_ROOM) {
+				op->status = result;
+				break;
+			}
+			_authenticated = true;
+			op->data.clear();
+			op->sectorStatus.assign(sectorStatus, sectorStatus + sectorCount);
+			op->value = blocksWritten;
+			break;
+		}
+
+		case CardOperation::OP_PLAN: {
+			// Like OP_READ_CARD, a step that fails does not fail the operation
+			AccessPlanner planner(_reader, (op->keys & 1) ? &op->key : NULL, (op->keys & 2) ? &op->keyB : NULL);
+			if (op->steps.empty() || op->data.size() != op->steps.size() * 16) {
+				op->status = MFRC522::STATUS_INVALID;
+				break;
+			}
+			for (size_t i = 0; i < op->steps.size(); i++) {
+				op->steps[i].data = &op->data[i * 16];
+			}
+			planner.Run(&uid, &op->steps[0], op->steps.size());
+			_authenticated = _authenticated || planner.GetAuthentications() > 0;
+			op->value = planner.GetRoundTrips();
+			op->length = planner.GetAuthentications();
+			break;
+		}
+
+		default:
+			op->status = MFRC522::STATUS_INVALID;
+			break;
+	}
+} // End RunMifare()
+
+/**
+ * The communication mode of reading a file while authenticated: the one in its settings, unless the file can be read
+ * without authentication (free access, key number 0xE), which is always plain.
+ */
+DESFire::mifare_desfire_communication_modes CardSession::GetReadMode(const DESFire::mifare_desfire_file_settings_t *fileSettings) const {
+	uint16_t rights = fileSettings->access_rights;
+	bool freeAccess = ((rights >> 12) & 0xF) == 0xE || ((rights >> 4) & 0xF) == 0xE;
+	if (fileSettings->file_type == DESFire::MDFT_VALUE_FILE_WITH_BACKUP) {
+		freeAccess = freeAccess || (rights & 0xF) == 0xE;	// GetValue is allowed with the write key as well
+	}
+	if (freeAccess) {
+		return DESFire::MDCM_PLAIN;
+	}
+	switch (fileSettings->communication_settings & 0x03) {
+		case DESFire::MDCM_MACED:		return DESFire::MDCM_MACED;
+		case DESFire::MDCM_ENCIPHERED:	return DESFire::MDCM_ENCIPHERED;
+		default:						return DESFire::MDCM_PLAIN;
+	}
+} // End GetReadMode()
+
+/**
+ * MIFARE DESFire commands. The PICC is in the ISO/IEC 14443-4 protocol state.
+ */
+void CardSession::RunDesfire(CardOperation *op) {
+	DESFire::StatusCode result;
+	result.mfrc522 = MFRC522::STATUS_INVALID;
+	result.desfire = DESFire::MF_OPERATION_OK;
+	_cachedSettings = false;
+
+	if (RunCached(op)) {
+		return;
+	}
+	// A deferred selection goes to the card first, a new one replaces it
+	if (op->type != CardOperation::OP_DESFIRE_SELECT_APPLICATION) {
+		result = SelectPending();
+		if (!_reader->IsStatusCodeOK(result)) {
+			SetDesfireResult(op, result);
+			return;
+		}
+		result.mfrc522 = MFRC522::STATUS_INVALID;
+	}
+
+	switch (op->type) {
+		case CardOperation::OP_DESFIRE_GET_VERSION:
+			result = _reader->MIFARE_DESFIRE_GetVersion(&_tag, &op->version);
+			break;
+
+		case CardOperation::OP_DESFIRE_GET_APPLICATION_IDS: {
+			DESFire::mifare_desfire_aid_t aids[MIFARE_MAX_APPLICATION_COUNT];
+			byte count = 0;
+			result = _reader->MIFARE_DESFIRE_GetApplicationIds(&_tag, aids, &count);
+			op->data.clear();
+			for (byte i = 0; i < count && _reader->IsStatusCodeOK(result); i++) {
+				op->data.insert(op->data.end(), aids[i].data, aids[i].data + MIFARE_AID_SIZE);
+			}
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_SELECT_APPLICATION: {
+			DESFire::mifare_desfire_aid_t aid;
+			if (op->data.size() != MIFARE_AID_SIZE) {
+				break;
+			}
+			memcpy(aid.data, &op->data[0], MIFARE_AID_SIZE);
+			_authKeySize = 0;	// Selecting ends the authentication
+			result = _reader->MIFARE_DESFIRE_SelectApplication(&_tag, &aid);
+			memcpy(_aid.data, _tag.selected_application, MIFARE_AID_SIZE);
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_AUTHENTICATE: {
+			DesfireCipher::KeyType keyType = (DesfireCipher::KeyType)op->keyType;
+			if (op->keyType > DesfireCipher::KEY_AES || op->data.size() != DesfireCipher::GetKeySize(keyType)) {
+				break;
+			}
+			_authKeySize = 0;
+			result = _reader->MIFARE_DESFIRE_Authenticate(&_tag, op->block, keyType, &op->data[0]);
+			if (_reader->IsStatusCodeOK(result)) {
+				_authKeyNo = op->block;
+				_authKeyType = keyType;
+				memcpy(_authKey, &op->data[0], op->data.size());
+				_authKeySize = op->data.size();
+			}
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_GET_KEY_SETTINGS: {
+			byte settings = 0, maxKeys = 0;
+			result = _reader->MIFARE_DESFIRE_GetKeySettings(&_tag, &settings, &maxKeys);
+			op->data.clear();
+			op->data.push_back(settings);
+			op->data.push_back(maxKeys);
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_GET_KEY_VERSION: {
+			byte version = 0;
+			result = _reader->MIFARE_DESFIRE_GetKeyVersion(&_tag, op->block, &version);
+			op->value = version;
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_GET_FILE_IDS: {
+			byte files[MIFARE_MAX_FILE_COUNT + 5];
+			byte count = 0;
+			result = _reader->MIFARE_DESFIRE_GetFileIDs(&_tag, files, &count);
+			op->data.assign(files, files + (_reader->IsStatusCodeOK(result) ? count : 0));
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_GET_FILE_SETTINGS:
+			result = _reader->MIFARE_DESFIRE_GetFileSettings(&_tag, &op->block, &op->fileSettings);
+			break;
+
+		case CardOperation::OP_DESFIRE_READ_DATA: {
+			// Data in op->data is from an earlier run that failed, the read continues after it
+			uint32_t kept = op->data.size();
+			uint32_t length = op->length;
+			DESFire::mifare_desfire_communication_modes mode = DESFire::MDCM_PLAIN;
+			if (length > MIFARE_DESFIRE_MAX_DATA || op->offset > MIFARE_DESFIRE_MAX_DATA) {
+				result.mfrc522 = MFRC522::STATUS_INVALID;
+				break;
+			}
+			if (length == 0 || _tag.authScheme != 0) {
+				// The whole file from offset on, its size has to be known up front. Secure messaging needs its mode.
+				result = ReadFileSettings(op);
+				if (!_reader->IsStatusCodeOK(result)) {
+					break;
+				}
+				if (op->fileSettings.file_type != DESFire::MDFT_STANDARD_DATA_FILE && op->fileSettings.file_type != DESFire::MDFT_BACKUP_DATA_FILE) {
+					result.mfrc522 = MFRC522::STATUS_INVALID;
+					break;
+				}
+				uint32_t size = op->fileSettings.settings.standard_file.file_size;
+				if (length == 0) {
+					length = size > op->offset ? size - op->offset : 0;
+				}
+				else if ((uint64_t)op->offset + length > size) {
+					result.mfrc522 = MFRC522::STATUS_INVALID;	// Past the end of the file
+					break;
+				}
+				mode = GetReadMode(&op->fileSettings);
+			}
+			result.mfrc522 = MFRC522::STATUS_OK;
+			if (kept >= length) {
+				break;
+			}
+			// Straight into op->data, window by window
+			op->data.resize((size_t)length + MIFARE_DESFIRE_READ_SLACK);
+			DesfireBufferSink sink(&op->data[kept], op->data.size() - kept);
+			uint32_t done = 0;
+			result = _reader->MIFARE_DESFIRE_ReadDataStream(&_tag, op->block, op->offset + kept, length - kept, &sink, mode, &done);
+			op->data.resize(kept + done);
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_GET_VALUE: {
+			DESFire::mifare_desfire_communication_modes mode = DESFire::MDCM_PLAIN;
+			if (_tag.authScheme != 0) {
+				result = ReadFileSettings(op);
+				if (!_reader->IsStatusCodeOK(result)) {
+					break;
+				}
+				mode = GetReadMode(&op->fileSettings);
+			}
+			result = _reader->MIFARE_DESFIRE_GetValue(&_tag, op->block, &op->value, mode);
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	SetDesfireResult(op, result);
+} // End RunDesfire()
+
+/**
+ * Stores the result of a DESFire command the card answered. A missing file or application means the card is not what
+ * the directory remembers of it, its entry is dropped. So do an integrity, length, permission or boundary error of a
+ * command that used file settings from the directory: the file's size, communication mode or access rights changed.
+ */
+void CardSession::SetDesfireResult(CardOperation *op, DESFire::StatusCode result) {
+	op->status = result.mfrc522;
+	op->desfireStatus = result.mfrc522 == MFRC522::STATUS_OK ? result.desfire : DESFire::MF_OPERATION_OK;
+	bool stale = op->desfireStatus == DESFire::MF_FILE_NOT_FOUND || op->desfireStatus == DESFire::MF_APPLICATION_NOT_FOUND;
+	if (_cachedSettings) {
+		switch (op->desfireStatus) {
+			case DESFire::MF_INTEGRITY_ERROR:
+			case DESFire::MF_LENGTH_ERROR:
+			case DESFire::MF_PERMISSION_ERROR:
+			case DESFire::MF_BOUNDARY_ERROR:
+				stale = true;
+				break;
+			default:
+				break;
+		}
+	}
+	if (_directory && stale) {
+		MFRC522::Uid uid = _tracker->GetUid();
+		_directory->Invalidate(&uid);
+	}
+} // End SetDesfireResult()
+
+/**
+ * Answers an operation that only reads the card's structure from the directory, and defers a SelectApplication that
+ * needs no authentication. The first of these operations on a card the directory does not know discovers the card,
+ * unless an authentication is in effect, which the selections of the discovery would end.
+ *
+ * @return true if the operation was answered, or the discovery failed in transport. false to run it on the card.
+ */
+bool CardSession::RunCached(CardOperation *op) {
+	if (!_directory) {
+		return false;
+	}
+	switch (op->type) {
+		case CardOperation::OP_DESFIRE_GET_VERSION:
+		case CardOperation::OP_DESFIRE_GET_APPLICATION_IDS:
+		case CardOperation::OP_DESFIRE_SELECT_APPLICATION:
+		case CardOperation::OP_DESFIRE_GET_KEY_SETTINGS:
+		case CardOperation::OP_DESFIRE_GET_FILE_IDS:
+		case CardOperation::OP_DESFIRE_GET_FILE_SETTINGS:
+			break;
+		default:
+			return false;
+	}
+
+	MFRC522::Uid uid = _tracker->GetUid();
+	const DesfireDirectory::Directory *directory = _directory->Find(&uid);
+	bool discovered = false;
+	if (!directory && _tag.authScheme == 0) {
+		DESFire::StatusCode result = _directory->Discover(&_tag, &uid, &directory);
+		if (result.mfrc522 != MFRC522::STATUS_OK) {
+			_directory->CountMiss();
+			op->status = result.mfrc522;
+			op->desfireStatus = DESFire::MF_OPERATION_OK;
+			return true;
+		}
+		discovered = true;
+	}
+	const DesfireDirectory::Application *application = directory ? DesfireDirectory::FindApplication(directory, &_aid) : NULL;
+	bool piccLevel = _aid.data[0] == 0 && _aid.data[1] == 0 && _aid.data[2] == 0;
+
+	DESFire::DesfireStatusCode answer = DESFire::MF_OPERATION_OK;
+	uint32_t frames = 0;	// That the card would have answered with, 0 if the directory cannot answer
+	switch (op->type) {
+		case CardOperation::OP_DESFIRE_GET_VERSION:
+			if (directory) {
+				op->version = directory->version;
+				frames = 3;		// Hardware, software and production data, one frame each
+			}
+			break;
+
+		case CardOperation::OP_DESFIRE_GET_APPLICATION_IDS:
+			if (directory && directory->applicationsKnown && piccLevel) {
+				op->data.clear();
+				for (size_t i = 0; i < directory->applications.size(); i++) {
+					const byte *aid = directory->applications[i].aid.data;
+					op->data.insert(op->data.end(), aid, aid + MIFARE_AID_SIZE);
+				}
+				frames = DesfireDirectory::GetFrames(op->data.size());
+			}
+			break;
+
+		case CardOperation::OP_DESFIRE_SELECT_APPLICATION: {
+			DESFire::mifare_desfire_aid_t aid;
+			if (!directory || _tag.authScheme != 0 || op->data.size() != MIFARE_AID_SIZE) {
+				break;
+			}
+			memcpy(aid.data, &op->data[0], MIFARE_AID_SIZE);
+			if (DesfireDirectory::FindApplication(directory, &aid)) {
+				_aid = aid;			// Selected on the card by the next command that goes there
+				_authKeySize = 0;
+				frames = 1;
+			}
+			else if (directory->applicationsKnown) {
+				answer = DESFire::MF_APPLICATION_NOT_FOUND;
+				frames = 1;
+			}
+			break;
+		}
+
+		case CardOperation::OP_DESFIRE_GET_KEY_SETTINGS:
+			if (application && application->keySettingsKnown) {
+				op->data.clear();
+				op->data.push_back(application->keySettings);
+				op->data.push_back(application->maxKeys);
+				frames = 1;
+			}
+			break;
+
+		case CardOperation::OP_DESFIRE_GET_FILE_IDS:
+			if (application && application->filesKnown) {
+				op->data.assign(application->fileIds, application->fileIds + application->fileCount);
+				frames = 1;
+			}
+			break;
+
+		case CardOperation::OP_DESFIRE_GET_FILE_SETTINGS: {
+			if (!application || !application->filesKnown) {
+				break;
+			}
+			const DESFire::mifare_desfire_file_settings_t *settings = DesfireDirectory::FindFile(application, op->block);
+			// Value and record files change their settings in use, the limited credit and the number of records
+			if (settings && (settings->file_type == DESFire::MDFT_STANDARD_DATA_FILE || settings->file_type == DESFire::MDFT_BACKUP_DATA_FILE)) {
+				op->fileSettings = *settings;
+				frames = 1;
+			}
+			else if (!DesfireDirectory::HasFile(application, op->block)) {
+				answer = DESFire::MF_FILE_NOT_FOUND;
+				frames = 1;
+			}
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	if (frames == 0) {
+		_directory->CountMiss();
+		return false;
+	}
+	if (discovered) {
+		_directory->CountMiss();
+	}
+	else {
+		_directory->CountHit(frames);
+	}
+	op->status = MFRC522::STATUS_OK;
+	op->desfireStatus = answer;
+	return true;
+} // End RunCached()
+
+/**
+ * The settings of the file op->block, into op->fileSettings. From the directory if it knows them.
+ */
+DESFire::StatusCode CardSession::ReadFileSettings(CardOperation *op) {
+	if (_directory) {
+		MFRC522::Uid uid = _tracker->GetUid();
+		const DesfireDirectory::Directory *directory = _directory->Find(&uid);
+		const DesfireDirectory::Application *application = directory ? DesfireDirectory::FindApplication(directory, &_aid) : NULL;
+		const DESFire::mifare_desfire_file_settings_t *settings = application ? DesfireDirectory::FindFile(application, op->block) : NULL;
+		if (settings) {
+			op->fileSettings = *settings;
+			_directory->CountHit(1);
+			_cachedSettings = true;
+			DESFire::StatusCode result;
+			result.mfrc522 = MFRC522::STATUS_OK;
+			result.desfire = DESFire::MF_OPERATION_OK;
+			return result;
+		}
+		_directory->CountMiss();
+	}
+	return _reader->MIFARE_DESFIRE_GetFileSettings(&_tag, &op->block, &op->fileSettings);
+} // End ReadFileSettings()
+
+/**
+ * Selects the application of a deferred SelectApplication on the card. If the card refuses, the selection stays where
+ * the card has it.
+ *
+ * @return The result of the SelectApplication, MF_OPERATION_OK if none was needed.
+ */
+DESFire::StatusCode CardSession::SelectPending() {
+	DESFire::StatusCode result;
+	result.mfrc522 = MFRC522::STATUS_OK;
+	result.desfire = DESFire::MF_OPERATION_OK;
+	if (memcmp(_aid.data, _tag.selected_application, MIFARE_AID_SIZE) != 0) {
+		result = _reader->MIFARE_DESFIRE_SelectApplication(&_tag, &_aid);
+		if (result.mfrc522 == MFRC522::STATUS_OK && !_reader->IsStatusCodeOK(result)) {
+			memcpy(_aid.data, _tag.selected_application, MIFARE_AID_SIZE);
+		}
+	}
+	return result;
+} // End SelectPending()
@@ -0,0 +1,124 @@
+/**
+ * CardOperation.h - Runs queued card commands on the tracked card.
+ *
+ * Card commands from other threads are not executed where they are issued: they are queued as CardOperation structs and
+ * the thread that owns the reader runs them between two presence polls. A CardSession wakes and selects the card the
+ * PresenceTracker follows, runs a batch of operations back to back (so an authentication carries over to the reads and
+ * writes after it), and halts the card again, leaving it where the tracker expects it.
+ * DESFire operations activate ISO/IEC 14443-4 (RATS) on first use within the session and deselect at the end. The
+ * session raises the bit rate with PPS as far as the card allows and falls back to a lower one, for the rest of the
+ * card's stay, when frames get lost at the raised rate.
+ * With a DesfireDirectory, the first DESFire command of a new card discovers its structure; commands that only read it
+ * (GetVersion, GetApplicationIds, GetKeySettings, GetFileIDs, GetFileSettings) are answered from the directory from
+ * then on. A SelectApplication that needs no authentication is deferred until a command has to go to the card.
+ *
+ * Released into the public domain.
+ */
+#ifndef CARDOPERATION_h
+#define CARDOPERATION_h
+
+#include <vector>
+#include "Desfire.h"
+#include "PresenceTracker.h"
+#include "KeyRing.h"
+#include "AccessPlanner.h"
+#include "DesfireDirectory.h"
+
+#define CARD_FIELD_RESET_MS		6	// Field off time that resets a PICC, ISO/IEC 14443-3 asks for more than 5.1 ms
+
+// One command of a batch, with its parameters and, once run, its results.
+struct CardOperation {
+	enum Type : byte {
+		OP_AUTHENTICATE					,	// keyType, block, key. With useKeyRing: block -> value (key ring index)
+		OP_READ							,	// block -> data
+		OP_WRITE						,	// block, data
+		OP_ULTRALIGHT_WRITE				,	// block (page), data
+		OP_INCREMENT					,	// block, value
+		OP_DECREMENT					,	// block, value
+		OP_RESTORE						,	// block
+		OP_TRANSFER						,	// block
+		OP_GET_VALUE					,	// block -> value
+		OP_SET_VALUE					,	// block, value
+		OP_NTAG216_AUTH					,	// data (password) -> data (PACK)
+		OP_READ_CARD					,	// keyType, key -> data (card image), sectorStatus, value (dump time in µs)
+		OP_WRITE_CARD					,	// keyType, key, data (target image), mask -> sectorStatus, value (blocks written)
+		OP_PLAN							,	// key (A), keyB, keys, steps, data (16 bytes per step) -> steps, data, value (RF round trips), length (authentications)
+		OP_DESFIRE_GET_VERSION			,	// -> version
+		OP_DESFIRE_GET_APPLICATION_IDS	,	// -> data, 3 bytes per AID
+		OP_DESFIRE_SELECT_APPLICATION	,	// data (AID)
+		OP_DESFIRE_GET_KEY_SETTINGS		,	// -> data (settings, max keys)
+		OP_DESFIRE_GET_KEY_VERSION		,	// block (key number) -> value
+		OP_DESFIRE_GET_FILE_IDS			,	// -> data
+		OP_DESFIRE_GET_FILE_SETTINGS	,	// block (file) -> fileSettings
+		OP_DESFIRE_READ_DATA			,	// block (file), offset, length -> data, the part read before a failure too
+		OP_DESFIRE_GET_VALUE			,	// block (file) -> value
+		OP_DESFIRE_AUTHENTICATE			,	// keyType (DesfireCipher::KeyType), block (key number), data (key)
+		OP_COUNT
+	};
+
+	Type type;
+	byte block;						// Block, page, key number or file id
+	byte keyType;					// PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B. OP_DESFIRE_AUTHENTICATE: a DesfireCipher::KeyType.
+	MFRC522::MIFARE_Key key;
+	MFRC522::MIFARE_Key keyB;		// OP_PLAN: key B, key is key A
+	byte keys;						// OP_PLAN: the keys that are known, bit 0 key A, bit 1 key B
+	bool useKeyRing;				// OP_AUTHENTICATE: find the key in the session's KeyRing instead
+	int32_t value;					// In: delta or value. Out: value read.
+	uint32_t offset;
+	uint32_t length;
+	std::vector<byte> data;			// In: data to write, password or AID. Out: data read.
+	std::vector<byte> mask;			// OP_WRITE_CARD: bits of data to write, empty for all
+	std::vector<MFRC522::StatusCode> sectorStatus;	// OP_READ_CARD, OP_WRITE_CARD: the result of each sector
+	std::vector<AccessPlanner::Request> steps;		// OP_PLAN: the block operations, their data is in data
+
+	MFRC522::StatusCode status;		// Result of the reader, STATUS_OK if the PICC answered
+	DESFire::DesfireStatusCode desfireStatus;	// Status byte of DESFire operations
+	DESFire::MIFARE_DESFIRE_Version_t version;
+	DESFire::mifare_desfire_file_settings_t fileSettings;
+
+	bool IsDesfire() const { return type >= OP_DESFIRE_GET_VERSION; };
+	bool Succeeded() const { return status == MFRC522::STATUS_OK && (!IsDesfire() || desfireStatus == DESFire::MF_OPERATION_OK); };
+};
+
+class CardSession {
+public:
+	CardSession(DESFire *reader, PresenceTracker *tracker, KeyRing *keyRing = NULL, DesfireDirectory *directory = NULL);
+
+	MFRC522::StatusCode Begin();
+	bool Run(CardOperation *op);
+	void End();
+
+	void SetMaxBitRate(MFRC522::PCD_BitRate maxRate) { _maxBitRate = maxRate; };
+
+protected:
+	DESFire *_reader;
+	PresenceTracker *_tracker;
+	KeyRing *_keyRing;				// Candidate keys of OP_AUTHENTICATE, NULL if there are none
+	DesfireDirectory *_directory;	// Known DESFire card structures, NULL to ask the card every time
+	bool _cachedSettings;			// The running DESFire operation took its file settings from _directory
+	DESFire::mifare_desfire_aid_t _aid;	// The application the operations selected. Differs from _tag.selected_application while a selection is deferred.
+	bool _authenticated;			// MIFARE Classic Crypto1 is on
+	bool _isoDep;					// RATS was answered, the PICC is in the ISO/IEC 14443-4 protocol state
+	DESFire::mifare_desfire_tag _tag;
+	MFRC522::PCD_BitRate _maxBitRate;	// Highest ISO/IEC 14443-4 bit rate to select with PPS, BITRATE_106 for none
+	MFRC522::Uid _lastUid;			// The card _tag.rateCeiling is for
+	// The last OP_DESFIRE_AUTHENTICATE, for ReactivateIsoDep(). _authKeySize is 0 if there is none.
+	byte _authKeyNo;
+	DesfireCipher::KeyType _authKeyType;
+	byte _authKey[DESFIRE_MAX_KEY_SIZE];
+	byte _authKeySize;
+
+	MFRC522::StatusCode ActivateIsoDep();
+	MFRC522::StatusCode ReactivateIsoDep();
+	void LeaveIsoDep();
+	bool IsTransportError(MFRC522::StatusCode status) const;
+	DESFire::mifare_desfire_communication_modes GetReadMode(const DESFire::mifare_desfire_file_settings_t *fileSettings) const;
+	void RunMifare(CardOperation *op);
+	void RunDesfire(CardOperation *op);
+	void SetDesfireResult(CardOperation *op, DESFire::StatusCode result);
+	bool RunCached(CardOperation *op);
+	DESFire::StatusCode ReadFileSettings(CardOperation *op);
+	DESFire::StatusCode SelectPending();
+};
+
+#endif
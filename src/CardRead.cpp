@@ -39,6 +39,7 @@
 #include <unistd.h>
 #include "Desfire.h"
 #include "MFRC522.h"
+#include "PollScheduler.h"
 
 using namespace std;
 
@@ -46,6 +47,8 @@ using namespace std;
 #define SS_PIN          10         // Configurable, see typical pin layout above
 
 DESFire mfrc522(SS_PIN, RST_PIN);  // Create MFRC522 instance
+PollScheduler scheduler;           // Polls fast while cards come and go, slower when the field is idle
+bool fieldEmpty = false;           // The last poll found no card, "nocard" was printed for it
 
 
 
@@ -58,12 +61,16 @@ void setup() {
   cout << "Scan PICC to see UID, SAK, type, and data blocks..."<< endl ;
 }
 
-void loop() {
+bool loop() {
   // Look for new cards, and select one if present
   if ( ! mfrc522.PICC_IsNewCardPresent()){
-   printf(">>>>>>>>>>>>>>nocard\n");
-    return;
+    if (!fieldEmpty) {
+      printf(">>>>>>>>>>>>>>nocard\n");   // Once when the field becomes empty, not on every poll
+      fieldEmpty = true;
+    }
+    return false;
   }
+  fieldEmpty = false;
 
 printf(">>>>>>>>>>>>>got card\n");
   byte c = mfrc522.PICC_ReadCardSerial() ;
@@ -88,6 +95,7 @@ printf(">>>>>>>>>>>>>got card\n");
     mfrc522.PICC_IsNewCardPresent();
     
   cout << endl;
+  return true;
 }
 
 
@@ -97,8 +105,10 @@ int main()
 	setup();
 	
 	while(1){
-		loop();
-		delay (1000) ;
+		scheduler.PollStarted();
+		bool card = loop();
+		scheduler.PollFinished(card);
+		usleep(scheduler.NextInterval());
 	}
 
 }
@@ -1,3 +1,4 @@
+#include <sys/random.h>
 #include "Desfire.h"
 
 MFRC522::StatusCode DESFire::PICC_RequestATS(byte *atsBuffer, byte *atsLength)
@@ -6,22 +7,42 @@ MFRC522::StatusCode DESFire::PICC_RequestATS(byte *atsBuffer, byte *atsLength)
 
 	// Build command buffer
 	atsBuffer[0] = 0xE0; //PICC_CMD_RATS;
-	atsBuffer[1] = 0x50; // FSD=64, CID=0
+	atsBuffer[1] = 0x80; // FSDI=8 => FSD=256 (MIFARE_DESFIRE_FSD), CID=0
+	byte sendLen = 4;
 
-	// Calculate CRC_A
-	result = PCD_CalculateCRC(atsBuffer, 2, &atsBuffer[2]);
-	if (result != STATUS_OK) {
-		return result;
+	if (PCD_GetAutoCRC()) {
+		// The MFRC522 appends the CRC_A and checks and removes the one of the ATS
+		PCD_SetFrameClass(FRAME_TXRX_CRC);
+		sendLen = 2;
+	}
+	else {
+		// Calculate CRC_A
+		result = PCD_CalculateCRC(atsBuffer, 2, &atsBuffer[2]);
+		if (result != STATUS_OK) {
+			return result;
+		}
 	}
 
 	// Transmit the buffer and receive the response, validate CRC_A.
-	result = PCD_TransceiveData(atsBuffer, 4, atsBuffer, atsLength, NULL, 0, true);
+	// The ATS must follow within the activation frame waiting time, 65536/fc + ΔFWT, ISO/IEC 14443-4 section 5.7.
+	PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
+	result = PCD_TransceiveData(atsBuffer, sendLen, atsBuffer, atsLength, NULL, 0, true);
 	if (result != STATUS_OK) {
 		PICC_HaltA();
-		printf("WTF???\n");
 		return result;
 	}
 
+	// The frame waiting time of all following blocks is TB(1)[7..4], FWI=4 if TB(1) is absent.
+	// ATS: TL T0 [TA(1)] [TB(1)] [TC(1)] historical bytes
+	byte fwi = 4;
+	if (*atsLength >= 2 && (atsBuffer[1] & 0x20)) {
+		byte tb = (atsBuffer[1] & 0x10) ? 3 : 2;
+		if (tb < *atsLength) {
+			fwi = atsBuffer[tb] >> 4;
+		}
+	}
+	PCD_SetFrameWaitingTime(fwi);
+
 	return result;
 } // End PICC_RequestATS()
 
@@ -41,27 +62,417 @@ MFRC522::StatusCode DESFire::PICC_ProtocolAndParameterSelection(byte cid,	///< T
 	ppsBuffer[0] = 0xD0 | (cid & 0x0F);
 	ppsBuffer[1] = pps0;
 	ppsBuffer[2] = pps1;
+	byte sendLen = 5;
 
-	// Calculate CRC_A
-	result = PCD_CalculateCRC(ppsBuffer, 3, &ppsBuffer[3]);
-	if (result != STATUS_OK) {
-		return result;
+	if (PCD_GetAutoCRC()) {
+		PCD_SetFrameClass(FRAME_TXRX_CRC);
+		sendLen = 3;
+	}
+	else {
+		// Calculate CRC_A
+		result = PCD_CalculateCRC(ppsBuffer, 3, &ppsBuffer[3]);
+		if (result != STATUS_OK) {
+			return result;
+		}
 	}
 
 	// Transmit the buffer and receive the response, validate CRC_A.
-	result = PCD_TransceiveData(ppsBuffer, 5, ppsBuffer, &ppsBufferSize, NULL, 0, true);
+	PCD_SetTimeoutProfile(TIMEOUT_FWT);
+	result = PCD_TransceiveData(ppsBuffer, sendLen, ppsBuffer, &ppsBufferSize, NULL, 0, true);
 	if (result == STATUS_OK) {
-		// This is how my MFRC522 is by default.
-		// Reading https://www.nxp.com/documents/data_sheet/MFRC522.pdf it seems CRC generation can only be disabled in this mode.
-		if (pps1 == 0x00) {
-			PCD_WriteRegister(TxModeReg, 0x00);
-			PCD_WriteRegister(RxModeReg, 0x00);
+		// The PPS response still comes at the old rate, the next block uses the new one.
+		// PPS1: DSI (PICC to PCD) in bits 3..2, DRI (PCD to PICC) in bits 1..0. Without PPS1 it is 106 kbit/s both ways.
+		if (pps0 & 0x10) {
+			PCD_SetBitRate((PCD_BitRate)(pps1 & 0x03), (PCD_BitRate)((pps1 >> 2) & 0x03));
+		}
+		else {
+			PCD_SetBitRate(BITRATE_106, BITRATE_106);
 		}
 	}
 
 	return result;
 } // End PICC_ProtocolAndParameterSelection()
 
+/**
+ * Transmits S(DESELECT), ISO/IEC 14443-4 section 8. The PICC leaves the protocol state and goes to HALT, so it answers
+ * WUPA (not REQA) again.
+ *
+ * @return STATUS_OK on success, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode DESFire::PICC_Deselect(byte cid	///< The CID the PICC was activated with, see PICC_RequestATS()
+) {
+	MFRC522::StatusCode result;
+
+	byte buffer[4];
+	byte bufferSize = sizeof(buffer);
+	buffer[0] = 0xCA;	// S(DESELECT) with CID following
+	buffer[1] = cid & 0x0F;
+	byte sendLen = 4;
+
+	if (PCD_GetAutoCRC()) {
+		PCD_SetFrameClass(FRAME_TXRX_CRC);
+		sendLen = 2;
+	}
+	else {
+		// Calculate CRC_A
+		result = PCD_CalculateCRC(buffer, 2, &buffer[2]);
+		if (result != STATUS_OK) {
+			return result;
+		}
+	}
+
+	// The PICC confirms with the same S-block within the activation frame waiting time, like the ATS.
+	PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
+	result = PCD_TransceiveData(buffer, sendLen, buffer, &bufferSize, NULL, 0, true);
+	if (result == STATUS_OK && (buffer[0] & 0xF7) != 0xC2) {
+		return STATUS_ERROR;
+	}
+	return result;
+} // End PICC_Deselect()
+
+/**
+ * Requests the ATS and sets up the ISO/IEC 14443-4 block protocol with the limits the PICC declares in it: the frame
+ * size, the frame waiting time and whether the CID may be sent. Waits out the start-up frame guard time before it returns.
+ *
+ * @return STATUS_OK on success, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode DESFire::PICC_ActivateIsoDep(	mifare_desfire_tag *tag,	///< Out: The protocol state of the PICC.
+													byte *atsBuffer,			///< Out: The ATS. NULL if not needed.
+													byte *atsLength				///< In: Size of atsBuffer, at least FIFO_SIZE. Out: The length of the ATS.
+) {
+	byte ats[FIFO_SIZE];
+	byte length = sizeof(ats);
+
+	MFRC522::StatusCode result = PICC_RequestATS(ats, &length);
+	if (result != STATUS_OK) {
+		return result;
+	}
+	if (length > ats[0]) {
+		length = ats[0];	// TL, without the CRC_A PICC_RequestATS() leaves in place if the host checks it
+	}
+	PICC_ParseATS(ats, length, tag);
+	tag->cid = 0x00;
+	tag->pcb = tag->cidSupported ? 0x0A : 0x02;	// I-block, block number 0
+	memset(tag->selected_application, 0, sizeof(tag->selected_application));
+	tag->retransmissions = 0;
+	tag->waitingTimeExtensions = 0;
+	tag->authScheme = 0;
+	tag->bitRate = 0;
+	tag->rateExchanges = 0;
+	tag->rateRecoveries = 0;
+	if (atsBuffer && atsLength) {
+		*atsLength = length < *atsLength ? length : *atsLength;
+		memcpy(atsBuffer, ats, *atsLength);
+	}
+
+	// SFGT = 256 * 16 / fc * 2^SFGI, ISO/IEC 14443-4 section 5.2.5
+	if (tag->sfgi > 0 && tag->sfgi < 15) {
+		delayMicroseconds((uint32_t)(((uint64_t)4096 << tag->sfgi) * 100 / 1356));
+	}
+	return STATUS_OK;
+} // End PICC_ActivateIsoDep()
+
+/**
+ * Reads the protocol parameters from an ATS, ISO/IEC 14443-4 section 5.2. Absent bytes take their default values.
+ * ATS: TL T0 [TA(1)] [TB(1)] [TC(1)] historical bytes
+ */
+void DESFire::PICC_ParseATS(const byte *atsBuffer,	///< The ATS, without CRC_A.
+							byte atsLength,			///< Its length.
+							mifare_desfire_tag *tag	///< Out: fsc, fwi, sfgi, ta1, cidSupported and nadSupported are set.
+) {
+	static const uint16_t fscTable[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+	byte t0 = 0x02;		// FSCI=2, no interface bytes
+	byte ta = 0x00, tb = 0x40, tc = 0x02;	// FWI=4, SFGI=0, CID supported, NAD not
+
+	if (atsLength >= 2 && atsBuffer[0] >= 2) {
+		t0 = atsBuffer[1];
+		byte next = 2;
+		if ((t0 & 0x10) && next < atsLength) {
+			ta = atsBuffer[next++];
+		}
+		if ((t0 & 0x20) && next < atsLength) {
+			tb = atsBuffer[next++];
+		}
+		if ((t0 & 0x40) && next < atsLength) {
+			tc = atsBuffer[next++];
+		}
+	}
+	byte fsci = t0 & 0x0F;
+	tag->fsc = fsci < sizeof(fscTable) / sizeof(fscTable[0]) ? fscTable[fsci] : 256;	// FSCI 9 and up are larger than our FSD anyway
+	tag->ta1 = ta;
+	tag->fwi = (tb >> 4) <= 14 ? (tb >> 4) : 4;
+	tag->sfgi = tb & 0x0F;
+	tag->nadSupported = (tc & 0x01) != 0;
+	tag->cidSupported = (tc & 0x02) != 0;
+} // End PICC_ParseATS()
+
+/**
+ * Raises the bit rate to the highest one both the PICC (TA(1) of its ATS) and the MFRC522 support, up to maxRate and
+ * below the ceiling left by PICC_LowerBitRate(). Sends a PPS and programs the MFRC522 to match, see
+ * PICC_ProtocolAndParameterSelection(). Nothing is sent if that is 106 kbit/s.
+ * Only allowed right after PICC_ActivateIsoDep(), before the first block.
+ * If the PPS fails the PICC may or may not have switched; select it again (WUPA) and activate it without PPS.
+ *
+ * @return STATUS_OK on success, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode DESFire::PICC_SelectBitRate(	mifare_desfire_tag *tag,	///< The protocol state of the PICC, ta1 set by PICC_ActivateIsoDep().
+													PCD_BitRate maxRate			///< The highest rate to use.
+) {
+	// TA(1): b8 same divisor both ways, b7..b5 DS=8,4,2 (PICC to PCD), b3..b1 DR=8,4,2 (PCD to PICC)
+	byte ds = (tag->ta1 >> 4) & 0x07;
+	byte dr = tag->ta1 & 0x07;
+	byte limit = maxRate;
+	if (tag->rateCeiling > 0 && tag->rateCeiling - 1 < limit) {
+		limit = tag->rateCeiling - 1;
+	}
+	if (tag->ta1 & 0x80) {
+		ds = dr = ds & dr;
+	}
+	byte dsi = 0, dri = 0;
+	for (byte rate = BITRATE_212; rate <= limit; rate++) {
+		if (ds & (1 << (rate - 1))) {
+			dsi = rate;
+		}
+		if (dr & (1 << (rate - 1))) {
+			dri = rate;
+		}
+	}
+	tag->rateExchanges = 0;
+	tag->rateRecoveries = 0;
+	if (dsi == 0 && dri == 0) {
+		tag->bitRate = 0;
+		return STATUS_OK;
+	}
+
+	byte pps1 = (dsi << 2) | dri;
+	MFRC522::StatusCode result = PICC_ProtocolAndParameterSelection(tag->cid, 0x11, pps1);	// PPS1 follows
+	if (result != STATUS_OK) {
+		PCD_SetBitRate(BITRATE_106, BITRATE_106);
+		return result;
+	}
+	tag->bitRate = pps1;
+	return STATUS_OK;
+} // End PICC_SelectBitRate()
+
+/**
+ * Tells if the raised bit rate needs error recovery in more than one of MIFARE_ISODEP_RATE_ERRORS exchanges, judged
+ * after MIFARE_ISODEP_RATE_WINDOW exchanges.
+ */
+bool DESFire::PICC_IsBitRateFailing(const mifare_desfire_tag *tag) {
+	return tag->bitRate != 0 && tag->rateExchanges >= MIFARE_ISODEP_RATE_WINDOW
+		&& (uint32_t)tag->rateRecoveries * MIFARE_ISODEP_RATE_ERRORS > tag->rateExchanges;
+} // End PICC_IsBitRateFailing()
+
+/**
+ * Makes the next PICC_SelectBitRate() choose a rate below the current one. A PPS only follows the activation, so the
+ * PICC has to be selected and activated again for it to take effect.
+ *
+ * @return false if the bit rate is 106 kbit/s already.
+ */
+bool DESFire::PICC_LowerBitRate(mifare_desfire_tag *tag) {
+	byte dsi = (tag->bitRate >> 2) & 0x03;
+	byte dri = tag->bitRate & 0x03;
+	byte rate = dsi > dri ? dsi : dri;
+	if (rate == BITRATE_106) {
+		return false;
+	}
+	tag->rateCeiling = rate;	// 1 + (rate - 1)
+	return true;
+} // End PICC_LowerBitRate()
+
+/**
+ * Writes the PCB and, if the PICC takes one, the CID of a block.
+ *
+ * @return The header length, 1 or 2.
+ */
+byte DESFire::PICC_IsoDepHeader(const mifare_desfire_tag *tag, byte pcb, byte *block) {
+	if (tag->pcb & 0x08) {
+		block[0] = pcb | 0x08;
+		block[1] = tag->cid & 0x0F;
+		return 2;
+	}
+	block[0] = pcb;
+	return 1;
+} // End PICC_IsoDepHeader()
+
+/**
+ * Sends one block and receives the answer within the frame waiting time, multiplied by wtxm after a waiting time
+ * extension. *block needs 2 bytes of room after blockLen for the CRC_A.
+ *
+ * @return STATUS_OK on success, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode DESFire::PICC_IsoDepExchangeBlock(	byte *block,		///< The block to send.
+														uint16_t blockLen,	///< Its length without CRC_A.
+														byte *backData,		///< Out: The block received, without CRC_A.
+														uint16_t *backLen,	///< In: Size of backData, 2 bytes more than the largest block. Out: The length of the block.
+														byte wtxm			///< Waiting time extension multiplier, 0 for none.
+) {
+	byte crcSize = 0;
+	if (PCD_GetAutoCRC()) {
+		PCD_SetFrameClass(FRAME_TXRX_CRC);
+	}
+	else {
+		CRC_A(block, blockLen, &block[blockLen]);
+		crcSize = 2;
+	}
+
+	uint32_t fwtUs = _fwtUs;
+	if (wtxm > 0) {
+		// FWT_temp = FWT * WTXM, at most FWT_max. ISO/IEC 14443-4 section 7.3.
+		PCD_SetFrameWaitingTime(14);
+		uint32_t maxUs = _fwtUs;
+		_fwtUs = fwtUs * wtxm < maxUs ? fwtUs * wtxm : maxUs;
+	}
+	PCD_SetTimeoutProfile(TIMEOUT_FWT);
+	MFRC522::StatusCode result = PCD_TransceiveStream(block, blockLen + crcSize, backData, backLen, NULL, crcSize != 0);
+	_fwtUs = fwtUs;
+	if (result == STATUS_OK) {
+		if (*backLen < 1 + crcSize) {
+			return STATUS_ERROR;
+		}
+		*backLen -= crcSize;
+	}
+	return result;
+} // End PICC_IsoDepExchangeBlock()
+
+/**
+ * Exchanges an INF field with a PICC in the ISO/IEC 14443-4 protocol state, the half-duplex block transmission
+ * protocol of section 7.
+ * Requests longer than the FSC of the PICC are sent in chained I-blocks, and chained responses are collected, so the
+ * lengths are only limited by the buffers. A transmission error or timeout is recovered from as the standard asks:
+ * R(NAK) (or R(ACK) while the PICC is chaining) and retransmission of the last block, up to MIFARE_ISODEP_RETRIES
+ * times per block. Waiting time extensions requested by the PICC are granted.
+ * The PICC must be activated, see PICC_ActivateIsoDep().
+ *
+ * @return STATUS_OK on success, STATUS_NO_ROOM if the response does not fit, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode DESFire::PICC_IsoDepTransceive(	mifare_desfire_tag *tag,	///< The protocol state of the PICC.
+													const byte *sendData,		///< The INF field to send.
+													uint16_t sendLen,			///< Its length.
+													byte *backData,				///< Out: The INF field received. NULL if not needed.
+													uint16_t *backLen			///< In: Size of backData. Out: The length of the INF field.
+) {
+	byte iBlock[MIFARE_DESFIRE_FSD + 2];	// The last I-block sent, room for the CRC_A
+	uint16_t iBlockLen = 0;
+	byte otherBlock[8];						// R- or S-block
+	byte response[MIFARE_DESFIRE_FSD + 2];
+	uint16_t fsc = tag->fsc < MIFARE_DESFIRE_FSD ? tag->fsc : MIFARE_DESFIRE_FSD;
+	uint16_t capacity = (backData && backLen) ? *backLen : 0;
+	uint16_t sent = 0, received = 0;
+	bool receiving = false;					// The PICC is chaining its response
+	byte errors = 0;
+	byte wtxm = 0;
+	MFRC522::StatusCode result;
+	bool recovered = false;
+	tag->rateExchanges++;
+
+	// The next I-block of the request, chained if the rest does not fit
+	byte header = PICC_IsoDepHeader(tag, 0x02, iBlock);
+	uint16_t maxInf = fsc - header - 2;
+	uint16_t chunk = sendLen - sent < maxInf ? sendLen - sent : maxInf;
+	byte *block = iBlock;
+	uint16_t blockLen = 0;
+
+	for (;;) {
+		if (block == iBlock && iBlockLen == 0) {
+			PICC_IsoDepHeader(tag, 0x02 | (tag->pcb & 0x01) | (sent + chunk < sendLen ? 0x10 : 0x00), iBlock);
+			memcpy(&iBlock[header], &sendData[sent], chunk);
+			iBlockLen = header + chunk;
+		}
+		blockLen = block == iBlock ? iBlockLen : blockLen;
+		uint16_t responseLen = sizeof(response);
+		result = PICC_IsoDepExchangeBlock(block, blockLen, response, &responseLen, wtxm);
+		wtxm = 0;
+
+		byte pcb = result == STATUS_OK ? response[0] : 0x00;
+		byte offset = 1 + ((pcb & 0x08) ? 1 : 0) + ((pcb & 0xC4) == 0x04 ? 1 : 0);	// CID, NAD (I-blocks only)
+		bool valid = result == STATUS_OK && responseLen >= offset
+			&& ((pcb & 0xE2) == 0x02 || (pcb & 0xE6) == 0xA2 || (pcb & 0xC7) == 0xC2);	// I-, R- or S-block
+		if (valid && (pcb & 0xC0) == 0x80 && (pcb & 0x10)) {
+			valid = false;			// The PICC never sends R(NAK)
+		}
+		if (valid && (pcb & 0xC0) == 0x00 && ((pcb & 0x01) != (tag->pcb & 0x01) || sent + chunk < sendLen)) {
+			valid = false;			// An I-block with the wrong block number, or before the request is complete
+		}
+		if (!valid) {
+			if (++errors > MIFARE_ISODEP_RETRIES) {
+				return result != STATUS_OK ? result : STATUS_ERROR;
+			}
+			// Rules 4 and 5: R(NAK), or R(ACK) while the PICC is chaining, with the current block number
+			tag->retransmissions++;
+			if (!recovered) {
+				recovered = true;
+				tag->rateRecoveries++;
+			}
+			blockLen = PICC_IsoDepHeader(tag, (receiving ? 0xA2 : 0xB2) | (tag->pcb & 0x01), otherBlock);
+			block = otherBlock;
+			continue;
+		}
+
+		if ((pcb & 0xC0) == 0xC0) {
+			if ((pcb & 0x30) != 0x30 || responseLen <= offset) {
+				return STATUS_ERROR;			// Only S(WTX) may come in the middle of an exchange
+			}
+			// Grant the waiting time extension: S(WTX) with the same WTXM
+			wtxm = response[offset] & 0x3F;
+			tag->waitingTimeExtensions++;
+			blockLen = PICC_IsoDepHeader(tag, 0xF2, otherBlock);
+			otherBlock[blockLen++] = wtxm;
+			block = otherBlock;
+			continue;
+		}
+
+		if ((pcb & 0xC0) == 0x80) {
+			if ((pcb & 0x01) != (tag->pcb & 0x01)) {
+				// Rule 6: the PICC did not get the last I-block
+				if (++errors > MIFARE_ISODEP_RETRIES) {
+					return STATUS_ERROR;
+				}
+				tag->retransmissions++;
+				if (!recovered) {
+					recovered = true;
+					tag->rateRecoveries++;
+				}
+				block = iBlock;
+				continue;
+			}
+			if (receiving || sent + chunk >= sendLen) {
+				return STATUS_ERROR;			// Nothing to acknowledge
+			}
+			// Rule 7: the chained block arrived, send the next one
+			tag->pcb ^= 0x01;
+			errors = 0;
+			sent += chunk;
+			chunk = sendLen - sent < maxInf ? sendLen - sent : maxInf;
+			iBlockLen = 0;
+			block = iBlock;
+			continue;
+		}
+
+		// I-block: part or all of the response
+		tag->pcb ^= 0x01;
+		errors = 0;
+		uint16_t infLen = responseLen - offset;
+		if (infLen > 0 && backData && backLen) {
+			if (received + infLen > capacity) {
+				return STATUS_NO_ROOM;
+			}
+			memcpy(&backData[received], &response[offset], infLen);
+		}
+		received += infLen;
+		if (!(pcb & 0x10)) {
+			if (backLen) {
+				*backLen = received;
+			}
+			return STATUS_OK;
+		}
+		// The PICC is chaining, R(ACK) asks for the next block
+		receiving = true;
+		blockLen = PICC_IsoDepHeader(tag, 0xA2 | (tag->pcb & 0x01), otherBlock);
+		block = otherBlock;
+	}
+} // End PICC_IsoDepTransceive()
+
 /**
  * @see MIFARE_BlockExchangeWithData()
  */
@@ -88,6 +499,8 @@ DESFire::StatusCode DESFire::MIFARE_BlockExchange(mifare_desfire_tag *tag, byte
  *  | PCB | CID | NAD | Command | Data | Checksum |
  *  |-----|-----|-----|---------|------|----------|
  *
+ * PCB, CID and the checksum, and chaining and error recovery, are done by PICC_IsoDepTransceive().
+ *
  * Documentation: http://read.pudn.com/downloads64/ebook/225463/M305_DESFireISO14443.pdf
  *                http://www.ti.com.cn/cn/lit/an/sloa213/sloa213.pdf
  */
@@ -95,108 +508,497 @@ DESFire::StatusCode DESFire::MIFARE_BlockExchangeWithData(mifare_desfire_tag *ta
 {
 	StatusCode result;
 
-	byte buffer[64];
-	byte bufferSize = 64;
-	byte sendSize = 3;
+	// Command and data form the INF field; ISO-DEP adds PCB and CID and chains it if it is longer than the FSC.
+	byte buffer[MIFARE_DESFIRE_FSD];
+	uint16_t bufferSize = 1;
 
-	buffer[0] = tag->pcb;
-	buffer[1] = tag->cid;
-	buffer[2] = cmd;
+	buffer[0] = cmd;
 
 	// Append data if available
 	if (sendData != NULL && sendLen != NULL) {
 		if (*sendLen > 0) {
-			memcpy(&buffer[3], sendData, *sendLen);
-			sendSize = sendSize + *sendLen;
+			memcpy(&buffer[1], sendData, *sendLen);
+			bufferSize = bufferSize + *sendLen;
 		}
 	}
 
-	// Update the PCB
-	if (tag->pcb == 0x0A)
-		tag->pcb = 0x0B;
-	else
-		tag->pcb = 0x0A;
-
-	// Calculate CRC_A
-	result.mfrc522 = PCD_CalculateCRC(buffer, sendSize, &buffer[sendSize]);
+	uint16_t backSize = sizeof(buffer);
+	result.mfrc522 = PICC_IsoDepTransceive(tag, buffer, bufferSize, buffer, &backSize);
 	if (result.mfrc522 != STATUS_OK) {
 		return result;
 	}
-
-	result.mfrc522 = PCD_TransceiveData(buffer, sendSize + 2, buffer, &bufferSize);
-	if (result.mfrc522 != STATUS_OK) {
+	if (backSize < 1) {
+		result.mfrc522 = STATUS_ERROR;
 		return result;
 	}
 
 	// Set the DESFire status code
-	result.desfire = (DesfireStatusCode)(buffer[2]);
+	result.desfire = (DesfireStatusCode)(buffer[0]);
 
-	// Copy data to backData and backLen
+	// Copy data to backData and backLen. *backLen is the capacity of backData.
 	if (backData != NULL && backLen != NULL) {
-		memcpy(backData, &buffer[3], bufferSize - 5);
-		*backLen = bufferSize - 5;
+		if (backSize - 1 > *backLen) {
+			result.mfrc522 = STATUS_NO_ROOM;
+			return result;
+		}
+		memcpy(backData, &buffer[1], backSize - 1);
+		*backLen = backSize - 1;
 	}
 
 	return result;
 } // End MIFARE_BlockExchangeWithData()
 
-DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetVersion(mifare_desfire_tag *tag, MIFARE_DESFIRE_Version_t *versionInfo)
-{
+/**
+ * Runs one DESFire command with secure messaging: sends cmd and sendData, collects the response over all additional
+ * frames (status 0xAF) in backData and checks and removes its MAC or deciphers it.
+ * What secure messaging does depends on the authentication in effect, see MIFARE_DESFIRE_Authenticate(), and on mode:
+ *  - Not authenticated: nothing, whatever the mode.
+ *  - ISO or AES authentication: the CMAC of every command advances the IV. Responses end in an 8 byte CMAC, except
+ *    for enciphered ones, which carry a CRC32 inside the cipher text.
+ *  - Native (legacy) authentication: only MAC'd and enciphered data is secured, with a 4 byte MAC or a CRC16.
+ * In MDCM_MACED and MDCM_ENCIPHERED the part of sendData after headerLen bytes is MAC'd or enciphered.
+ * A response whose MAC or CRC does not match is reported as MF_INTEGRITY_ERROR, like the PICC does for commands.
+ * Errors end the authentication, on the PICC as here.
+ *
+ * @return The status of the last frame.
+ */
+DESFire::StatusCode DESFire::MIFARE_DESFIRE_Exchange(	mifare_desfire_tag *tag,	///< The PICC, in the ISO/IEC 14443-4 protocol state.
+														byte cmd,					///< The command code.
+														const byte *sendData,		///< Parameters and data of the command. NULL if there are none.
+														size_t sendLen,				///< Bytes in sendData.
+														size_t headerLen,			///< Bytes of sendData that are never enciphered.
+														mifare_desfire_communication_modes mode,	///< How the data of the command and of the response is secured.
+														byte *backData,				///< Out: The data of the response, without MAC or CRC. NULL if none is expected.
+														size_t *backLen				///< In: Size of backData, it needs room for the MAC or CRC and padding. Out: Bytes in backData.
+) {
 	StatusCode result;
-	byte versionBuffer[64];
-	byte versionBufferSize = 64;
+	result.desfire = MF_OPERATION_OK;
 
-	result = MIFARE_BlockExchange(tag, 0x60, versionBuffer, &versionBufferSize);
+	// Command code, data and what secure messaging adds
+	byte frame[MIFARE_DESFIRE_FSD];
+	if (1 + sendLen + 4 + DESFIRE_MAX_BLOCK_SIZE > sizeof(frame) || headerLen > sendLen) {
+		result.mfrc522 = STATUS_NO_ROOM;
+		return result;
+	}
+	frame[0] = cmd;
+	if (sendLen > 0) {
+		memcpy(&frame[1], sendData, sendLen);
+	}
+	byte dataLen = MIFARE_DESFIRE_SecureCommand(tag, frame, 1 + sendLen, 1 + headerLen, mode) - 1;
+
+	// The first frame is received in frame, where the command was, and its data copied once from behind the status byte.
+	// The additional frames are received straight into their place in backData: their status lands on the last byte of
+	// the frame before, which is put back.
+	size_t capacity = (backData != NULL && backLen != NULL) ? *backLen : 0;
+	size_t received = 0;
+	uint16_t firstLen = sizeof(frame);
+	result.mfrc522 = PICC_IsoDepTransceive(tag, frame, 1 + dataLen, frame, &firstLen);
+	if (result.mfrc522 == STATUS_OK && firstLen < 1) {
+		result.mfrc522 = STATUS_ERROR;
+	}
 	if (result.mfrc522 == STATUS_OK) {
-		byte hardwareVersion[2];
-		byte storageSize;
-
-		versionInfo->hardware.vendor_id = versionBuffer[0];
-		versionInfo->hardware.type = versionBuffer[1];
-		versionInfo->hardware.subtype = versionBuffer[2];
-		versionInfo->hardware.version_major = versionBuffer[3];
-		versionInfo->hardware.version_minor = versionBuffer[4];
-		versionInfo->hardware.storage_size = versionBuffer[5];
-		versionInfo->hardware.protocol = versionBuffer[6];
-
-		if (result.desfire == MF_ADDITIONAL_FRAME) {
-			result = MIFARE_BlockExchange(tag, 0xAF, versionBuffer, &versionBufferSize);
-			if (result.mfrc522 == STATUS_OK) {
-				versionInfo->software.vendor_id = versionBuffer[0];
-				versionInfo->software.type = versionBuffer[1];
-				versionInfo->software.subtype = versionBuffer[2];
-				versionInfo->software.version_major = versionBuffer[3];
-				versionInfo->software.version_minor = versionBuffer[4];
-				versionInfo->software.storage_size = versionBuffer[5];
-				versionInfo->software.protocol = versionBuffer[6];
-			} else {
-				printf("Failed to send AF: ");
-				printf("%s \n",GetStatusCodeName(result));
+		result.desfire = (DesfireStatusCode)frame[0];
+		if ((size_t)(firstLen - 1) > capacity) {
+			result.mfrc522 = STATUS_NO_ROOM;
+		}
+		else if (firstLen > 1) {
+			memcpy(backData, &frame[1], firstLen - 1);
+			received = firstLen - 1;
+		}
+	}
+	while (result.mfrc522 == STATUS_OK && result.desfire == MF_ADDITIONAL_FRAME) {
+		byte *target = received > 0 ? &backData[received - 1] : frame;
+		size_t room = received > 0 ? capacity - received + 1 : sizeof(frame);
+		uint16_t frameLen = room < 0xFFFF ? room : 0xFFFF;
+		byte saved = target[0];
+		byte additionalFrame = 0xAF;
+		result.mfrc522 = PICC_IsoDepTransceive(tag, &additionalFrame, 1, target, &frameLen);
+		byte status = target[0];
+		target[0] = saved;
+		if (result.mfrc522 != STATUS_OK) {
+			break;
+		}
+		if (frameLen < 1) {
+			result.mfrc522 = STATUS_ERROR;
+			break;
+		}
+		result.desfire = (DesfireStatusCode)status;
+		if (target == frame && frameLen > 1) {
+			if ((size_t)(frameLen - 1) > capacity) {
+				result.mfrc522 = STATUS_NO_ROOM;
+				break;
 			}
+			memcpy(backData, &frame[1], frameLen - 1);
+		}
+		received += frameLen - 1;
+	}
+	if (backLen != NULL) {
+		*backLen = received;
+	}
+	if (result.mfrc522 != STATUS_OK) {
+		tag->authScheme = 0;	// The IV is out of step with the PICC now
+		return result;
+	}
+	if (!MIFARE_DESFIRE_SecureResponse(tag, result.desfire, backData, backLen, mode)) {
+		result.desfire = MF_INTEGRITY_ERROR;
+	}
+	return result;
+} // End MIFARE_DESFIRE_Exchange()
 
-			if (result.desfire == MF_ADDITIONAL_FRAME) {
-				byte nad = 0x60;
-				result = MIFARE_BlockExchange(tag, 0xAF, versionBuffer, &versionBufferSize);
-				if (result.mfrc522 == STATUS_OK) {
-					memcpy(versionInfo->uid, &versionBuffer[0], 7);
-					memcpy(versionInfo->batch_number, &versionBuffer[7], 5);
-					versionInfo->production_week = versionBuffer[12];
-					versionInfo->production_year = versionBuffer[13];
-				} else {
-					printf("Failed to send AF: ");
-					printf("%s \n",GetStatusCodeName(result));
+/**
+ * Applies secure messaging to a command, see MIFARE_DESFIRE_Exchange(). frame needs room for 4 + DESFIRE_MAX_BLOCK_SIZE
+ * more bytes.
+ *
+ * @return The length of the secured command.
+ */
+size_t DESFire::MIFARE_DESFIRE_SecureCommand(	mifare_desfire_tag *tag,	///< The PICC.
+												byte *frame,				///< In: Command code and data. Out: The secured command.
+												size_t length,				///< Bytes in frame.
+												size_t plainLength,			///< Bytes at the start of frame that stay plain: the command code and the header.
+												mifare_desfire_communication_modes mode	///< How the data is secured.
+) {
+	if (tag->authScheme == 0) {
+		return length;
+	}
+	const DesfireCipher &key = tag->sessionKey;
+	bool iso = tag->authScheme != 0x0A;
+	if (length == plainLength) {
+		mode = MDCM_PLAIN;		// Nothing to secure, eg a read: mode is for the response
+	}
+
+	switch (mode) {
+		case MDCM_MACED:
+			if (iso) {
+				key.Cmac(tag->iv, frame, length);
+				memcpy(&frame[length], tag->iv, 8);
+				return length + 8;
+			}
+			MIFARE_DESFIRE_LegacyMac(key, &frame[plainLength], length - plainLength, &frame[length]);
+			return length + 4;
+
+		case MDCM_ENCIPHERED: {
+			// Data, CRC and zeros up to the block size
+			if (iso) {
+				uint32_t crc = DesfireCipher::Crc32(frame, length);
+				for (byte i = 0; i < 4; i++) {
+					frame[length++] = (crc >> (8 * i)) & 0xFF;
 				}
 			}
+			else {
+				CRC_A(&frame[plainLength], length - plainLength, &frame[length]);
+				length += 2;
+			}
+			byte blockSize = key.GetBlockSize();
+			while ((length - plainLength) % blockSize != 0) {
+				frame[length++] = 0x00;
+			}
+			if (iso) {
+				key.EncryptCBC(tag->iv, &frame[plainLength], &frame[plainLength], length - plainLength);
+			}
+			else {
+				key.LegacySend(&frame[plainLength], &frame[plainLength], length - plainLength);
+			}
+			return length;
+		}
 
-			if (result.desfire == MF_ADDITIONAL_FRAME) {
-				printf("GetVersion(): More data???\n");
+		default:
+			if (iso) {
+				key.Cmac(tag->iv, frame, length);	// Only advances the IV
 			}
+			return length;
+	}
+} // End MIFARE_DESFIRE_SecureCommand()
+
+/**
+ * Checks and removes the MAC of a response, or deciphers it, see MIFARE_DESFIRE_Exchange().
+ *
+ * @return false if the MAC or the CRC does not match.
+ */
+bool DESFire::MIFARE_DESFIRE_SecureResponse(	mifare_desfire_tag *tag,	///< The PICC.
+												DesfireStatusCode status,	///< The status of the response.
+												byte *data,					///< In: The data of all frames. Out: The plain data.
+												size_t *length,				///< In: Bytes in data. Out: Bytes of plain data.
+												mifare_desfire_communication_modes mode	///< How the data is secured.
+) {
+	if (tag->authScheme == 0) {
+		return true;
+	}
+	if (status != MF_OPERATION_OK) {
+		tag->authScheme = 0;	// Errors come without MAC and end the authentication
+		return true;
+	}
+	size_t dataLen = (data != NULL && length != NULL) ? *length : 0;
+	const DesfireCipher &key = tag->sessionKey;
+	bool iso = tag->authScheme != 0x0A;
+	byte mac[8];
+
+	if (mode == MDCM_ENCIPHERED && dataLen > 0) {
+		// Data, CRC (ISO: CRC32 over data and status, native: CRC16 over data) and zeros up to the block size
+		byte blockSize = key.GetBlockSize();
+		if (dataLen % blockSize != 0) {
+			tag->authScheme = 0;
+			return false;
+		}
+		if (iso) {
+			key.DecryptCBC(tag->iv, data, data, dataLen);
 		}
+		else {
+			byte iv[DESFIRE_MAX_BLOCK_SIZE] = { 0 };
+			key.DecryptCBC(iv, data, data, dataLen);
+		}
+		// The CRC ends after the last non-zero byte, within the last block. The shortest fit wins: a CRC over the data
+		// and its own CRC is 0, so a longer fit can take the real CRC for data and two bytes of padding for its CRC.
+		byte crcSize = iso ? 4 : 2;
+		size_t end = dataLen;
+		while (end > 0 && data[end - 1] == 0x00) {
+			end--;
+		}
+		if (end < dataLen - blockSize + 1) {
+			end = dataLen - blockSize + 1;
+		}
+		if (end < crcSize) {
+			end = crcSize;
+		}
+		for (; end <= dataLen; end++) {
+			size_t plainLen = end - crcSize;
+			bool match;
+			if (iso) {
+				byte statusByte = status;
+				uint32_t crc = DesfireCipher::Crc32(&statusByte, 1, DesfireCipher::Crc32(data, plainLen));
+				match = data[plainLen] == (crc & 0xFF) && data[plainLen + 1] == ((crc >> 8) & 0xFF)
+					&& data[plainLen + 2] == ((crc >> 16) & 0xFF) && data[plainLen + 3] == (crc >> 24);
+			}
+			else {
+				byte crc[2];
+				CRC_A(data, plainLen, crc);
+				match = data[plainLen] == crc[0] && data[plainLen + 1] == crc[1];
+			}
+			if (match) {
+				*length = plainLen;
+				return true;
+			}
+		}
+		tag->authScheme = 0;
+		return false;
+	}
+
+	if (iso) {
+		// CMAC over data and status, whatever the mode
+		if (dataLen < 8) {
+			tag->authScheme = 0;
+			return false;
+		}
+		dataLen -= 8;
+		memcpy(mac, &data[dataLen], 8);
+		data[dataLen] = status;
+		key.Cmac(tag->iv, data, dataLen + 1);
+		*length = dataLen;
+		if (memcmp(mac, tag->iv, 8) != 0) {
+			tag->authScheme = 0;
+			return false;
+		}
+		return true;
+	}
+
+	if (mode == MDCM_MACED) {
+		if (dataLen < 4) {
+			tag->authScheme = 0;
+			return false;
+		}
+		dataLen -= 4;
+		MIFARE_DESFIRE_LegacyMac(key, data, dataLen, mac);
+		*length = dataLen;
+		if (memcmp(mac, &data[dataLen], 4) != 0) {
+			tag->authScheme = 0;
+			return false;
+		}
+	}
+	return true;
+} // End MIFARE_DESFIRE_SecureResponse()
+
+/**
+ * The MAC of native (legacy) secure messaging: the first 4 bytes of the last block of the CBC encryption of the data,
+ * padded with zeros, from a zero IV.
+ */
+void DESFire::MIFARE_DESFIRE_LegacyMac(	const DesfireCipher &key,	///< The session key.
+										const byte *data,			///< The data.
+										size_t length,				///< Bytes in data.
+										byte *mac					///< Out: 4 bytes.
+) {
+	byte iv[8] = { 0 };
+	size_t whole = length / 8 * 8;
+	for (size_t offset = 0; offset < whole; offset += 8) {
+		key.EncryptCBC(iv, &data[offset], iv, 8);
+	}
+	if (length > whole) {
+		byte last[8] = { 0 };
+		memcpy(last, &data[whole], length - whole);
+		key.EncryptCBC(iv, last, iv, 8);
+	}
+	memcpy(mac, iv, 4);
+} // End MIFARE_DESFIRE_LegacyMac()
+
+/**
+ * Authenticates with a key of the selected application, or of the PICC at the PICC level, and starts secure messaging
+ * with the session key both sides derive from their random numbers. The key type picks the protocol:
+ * DES and 2K3DES keys use native authentication (0x0A), which DESFire EV1 and the original DESFire know;
+ * 3K3DES keys use ISO authentication (0x1A) and AES keys AES authentication (0xAA), both DESFire EV1 only.
+ * The authentication lasts until an error, a SelectApplication or the next authentication.
+ *
+ * @return MF_AUTHENTICATION_ERROR in desfire if the PICC did not prove it has the key.
+ */
+DESFire::StatusCode DESFire::MIFARE_DESFIRE_Authenticate(	mifare_desfire_tag *tag,			///< The PICC, in the ISO/IEC 14443-4 protocol state.
+															byte keyNo,							///< The key number.
+															DesfireCipher::KeyType keyType,		///< The cipher of the key.
+															const byte *key						///< DesfireCipher::GetKeySize(keyType) bytes.
+) {
+	StatusCode result;
+	result.mfrc522 = STATUS_OK;
+	result.desfire = MF_OPERATION_OK;
+	tag->authScheme = 0;
+
+	DesfireCipher cipher;
+	if (!cipher.SetKey(keyType, key)) {
+		result.mfrc522 = STATUS_INVALID;
+		return result;
+	}
+	byte cmd = keyType == DesfireCipher::KEY_AES ? 0xAA : keyType == DesfireCipher::KEY_3K3DES ? 0x1A : 0x0A;
+	bool iso = cmd != 0x0A;
+	byte randomSize = iso ? 16 : 8;
+	byte rndA[16], rndB[16];
+	byte iv[DESFIRE_MAX_BLOCK_SIZE] = { 0 };
+
+	// 1. The PICC sends RndB, enciphered
+	byte buffer[2 * 16 + 8];
+	byte bufferSize = sizeof(buffer);
+	byte sendLen = 1;
+	buffer[0] = keyNo;
+	result = MIFARE_BlockExchangeWithData(tag, cmd, buffer, &sendLen, buffer, &bufferSize);
+	if (result.mfrc522 != STATUS_OK || result.desfire != MF_ADDITIONAL_FRAME) {
+		return result;
+	}
+	if (bufferSize != randomSize) {
+		result.mfrc522 = STATUS_ERROR;
+		return result;
+	}
+	if (iso) {
+		cipher.DecryptCBC(iv, buffer, rndB, randomSize);
 	}
 	else {
-		printf("Version(): Failure.\n");
+		cipher.DecryptBlock(buffer, rndB);
 	}
 
+	// 2. RndA and RndB rotated left by a byte, enciphered
+	if (getrandom(rndA, randomSize, 0) != randomSize) {
+		result.mfrc522 = STATUS_INTERNAL_ERROR;
+		return result;
+	}
+	memcpy(buffer, rndA, randomSize);
+	memcpy(&buffer[randomSize], &rndB[1], randomSize - 1);
+	buffer[2 * randomSize - 1] = rndB[0];
+	if (iso) {
+		cipher.EncryptCBC(iv, buffer, buffer, 2 * randomSize);
+	}
+	else {
+		cipher.LegacySend(buffer, buffer, 2 * randomSize);
+	}
+	sendLen = 2 * randomSize;
+	bufferSize = sizeof(buffer);
+	result = MIFARE_BlockExchangeWithData(tag, 0xAF, buffer, &sendLen, buffer, &bufferSize);
+	if (result.mfrc522 != STATUS_OK || result.desfire != MF_OPERATION_OK) {
+		return result;
+	}
+
+	// 3. The PICC proves it has the key: RndA rotated left by a byte, enciphered
+	if (bufferSize != randomSize) {
+		result.mfrc522 = STATUS_ERROR;
+		return result;
+	}
+	if (iso) {
+		cipher.DecryptCBC(iv, buffer, buffer, randomSize);
+	}
+	else {
+		cipher.DecryptBlock(buffer, buffer);
+	}
+	if (memcmp(buffer, &rndA[1], randomSize - 1) != 0 || buffer[randomSize - 1] != rndA[0]) {
+		result.desfire = MF_AUTHENTICATION_ERROR;
+		return result;
+	}
+
+	// Session key from both random numbers
+	byte sessionKey[DESFIRE_MAX_KEY_SIZE];
+	DesfireCipher::KeyType sessionType = keyType;
+	memcpy(&sessionKey[0], &rndA[0], 4);
+	memcpy(&sessionKey[4], &rndB[0], 4);
+	switch (keyType) {
+		case DesfireCipher::KEY_2K3DES:
+			// A 2K3DES key with K1 = K2 (parity bits aside) is a DES key to the PICC
+			sessionType = DesfireCipher::KEY_DES;
+			for (byte i = 0; i < 8; i++) {
+				if ((key[i] & 0xFE) != (key[8 + i] & 0xFE)) {
+					sessionType = DesfireCipher::KEY_2K3DES;
+				}
+			}
+			memcpy(&sessionKey[8], &rndA[4], 4);
+			memcpy(&sessionKey[12], &rndB[4], 4);
+			break;
+		case DesfireCipher::KEY_3K3DES:
+			memcpy(&sessionKey[8], &rndA[6], 4);
+			memcpy(&sessionKey[12], &rndB[6], 4);
+			memcpy(&sessionKey[16], &rndA[12], 4);
+			memcpy(&sessionKey[20], &rndB[12], 4);
+			break;
+		case DesfireCipher::KEY_AES:
+			memcpy(&sessionKey[8], &rndA[12], 4);
+			memcpy(&sessionKey[12], &rndB[12], 4);
+			break;
+		default:
+			break;
+	}
+	tag->sessionKey.SetKey(sessionType, sessionKey);
+	memset(tag->iv, 0, sizeof(tag->iv));
+	tag->authKeyNo = keyNo;
+	tag->authScheme = cmd;
+	return result;
+} // End MIFARE_DESFIRE_Authenticate()
+
+DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetVersion(mifare_desfire_tag *tag, MIFARE_DESFIRE_Version_t *versionInfo)
+{
+	StatusCode result;
+	// Hardware (7 bytes), software (7 bytes) and production data (14 bytes) in three frames, and a MAC
+	byte versionBuffer[28 + 8];
+	size_t versionBufferSize = sizeof(versionBuffer);
+
+	result = MIFARE_DESFIRE_Exchange(tag, 0x60, NULL, 0, 0, MDCM_PLAIN, versionBuffer, &versionBufferSize);
+	if (!IsStatusCodeOK(result)) {
+		return result;
+	}
+	if (versionBufferSize < 28) {
+		result.mfrc522 = STATUS_ERROR;
+		return result;
+	}
+
+	versionInfo->hardware.vendor_id = versionBuffer[0];
+	versionInfo->hardware.type = versionBuffer[1];
+	versionInfo->hardware.subtype = versionBuffer[2];
+	versionInfo->hardware.version_major = versionBuffer[3];
+	versionInfo->hardware.version_minor = versionBuffer[4];
+	versionInfo->hardware.storage_size = versionBuffer[5];
+	versionInfo->hardware.protocol = versionBuffer[6];
+
+	versionInfo->software.vendor_id = versionBuffer[7];
+	versionInfo->software.type = versionBuffer[8];
+	versionInfo->software.subtype = versionBuffer[9];
+	versionInfo->software.version_major = versionBuffer[10];
+	versionInfo->software.version_minor = versionBuffer[11];
+	versionInfo->software.storage_size = versionBuffer[12];
+	versionInfo->software.protocol = versionBuffer[13];
+
+	memcpy(versionInfo->uid, &versionBuffer[14], 7);
+	memcpy(versionInfo->batch_number, &versionBuffer[21], 5);
+	versionInfo->production_week = versionBuffer[26];
+	versionInfo->production_year = versionBuffer[27];
+
 	return result;
 } // End MIFARE_DESFIRE_GetVersion
 
@@ -204,14 +1006,9 @@ DESFire::StatusCode DESFire::MIFARE_DESFIRE_SelectApplication(mifare_desfire_tag
 {
 	StatusCode result;
 
-	byte buffer[64];
-	byte bufferSize = MIFARE_AID_SIZE;
-	
-	for (byte i = 0; i < MIFARE_AID_SIZE; i++) {
-		buffer[i] = aid->data[i];
-	}
-	
-	result = MIFARE_BlockExchangeWithData(tag, 0x5A, buffer, &bufferSize, buffer, &bufferSize);
+	// Selecting ends the authentication, the response has no MAC
+	tag->authScheme = 0;
+	result = MIFARE_DESFIRE_Exchange(tag, 0x5A, aid->data, MIFARE_AID_SIZE, MIFARE_AID_SIZE, MDCM_PLAIN, NULL, NULL);
 	if (IsStatusCodeOK(result)) {
 		// keep track of the application
 		memcpy(tag->selected_application, aid->data, MIFARE_AID_SIZE);
@@ -224,13 +1021,17 @@ DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetFileIDs(mifare_desfire_tag *tag,
 {
 	StatusCode result;
 	
-	byte bufferSize = MIFARE_MAX_FILE_COUNT + 5;
-	byte buffer[bufferSize];
+	byte buffer[MIFARE_MAX_FILE_COUNT + 8];
+	size_t bufferSize = sizeof(buffer);
 
-	result = MIFARE_BlockExchange(tag, 0x6F, buffer, &bufferSize);
+	result = MIFARE_DESFIRE_Exchange(tag, 0x6F, NULL, 0, 0, MDCM_PLAIN, buffer, &bufferSize);
 	if (IsStatusCodeOK(result)) {
+		if (bufferSize > MIFARE_MAX_FILE_COUNT) {
+			result.mfrc522 = STATUS_ERROR;
+			return result;
+		}
 		*filesCount = bufferSize;
-		memcpy(files, &buffer, *filesCount);
+		memcpy(files, buffer, *filesCount);
 	}
 
 	return result;
@@ -240,14 +1041,15 @@ DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetFileSettings(mifare_desfire_tag *
 {
 	StatusCode result;
 
-	byte buffer[21];
-	byte bufferSize = 21;
-	byte sendLen = 1;
-
-	buffer[0] = *file;
+	byte buffer[17 + 8];
+	size_t bufferSize = sizeof(buffer);
 
-	result = MIFARE_BlockExchangeWithData(tag, 0xF5, buffer, &sendLen, buffer, &bufferSize);
+	result = MIFARE_DESFIRE_Exchange(tag, 0xF5, file, 1, 1, MDCM_PLAIN, buffer, &bufferSize);
 	if (IsStatusCodeOK(result)) {
+		if (bufferSize < 7) {
+			result.mfrc522 = STATUS_ERROR;
+			return result;
+		}
 		fileSettings->file_type = buffer[0];
 		fileSettings->communication_settings = buffer[1];
 		fileSettings->access_rights = ((uint16_t)(buffer[2]) << 8) | (buffer[3]);
@@ -286,11 +1088,15 @@ DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetKeySettings(mifare_desfire_tag *t
 {
 	StatusCode result;
 
-	byte buffer[7];
-	byte bufferSize = 7;
+	byte buffer[2 + 8];
+	size_t bufferSize = sizeof(buffer);
 
-	result = MIFARE_BlockExchange(tag, 0x45, buffer, &bufferSize);
+	result = MIFARE_DESFIRE_Exchange(tag, 0x45, NULL, 0, 0, MDCM_PLAIN, buffer, &bufferSize);
 	if (IsStatusCodeOK(result)) {
+		if (bufferSize < 2) {
+			result.mfrc522 = STATUS_ERROR;
+			return result;
+		}
 		*settings = buffer[0];
 		*maxKeys = buffer[1];
 	}
@@ -302,70 +1108,133 @@ DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetKeyVersion(mifare_desfire_tag *ta
 {
 	StatusCode result;
 
-	byte buffer[6];
-	byte bufferSize = 6;
-	byte sendLen = 1;
-
-	buffer[0] = key;
+	byte buffer[1 + 8];
+	size_t bufferSize = sizeof(buffer);
 
-	result = MIFARE_BlockExchangeWithData(tag, 0x64, buffer, &sendLen, buffer, &bufferSize);
+	result = MIFARE_DESFIRE_Exchange(tag, 0x64, &key, 1, 1, MDCM_PLAIN, buffer, &bufferSize);
 	if (IsStatusCodeOK(result)) {
+		if (bufferSize < 1) {
+			result.mfrc522 = STATUS_ERROR;
+			return result;
+		}
 		*version = buffer[0];
 	}
 
 	return result;
 }
 
-DESFire::StatusCode DESFire::MIFARE_DESFIRE_ReadData(mifare_desfire_tag *tag, byte fid, uint32_t offset, uint32_t length, byte *backData, size_t *backLen)
+/**
+ * Reads length bytes of a standard or backup data file from offset on, all of it from offset on if length is 0.
+ * mode is the communication mode of the file, from its communication settings. It only matters while authenticated.
+ * *backLen is the size of backData on the way in: enough for the data and, in MDCM_ENCIPHERED, CRC and padding (up to
+ * 4 + 15 bytes more), or the 8 byte CMAC of an ISO or AES authentication.
+ */
+DESFire::StatusCode DESFire::MIFARE_DESFIRE_ReadData(mifare_desfire_tag *tag, byte fid, uint32_t offset, uint32_t length, byte *backData, size_t *backLen, mifare_desfire_communication_modes mode)
 {
-	StatusCode result;
-
-	byte buffer[64];
-	byte bufferSize = 64;
-	byte sendLen = 7;
-	size_t outSize = 0;
+	byte buffer[7];
 
 	// file ID
 	buffer[0] = fid;
 	// offset
-	buffer[1] = (offset & 0x00000F);
+	buffer[1] = (offset & 0x0000FF);
 	buffer[2] = (offset & 0x00FF00) >> 8;
 	buffer[3] = (offset & 0xFF0000) >> 16;
 	// length
 	buffer[4] = (length & 0x0000FF);
 	buffer[5] = (length & 0x00FF00) >> 8;
 	buffer[6] = (length & 0xFF0000) >> 16;
-	
-	result = MIFARE_BlockExchangeWithData(tag, 0xBD, buffer, &sendLen, buffer, &bufferSize);
-	if (result.mfrc522 == STATUS_OK) {
-		do {
-			// Copy the data
-			memcpy(backData + outSize, buffer, bufferSize);
-			outSize += bufferSize;
-			*backLen = outSize;
-
-			if (result.desfire == MF_ADDITIONAL_FRAME) {
-				result = MIFARE_BlockExchange(tag, 0xAF, buffer, &bufferSize);
-			}
-		}  while (result.mfrc522 == STATUS_OK && result.desfire == MF_ADDITIONAL_FRAME);
+
+	return MIFARE_DESFIRE_Exchange(tag, 0xBD, buffer, sizeof(buffer), sizeof(buffer), mode, backData, backLen);
+}
+
+/**
+ * Reads length bytes of a standard or backup data file from offset on into sink, with one ReadData command per
+ * MIFARE_DESFIRE_READ_WINDOW bytes, so that memory stays bounded whatever the size of the file. The frames of a window
+ * go straight into the sink's buffer, or a staging buffer if the sink has none, see DesfireSink::GetBuffer().
+ * What the sink got stays valid when a later window fails: *done tells how far the read got, and a read from
+ * offset + *done of length - *done resumes it. Plain data of a failed window is passed on as far as it arrived,
+ * secured data only once its MAC or CRC checked out.
+ *
+ * @return STATUS_OK in mfrc522 and MF_OPERATION_OK in desfire if all length bytes were read. STATUS_NO_ROOM if the sink
+ * stopped the read, STATUS_INVALID if there is nothing to read.
+ */
+DESFire::StatusCode DESFire::MIFARE_DESFIRE_ReadDataStream(	mifare_desfire_tag *tag,	///< The PICC, in the ISO/IEC 14443-4 protocol state.
+																byte fid,					///< The file.
+																uint32_t offset,			///< The first byte to read.
+																uint32_t length,			///< Bytes to read, at least 1.
+																DesfireSink *sink,			///< Takes the data.
+																mifare_desfire_communication_modes mode,	///< The communication mode of the file, see MIFARE_DESFIRE_ReadData().
+																uint32_t *done				///< Out: Bytes the sink took. NULL if not needed.
+) {
+	StatusCode result;
+	result.mfrc522 = STATUS_OK;
+	result.desfire = MF_OPERATION_OK;
+	byte staging[MIFARE_DESFIRE_READ_WINDOW + MIFARE_DESFIRE_READ_SLACK];
+	uint32_t read = 0;
+
+	if (length == 0 || sink == NULL) {
+		result.mfrc522 = STATUS_INVALID;
+	}
+	while (result.mfrc522 == STATUS_OK && read < length) {
+		uint32_t window = length - read < MIFARE_DESFIRE_READ_WINDOW ? length - read : MIFARE_DESFIRE_READ_WINDOW;
+		size_t backLen = window + MIFARE_DESFIRE_READ_SLACK;
+		byte *target = sink->GetBuffer(backLen);
+		if (target == NULL) {
+			target = staging;
+		}
+		bool secured = tag->authScheme != 0;
+		result = MIFARE_DESFIRE_ReadData(tag, fid, offset + read, window, target, &backLen, mode);
+		bool complete = IsStatusCodeOK(result);
+		if (complete && backLen != window) {
+			result.mfrc522 = STATUS_ERROR;		// The PICC did not return what was asked for
+			complete = false;
+		}
+		size_t valid = (complete || !secured) ? (backLen < window ? backLen : window) : 0;
+		if (valid > 0 && !sink->Write(target, valid)) {
+			result.mfrc522 = STATUS_NO_ROOM;
+			break;
+		}
+		read += valid;
+		if (!complete) {
+			break;
+		}
 	}
 
+	if (done != NULL) {
+		*done = read;
+	}
 	return result;
-}
+} // End MIFARE_DESFIRE_ReadDataStream()
+
+/**
+ * Takes the next length bytes: nothing to do if the reader wrote them in place, a copy otherwise.
+ *
+ * @return false if they do not fit.
+ */
+bool DesfireBufferSink::Write(const byte *data, size_t length) {
+	if (_length + length > _capacity) {
+		return false;
+	}
+	if (data != &_buffer[_length]) {
+		memcpy(&_buffer[_length], data, length);
+	}
+	_length += length;
+	return true;
+} // End Write()
 
-DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetValue(mifare_desfire_tag *tag, byte fid, int32_t *value)
+DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetValue(mifare_desfire_tag *tag, byte fid, int32_t *value, mifare_desfire_communication_modes mode)
 {
 	StatusCode result;
 
-	byte buffer[MFRC522::FIFO_SIZE];
-	byte bufferSize = MFRC522::FIFO_SIZE;
-	byte sendLen = 1;
-	size_t outSize = 0;
-
-	buffer[0] = fid;
+	byte buffer[4 + 4 + DESFIRE_MAX_BLOCK_SIZE];
+	size_t bufferSize = sizeof(buffer);
 
-	result = MIFARE_BlockExchangeWithData(tag, 0x6C, buffer, &sendLen, buffer, &bufferSize);
+	result = MIFARE_DESFIRE_Exchange(tag, 0x6C, &fid, 1, 1, mode, buffer, &bufferSize);
 	if (IsStatusCodeOK(result)) {
+		if (bufferSize < 4) {
+			result.mfrc522 = STATUS_ERROR;
+			return result;
+		}
 		*value = ((uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24));
 	}
 
@@ -376,50 +1245,16 @@ DESFire::StatusCode DESFire::MIFARE_DESFIRE_GetApplicationIds(mifare_desfire_tag
 {
 	StatusCode result;
 	
-	// MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE + PCB (1 byte) + CID (1 byte) + Checksum (2 bytes)
-	// I also add an extra byte in case NAD is needed
-	byte bufferSize = (MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE) + 5;
-	byte buffer[bufferSize]; 
-	byte aidBuffer[MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE];
-	byte aidBufferSize = 0;
-
-	result = MIFARE_BlockExchange(tag, 0x6A, buffer, &bufferSize);
-	if (result.mfrc522 != STATUS_OK)
-		return result;
-		
-	// MIFARE_MAX_APPLICATION_COUNT (28) * MIFARE_AID_SIZE + PCB (1) + CID (1) + Checksum (2) = 88
-	// Even if the NAD byte is not present we could GET a 0xAF response.
-	if (result.desfire == MF_OPERATION_OK && bufferSize == 0x00) {
-		// Empty application list
-		*applicationCount = 0;
-		return result;
-	}
-
-	memcpy(aidBuffer, buffer, bufferSize);
-	aidBufferSize = bufferSize;
-
-	while (result.desfire == MF_ADDITIONAL_FRAME) {
-		bufferSize = (MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE) + 5;
-		result = MIFARE_BlockExchange(tag, 0xAF, buffer, &bufferSize);
-		if (result.mfrc522 != STATUS_OK)
-			return result;
-
-		// Make sure we have space (Just in case)
-		if ((aidBufferSize + bufferSize) > (MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE)) {
-			result.mfrc522 = STATUS_NO_ROOM;
-			return result;
-		}
+	// Up to MIFARE_MAX_APPLICATION_COUNT AIDs in two frames, and a MAC
+	byte aidBuffer[MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE + 8];
+	size_t aidBufferSize = sizeof(aidBuffer);
 
-		// Append the new data
-		memcpy(aidBuffer + aidBufferSize, buffer, bufferSize);
-	}
-	
+	result = MIFARE_DESFIRE_Exchange(tag, 0x6A, NULL, 0, 0, MDCM_PLAIN, aidBuffer, &aidBufferSize);
+	if (!IsStatusCodeOK(result))
+		return result;
 
 	// Applications are identified with a 3 byte application identifier(AID)
-	// we also received the status byte:
-	if ((aidBufferSize % 3) != 0) {
-		printf("MIFARE_DESFIRE_GetApplicationIds(): Data is not a modulus of 3.");
-		// TODO: Some kind of failure
+	if ((aidBufferSize % 3) != 0 || aidBufferSize > MIFARE_MAX_APPLICATION_COUNT * MIFARE_AID_SIZE) {
 		result.mfrc522 = STATUS_ERROR;
 		return result;
 	}
@@ -446,7 +1281,15 @@ const char *DESFire::GetStatusCodeName(StatusCode code)
 		return MFRC522::GetStatusCodeName(code.mfrc522);
 	}
 
-	switch (code.desfire) {
+	return GetDesfireStatusCodeName(code.desfire);
+} // End GetStatusCodeName()
+
+/**
+ * Returns the description of a DESFire status byte.
+ */
+const char *DESFire::GetDesfireStatusCodeName(DesfireStatusCode code)
+{
+	switch (code) {
 		case MF_OPERATION_OK:			return "Successful operation.";
 		case MF_NO_CHANGES:				return "No changes done to backup files.";
 		case MF_OUT_OF_EEPROM_ERROR:	return "Insufficient NV-Mem. to complete cmd.";
@@ -471,7 +1314,7 @@ const char *DESFire::GetStatusCodeName(StatusCode code)
 		case MF_FILE_INTEGRITY_ERROR:	return "Unrecoverable error within file.";
 		default:						return "Unknown error";
 	}
-} // End GetStatusCodeName()
+} // End GetDesfireStatusCodeName()
 
 const char *DESFire::GetFileTypeName(mifare_desfire_file_types fileType)
 {
@@ -6,6 +6,7 @@
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
 #include "MFRC522.h"
+#include "DesfireCipher.h"
 
 /* --------------------------------------
 * DESFire Logical Structure
@@ -15,6 +16,42 @@
 #define MIFARE_MAX_FILE_COUNT        16 /* max # of files in each application */
 #define MIFARE_UID_BYTES             7  /* number of UID bytes */
 #define MIFARE_AID_SIZE              3  /* number of AID bytes */
+#define MIFARE_DESFIRE_FSD           256 /* frame size we accept from the PICC, advertised in RATS */
+#define MIFARE_ISODEP_RETRIES        2   /* ISO-DEP error recoveries (R(NAK) or retransmission) per block before giving up */
+#define MIFARE_ISODEP_RATE_WINDOW    8   /* exchanges at a raised bit rate before its error rate is judged */
+#define MIFARE_ISODEP_RATE_ERRORS    4   /* more than one recovery per this many exchanges is too many, see PICC_IsBitRateFailing() */
+#define MIFARE_DESFIRE_READ_WINDOW   1024 /* bytes per ReadData command of MIFARE_DESFIRE_ReadDataStream() */
+#define MIFARE_DESFIRE_READ_SLACK    (4 + DESFIRE_MAX_BLOCK_SIZE) /* room a ReadData response needs beyond the data: CRC32 and padding, or a CMAC */
+#define MIFARE_DESFIRE_MAX_DATA      0xFFFFFF /* largest offset and length of a data file command, they are 3 byte fields */
+
+/**
+ * Takes the data of DESFire::MIFARE_DESFIRE_ReadDataStream() piece by piece, in file order.
+ */
+class DesfireSink {
+public:
+	virtual ~DesfireSink() {};
+	// Memory for the next length bytes, which the reader then fills in place before it passes them to Write().
+	// NULL if there is none: Write() gets the data from a staging buffer.
+	virtual byte *GetBuffer(size_t /*length*/) { return NULL; };
+	// Takes the next length bytes. false stops the read.
+	virtual bool Write(const byte *data, size_t length) = 0;
+};
+
+/**
+ * A DesfireSink that collects the data in a buffer of the caller. The reader writes straight into it.
+ */
+class DesfireBufferSink : public DesfireSink {
+public:
+	DesfireBufferSink(byte *buffer, size_t capacity) : _buffer(buffer), _capacity(capacity), _length(0) {};
+	virtual byte *GetBuffer(size_t length) { return _length + length <= _capacity ? &_buffer[_length] : NULL; };
+	virtual bool Write(const byte *data, size_t length);
+	size_t GetLength() const { return _length; };
+
+protected:
+	byte *_buffer;
+	size_t _capacity;
+	size_t _length;
+};
 
 class DESFire : public MFRC522 {
 public:
@@ -123,8 +160,28 @@ public:
 
 	typedef struct {
 		byte cid;	// Card ID
-		byte pcb;	// Protocol Control Byte
+		byte pcb;	// Protocol Control Byte of the next I-block: 0x0A (CID following) or 0x02, bit 0 is the block number
 		byte selected_application[MIFARE_AID_SIZE];
+		// ISO/IEC 14443-4 parameters from the ATS, see PICC_ActivateIsoDep()
+		uint16_t fsc;		// Largest frame the PICC accepts, with PCB, CID and CRC_A
+		byte fwi;			// Frame waiting time integer
+		byte sfgi;			// Start-up frame guard time integer
+		byte ta1;			// TA(1), the bit rates the PICC supports
+		bool cidSupported;
+		bool nadSupported;
+		// Error recovery, counted since the activation
+		uint16_t retransmissions;	// Blocks sent again and R(NAK)s sent
+		uint16_t waitingTimeExtensions;
+		// Bit rate, see PICC_SelectBitRate()
+		byte bitRate;				// PPS1 in effect: DSI << 2 | DRI, 0 for 106 kbit/s both ways
+		byte rateCeiling;			// 0, or 1 + the highest PCD_BitRate left after PICC_LowerBitRate(). Kept over activations.
+		uint16_t rateExchanges;		// PICC_IsoDepTransceive() calls at the current bit rate
+		uint16_t rateRecoveries;	// Of those, the ones that needed error recovery
+		// Secure messaging, see MIFARE_DESFIRE_Authenticate()
+		byte authScheme;			// The authentication command in effect: 0x0A (native), 0x1A (ISO), 0xAA (AES), 0 for none
+		byte authKeyNo;
+		byte iv[DESFIRE_MAX_BLOCK_SIZE];	// ISO and AES: the IV, which runs on over all commands of the session
+		DesfireCipher sessionKey;
 	} mifare_desfire_tag;
 
 	/////////////////////////////////////////////////////////////////////////////////////
@@ -132,17 +189,26 @@ public:
 	/////////////////////////////////////////////////////////////////////////////////////
 	explicit DESFire() : MFRC522() {};
 	explicit DESFire(byte resetPowerDownPin) : MFRC522(resetPowerDownPin) {};
-	explicit DESFire(byte chipSelectPin, byte resetPowerDownPin) : MFRC522(chipSelectPin, resetPowerDownPin) {};
+	explicit DESFire(byte chipSelectPin, byte resetPowerDownPin, uint32_t spiClock = MFRC522_SPICLOCK) : MFRC522(chipSelectPin, resetPowerDownPin, spiClock) {};
+	explicit DESFire(SPITransport *transport, byte resetPowerDownPin) : MFRC522(transport, resetPowerDownPin) {};
 
 	/////////////////////////////////////////////////////////////////////////////////////
 	// ISO/IEC 14443 functions not currentlly present in MFRC522 library
 	/////////////////////////////////////////////////////////////////////////////////////
 	MFRC522::StatusCode PICC_RequestATS(byte *atsBuffer, byte *atsLength);
 	MFRC522::StatusCode PICC_ProtocolAndParameterSelection(byte cid, byte pps0, byte pps1 = 0x00);
+	MFRC522::StatusCode PICC_Deselect(byte cid);
+	MFRC522::StatusCode PICC_ActivateIsoDep(mifare_desfire_tag *tag, byte *atsBuffer = NULL, byte *atsLength = NULL);
+	static void PICC_ParseATS(const byte *atsBuffer, byte atsLength, mifare_desfire_tag *tag);
+	MFRC522::StatusCode PICC_SelectBitRate(mifare_desfire_tag *tag, PCD_BitRate maxRate = BITRATE_848);
+	static bool PICC_IsBitRateFailing(const mifare_desfire_tag *tag);
+	static bool PICC_LowerBitRate(mifare_desfire_tag *tag);
+	MFRC522::StatusCode PICC_IsoDepTransceive(mifare_desfire_tag *tag, const byte *sendData, uint16_t sendLen, byte *backData, uint16_t *backLen);
 
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Functions for MIFARE DESFire
 	/////////////////////////////////////////////////////////////////////////////////////
+	StatusCode MIFARE_DESFIRE_Authenticate(mifare_desfire_tag *tag, byte keyNo, DesfireCipher::KeyType keyType, const byte *key);
 	StatusCode MIFARE_DESFIRE_GetVersion(mifare_desfire_tag *tag, MIFARE_DESFIRE_Version_t *versionInfo);
 	StatusCode MIFARE_DESFIRE_GetApplicationIds(mifare_desfire_tag *tag, mifare_desfire_aid_t *aids, byte *applicationCount);
 	StatusCode MIFARE_DESFIRE_SelectApplication(mifare_desfire_tag *tag, mifare_desfire_aid_t *aid);
@@ -158,8 +224,9 @@ public:
 	/////////////////////////////////////////////////////////////////////////////////////
 	// MIFARE DESFire data manipulation commands
 	/////////////////////////////////////////////////////////////////////////////////////
-	StatusCode MIFARE_DESFIRE_ReadData(mifare_desfire_tag *tag, byte fid, uint32_t offset, uint32_t length, byte *backData, size_t *backLen);
-	StatusCode MIFARE_DESFIRE_GetValue(mifare_desfire_tag *tag, byte fid, int32_t *value);
+	StatusCode MIFARE_DESFIRE_ReadData(mifare_desfire_tag *tag, byte fid, uint32_t offset, uint32_t length, byte *backData, size_t *backLen, mifare_desfire_communication_modes mode = MDCM_PLAIN);
+	StatusCode MIFARE_DESFIRE_ReadDataStream(mifare_desfire_tag *tag, byte fid, uint32_t offset, uint32_t length, DesfireSink *sink, mifare_desfire_communication_modes mode = MDCM_PLAIN, uint32_t *done = NULL);
+	StatusCode MIFARE_DESFIRE_GetValue(mifare_desfire_tag *tag, byte fid, int32_t *value, mifare_desfire_communication_modes mode = MDCM_PLAIN);
 
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Support functions
@@ -177,6 +244,12 @@ protected:
 	/////////////////////////////////////////////////////////////////////////////////////
 	StatusCode MIFARE_BlockExchange(mifare_desfire_tag *tag, byte cmd, byte *backData = NULL, byte *backLen = NULL);
 	StatusCode MIFARE_BlockExchangeWithData(mifare_desfire_tag *tag, byte cmd, byte *sendData = NULL, byte *sendLen = NULL, byte *backData = NULL, byte *backLen = NULL);
+	MFRC522::StatusCode PICC_IsoDepExchangeBlock(byte *block, uint16_t blockLen, byte *backData, uint16_t *backLen, byte wtxm);
+	static byte PICC_IsoDepHeader(const mifare_desfire_tag *tag, byte pcb, byte *block);
+	StatusCode MIFARE_DESFIRE_Exchange(mifare_desfire_tag *tag, byte cmd, const byte *sendData, size_t sendLen, size_t headerLen, mifare_desfire_communication_modes mode, byte *backData, size_t *backLen);
+	size_t MIFARE_DESFIRE_SecureCommand(mifare_desfire_tag *tag, byte *frame, size_t length, size_t plainLength, mifare_desfire_communication_modes mode);
+	bool MIFARE_DESFIRE_SecureResponse(mifare_desfire_tag *tag, DesfireStatusCode status, byte *data, size_t *length, mifare_desfire_communication_modes mode);
+	static void MIFARE_DESFIRE_LegacyMac(const DesfireCipher &key, const byte *data, size_t length, byte *mac);
 };
 
 #endif
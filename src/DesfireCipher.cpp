@@ -0,0 +1,590 @@
+/*
+* DesfireCipher.cpp - The block ciphers, CBC modes, CMAC and CRC32 of MIFARE DESFire secure messaging.
+* NOTE: Please also check the comments in DesfireCipher.h.
+* Released into the public domain.
+*/
+
+#include <string.h>
+#include "DesfireCipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define DESFIRECIPHER_AESNI
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define DESFIRECIPHER_ARMV8
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Tables
+/////////////////////////////////////////////////////////////////////////////////////
+
+// DES, FIPS 46-3. Bit 1 is the most significant bit.
+static const uint8_t DES_IP[64] = {
+	58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+	62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+	57, 49, 41, 33, 25, 17,  9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+	61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7
+};
+static const uint8_t DES_P[32] = {
+	16,  7, 20, 21, 29, 12, 28, 17,  1, 15, 23, 26,  5, 18, 31, 10,
+	 2,  8, 24, 14, 32, 27,  3,  9, 19, 13, 30,  6, 22, 11,  4, 25
+};
+static const uint8_t DES_PC1[56] = {
+	57, 49, 41, 33, 25, 17,  9,  1, 58, 50, 42, 34, 26, 18,
+	10,  2, 59, 51, 43, 35, 27, 19, 11,  3, 60, 52, 44, 36,
+	63, 55, 47, 39, 31, 23, 15,  7, 62, 54, 46, 38, 30, 22,
+	14,  6, 61, 53, 45, 37, 29, 21, 13,  5, 28, 20, 12,  4
+};
+static const uint8_t DES_PC2[48] = {
+	14, 17, 11, 24,  1,  5,  3, 28, 15,  6, 21, 10,
+	23, 19, 12,  4, 26,  8, 16,  7, 27, 20, 13,  2,
+	41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+	44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+static const uint8_t DES_SHIFTS[16] = { 1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1 };
+static const uint8_t DES_S[8][64] = {
+	{ 14,  4, 13,  1,  2, 15, 11,  8,  3, 10,  6, 12,  5,  9,  0,  7,
+	   0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8,
+	   4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0,
+	  15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13 },
+	{ 15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5, 10,
+	   3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5,
+	   0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15,
+	  13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9 },
+	{ 10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8,
+	  13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1,
+	  13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7,
+	   1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12 },
+	{  7, 13, 14,  3,  0,  6,  9, 10,  1,  2,  8,  5, 11, 12,  4, 15,
+	  13,  8, 11,  5,  6, 15,  0,  3,  4,  7,  2, 12,  1, 10, 14,  9,
+	  10,  6,  9,  0, 12, 11,  7, 13, 15,  1,  3, 14,  5,  2,  8,  4,
+	   3, 15,  0,  6, 10,  1, 13,  8,  9,  4,  5, 11, 12,  7,  2, 14 },
+	{  2, 12,  4,  1,  7, 10, 11,  6,  8,  5,  3, 15, 13,  0, 14,  9,
+	  14, 11,  2, 12,  4,  7, 13,  1,  5,  0, 15, 10,  3,  9,  8,  6,
+	   4,  2,  1, 11, 10, 13,  7,  8, 15,  9, 12,  5,  6,  3,  0, 14,
+	  11,  8, 12,  7,  1, 14,  2, 13,  6, 15,  0,  9, 10,  4,  5,  3 },
+	{ 12,  1, 10, 15,  9,  2,  6,  8,  0, 13,  3,  4, 14,  7,  5, 11,
+	  10, 15,  4,  2,  7, 12,  9,  5,  6,  1, 13, 14,  0, 11,  3,  8,
+	   9, 14, 15,  5,  2,  8, 12,  3,  7,  0,  4, 10,  1, 13, 11,  6,
+	   4,  3,  2, 12,  9,  5, 15, 10, 11, 14,  1,  7,  6,  0,  8, 13 },
+	{  4, 11,  2, 14, 15,  0,  8, 13,  3, 12,  9,  7,  5, 10,  6,  1,
+	  13,  0, 11,  7,  4,  9,  1, 10, 14,  3,  5, 12,  2, 15,  8,  6,
+	   1,  4, 11, 13, 12,  3,  7, 14, 10, 15,  6,  8,  0,  5,  9,  2,
+	   6, 11, 13,  8,  1,  4, 10,  7,  9,  5,  0, 15, 14,  2,  3, 12 },
+	{ 13,  2,  8,  4,  6, 15, 11,  1, 10,  9,  3, 14,  5,  0, 12,  7,
+	   1, 15, 13,  8, 10,  3,  7,  4, 12,  5,  6, 11,  0, 14,  9,  2,
+	   7, 11,  4,  1,  9, 12, 14,  2,  0,  6, 10, 13, 15,  3,  5,  8,
+	   2,  1, 14,  7,  4, 10,  8, 13, 15, 12,  9,  0,  3,  5,  6, 11 }
+};
+
+/**
+ * Moves bit table[i] of the inBits wide value in to bit i + 1 of an outBits wide value. Bit 1 is the most significant.
+ */
+static uint64_t Permute(uint64_t in, uint8_t inBits, const uint8_t *table, uint8_t outBits) {
+	uint64_t out = 0;
+	for (uint8_t i = 0; i < outBits; i++) {
+		out = (out << 1) | ((in >> (inBits - table[i])) & 1);
+	}
+	return out;
+} // End Permute()
+
+// Tables built once from the ones above: the S-boxes merged with P, the initial and final permutations by nibble, and
+// the AES S-boxes.
+struct CipherTables {
+	uint32_t sp[8][64];			// S-box i for the 6 input bits, placed and permuted by P
+	uint64_t ip[16][16];		// IP of nibble value v at nibble position i, the results OR together
+	uint64_t fp[16][16];		// IP^-1 the same way
+	uint8_t sbox[256];
+	uint8_t inverseSbox[256];
+	uint32_t crc32[256];
+	bool aesInstructions;
+
+	CipherTables() {
+		uint8_t fpTable[64];
+		for (uint8_t i = 0; i < 64; i++) {
+			fpTable[DES_IP[i] - 1] = i + 1;
+		}
+		for (uint8_t box = 0; box < 8; box++) {
+			for (uint8_t v = 0; v < 64; v++) {
+				// The outer bits select the row, the inner four the column
+				uint8_t s = DES_S[box][(((v >> 4) & 0x02) | (v & 0x01)) * 16 + ((v >> 1) & 0x0F)];
+				sp[box][v] = (uint32_t)Permute((uint64_t)s << (28 - 4 * box), 32, DES_P, 32);
+			}
+		}
+		for (uint8_t i = 0; i < 16; i++) {
+			for (uint8_t v = 0; v < 16; v++) {
+				ip[i][v] = Permute((uint64_t)v << (60 - 4 * i), 64, DES_IP, 64);
+				fp[i][v] = Permute((uint64_t)v << (60 - 4 * i), 64, fpTable, 64);
+			}
+		}
+
+		// AES S-box: the multiplicative inverse in GF(2^8) and the affine transformation, walking the field with
+		// generator 3 and its inverse
+		uint8_t p = 1, q = 1;
+		do {
+			p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1B : 0);
+			q ^= q << 1;
+			q ^= q << 2;
+			q ^= q << 4;
+			if (q & 0x80) {
+				q ^= 0x09;
+			}
+			uint8_t x = q ^ (uint8_t)((q << 1) | (q >> 7)) ^ (uint8_t)((q << 2) | (q >> 6)) ^ (uint8_t)((q << 3) | (q >> 5)) ^ (uint8_t)((q << 4) | (q >> 4));
+			sbox[p] = x ^ 0x63;
+		} while (p != 1);
+		sbox[0] = 0x63;
+		for (int i = 0; i < 256; i++) {
+			inverseSbox[sbox[i]] = i;
+		}
+
+		// CRC32 of DESFire EV1: IEEE 802.3, reflected polynomial 0xEDB88320, preset 0xFFFFFFFF, no final inversion
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (uint8_t bit = 0; bit < 8; bit++) {
+				crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+			}
+			crc32[i] = crc;
+		}
+
+		aesInstructions = false;
+#if defined(DESFIRECIPHER_AESNI)
+		unsigned int eax, ebx, ecx, edx;
+		aesInstructions = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES);
+#elif defined(DESFIRECIPHER_ARMV8)
+		aesInstructions = (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#endif
+	}
+};
+
+/**
+ * The tables, built on first use.
+ */
+static const CipherTables &Tables() {
+	static const CipherTables tables;
+	return tables;
+} // End Tables()
+
+/////////////////////////////////////////////////////////////////////////////////////
+// AES-128, FIPS 197
+/////////////////////////////////////////////////////////////////////////////////////
+
+static inline uint8_t Xtime(uint8_t x) {
+	return (x << 1) ^ ((x & 0x80) ? 0x1B : 0);
+}
+
+/**
+ * Multiplies in GF(2^8), for the inverse MixColumns.
+ */
+static uint8_t Multiply(uint8_t x, uint8_t y) {
+	uint8_t result = 0;
+	while (y) {
+		if (y & 1) {
+			result ^= x;
+		}
+		x = Xtime(x);
+		y >>= 1;
+	}
+	return result;
+} // End Multiply()
+
+static void InverseMixColumns(uint8_t *state) {
+	for (uint8_t c = 0; c < 4; c++) {
+		uint8_t *col = state + 4 * c;
+		uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+		col[0] = Multiply(a0, 14) ^ Multiply(a1, 11) ^ Multiply(a2, 13) ^ Multiply(a3, 9);
+		col[1] = Multiply(a0, 9) ^ Multiply(a1, 14) ^ Multiply(a2, 11) ^ Multiply(a3, 13);
+		col[2] = Multiply(a0, 13) ^ Multiply(a1, 9) ^ Multiply(a2, 14) ^ Multiply(a3, 11);
+		col[3] = Multiply(a0, 11) ^ Multiply(a1, 13) ^ Multiply(a2, 9) ^ Multiply(a3, 14);
+	}
+} // End InverseMixColumns()
+
+static void AesEncryptPortable(const uint8_t (*roundKeys)[16], const uint8_t *in, uint8_t *out) {
+	const uint8_t *sbox = Tables().sbox;
+	uint8_t s[16], t[16];
+	for (uint8_t i = 0; i < 16; i++) {
+		s[i] = in[i] ^ roundKeys[0][i];
+	}
+	for (uint8_t round = 1; round <= 10; round++) {
+		// SubBytes and ShiftRows: row r of column c comes from column c + r
+		for (uint8_t c = 0; c < 4; c++) {
+			for (uint8_t r = 0; r < 4; r++) {
+				t[4 * c + r] = sbox[s[4 * ((c + r) & 3) + r]];
+			}
+		}
+		if (round < 10) {
+			for (uint8_t c = 0; c < 4; c++) {
+				uint8_t *col = t + 4 * c;
+				uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+				uint8_t first = col[0];
+				col[0] ^= all ^ Xtime(col[0] ^ col[1]);
+				col[1] ^= all ^ Xtime(col[1] ^ col[2]);
+				col[2] ^= all ^ Xtime(col[2] ^ col[3]);
+				col[3] ^= all ^ Xtime(col[3] ^ first);
+			}
+		}
+		for (uint8_t i = 0; i < 16; i++) {
+			s[i] = t[i] ^ roundKeys[round][i];
+		}
+	}
+	memcpy(out, s, 16);
+} // End AesEncryptPortable()
+
+static void AesDecryptPortable(const uint8_t (*roundKeys)[16], const uint8_t *in, uint8_t *out) {
+	const uint8_t *inverseSbox = Tables().inverseSbox;
+	uint8_t s[16], t[16];
+	for (uint8_t i = 0; i < 16; i++) {
+		s[i] = in[i] ^ roundKeys[10][i];
+	}
+	for (int8_t round = 9; round >= 0; round--) {
+		// InvShiftRows and InvSubBytes: row r of column c goes to column c + r
+		for (uint8_t c = 0; c < 4; c++) {
+			for (uint8_t r = 0; r < 4; r++) {
+				t[4 * ((c + r) & 3) + r] = inverseSbox[s[4 * c + r]];
+			}
+		}
+		for (uint8_t i = 0; i < 16; i++) {
+			s[i] = t[i] ^ roundKeys[round][i];
+		}
+		if (round > 0) {
+			InverseMixColumns(s);
+		}
+	}
+	memcpy(out, s, 16);
+} // End AesDecryptPortable()
+
+#if defined(DESFIRECIPHER_AESNI)
+__attribute__((target("aes,sse2")))
+static void AesEncryptInstructions(const uint8_t (*roundKeys)[16], const uint8_t *in, uint8_t *out) {
+	__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)roundKeys[0]));
+	for (uint8_t round = 1; round < 10; round++) {
+		s = _mm_aesenc_si128(s, _mm_loadu_si128((const __m128i *)roundKeys[round]));
+	}
+	s = _mm_aesenclast_si128(s, _mm_loadu_si128((const __m128i *)roundKeys[10]));
+	_mm_storeu_si128((__m128i *)out, s);
+}
+
+__attribute__((target("aes,sse2")))
+static void AesDecryptInstructions(const uint8_t (*roundKeys)[16], const uint8_t *in, uint8_t *out) {
+	__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)roundKeys[0]));
+	for (uint8_t round = 1; round < 10; round++) {
+		s = _mm_aesdec_si128(s, _mm_loadu_si128((const __m128i *)roundKeys[round]));
+	}
+	s = _mm_aesdeclast_si128(s, _mm_loadu_si128((const __m128i *)roundKeys[10]));
+	_mm_storeu_si128((__m128i *)out, s);
+}
+#elif defined(DESFIRECIPHER_ARMV8)
+__attribute__((target("+crypto")))
+static void AesEncryptInstructions(const uint8_t (*roundKeys)[16], const uint8_t *in, uint8_t *out) {
+	uint8x16_t s = vld1q_u8(in);
+	for (uint8_t round = 0; round < 9; round++) {
+		s = vaesmcq_u8(vaeseq_u8(s, vld1q_u8(roundKeys[round])));
+	}
+	s = veorq_u8(vaeseq_u8(s, vld1q_u8(roundKeys[9])), vld1q_u8(roundKeys[10]));
+	vst1q_u8(out, s);
+}
+
+__attribute__((target("+crypto")))
+static void AesDecryptInstructions(const uint8_t (*roundKeys)[16], const uint8_t *in, uint8_t *out) {
+	uint8x16_t s = vld1q_u8(in);
+	for (uint8_t round = 0; round < 9; round++) {
+		s = vaesimcq_u8(vaesdq_u8(s, vld1q_u8(roundKeys[round])));
+	}
+	s = veorq_u8(vaesdq_u8(s, vld1q_u8(roundKeys[9])), vld1q_u8(roundKeys[10]));
+	vst1q_u8(out, s);
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////
+// DesfireCipher
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @return The key length of a key type in bytes.
+ */
+uint8_t DesfireCipher::GetKeySize(KeyType type) {
+	switch (type) {
+		case KEY_DES:		return 8;
+		case KEY_3K3DES:	return 24;
+		default:			return 16;
+	}
+} // End GetKeySize()
+
+/**
+ * Expands a key and derives its CMAC subkeys.
+ *
+ * @return false if the key type is unknown.
+ */
+bool DesfireCipher::SetKey(	KeyType type,		///< The cipher.
+							const uint8_t *key	///< GetKeySize(type) bytes.
+						) {
+	if (type > KEY_AES) {
+		return false;
+	}
+	_type = type;
+	memset(&_schedule, 0, sizeof(_schedule));
+
+	if (type == KEY_AES) {
+		uint8_t (*w)[16] = _schedule.aes.encrypt;
+		const uint8_t *sbox = Tables().sbox;
+		uint8_t rcon = 0x01;
+		memcpy(w[0], key, 16);
+		for (uint8_t round = 1; round <= 10; round++) {
+			const uint8_t *last = w[round - 1] + 12;
+			uint8_t t[4] = { (uint8_t)(sbox[last[1]] ^ rcon), sbox[last[2]], sbox[last[3]], sbox[last[0]] };
+			for (uint8_t i = 0; i < 16; i++) {
+				w[round][i] = w[round - 1][i] ^ (i < 4 ? t[i] : w[round][i - 4]);
+			}
+			rcon = Xtime(rcon);
+		}
+		// The equivalent inverse cipher of the AES instructions: the round keys backwards, InvMixColumns on the inner ones
+		for (uint8_t round = 0; round <= 10; round++) {
+			memcpy(_schedule.aes.decrypt[round], w[10 - round], 16);
+			if (round > 0 && round < 10) {
+				InverseMixColumns(_schedule.aes.decrypt[round]);
+			}
+		}
+	}
+	else {
+		// K1 K2 K3, 2K3DES repeats K1 and DES uses K1 only
+		uint8_t keys = type == KEY_DES ? 1 : type == KEY_2K3DES ? 2 : 3;
+		for (uint8_t k = 0; k < keys; k++) {
+			uint64_t keyBits = 0;
+			for (uint8_t i = 0; i < 8; i++) {
+				keyBits = (keyBits << 8) | key[8 * k + i];
+			}
+			uint64_t cd = Permute(keyBits, 64, DES_PC1, 56);
+			uint32_t c = cd >> 28, d = cd & 0x0FFFFFFF;
+			for (uint8_t round = 0; round < 16; round++) {
+				for (uint8_t shift = 0; shift < DES_SHIFTS[round]; shift++) {
+					c = ((c << 1) | (c >> 27)) & 0x0FFFFFFF;
+					d = ((d << 1) | (d >> 27)) & 0x0FFFFFFF;
+				}
+				uint64_t roundKey = Permute(((uint64_t)c << 28) | d, 56, DES_PC2, 48);
+				for (uint8_t piece = 0; piece < 8; piece++) {
+					_schedule.des[k][round][piece] = (roundKey >> (42 - 6 * piece)) & 0x3F;
+				}
+			}
+		}
+		if (type == KEY_2K3DES) {
+			memcpy(_schedule.des[2], _schedule.des[0], sizeof(_schedule.des[0]));
+		}
+	}
+	DeriveSubkeys();
+	return true;
+} // End SetKey()
+
+/**
+ * CMAC subkeys: L = E(0), K1 = L << 1, K2 = K1 << 1, each XORed with Rb if a one was shifted out.
+ */
+void DesfireCipher::DeriveSubkeys() {
+	uint8_t blockSize = GetBlockSize();
+	uint8_t rb = blockSize == 16 ? 0x87 : 0x1B;
+	uint8_t l[DESFIRE_MAX_BLOCK_SIZE] = { 0 };
+	EncryptBlock(l, l);
+	for (uint8_t k = 0; k < 2; k++) {
+		uint8_t *subkey = k == 0 ? _subkey1 : _subkey2;
+		const uint8_t *from = k == 0 ? l : _subkey1;
+		for (uint8_t i = 0; i < blockSize; i++) {
+			subkey[i] = (from[i] << 1) | (i + 1 < blockSize ? from[i + 1] >> 7 : 0);
+		}
+		if (from[0] & 0x80) {
+			subkey[blockSize - 1] ^= rb;
+		}
+	}
+} // End DeriveSubkeys()
+
+/**
+ * DES on one 8 byte block, or 3DES EDE (decryption: DED with the keys in reverse) if the key has more than one part.
+ */
+void DesfireCipher::DesBlock(const uint8_t *in, uint8_t *out, bool decrypt) const {
+	const CipherTables &tables = Tables();
+	uint64_t block = 0;
+	for (uint8_t i = 0; i < 8; i++) {
+		block = (block << 8) | in[i];
+	}
+	uint64_t x = 0;
+	for (uint8_t i = 0; i < 16; i++) {
+		x |= tables.ip[i][(block >> (60 - 4 * i)) & 0x0F];
+	}
+	uint32_t left = x >> 32, right = x & 0xFFFFFFFF;
+
+	// The final and initial permutations between the stages of 3DES cancel out
+	uint8_t stages = _type == KEY_DES ? 1 : 3;
+	for (uint8_t stage = 0; stage < stages; stage++) {
+		uint8_t k = decrypt ? stages - 1 - stage : stage;
+		bool backwards = decrypt != (stage == 1);		// EDE: the middle stage runs the other way
+		for (uint8_t round = 0; round < 16; round++) {
+			const uint8_t *roundKey = _schedule.des[k][backwards ? 15 - round : round];
+			uint32_t f = 0;
+			for (uint8_t piece = 0; piece < 8; piece++) {
+				// Expansion E: piece i is bits 4i .. 4i + 5 of the right half, bit 0 being bit 32
+				uint8_t shift = 4 * piece + 5;
+				uint32_t rotated = (right << shift) | (right >> (32 - shift));
+				f ^= tables.sp[piece][(rotated & 0x3F) ^ roundKey[piece]];
+			}
+			uint32_t next = left ^ f;
+			left = right;
+			right = next;
+		}
+		// Undo the swap of the last round
+		uint32_t swap = left;
+		left = right;
+		right = swap;
+	}
+
+	x = ((uint64_t)left << 32) | right;
+	block = 0;
+	for (uint8_t i = 0; i < 16; i++) {
+		block |= tables.fp[i][(x >> (60 - 4 * i)) & 0x0F];
+	}
+	for (int8_t i = 7; i >= 0; i--) {
+		out[i] = block & 0xFF;
+		block >>= 8;
+	}
+} // End DesBlock()
+
+/**
+ * Encrypts one block. in and out may be the same.
+ */
+void DesfireCipher::EncryptBlock(const uint8_t *in, uint8_t *out) const {
+	if (_type != KEY_AES) {
+		DesBlock(in, out, false);
+		return;
+	}
+#if defined(DESFIRECIPHER_AESNI) || defined(DESFIRECIPHER_ARMV8)
+	if (Tables().aesInstructions) {
+		AesEncryptInstructions(_schedule.aes.encrypt, in, out);
+		return;
+	}
+#endif
+	AesEncryptPortable(_schedule.aes.encrypt, in, out);
+} // End EncryptBlock()
+
+/**
+ * Decrypts one block. in and out may be the same.
+ */
+void DesfireCipher::DecryptBlock(const uint8_t *in, uint8_t *out) const {
+	if (_type != KEY_AES) {
+		DesBlock(in, out, true);
+		return;
+	}
+#if defined(DESFIRECIPHER_AESNI) || defined(DESFIRECIPHER_ARMV8)
+	if (Tables().aesInstructions) {
+		AesDecryptInstructions(_schedule.aes.decrypt, in, out);
+		return;
+	}
+#endif
+	AesDecryptPortable(_schedule.aes.encrypt, in, out);
+} // End DecryptBlock()
+
+/**
+ * CBC encryption of length bytes, a multiple of the block size. in and out may be the same.
+ */
+void DesfireCipher::EncryptCBC(	uint8_t *iv,		///< In: The IV. Out: The last cipher block, the IV of what follows.
+								const uint8_t *in,	///< The plain text.
+								uint8_t *out,		///< The cipher text.
+								size_t length		///< Bytes, a multiple of GetBlockSize().
+							) const {
+	uint8_t blockSize = GetBlockSize();
+	for (size_t offset = 0; offset + blockSize <= length; offset += blockSize) {
+		for (uint8_t i = 0; i < blockSize; i++) {
+			iv[i] ^= in[offset + i];
+		}
+		EncryptBlock(iv, iv);
+		memcpy(out + offset, iv, blockSize);
+	}
+} // End EncryptCBC()
+
+/**
+ * CBC decryption of length bytes, a multiple of the block size. in and out may be the same.
+ */
+void DesfireCipher::DecryptCBC(	uint8_t *iv,		///< In: The IV. Out: The last cipher block, the IV of what follows.
+								const uint8_t *in,	///< The cipher text.
+								uint8_t *out,		///< The plain text.
+								size_t length		///< Bytes, a multiple of GetBlockSize().
+							) const {
+	uint8_t blockSize = GetBlockSize();
+	uint8_t cipherBlock[DESFIRE_MAX_BLOCK_SIZE];
+	for (size_t offset = 0; offset + blockSize <= length; offset += blockSize) {
+		memcpy(cipherBlock, in + offset, blockSize);
+		DecryptBlock(cipherBlock, out + offset);
+		for (uint8_t i = 0; i < blockSize; i++) {
+			out[offset + i] ^= iv[i];
+		}
+		memcpy(iv, cipherBlock, blockSize);
+	}
+} // End DecryptCBC()
+
+/**
+ * What DESFire native (legacy) authentication calls enciphering on the PCD side: each block is XORed with the previous
+ * result and then run through the decryption function, starting from a zero IV. The PICC undoes it with CBC encryption.
+ */
+void DesfireCipher::LegacySend(	const uint8_t *in,	///< The plain text.
+								uint8_t *out,		///< The result. May be in.
+								size_t length		///< Bytes, a multiple of 8.
+							) const {
+	uint8_t previous[8] = { 0 };
+	for (size_t offset = 0; offset + 8 <= length; offset += 8) {
+		for (uint8_t i = 0; i < 8; i++) {
+			previous[i] ^= in[offset + i];
+		}
+		DecryptBlock(previous, previous);
+		memcpy(out + offset, previous, 8);
+	}
+} // End LegacySend()
+
+/**
+ * CMAC (NIST SP 800-38B) of data, chained from iv the way DESFire EV1 does. DESFire sends the first 8 bytes of it.
+ */
+void DesfireCipher::Cmac(	uint8_t *iv,			///< In: The IV, zero for a plain CMAC. Out: The CMAC, the IV of what follows.
+							const uint8_t *data,	///< The message.
+							size_t length			///< Bytes.
+						) const {
+	uint8_t blockSize = GetBlockSize();
+	// All blocks but the last one go through CBC as they are
+	size_t whole = length == 0 ? 0 : (length - 1) / blockSize * blockSize;
+	for (size_t offset = 0; offset < whole; offset += blockSize) {
+		for (uint8_t i = 0; i < blockSize; i++) {
+			iv[i] ^= data[offset + i];
+		}
+		EncryptBlock(iv, iv);
+	}
+	// The last block is XORed with K1 if it is complete, padded with 0x80 0x00... and XORed with K2 otherwise
+	uint8_t rest = length - whole;
+	const uint8_t *subkey = rest == blockSize ? _subkey1 : _subkey2;
+	for (uint8_t i = 0; i < blockSize; i++) {
+		uint8_t b = i < rest ? data[whole + i] : i == rest ? 0x80 : 0x00;
+		iv[i] ^= b ^ subkey[i];
+	}
+	EncryptBlock(iv, iv);
+} // End Cmac()
+
+/**
+ * CRC32 as DESFire EV1 appends it to enciphered data: IEEE 802.3 without the final inversion.
+ * Pass the result of one call as crc of the next to continue over more data.
+ */
+uint32_t DesfireCipher::Crc32(const uint8_t *data, size_t length, uint32_t crc) {
+	const uint32_t *table = Tables().crc32;
+	for (size_t i = 0; i < length; i++) {
+		crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xFF];
+	}
+	return crc;
+} // End Crc32()
+
+/**
+ * @return The AES implementation in use: "AES-NI", "ARMv8" or "portable".
+ */
+const char *DesfireCipher::GetImplementationName() {
+	if (Tables().aesInstructions) {
+#if defined(DESFIRECIPHER_AESNI)
+		return "AES-NI";
+#elif defined(DESFIRECIPHER_ARMV8)
+		return "ARMv8";
+#endif
+	}
+	return "portable";
+} // End GetImplementationName()
@@ -0,0 +1,62 @@
+/**
+ * DesfireCipher.h - The block ciphers, CBC modes, CMAC and CRC32 of MIFARE DESFire authentication and secure messaging.
+ *
+ * A DesfireCipher holds the key schedule of one DES, 2K3DES, 3K3DES or AES-128 key. The CBC functions and Cmac() take
+ * the IV from the caller and leave the last block in it, which is how DESFire EV1 chains the IV over all commands of a
+ * session. The legacy (DESFire native, command 0x0A) modes are there as well: the PCD "enciphers" with the decryption
+ * function, see LegacySend().
+ * AES runs on the AES instructions of the CPU when it has them, AES-NI on x86 and the cryptography extension on AArch64,
+ * checked once at run time. Other CPUs, and DES, which has no such instructions, use the portable code.
+ *
+ * Released into the public domain.
+ */
+#ifndef DESFIRECIPHER_h
+#define DESFIRECIPHER_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DESFIRE_MAX_KEY_SIZE	24		// 3K3DES
+#define DESFIRE_MAX_BLOCK_SIZE	16		// AES
+
+class DesfireCipher {
+public:
+	enum KeyType : uint8_t {
+		KEY_DES			,	// 8 bytes, the parity bits hold the key version
+		KEY_2K3DES		,	// 16 bytes, K1 K2 (K3 = K1)
+		KEY_3K3DES		,	// 24 bytes
+		KEY_AES				// 16 bytes, AES-128
+	};
+
+	bool SetKey(KeyType type, const uint8_t *key);
+	KeyType GetKeyType() const { return _type; };
+	uint8_t GetBlockSize() const { return _type == KEY_AES ? 16 : 8; };
+	static uint8_t GetKeySize(KeyType type);
+
+	void EncryptBlock(const uint8_t *in, uint8_t *out) const;
+	void DecryptBlock(const uint8_t *in, uint8_t *out) const;
+	void EncryptCBC(uint8_t *iv, const uint8_t *in, uint8_t *out, size_t length) const;
+	void DecryptCBC(uint8_t *iv, const uint8_t *in, uint8_t *out, size_t length) const;
+	void LegacySend(const uint8_t *in, uint8_t *out, size_t length) const;
+	void Cmac(uint8_t *iv, const uint8_t *data, size_t length) const;
+
+	static uint32_t Crc32(const uint8_t *data, size_t length, uint32_t crc = 0xFFFFFFFF);
+	static const char *GetImplementationName();
+
+protected:
+	KeyType _type;
+	uint8_t _subkey1[DESFIRE_MAX_BLOCK_SIZE];	// CMAC subkeys K1 and K2, NIST SP 800-38B
+	uint8_t _subkey2[DESFIRE_MAX_BLOCK_SIZE];
+	union {
+		struct {
+			uint8_t encrypt[11][16];		// Round keys
+			uint8_t decrypt[11][16];		// Round keys of the equivalent inverse cipher, in the order they are used
+		} aes;
+		uint8_t des[3][16][8];				// K1 K2 K3: 8 6-bit pieces of each of the 16 round keys
+	} _schedule;
+
+	void DesBlock(const uint8_t *in, uint8_t *out, bool decrypt) const;
+	void DeriveSubkeys();
+};
+
+#endif
@@ -0,0 +1,221 @@
+/*
+* DesfireDirectory.cpp - Remembers the structure of DESFire cards, so that a repeat tap skips the discovery commands.
+* NOTE: Please also check the comments in DesfireDirectory.h.
+* Released into the public domain.
+*/
+
+#include <string.h>
+#include "DesfireDirectory.h"
+
+/**
+ * Constructor.
+ */
+DesfireDirectory::DesfireDirectory(	DESFire *reader		///< The reader the cards are discovered with.
+								) {
+	_reader = reader;
+	_clock = 0;
+	_entries.reserve(DESFIRE_DIRECTORY_SIZE);
+	ResetCounters();
+} // End constructor
+
+/**
+ * Looks up the card with the given UID.
+ *
+ * @return The entry, NULL if the card is not known. Valid until the next Discover(), Invalidate() or Forget().
+ */
+const DesfireDirectory::Directory *DesfireDirectory::Find(const MFRC522::Uid *uid) {
+	Directory *entry = Lookup(uid);
+	if (entry) {
+		entry->lastUsed = ++_clock;
+	}
+	return entry;
+} // End Find()
+
+/**
+ * Reads the structure of the card and remembers it, in place of an older entry for the UID or of the least recently
+ * used one. Parts the card does not list without authentication are marked as not known, the commands for them go to
+ * the card. Nothing is remembered if an answer was lost or garbled.
+ * The PICC must be in the ISO/IEC 14443-4 protocol state and not authenticated. When this returns, the last discovered
+ * application is selected, see tag->selected_application.
+ *
+ * @return The status of the first command that failed in transport, or of GetVersion if the card refused it.
+ */
+DESFire::StatusCode DesfireDirectory::Discover(	DESFire::mifare_desfire_tag *tag,	///< The PICC.
+												const MFRC522::Uid *uid,			///< Its UID, the key of the entry.
+												const Directory **directory			///< Out: The new entry, NULL if there is none.
+											) {
+	Directory found;
+	found.uid = *uid;
+	memset(&found.picc, 0, sizeof(found.picc));
+	found.applicationsKnown = false;
+	*directory = NULL;
+
+	DESFire::StatusCode result = _reader->MIFARE_DESFIRE_GetVersion(tag, &found.version);
+	if (!_reader->IsStatusCodeOK(result)) {
+		return result;
+	}
+	if (tag->selected_application[0] != 0 || tag->selected_application[1] != 0 || tag->selected_application[2] != 0) {
+		result = _reader->MIFARE_DESFIRE_SelectApplication(tag, &found.picc.aid);
+		if (!_reader->IsStatusCodeOK(result)) {
+			return result;
+		}
+	}
+	result = DiscoverApplication(tag, &found.picc);
+	if (result.mfrc522 != MFRC522::STATUS_OK) {
+		return result;
+	}
+
+	DESFire::mifare_desfire_aid_t aids[MIFARE_MAX_APPLICATION_COUNT];
+	byte count = 0;
+	result = _reader->MIFARE_DESFIRE_GetApplicationIds(tag, aids, &count);
+	if (result.mfrc522 != MFRC522::STATUS_OK) {
+		return result;
+	}
+	found.applicationsKnown = _reader->IsStatusCodeOK(result);
+	for (byte i = 0; i < count && found.applicationsKnown; i++) {
+		Application application;
+		memset(&application, 0, sizeof(application));
+		application.aid = aids[i];
+		result = _reader->MIFARE_DESFIRE_SelectApplication(tag, &application.aid);
+		if (result.mfrc522 != MFRC522::STATUS_OK) {
+			return result;
+		}
+		if (_reader->IsStatusCodeOK(result)) {
+			result = DiscoverApplication(tag, &application);
+			if (result.mfrc522 != MFRC522::STATUS_OK) {
+				return result;
+			}
+		}
+		found.applications.push_back(application);
+	}
+
+	// In place of the card's old entry, or the least recently used one once the directory is full
+	Directory *entry = Lookup(uid);
+	if (!entry && _entries.size() < DESFIRE_DIRECTORY_SIZE) {
+		_entries.push_back(found);
+		entry = &_entries.back();
+	}
+	else if (!entry) {
+		entry = &_entries[0];
+		for (size_t i = 1; i < _entries.size(); i++) {
+			if (_entries[i].lastUsed < entry->lastUsed) {
+				entry = &_entries[i];
+			}
+		}
+		*entry = found;
+	}
+	else {
+		*entry = found;
+	}
+	entry->lastUsed = ++_clock;
+	*directory = entry;
+	result.mfrc522 = MFRC522::STATUS_OK;
+	result.desfire = DESFire::MF_OPERATION_OK;
+	return result;
+} // End Discover()
+
+/**
+ * Reads the key settings, and for an application the files and their settings, of the selected application.
+ *
+ * @return STATUS_OK unless an answer was lost or garbled. Commands the PICC refused leave their part not known.
+ */
+DESFire::StatusCode DesfireDirectory::DiscoverApplication(	DESFire::mifare_desfire_tag *tag,	///< The PICC, with the application selected.
+															Application *application			///< Its entry, aid is set.
+														) {
+	DESFire::StatusCode result = _reader->MIFARE_DESFIRE_GetKeySettings(tag, &application->keySettings, &application->maxKeys);
+	if (result.mfrc522 != MFRC522::STATUS_OK) {
+		return result;
+	}
+	application->keySettingsKnown = _reader->IsStatusCodeOK(result);
+	DESFire::mifare_desfire_aid_t *aid = &application->aid;
+	if (aid->data[0] == 0 && aid->data[1] == 0 && aid->data[2] == 0) {
+		return result;		// The PICC level has no files
+	}
+
+	result = _reader->MIFARE_DESFIRE_GetFileIDs(tag, application->fileIds, &application->fileCount);
+	if (result.mfrc522 != MFRC522::STATUS_OK) {
+		return result;
+	}
+	application->filesKnown = _reader->IsStatusCodeOK(result);
+	if (!application->filesKnown) {
+		application->fileCount = 0;
+	}
+	for (byte i = 0; i < application->fileCount; i++) {
+		byte file = application->fileIds[i];
+		result = _reader->MIFARE_DESFIRE_GetFileSettings(tag, &file, &application->fileSettings[i]);
+		if (result.mfrc522 != MFRC522::STATUS_OK) {
+			return result;
+		}
+		application->fileSettingsKnown[i] = _reader->IsStatusCodeOK(result);
+	}
+	result.mfrc522 = MFRC522::STATUS_OK;
+	result.desfire = DESFire::MF_OPERATION_OK;
+	return result;
+} // End DiscoverApplication()
+
+/**
+ * Forgets a card, eg after a command found that a file or application of its entry is gone.
+ */
+void DesfireDirectory::Invalidate(const MFRC522::Uid *uid) {
+	Directory *entry = Lookup(uid);
+	if (entry) {
+		_entries.erase(_entries.begin() + (entry - &_entries[0]));
+	}
+} // End Invalidate()
+
+/**
+ * Forgets all cards.
+ */
+void DesfireDirectory::Forget() {
+	_entries.clear();
+} // End Forget()
+
+/**
+ * The entry of a UID, NULL if there is none.
+ */
+DesfireDirectory::Directory *DesfireDirectory::Lookup(const MFRC522::Uid *uid) {
+	for (size_t i = 0; i < _entries.size(); i++) {
+		if (_entries[i].uid.size == uid->size && memcmp(_entries[i].uid.uidByte, uid->uidByte, uid->size) == 0) {
+			return &_entries[i];
+		}
+	}
+	return NULL;
+} // End Lookup()
+
+/**
+ * Looks up an application of a card, AID 000000 is the PICC level.
+ *
+ * @return The application, NULL if the card does not have it or its applications are not known.
+ */
+const DesfireDirectory::Application *DesfireDirectory::FindApplication(const Directory *directory, const DESFire::mifare_desfire_aid_t *aid) {
+	if (aid->data[0] == 0 && aid->data[1] == 0 && aid->data[2] == 0) {
+		return &directory->picc;
+	}
+	for (size_t i = 0; i < directory->applications.size(); i++) {
+		if (memcmp(directory->applications[i].aid.data, aid->data, MIFARE_AID_SIZE) == 0) {
+			return &directory->applications[i];
+		}
+	}
+	return NULL;
+} // End FindApplication()
+
+/**
+ * Looks up the settings of a file of an application.
+ *
+ * @return The settings, NULL if they are not known.
+ */
+const DESFire::mifare_desfire_file_settings_t *DesfireDirectory::FindFile(const Application *application, byte file) {
+	for (byte i = 0; i < application->fileCount; i++) {
+		if (application->fileIds[i] == file) {
+			return application->fileSettingsKnown[i] ? &application->fileSettings[i] : NULL;
+		}
+	}
+	return NULL;
+} // End FindFile()
+
+/**
+ * Tells if an application has a file, whether its settings are known or not.
+ */
+bool DesfireDirectory::HasFile(const Application *application, byte file) {
+	return memchr(application->fileIds, file, application->fileCount) != NULL;
+} // End HasFile()
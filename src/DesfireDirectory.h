@@ -0,0 +1,81 @@
+/**
+ * DesfireDirectory.h - Remembers the structure of DESFire cards, so that a repeat tap skips the discovery commands.
+ *
+ * Finding out what is on a DESFire card takes GetVersion (three frames), GetApplicationIds, and for every application
+ * SelectApplication, GetKeySettings, GetFileIDs and one GetFileSettings per file. A site's cards usually share one
+ * layout that does not change once issued. DesfireDirectory runs the discovery once per card and keeps what it found:
+ * the version, the key settings, the AIDs, and for each application its key settings, file IDs and file settings.
+ * Entries are looked up by UID, the least recently used one is replaced. GetVersion is answered from the entry too.
+ * A command that reports a missing file or application (MF_FILE_NOT_FOUND, MF_APPLICATION_NOT_FOUND) means the card
+ * was changed: its entry is dropped with Invalidate() and discovered again on the next use. So is one whose file
+ * settings a failed command used, if the card reported an integrity, length, permission or boundary error.
+ *
+ * Released into the public domain.
+ */
+#ifndef DESFIREDIRECTORY_h
+#define DESFIREDIRECTORY_h
+
+#include <vector>
+#include "Desfire.h"
+
+#define DESFIRE_DIRECTORY_SIZE		16		// Remembered cards, the least recently used one is replaced
+#define DESFIRE_FRAME_DATA			59		// Response data bytes per DESFire frame, more follow with MF_ADDITIONAL_FRAME
+
+class DesfireDirectory {
+public:
+	// An application, or the PICC level (AID 000000), and what is known about it
+	typedef struct {
+		DESFire::mifare_desfire_aid_t aid;
+		bool keySettingsKnown;
+		byte keySettings;
+		byte maxKeys;
+		bool filesKnown;			// The application allows to list its files without authentication
+		byte fileCount;
+		byte fileIds[MIFARE_MAX_FILE_COUNT];
+		bool fileSettingsKnown[MIFARE_MAX_FILE_COUNT];
+		DESFire::mifare_desfire_file_settings_t fileSettings[MIFARE_MAX_FILE_COUNT];
+	} Application;
+
+	// A card
+	typedef struct {
+		MFRC522::Uid uid;
+		DESFire::MIFARE_DESFIRE_Version_t version;
+		Application picc;			// PICC level key settings, no files
+		bool applicationsKnown;		// The PICC allows to list its applications without authentication
+		std::vector<Application> applications;
+		uint32_t lastUsed;			// _clock when it was looked up or stored
+	} Directory;
+
+	DesfireDirectory(DESFire *reader);
+
+	const Directory *Find(const MFRC522::Uid *uid);
+	DESFire::StatusCode Discover(DESFire::mifare_desfire_tag *tag, const MFRC522::Uid *uid, const Directory **directory);
+	void Invalidate(const MFRC522::Uid *uid);
+	void Forget();
+	size_t GetCount() const { return _entries.size(); };
+
+	static const Application *FindApplication(const Directory *directory, const DESFire::mifare_desfire_aid_t *aid);
+	static const DESFire::mifare_desfire_file_settings_t *FindFile(const Application *application, byte file);
+	static bool HasFile(const Application *application, byte file);
+	static uint32_t GetFrames(size_t length) { return length == 0 ? 1 : 1 + (length - 1) / DESFIRE_FRAME_DATA; };
+
+	void CountHit(uint32_t frames) { _hits++; _savedFrames += frames; };
+	void CountMiss() { _misses++; };
+	uint32_t GetHits() const { return _hits; };
+	uint32_t GetMisses() const { return _misses; };
+	uint32_t GetSavedFrames() const { return _savedFrames; };
+	void ResetCounters() { _hits = _misses = _savedFrames = 0; };
+
+protected:
+	DESFire *_reader;
+	std::vector<Directory> _entries;
+	uint32_t _clock;				// Counts lookups, for the LRU replacement
+	uint32_t _hits;					// Commands answered from an entry
+	uint32_t _misses;				// Commands that had to go to the card, a discovery included
+	uint32_t _savedFrames;			// Response frames the hits did not need, estimated from the response sizes
+
+	Directory *Lookup(const MFRC522::Uid *uid);
+	DESFire::StatusCode DiscoverApplication(DESFire::mifare_desfire_tag *tag, Application *application);
+};
+
+#endif
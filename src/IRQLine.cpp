@@ -0,0 +1,92 @@
+/*
+* IRQLine.cpp - Completion sources for the MFRC522 IRQ pin.
+* NOTE: Please also check the comments in IRQLine.h.
+* Released into the public domain.
+*/
+
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "IRQLine.h"
+
+/**
+ * Constructor.
+ * Requests the line as an input with falling edge detection. The events are read non-blocking, Wait() sleeps in poll().
+ */
+GpioChardevIRQLine::GpioChardevIRQLine(	unsigned int line,	///< The line offset on the chip, eg the BCM GPIO number on a Raspberry Pi.
+										const char *chip	///< Path to the GPIO character device.
+									) {
+	struct gpio_v2_line_request request;
+
+	_fd = -1;
+	int chipFd = open(chip, O_RDWR | O_CLOEXEC);
+	if (chipFd < 0) {
+		return;
+	}
+	memset(&request, 0, sizeof(request));
+	request.offsets[0]		= line;
+	request.num_lines		= 1;
+	request.config.flags	= GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	strncpy(request.consumer, "mfrc522-irq", sizeof(request.consumer) - 1);
+	if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request) >= 0) {
+		_fd = request.fd;
+		fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+	}
+	close(chipFd);
+} // End constructor
+
+/**
+ * Destructor. Releases the line.
+ */
+GpioChardevIRQLine::~GpioChardevIRQLine() {
+	if (_fd >= 0) {
+		close(_fd);
+	}
+} // End destructor
+
+/**
+ * Reads and drops all queued edge events.
+ */
+void GpioChardevIRQLine::Arm() {
+	struct gpio_v2_line_event events[16];
+
+	if (_fd < 0) {
+		return;
+	}
+	while (read(_fd, events, sizeof(events)) > 0) {
+	}
+} // End Arm()
+
+/**
+ * Sleeps until a falling edge is reported or the timeout passed.
+ *
+ * @return true if at least one edge arrived.
+ */
+bool GpioChardevIRQLine::Wait(	uint32_t timeoutUs	///< Maximum time to sleep in microseconds.
+								) {
+	struct gpio_v2_line_event events[16];
+	struct pollfd fds;
+	struct timespec timeout;
+
+	if (_fd < 0) {
+		return false;
+	}
+	fds.fd = _fd;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	timeout.tv_sec = timeoutUs / 1000000;
+	timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+	if (ppoll(&fds, 1, &timeout, NULL) <= 0 || !(fds.revents & POLLIN)) {
+		return false;
+	}
+	ssize_t n = read(_fd, events, sizeof(events));
+	if (n < (ssize_t)sizeof(events[0])) {
+		return false;
+	}
+	_events += n / sizeof(events[0]);
+	return true;
+} // End Wait()
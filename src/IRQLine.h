@@ -0,0 +1,51 @@
+/**
+ * IRQLine.h - Completion sources for the MFRC522 IRQ pin.
+ *
+ * The MFRC522 can signal the end of a command on its IRQ pin (datasheet section 9.3.1.3 and 9.3.1.4) instead of being
+ * polled over SPI. IRQLine hides how the host waits for that pin:
+ *  - GpioChardevIRQLine requests the GPIO line through the Linux GPIO character device and sleeps in the kernel
+ *    until a falling edge arrives.
+ *  - Other implementations, eg a simulated line driven by a fake chip, only need Arm() and Wait().
+ *
+ * Released into the public domain.
+ */
+#ifndef IRQLINE_h
+#define IRQLINE_h
+
+#include <stdint.h>
+
+class IRQLine {
+public:
+	IRQLine() : _events(0) {};
+	virtual ~IRQLine() {};
+
+	// Discards edges that arrived before the next command was started.
+	virtual void Arm() = 0;
+
+	// Sleeps until the IRQ pin becomes active or timeoutUs passed. Returns false on timeout or error.
+	virtual bool Wait(uint32_t timeoutUs) = 0;
+
+	// Number of edges seen so far.
+	uint32_t GetEventCount() const { return _events; };
+
+protected:
+	uint32_t _events;
+};
+
+/**
+ * IRQ pin connected to a GPIO, accessed through /dev/gpiochipN (GPIO uAPI v2).
+ * The MFRC522 drives IRQ active low (ComIEnReg.IRqInv, the reset default), so falling edges are requested.
+ */
+class GpioChardevIRQLine : public IRQLine {
+public:
+	GpioChardevIRQLine(unsigned int line, const char *chip = "/dev/gpiochip0");
+	virtual ~GpioChardevIRQLine();
+	virtual void Arm();
+	virtual bool Wait(uint32_t timeoutUs);
+	bool IsOpen() const { return _fd >= 0; };
+
+protected:
+	int _fd;		// Line request, delivers the edge events
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+* KeyRing.cpp - Finds the MIFARE Classic key of a sector among a set of candidate keys.
+* NOTE: Please also check the comments in KeyRing.h.
+* Released into the public domain.
+*/
+
+#include <string.h>
+#include "KeyRing.h"
+
+/**
+ * Constructor.
+ */
+KeyRing::KeyRing(	MFRC522 *reader		///< The reader the PICCs are authenticated with.
+				) {
+	_reader = reader;
+	_keyCount = 0;
+	_clock = 0;
+	Forget();
+	ResetCounters();
+} // End constructor
+
+/**
+ * Adds a candidate key. Candidates are tried in the order they were added.
+ *
+ * @return false if the ring is full or the command is not an authentication.
+ */
+bool KeyRing::AddKey(	const MFRC522::MIFARE_Key &key,	///< The key
+						byte command					///< PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+					) {
+	if (_keyCount >= KEYRING_MAX_KEYS || (command != MFRC522::PICC_CMD_MF_AUTH_KEY_A && command != MFRC522::PICC_CMD_MF_AUTH_KEY_B)) {
+		return false;
+	}
+	_keys[_keyCount].key = key;
+	_keys[_keyCount].command = command;
+	_keyCount++;
+	return true;
+} // End AddKey()
+
+/**
+ * Removes all candidate keys and the remembered ones.
+ */
+void KeyRing::Clear() {
+	_keyCount = 0;
+	Forget();
+} // End Clear()
+
+/**
+ * Forgets which keys worked, the candidates stay.
+ */
+void KeyRing::Forget() {
+	memset(_cache, 0, sizeof(_cache));
+} // End Forget()
+
+/**
+ * Authenticates the sector of a block with the first candidate that works.
+ *
+ * The key remembered for the card is tried first, then the one remembered for the card family, then the remaining
+ * candidates in order. After every failed try the PICC is selected again, so it is ACTIVE when this returns, also if no
+ * key worked. The key that worked is remembered for the card and the family.
+ * The PICC must be selected - ie in state ACTIVE - before calling this function.
+ * Remember to call PCD_StopCrypto1() after communicating with the authenticated PICC.
+ *
+ * @return STATUS_OK on success, STATUS_INVALID if there are no candidates, the status of the last try if no key worked,
+ * or the status of the selection if the PICC left the field.
+ */
+MFRC522::StatusCode KeyRing::Authenticate(	MFRC522::Uid *uid,	///< The UID of the selected PICC, its SAK selects the family.
+											byte blockAddr,		///< A block of the sector to authenticate.
+											byte *keyIndex		///< Out: The candidate that worked, see GetKey(). NULL if not needed.
+										) {
+	if (_keyCount == 0) {
+		return MFRC522::STATUS_INVALID;
+	}
+	byte sector = MFRC522::MIFARE_GetSector(blockAddr);
+	byte order[KEYRING_MAX_KEYS + 2];
+	byte count = 0;
+	CacheEntry *entry = Find(uid, sector, false);
+	if (entry) {
+		order[count++] = entry->keyIndex;
+	}
+	entry = Find(uid, sector, true);
+	if (entry) {
+		order[count++] = entry->keyIndex;
+	}
+	bool cached = count > 0;
+	for (byte i = 0; i < _keyCount; i++) {
+		order[count++] = i;
+	}
+
+	MFRC522::StatusCode result = MFRC522::STATUS_INVALID;
+	bool tried[KEYRING_MAX_KEYS] = { false };
+	bool first = true;
+	for (byte i = 0; i < count; i++) {
+		byte index = order[i];
+		if (tried[index]) {
+			continue;
+		}
+		tried[index] = true;
+		bool retry;
+		result = TryKey(uid, blockAddr, index, &retry);
+		if (result == MFRC522::STATUS_OK) {
+			if (first && cached) {
+				_hits++;
+			}
+			else {
+				_misses++;
+			}
+			Remember(uid, sector, index, false);
+			Remember(uid, sector, index, true);
+			if (keyIndex) {
+				*keyIndex = index;
+			}
+			return MFRC522::STATUS_OK;
+		}
+		first = false;
+		Drop(uid, sector, index);
+		if (!retry) {
+			break;
+		}
+	}
+	_misses++;
+	return result;
+} // End Authenticate()
+
+/**
+ * One authentication. If it fails the PICC is selected again.
+ *
+ * @return The result of the authentication, or the status of the selection if that failed too.
+ */
+MFRC522::StatusCode KeyRing::TryKey(MFRC522::Uid *uid,		///< The UID of the selected PICC.
+									byte blockAddr,			///< A block of the sector to authenticate.
+									byte keyIndex,			///< The candidate to try.
+									bool *retry				///< Out: The PICC is ACTIVE again, the next candidate can be tried.
+								) {
+	_attempts++;
+	MFRC522::StatusCode result = _reader->PCD_Authenticate(_keys[keyIndex].command, blockAddr, &_keys[keyIndex].key, uid);
+	*retry = false;
+	if (result == MFRC522::STATUS_OK) {
+		return result;
+	}
+	// The PICC dropped out of the ACTIVE state
+	_reader->PCD_StopCrypto1();
+	MFRC522::StatusCode selected = _reader->PICC_Reselect(uid);
+	if (selected != MFRC522::STATUS_OK) {
+		return selected;
+	}
+	*retry = true;
+	return result;
+} // End TryKey()
+
+/**
+ * Looks up the remembered key of a sector, for the card or for its family.
+ *
+ * @return The entry, NULL if none matches.
+ */
+KeyRing::CacheEntry *KeyRing::Find(const MFRC522::Uid *uid, byte sector, bool family) {
+	for (byte i = 0; i < KEYRING_CACHE_SIZE; i++) {
+		CacheEntry *entry = &_cache[i];
+		if (entry->lastUsed != 0 && entry->family == family && entry->sak == uid->sak && entry->sector == sector
+				&& (family || memcmp(entry->uidPrefix, uid->uidByte, sizeof(entry->uidPrefix)) == 0)) {
+			entry->lastUsed = ++_clock;
+			return entry;
+		}
+	}
+	return NULL;
+} // End Find()
+
+/**
+ * Remembers the key that worked, in the matching entry or the least recently used one.
+ */
+void KeyRing::Remember(const MFRC522::Uid *uid, byte sector, byte keyIndex, bool family) {
+	CacheEntry *entry = Find(uid, sector, family);
+	if (!entry) {
+		entry = &_cache[0];
+		for (byte i = 1; i < KEYRING_CACHE_SIZE && entry->lastUsed != 0; i++) {
+			if (_cache[i].lastUsed < entry->lastUsed) {
+				entry = &_cache[i];
+			}
+		}
+		memcpy(entry->uidPrefix, uid->uidByte, sizeof(entry->uidPrefix));
+		entry->sak = uid->sak;
+		entry->sector = sector;
+		entry->family = family;
+	}
+	entry->keyIndex = keyIndex;
+	entry->lastUsed = ++_clock;
+} // End Remember()
+
+/**
+ * Forgets the card's key of a sector if it is the one that just failed, eg because the key was changed.
+ */
+void KeyRing::Drop(const MFRC522::Uid *uid, byte sector, byte keyIndex) {
+	CacheEntry *entry = Find(uid, sector, false);
+	if (entry && entry->keyIndex == keyIndex) {
+		entry->lastUsed = 0;
+	}
+} // End Drop()
@@ -0,0 +1,71 @@
+/**
+ * KeyRing.h - Finds the MIFARE Classic key of a sector among a set of candidate keys.
+ *
+ * A site usually has a handful of keys, and which one a sector uses depends on the card family and the sector. KeyRing
+ * holds the candidate A/B keys and remembers which one authenticated a sector, both for the card (first UID bytes, SAK
+ * and sector) and for the card family (SAK and sector). The next authentication of that sector tries the remembered
+ * key first, so a repeat tap, or a new card of a known family, authenticates on the first try.
+ * A failed authentication drops the PICC out of the ACTIVE state; KeyRing selects it again by its UID before the next
+ * candidate is tried, without REQA or anticollision.
+ *
+ * Released into the public domain.
+ */
+#ifndef KEYRING_h
+#define KEYRING_h
+
+#include "MFRC522.h"
+
+#define KEYRING_MAX_KEYS	16		// Candidate keys, each A/B pairing counts
+#define KEYRING_CACHE_SIZE	64		// Remembered sector keys, the least recently used one is replaced
+
+class KeyRing {
+public:
+	// A candidate: the key and the authentication command to use it with.
+	typedef struct {
+		MFRC522::MIFARE_Key key;
+		byte command;				// PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+	} Key;
+
+	KeyRing(MFRC522 *reader);
+
+	bool AddKey(const MFRC522::MIFARE_Key &key, byte command);
+	bool AddKey(const Key &key) { return AddKey(key.key, key.command); };
+	void Clear();
+	void Forget();
+	byte GetKeyCount() const { return _keyCount; };
+	const Key &GetKey(byte index) const { return _keys[index]; };
+
+	MFRC522::StatusCode Authenticate(MFRC522::Uid *uid, byte blockAddr, byte *keyIndex = NULL);
+
+	uint32_t GetHits() const { return _hits; };
+	uint32_t GetMisses() const { return _misses; };
+	uint32_t GetAttempts() const { return _attempts; };
+	void ResetCounters() { _hits = _misses = _attempts = 0; };
+
+protected:
+	// A key that worked. Family entries match every UID.
+	typedef struct {
+		byte uidPrefix[4];			// First UID bytes of the card
+		byte sak;
+		byte sector;
+		byte keyIndex;				// Into _keys
+		bool family;				// Matches the card family, uidPrefix is not used
+		uint32_t lastUsed;			// _clock when it was looked up or stored, 0 if the entry is free
+	} CacheEntry;
+
+	MFRC522 *_reader;
+	Key _keys[KEYRING_MAX_KEYS];
+	byte _keyCount;
+	CacheEntry _cache[KEYRING_CACHE_SIZE];
+	uint32_t _clock;				// Counts cache accesses, for the LRU replacement
+	uint32_t _hits;					// Authentications the first key tried succeeded, and it came from the cache
+	uint32_t _misses;				// Authentications that needed more than one try or had no cached key
+	uint32_t _attempts;				// PCD_Authenticate() calls
+
+	CacheEntry *Find(const MFRC522::Uid *uid, byte sector, bool family);
+	void Remember(const MFRC522::Uid *uid, byte sector, byte keyIndex, bool family);
+	void Drop(const MFRC522::Uid *uid, byte sector, byte keyIndex);
+	MFRC522::StatusCode TryKey(MFRC522::Uid *uid, byte blockAddr, byte keyIndex, bool *retry);
+};
+
+#endif
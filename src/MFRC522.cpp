@@ -5,18 +5,56 @@
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "MFRC522.h"
 
 #define CHANNEL 0
 #define SS 0
+
+// Lookup table for CRC_A (ISO/IEC 14443-3 section 6.2.4): CRC-16/CCITT, reflected polynomial 0x8408.
+// Entry i is the CRC register update for the low byte i.
+static const uint16_t CRC_A_table[256] = {
+	0x0000, 0x1189, 0x2312, 0x329B, 0x4624, 0x57AD, 0x6536, 0x74BF,
+	0x8C48, 0x9DC1, 0xAF5A, 0xBED3, 0xCA6C, 0xDBE5, 0xE97E, 0xF8F7,
+	0x1081, 0x0108, 0x3393, 0x221A, 0x56A5, 0x472C, 0x75B7, 0x643E,
+	0x9CC9, 0x8D40, 0xBFDB, 0xAE52, 0xDAED, 0xCB64, 0xF9FF, 0xE876,
+	0x2102, 0x308B, 0x0210, 0x1399, 0x6726, 0x76AF, 0x4434, 0x55BD,
+	0xAD4A, 0xBCC3, 0x8E58, 0x9FD1, 0xEB6E, 0xFAE7, 0xC87C, 0xD9F5,
+	0x3183, 0x200A, 0x1291, 0x0318, 0x77A7, 0x662E, 0x54B5, 0x453C,
+	0xBDCB, 0xAC42, 0x9ED9, 0x8F50, 0xFBEF, 0xEA66, 0xD8FD, 0xC974,
+	0x4204, 0x538D, 0x6116, 0x709F, 0x0420, 0x15A9, 0x2732, 0x36BB,
+	0xCE4C, 0xDFC5, 0xED5E, 0xFCD7, 0x8868, 0x99E1, 0xAB7A, 0xBAF3,
+	0x5285, 0x430C, 0x7197, 0x601E, 0x14A1, 0x0528, 0x37B3, 0x263A,
+	0xDECD, 0xCF44, 0xFDDF, 0xEC56, 0x98E9, 0x8960, 0xBBFB, 0xAA72,
+	0x6306, 0x728F, 0x4014, 0x519D, 0x2522, 0x34AB, 0x0630, 0x17B9,
+	0xEF4E, 0xFEC7, 0xCC5C, 0xDDD5, 0xA96A, 0xB8E3, 0x8A78, 0x9BF1,
+	0x7387, 0x620E, 0x5095, 0x411C, 0x35A3, 0x242A, 0x16B1, 0x0738,
+	0xFFCF, 0xEE46, 0xDCDD, 0xCD54, 0xB9EB, 0xA862, 0x9AF9, 0x8B70,
+	0x8408, 0x9581, 0xA71A, 0xB693, 0xC22C, 0xD3A5, 0xE13E, 0xF0B7,
+	0x0840, 0x19C9, 0x2B52, 0x3ADB, 0x4E64, 0x5FED, 0x6D76, 0x7CFF,
+	0x9489, 0x8500, 0xB79B, 0xA612, 0xD2AD, 0xC324, 0xF1BF, 0xE036,
+	0x18C1, 0x0948, 0x3BD3, 0x2A5A, 0x5EE5, 0x4F6C, 0x7DF7, 0x6C7E,
+	0xA50A, 0xB483, 0x8618, 0x9791, 0xE32E, 0xF2A7, 0xC03C, 0xD1B5,
+	0x2942, 0x38CB, 0x0A50, 0x1BD9, 0x6F66, 0x7EEF, 0x4C74, 0x5DFD,
+	0xB58B, 0xA402, 0x9699, 0x8710, 0xF3AF, 0xE226, 0xD0BD, 0xC134,
+	0x39C3, 0x284A, 0x1AD1, 0x0B58, 0x7FE7, 0x6E6E, 0x5CF5, 0x4D7C,
+	0xC60C, 0xD785, 0xE51E, 0xF497, 0x8028, 0x91A1, 0xA33A, 0xB2B3,
+	0x4A44, 0x5BCD, 0x6956, 0x78DF, 0x0C60, 0x1DE9, 0x2F72, 0x3EFB,
+	0xD68D, 0xC704, 0xF59F, 0xE416, 0x90A9, 0x8120, 0xB3BB, 0xA232,
+	0x5AC5, 0x4B4C, 0x79D7, 0x685E, 0x1CE1, 0x0D68, 0x3FF3, 0x2E7A,
+	0xE70E, 0xF687, 0xC41C, 0xD595, 0xA12A, 0xB0A3, 0x8238, 0x93B1,
+	0x6B46, 0x7ACF, 0x4854, 0x59DD, 0x2D62, 0x3CEB, 0x0E70, 0x1FF9,
+	0xF78F, 0xE606, 0xD49D, 0xC514, 0xB1AB, 0xA022, 0x92B9, 0x8330,
+	0x7BC7, 0x6A4E, 0x58D5, 0x495C, 0x3DE3, 0x2C6A, 0x1EF1, 0x0F78
+};
 /////////////////////////////////////////////////////////////////////////////////////
 // Functions for setting up the Arduino
 /////////////////////////////////////////////////////////////////////////////////////
 /**
  * Constructor.
  */
-MFRC522::MFRC522(): MFRC522(SS, UINT8_MAX) { // SS is defined in pins_arduino.h, UINT8_MAX means there is no connection from Arduino to MFRC522's reset and power down input
-	_fd = wiringPiSPISetup(CHANNEL, 1000000);
+MFRC522::MFRC522(): MFRC522((byte)SS, (byte)UINT8_MAX) { // SS is defined in pins_arduino.h, UINT8_MAX means there is no connection from Arduino to MFRC522's reset and power down input
 } // End constructor
 
 /**
@@ -24,8 +62,7 @@ MFRC522::MFRC522(): MFRC522(SS, UINT8_MAX) { // SS is defined in pins_arduino.h,
  * Prepares the output pins.
  */
 MFRC522::MFRC522(	byte resetPowerDownPin	///< Arduino pin connected to MFRC522's reset and power down input (Pin 6, NRSTPD, active low). If there is no connection from the CPU to NRSTPD, set this to UINT8_MAX. In this case, only soft reset will be used in PCD_Init().
-				): MFRC522(SS, resetPowerDownPin) { // SS is defined in pins_arduino.h
-	_fd = wiringPiSPISetup(CHANNEL, 1000000);
+				): MFRC522((byte)SS, resetPowerDownPin) { // SS is defined in pins_arduino.h
 } // End constructor
 
 /**
@@ -33,13 +70,75 @@ MFRC522::MFRC522(	byte resetPowerDownPin	///< Arduino pin connected to MFRC522's
  * Prepares the output pins.
  */
 MFRC522::MFRC522(	byte chipSelectPin,		///< Arduino pin connected to MFRC522's SPI slave select input (Pin 24, NSS, active low)
-					byte resetPowerDownPin	///< Arduino pin connected to MFRC522's reset and power down input (Pin 6, NRSTPD, active low). If there is no connection from the CPU to NRSTPD, set this to UINT8_MAX. In this case, only soft reset will be used in PCD_Init().
-				) {
-	_fd = wiringPiSPISetup(CHANNEL, 1000000);
+					byte resetPowerDownPin,	///< Arduino pin connected to MFRC522's reset and power down input (Pin 6, NRSTPD, active low). If there is no connection from the CPU to NRSTPD, set this to UINT8_MAX. In this case, only soft reset will be used in PCD_Init().
+					uint32_t spiClock		///< SPI clock in Hz. Default MFRC522_SPICLOCK. Lower it for long cable runs.
+				): MFRC522(new WiringPiSPITransport(CHANNEL, spiClock), resetPowerDownPin) {
 	_chipSelectPin = chipSelectPin;
+	_ownsTransport = true;
+} // End constructor
+
+/**
+ * Constructor.
+ * Uses the given bus backend for all register accesses. The caller keeps ownership of the transport.
+ */
+MFRC522::MFRC522(	SPITransport *transport,	///< The bus backend, eg a SpidevTransport.
+					byte resetPowerDownPin		///< Arduino pin connected to MFRC522's reset and power down input (Pin 6, NRSTPD, active low). If there is no connection from the CPU to NRSTPD, set this to UINT8_MAX. In this case, only soft reset will be used in PCD_Init().
+				) {
+	_transport = transport;
+	_ownsTransport = false;
+	_batching = false;
+	_batchCount = 0;
+	_batchUsed = 0;
+	_chipSelectPin = SS;
 	_resetPowerDownPin = resetPowerDownPin;
+	_shadowValid = 0;
+	_spiClockMax = 0;
+	_hostCRC = true;
+	_autoCRC = false;
+	_frameClass = FRAME_NO_CRC;
+	_irq = NULL;
+	_timeoutProfile = TIMEOUT_DEFAULT;
+	_timeoutUs = MFRC522_TIMEOUT_DEFAULT_US;
+	_fwtUs = MFRC522_TIMEOUT_DEFAULT_US;
+	_exchanges = 0;
+	PCD_InitPrograms();
 } // End constructor
 
+/**
+ * Destructor.
+ */
+MFRC522::~MFRC522() {
+	if (_ownsTransport) {
+		delete _transport;
+	}
+} // End destructor
+
+/**
+ * Records the fixed parts of the register programs used on the hot paths.
+ */
+void MFRC522::PCD_InitPrograms() {
+	_transceiveProgram.Clear();
+	_transceiveProgram.WriteRegister(CommandReg, PCD_Idle);		// Stop any active command.
+	_transceiveProgram.WriteRegister(ComIrqReg, 0x7F);			// Clear all seven interrupt request bits
+	_transceiveProgram.WriteRegister(FIFOLevelReg, 0x80);		// FlushBuffer = 1, FIFO initialization
+	
+	_pollProgram.Clear();
+	_pollProgram.ReadRegister(ComIrqReg, &_pollResult[0]);		// Completion and timeout
+	_pollProgram.ReadRegister(ErrorReg, &_pollResult[1]);		// Error status of the command
+	_pollProgram.ReadRegister(FIFOLevelReg, &_pollResult[2]);	// Number of bytes received
+	_pollProgram.ReadRegister(ControlReg, &_pollResult[3]);		// RxLastBits
+	
+	_crcProgram.Clear();
+	_crcProgram.WriteRegister(CommandReg, PCD_Idle);			// Stop any active command.
+	_crcProgram.WriteRegister(DivIrqReg, 0x04);					// Clear the CRCIRq interrupt request bit
+	_crcProgram.WriteRegister(FIFOLevelReg, 0x80);				// FlushBuffer = 1, FIFO initialization
+	
+	_crcResultProgram.Clear();
+	_crcResultProgram.WriteRegister(CommandReg, PCD_Idle);		// Stop calculating CRC for new content in the FIFO.
+	_crcResultProgram.ReadRegister(CRCResultRegL, &_crcResult[0]);
+	_crcResultProgram.ReadRegister(CRCResultRegH, &_crcResult[1]);
+} // End PCD_InitPrograms()
+
 /////////////////////////////////////////////////////////////////////////////////////
 // Basic interface functions for communicating with the MFRC522
 /////////////////////////////////////////////////////////////////////////////////////
@@ -56,8 +155,21 @@ void MFRC522::PCD_WriteRegister(	PCD_Register reg,	///< The register to write to
 	buffer[1] = value;
 	
 //	printf("Write %X : %X \n",reg, value);
-							
-	wiringPiSPIDataRW(CHANNEL, buffer, 2);
+	
+	if (PCD_IsShadowed(reg)) {
+		if (reg == BitFramingReg && (value & 0x80)) {
+			// StartSend is a trigger, not a setting. Always send it, but do not remember it.
+			PCD_UpdateShadow(reg, value & 0x7F);
+		}
+		else if (PCD_ShadowValid(reg) && _shadow[reg >> 1] == value) {
+			return;	// The register already holds this value
+		}
+		else {
+			PCD_UpdateShadow(reg, value);
+		}
+	}
+	
+	PCD_QueueTransfer(buffer, 2);
 	
 } // End PCD_WriteRegister()
 
@@ -92,7 +204,10 @@ printf("\n");
 	
 	//printf("Write out (%d) %X : %X \n",count, reg, buffer);
 	
-	wiringPiSPIDataRW(CHANNEL, buffer, count + 1);
+	if (count > 0 && PCD_IsShadowed(reg)) {
+		PCD_UpdateShadow(reg, values[count - 1]);	// The last value written stands
+	}
+	PCD_QueueTransfer(buffer, count + 1);
 	
 } // End PCD_WriteRegister()
 
@@ -103,6 +218,10 @@ printf("\n");
 byte MFRC522::PCD_ReadRegister(	PCD_Register reg	///< The register to read from. One of the PCD_Register enums.
 								) {
 	byte value;
+	
+	if (PCD_ShadowValid(reg)) {
+		return _shadow[reg >> 1];	// Only the host changes this register, no need to ask the chip
+	}
 
 	unsigned char buffer[2];
 	
@@ -111,14 +230,15 @@ byte MFRC522::PCD_ReadRegister(	PCD_Register reg	///< The register to read from.
 	
 //	printf("Reads %X send %X %X\n", reg, buffer[0], buffer[1]);
 		
-	wiringPiSPIDataRW(CHANNEL, buffer, 2);
+	PCD_ExecuteTransfer(buffer, 2);
 
 //	printf("Reads %X recv %X %X\n", reg, buffer[0], buffer[1]);
 
 	value = buffer[1];
-
-
 	
+	if (PCD_IsShadowed(reg)) {
+		PCD_UpdateShadow(reg, value);
+	}
 
 //	printf("Read %X : %X \n", reg, value);
 
@@ -157,26 +277,23 @@ void MFRC522::PCD_ReadRegister(	PCD_Register reg,	///< The register to read from
 //	printf("\n");
 //	printf("Reads multiple %X (%d) receive ", reg,count);
 	
-	wiringPiSPIDataRW(CHANNEL, buffer, count +1);
+	PCD_ExecuteTransfer(buffer, count + 1);
 	
 //	for (byte index = 0; index < count+1; index++) {
 //		printf("%X:",buffer[index]);	
 //	}
 //	printf("\n");
 
+	byte first = values[0];		// Holds the bits below rxAlign, which the caller already knows
 	for (byte index = 0; index < count; index++) {
 		values[index] = buffer[index+1];	
 	}
 
 	if (rxAlign) {		// Only update bit positions rxAlign..7 in values[0]
-		printf("rxAlign");
 		// Create bit mask for bit positions rxAlign..7
 		byte mask = (0xFF << rxAlign) & 0xFF;
-		// Read value and tell that we want to read the same address again.
-		for (byte index = 1; index < count; index++) {
-			// Apply mask to both current value of values[0] and the new data in value.
-			values[0] = (values[0] & ~mask) | (values[index] & mask);
-		}
+		// Keep the known low bits, take the received high bits.
+		values[0] = (first & ~mask) | (values[0] & mask);
 	}
 	
 /*		printf("Read mul(%d) %X  values ", count, reg);
@@ -190,6 +307,253 @@ printf("\n");
 */
 } // End PCD_ReadRegister()
 
+/**
+ * Opens a batch. Until PCD_EndBatch() is called, register writes are queued instead of being sent one by one.
+ * A register read flushes the queue first, so reads always see the effect of earlier writes.
+ */
+void MFRC522::PCD_BeginBatch() {
+	_batching = true;
+} // End PCD_BeginBatch()
+
+/**
+ * Sends all queued register writes to the MFRC522 and closes the batch.
+ */
+void MFRC522::PCD_EndBatch() {
+	PCD_FlushBatch();
+	_batching = false;
+} // End PCD_EndBatch()
+
+/**
+ * Queues a register write without opening a batch. It is sent together with the next bus transaction,
+ * which saves a round trip when a single setup write precedes a register program.
+ */
+void MFRC522::PCD_DeferWriteRegister(	PCD_Register reg,	///< The register to write to. One of the PCD_Register enums.
+										byte value			///< The value to write.
+									) {
+	bool batching = _batching;
+	_batching = true;
+	PCD_WriteRegister(reg, value);
+	_batching = batching;
+} // End PCD_DeferWriteRegister()
+
+/**
+ * Queues a write of a number of bytes to the specified register, to go out with the next bus transaction.
+ */
+void MFRC522::PCD_DeferWriteRegister(	PCD_Register reg,	///< The register to write to. One of the PCD_Register enums.
+										byte count,			///< The number of bytes to write to the register
+										byte *values		///< The values to write. Byte array.
+									) {
+	bool batching = _batching;
+	_batching = true;
+	PCD_WriteRegister(reg, count, values);
+	_batching = batching;
+} // End PCD_DeferWriteRegister()
+
+/**
+ * Sends all queued register writes in a single bus transaction.
+ */
+void MFRC522::PCD_FlushBatch() {
+	if (_batchCount == 0) {
+		return;
+	}
+	_transport->Transfer(_batch, _batchCount);
+	_batchCount = 0;
+	_batchUsed = 0;
+} // End PCD_FlushBatch()
+
+/**
+ * Sends a register write to the MFRC522, or appends it to the open batch.
+ */
+void MFRC522::PCD_QueueTransfer(	byte *data,		///< The SPI frame: address byte followed by the data bytes.
+									uint16_t len	///< Length of the frame.
+								) {
+	if (!_batching) {
+		PCD_ExecuteTransfer(data, len);
+		return;
+	}
+	if (_batchCount == SPI_MAX_BATCH || (size_t)(_batchUsed + len) > sizeof(_batchData)) {
+		PCD_FlushBatch();
+	}
+	if (len > sizeof(_batchData)) {	// Will never fit, send it on its own.
+		PCD_ExecuteTransfer(data, len);
+		return;
+	}
+	memcpy(&_batchData[_batchUsed], data, len);
+	_batch[_batchCount].tx = &_batchData[_batchUsed];
+	_batch[_batchCount].rx = NULL;
+	_batch[_batchCount].len = len;
+	_batchCount++;
+	_batchUsed += len;
+} // End PCD_QueueTransfer()
+
+/**
+ * Sends an SPI frame to the MFRC522 immediately and stores the response in place.
+ * Any queued writes are sent first, in the same bus transaction.
+ */
+void MFRC522::PCD_ExecuteTransfer(	byte *data,		///< In: The SPI frame. Out: The bytes clocked in from MISO.
+									uint16_t len	///< Length of the frame.
+								) {
+	if (_batchCount > 0 && _batchCount < SPI_MAX_BATCH) {
+		_batch[_batchCount].tx = data;
+		_batch[_batchCount].rx = data;
+		_batch[_batchCount].len = len;
+		_transport->Transfer(_batch, _batchCount + 1);
+		_batchCount = 0;
+		_batchUsed = 0;
+		return;
+	}
+	PCD_FlushBatch();
+	SPI_Transfer transfer = { data, data, len };
+	_transport->Transfer(&transfer, 1);
+} // End PCD_ExecuteTransfer()
+
+/**
+ * Sends a recorded register program to the MFRC522 and stores the values of its register reads.
+ * Writes still queued by PCD_BeginBatch() go out first, in the same bus transaction.
+ */
+void MFRC522::PCD_RunProgram(	RegisterProgram *program	///< The program to execute. It is not modified and can be run again.
+							) {
+	SPI_Transfer transfers[SPI_MAX_BATCH];
+	byte count = 0;
+	
+	if (_batchCount + program->_count > SPI_MAX_BATCH) {
+		PCD_FlushBatch();
+	}
+	for (byte i = 0; i < _batchCount; i++) {
+		transfers[count++] = _batch[i];
+	}
+	for (byte i = 0; i < program->_count; i++) {
+		transfers[count++] = program->_ops[i];
+		// Keep the shadow copy in step with writes to configuration registers. StartSend is never remembered.
+		PCD_Register reg = (PCD_Register)(program->_ops[i].tx[0] & 0x7E);
+		if (!program->_results[i] && PCD_IsShadowed(reg)) {
+			byte value = program->_ops[i].tx[program->_ops[i].len - 1];
+			PCD_UpdateShadow(reg, reg == BitFramingReg ? (value & 0x7F) : value);
+		}
+	}
+	_transport->Transfer(transfers, count);
+	_batchCount = 0;
+	_batchUsed = 0;
+	
+	for (byte i = 0; i < program->_count; i++) {
+		if (program->_results[i]) {
+			*program->_results[i] = program->_ops[i].rx[1];
+		}
+	}
+} // End PCD_RunProgram()
+
+/**
+ * Forgets the shadow copy of all configuration registers.
+ * Must be called whenever the MFRC522 may have reset its registers behind our back, eg after a soft or hard reset.
+ */
+void MFRC522::PCD_InvalidateShadow() {
+	_shadowValid = 0;
+} // End PCD_InvalidateShadow()
+
+/**
+ * Tells if a register is kept in the shadow copy.
+ * Only configuration registers that the MFRC522 never changes by itself qualify. Status, interrupt, FIFO and
+ * command registers (eg ComIrqReg, ErrorReg, FIFOLevelReg, CommandReg) always go to the chip.
+ * 
+ * @return true if reads of reg may be served from the shadow copy.
+ */
+bool MFRC522::PCD_IsShadowed(	PCD_Register reg	///< The register. One of the PCD_Register enums.
+							) {
+	// One bit per register address 0x00-0x3F.
+	static const uint64_t shadowed =
+		(1ULL << (ComIEnReg >> 1))		| (1ULL << (DivIEnReg >> 1))		| (1ULL << (WaterLevelReg >> 1))	|
+		(1ULL << (BitFramingReg >> 1))	| (1ULL << (ModeReg >> 1))			| (1ULL << (TxModeReg >> 1))		|
+		(1ULL << (RxModeReg >> 1))		| (1ULL << (TxControlReg >> 1))		| (1ULL << (TxASKReg >> 1))			|
+		(1ULL << (TxSelReg >> 1))		| (1ULL << (RxSelReg >> 1))			| (1ULL << (RxThresholdReg >> 1))	|
+		(1ULL << (DemodReg >> 1))		| (1ULL << (MfTxReg >> 1))			| (1ULL << (MfRxReg >> 1))			|
+		(1ULL << (ModWidthReg >> 1))	| (1ULL << (RFCfgReg >> 1))			| (1ULL << (GsNReg >> 1))			|
+		(1ULL << (CWGsPReg >> 1))		| (1ULL << (ModGsPReg >> 1))		| (1ULL << (TModeReg >> 1))			|
+		(1ULL << (TPrescalerReg >> 1))	| (1ULL << (TReloadRegH >> 1))		| (1ULL << (TReloadRegL >> 1));
+	return (shadowed >> ((reg >> 1) & 0x3F)) & 1;
+} // End PCD_IsShadowed()
+
+/**
+ * Records the value of a shadowed register.
+ */
+void MFRC522::PCD_UpdateShadow(	PCD_Register reg,	///< The register. One of the PCD_Register enums.
+								byte value			///< The value the register now holds.
+							) {
+	_shadow[reg >> 1] = value;
+	_shadowValid |= 1ULL << (reg >> 1);
+} // End PCD_UpdateShadow()
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Register programs
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Discards all recorded operations after the first count. Used to reuse a fixed prefix of a program.
+ */
+void MFRC522::RegisterProgram::Truncate(	byte count	///< The number of operations to keep.
+										) {
+	if (count >= _count) {
+		return;
+	}
+	_count = count;
+	_used = count ? (_ops[count - 1].tx - _txData) + _ops[count - 1].len : 0;
+} // End Truncate()
+
+/**
+ * Records a write of one register.
+ * 
+ * @return false if the program is full.
+ */
+bool MFRC522::RegisterProgram::WriteRegister(	PCD_Register reg,	///< The register to write to. One of the PCD_Register enums.
+												byte value			///< The value to write.
+											) {
+	return WriteRegister(reg, 1, &value);
+} // End WriteRegister()
+
+/**
+ * Records a write of a number of bytes to one register, eg FIFODataReg.
+ * 
+ * @return false if the program is full.
+ */
+bool MFRC522::RegisterProgram::WriteRegister(	PCD_Register reg,		///< The register to write to. One of the PCD_Register enums.
+												byte count,				///< The number of bytes to write to the register
+												const byte *values		///< The values to write. Byte array.
+											) {
+	if (_count == SPI_MAX_BATCH || (size_t)(_used + count + 1) > sizeof(_txData)) {
+		return false;
+	}
+	_txData[_used] = reg;
+	memcpy(&_txData[_used + 1], values, count);
+	_ops[_count].tx = &_txData[_used];
+	_ops[_count].rx = NULL;
+	_ops[_count].len = count + 1;
+	_results[_count] = NULL;
+	_count++;
+	_used += count + 1;
+	return true;
+} // End WriteRegister()
+
+/**
+ * Records a read of one register. The value is stored in *value when the program is run.
+ * 
+ * @return false if the program is full.
+ */
+bool MFRC522::RegisterProgram::ReadRegister(	PCD_Register reg,	///< The register to read from. One of the PCD_Register enums.
+												byte *value			///< Out: Where to store the value read.
+											) {
+	if (_count == SPI_MAX_BATCH || (size_t)(_used + 2) > sizeof(_txData)) {
+		return false;
+	}
+	_txData[_used] = 0x80 | reg;
+	_txData[_used + 1] = 0;
+	_ops[_count].tx = &_txData[_used];
+	_ops[_count].rx = &_rxData[_used];
+	_ops[_count].len = 2;
+	_results[_count] = value;
+	_count++;
+	_used += 2;
+	return true;
+} // End ReadRegister()
+
 /**
  * Sets the bits given in mask in register reg.
  */
@@ -214,19 +578,214 @@ void MFRC522::PCD_ClearRegisterBitMask(	PCD_Register reg,	///< The register to u
 
 
 /**
- * Use the CRC coprocessor in the MFRC522 to calculate a CRC_A.
+ * Calculates a CRC_A.
+ * By default the CRC is calculated on the host, which needs no bus traffic at all.
+ * Use PCD_SetHostCRC(false) to go back to the CRC coprocessor in the MFRC522.
  * 
  * @return STATUS_OK on success, STATUS_??? otherwise.
  */
-MFRC522::StatusCode MFRC522::PCD_CalculateCRC(	byte *data,		///< In: Pointer to the data to transfer to the FIFO for CRC calculation.
-												byte length,	///< In: The number of bytes to transfer.
+MFRC522::StatusCode MFRC522::PCD_CalculateCRC(	byte *data,		///< In: Pointer to the data to calculate the CRC for.
+												byte length,	///< In: The number of bytes.
 												byte *result	///< Out: Pointer to result buffer. Result is written to result[0..1], low byte first.
 					 ) {
-	PCD_WriteRegister(CommandReg, PCD_Idle);		// Stop any active command.
-	PCD_WriteRegister(DivIrqReg, 0x04);				// Clear the CRCIRq interrupt request bit
-	PCD_WriteRegister(FIFOLevelReg, 0x80);			// FlushBuffer = 1, FIFO initialization
-	PCD_WriteRegister(FIFODataReg, length, data);	// Write data to the FIFO
-	PCD_WriteRegister(CommandReg, PCD_CalcCRC);		// Start the calculation
+	if (_hostCRC) {
+		CRC_A(data, length, result);
+		return STATUS_OK;
+	}
+	return PCD_CalculateCRC_Coprocessor(data, length, result);
+} // End PCD_CalculateCRC()
+
+/**
+ * Selects where PCD_CalculateCRC() calculates the CRC_A.
+ */
+void MFRC522::PCD_SetHostCRC(	bool enable		///< true: on the host (default). false: with the CRC coprocessor of the MFRC522.
+							) {
+	_hostCRC = enable;
+} // End PCD_SetHostCRC()
+
+/**
+ * Switches the auto CRC mode on or off.
+ * In auto CRC mode the MFRC522 generates the CRC_A of outgoing frames (TxModeReg.TxCRCEn) and checks and removes the
+ * CRC_A of incoming frames (RxModeReg.RxCRCEn), so the CRC bytes never cross the SPI bus. CRC errors are reported
+ * through ErrorReg.CRCErr. The CRC bits are programmed per frame, according to the class declared with PCD_SetFrameClass().
+ * Responses read with MIFARE_Read() are then 16 bytes long, without the CRC_A.
+ */
+void MFRC522::PCD_SetAutoCRC(	bool enable		///< true: let the MFRC522 handle CRC_A. false: calculate it in software (default).
+							) {
+	_autoCRC = enable;
+	_frameClass = FRAME_NO_CRC;
+	if (!enable) {
+		// Back to the software CRC: no CRC generation or checking by the MFRC522.
+		PCD_WriteRegister(TxModeReg, PCD_ReadRegister(TxModeReg) & 0x7F);
+		PCD_WriteRegister(RxModeReg, PCD_ReadRegister(RxModeReg) & 0x7F);
+	}
+} // End PCD_SetAutoCRC()
+
+/**
+ * Declares how the CRC_A of the next frame is handled in auto CRC mode. Ignored otherwise.
+ * Applies to the next PCD_CommunicateWithPICC() only; after that frames are FRAME_NO_CRC again.
+ */
+void MFRC522::PCD_SetFrameClass(	PCD_FrameClass frameClass	///< One of the PCD_FrameClass enums.
+								) {
+	_frameClass = frameClass;
+} // End PCD_SetFrameClass()
+
+/**
+ * Programs TxCRCEn and RxCRCEn for the declared frame class.
+ * The writes are deferred, so they go out with the transceive preamble, and the shadow copy drops them if nothing changes.
+ */
+void MFRC522::PCD_ApplyFrameClass() {
+	byte txCRC = (_frameClass != FRAME_NO_CRC) ? 0x80 : 0x00;
+	byte rxCRC = (_frameClass == FRAME_TXRX_CRC) ? 0x80 : 0x00;
+	PCD_DeferWriteRegister(TxModeReg, (PCD_ReadRegister(TxModeReg) & 0x7F) | txCRC);	// TxModeReg[7] is TxCRCEn
+	PCD_DeferWriteRegister(RxModeReg, (PCD_ReadRegister(RxModeReg) & 0x7F) | rxCRC);	// RxModeReg[7] is RxCRCEn
+	_frameClass = FRAME_NO_CRC;
+} // End PCD_ApplyFrameClass()
+
+/**
+ * Selects how command completion is detected.
+ * With an IRQLine the MFRC522 is programmed to raise its IRQ pin (ComIEnReg, DivIEnReg) and the host sleeps until the
+ * edge arrives, instead of reading ComIrqReg or DivIrqReg over SPI every 18µs. The IRQ pin is switched to push-pull.
+ * The line is not owned by the MFRC522 object.
+ */
+void MFRC522::PCD_SetIRQLine(	IRQLine *irq	///< The completion source connected to the IRQ pin. NULL to poll (default).
+							) {
+	_irq = irq;
+} // End PCD_SetIRQLine()
+
+/**
+ * Selects the RF timeout of the next PCD_CommunicateWithPICC(). After that TIMEOUT_DEFAULT applies again.
+ * The timer registers are only rewritten when the timeout differs from the programmed one, and then as part of the
+ * transceive preamble, so a profile change costs no extra bus transaction.
+ */
+void MFRC522::PCD_SetTimeoutProfile(	PCD_TimeoutProfile profile	///< One of the PCD_TimeoutProfile enums.
+									) {
+	_timeoutProfile = profile;
+} // End PCD_SetTimeoutProfile()
+
+/**
+ * Sets the ISO-DEP frame waiting time used by TIMEOUT_FWT.
+ * FWT = (256 * 16 / fc) * 2^FWI, ISO/IEC 14443-4 section 7.2. The extra ΔFWT = 49152 / fc is added on top.
+ */
+void MFRC522::PCD_SetFrameWaitingTime(	byte fwi	///< Frame waiting time integer from the ATS, 0..14. 15 is RFU and selects the default 4.
+									) {
+	if (fwi > 14) {
+		fwi = 4;
+	}
+	_fwtUs = (uint32_t)(((uint64_t)4096 << fwi) * 100 / 1356) + 3625;
+} // End PCD_SetFrameWaitingTime()
+
+/**
+ * Sets the bit rates of transmission and reception, and the modulation pulse width that goes with the transmission
+ * rate. The writes are deferred and go out with the next bus transaction, and left out if the rates are already set.
+ * ISO/IEC 14443 activation always runs at 106 kbit/s; PICC_REQA_or_WUPA() returns to it.
+ */
+void MFRC522::PCD_SetBitRate(	PCD_BitRate txRate,	///< PCD to PICC
+								PCD_BitRate rxRate	///< PICC to PCD
+							) {
+	static const byte modWidth[] = { 0x26, 0x15, 0x0A, 0x05 };	// About the same pulse length in carrier cycles, relative to the bit length
+	PCD_DeferWriteRegister(TxModeReg, (PCD_ReadRegister(TxModeReg) & 0x8F) | ((txRate & 0x03) << 4));	// TxModeReg[6..4] is TxSpeed
+	PCD_DeferWriteRegister(RxModeReg, (PCD_ReadRegister(RxModeReg) & 0x8F) | ((rxRate & 0x03) << 4));	// RxModeReg[6..4] is RxSpeed
+	PCD_DeferWriteRegister(ModWidthReg, modWidth[txRate & 0x03]);
+} // End PCD_SetBitRate()
+
+/**
+ * Programs the timer for the declared profile if it is not programmed already.
+ */
+void MFRC522::PCD_ApplyTimeoutProfile() {
+	uint32_t timeoutUs;
+	switch (_timeoutProfile) {
+		case TIMEOUT_SHORT:		timeoutUs = MFRC522_TIMEOUT_SHORT_US;		break;
+		case TIMEOUT_MEDIUM:	timeoutUs = MFRC522_TIMEOUT_MEDIUM_US;		break;
+		case TIMEOUT_FWT:		timeoutUs = _fwtUs;							break;
+		default:				timeoutUs = MFRC522_TIMEOUT_DEFAULT_US;		break;
+	}
+	_timeoutProfile = TIMEOUT_DEFAULT;
+	if (timeoutUs != _timeoutUs) {
+		PCD_ProgramTimer(timeoutUs);
+	}
+} // End PCD_ApplyTimeoutProfile()
+
+/**
+ * Writes the timer registers for a timeout. The writes are deferred and go out with the next bus transaction.
+ * f_timer = 13.56 MHz / (2*TPreScaler+1) where TPreScaler = [TPrescaler_Hi:TPrescaler_Lo].
+ * TPrescaler_Hi are the four low bits in TModeReg. TPrescaler_Lo is TPrescalerReg.
+ */
+void MFRC522::PCD_ProgramTimer(	uint32_t timeoutUs	///< The timeout in microseconds, counted from the end of the transmission.
+							) {
+	uint16_t prescaler;
+	uint32_t reload;
+	if (timeoutUs <= 65535UL * 25) {
+		prescaler = 0x0A9;							// 169 => f_timer=40kHz, ie a timer period of 25μs.
+		reload = (timeoutUs + 24) / 25;
+	}
+	else {
+		prescaler = 0xFFF;							// 4095 => a timer period of 604μs, enough for the longest FWT.
+		reload = (uint32_t)(((uint64_t)timeoutUs * 1356 + 819099) / 819100);
+	}
+	if (reload > 0xFFFF) {
+		reload = 0xFFFF;
+	}
+	PCD_DeferWriteRegister(TModeReg, 0x80 | (prescaler >> 8));	// TAuto=1; timer starts automatically at the end of the transmission in all communication modes at all speeds
+	PCD_DeferWriteRegister(TPrescalerReg, prescaler & 0xFF);
+	PCD_DeferWriteRegister(TReloadRegH, reload >> 8);
+	PCD_DeferWriteRegister(TReloadRegL, reload & 0xFF);
+	_timeoutUs = timeoutUs;
+} // End PCD_ProgramTimer()
+
+/**
+ * Calculates a CRC_A on the host. Table driven, one lookup per byte.
+ * The result is identical to the one of the CRC coprocessor with the 0x6363 preset set by PCD_Init().
+ */
+void MFRC522::CRC_A(	const byte *data,	///< In: Pointer to the data.
+						size_t length,		///< In: The number of bytes.
+						byte *result		///< Out: Pointer to result buffer. Result is written to result[0..1], low byte first.
+					) {
+	uint16_t crc = 0x6363;	// Preset value, ISO/IEC 14443-3 section 6.2.4
+	for (size_t i = 0; i < length; i++) {
+		crc = (crc >> 8) ^ CRC_A_table[(crc ^ data[i]) & 0xFF];
+	}
+	result[0] = crc & 0xFF;
+	result[1] = crc >> 8;
+} // End CRC_A()
+
+/**
+ * Use the CRC coprocessor in the MFRC522 to calculate a CRC_A.
+ * 
+ * @return STATUS_OK on success, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode MFRC522::PCD_CalculateCRC_Coprocessor(	byte *data,		///< In: Pointer to the data to transfer to the FIFO for CRC calculation.
+															byte length,	///< In: The number of bytes to transfer.
+															byte *result	///< Out: Pointer to result buffer. Result is written to result[0..1], low byte first.
+					 ) {
+	// The fixed part of the preamble is recorded once, only the FIFO contents change.
+	_crcProgram.Truncate(3);						// CommandReg=Idle, DivIrqReg=0x04, FIFOLevelReg=0x80
+	if (_irq) {
+		// Only CRCIRq drives the IRQ pin. Enabled after the clear above, so no stale request raises it.
+		_crcProgram.WriteRegister(ComIEnReg, 0x80);			// IRqInv, no ComIrqReg sources
+		_crcProgram.WriteRegister(DivIEnReg, 0x84);			// IRQPushPull, CRCIEn
+	}
+	_crcProgram.WriteRegister(FIFODataReg, length, data);	// Write data to the FIFO
+	_crcProgram.WriteRegister(CommandReg, PCD_CalcCRC);		// Start the calculation
+	if (_irq) {
+		_irq->Arm();
+	}
+	PCD_RunProgram(&_crcProgram);
+	
+	if (_irq) {
+		// Sleep until the IRQ pin signals the end of the calculation. The DivIrqReg read catches lost and spurious edges.
+		bool fired;
+		do {
+			fired = _irq->Wait(MFRC522_TIMEOUT_MARGIN_US);
+			if (PCD_ReadRegister(DivIrqReg) & 0x04) {		// CRCIRq bit set - calculation done
+				PCD_RunProgram(&_crcResultProgram);
+				result[0] = _crcResult[0];
+				result[1] = _crcResult[1];
+				return STATUS_OK;
+			}
+		} while (fired);
+		return STATUS_TIMEOUT;
+	}
 	
 	// Wait for the CRC calculation to complete. Each iteration of the while-loop takes 17.73μs.
 	// TODO check/modify for other architectures than Arduino Uno 16bit
@@ -236,17 +795,17 @@ MFRC522::StatusCode MFRC522::PCD_CalculateCRC(	byte *data,		///< In: Pointer to
 		// DivIrqReg[7..0] bits are: Set2 reserved reserved MfinActIRq reserved CRCIRq reserved reserved
 		byte n = PCD_ReadRegister(DivIrqReg);
 		if (n & 0x04) {									// CRCIRq bit set - calculation done
-			PCD_WriteRegister(CommandReg, PCD_Idle);	// Stop calculating CRC for new content in the FIFO.
-			// Transfer the result from the registers to the result buffer
-			result[0] = PCD_ReadRegister(CRCResultRegL);
-			result[1] = PCD_ReadRegister(CRCResultRegH);
+			// Stop calculating CRC for new content in the FIFO and fetch the result in one bus transaction.
+			PCD_RunProgram(&_crcResultProgram);
+			result[0] = _crcResult[0];
+			result[1] = _crcResult[1];
 			return STATUS_OK;
 		}
 		delayMicroseconds(18);
 	}
 	// 89ms passed and nothing happend. Communication with the MFRC522 might be down.
 	return STATUS_TIMEOUT;
-} // End PCD_CalculateCRC()
+} // End PCD_CalculateCRC_Coprocessor()
 
 
 /////////////////////////////////////////////////////////////////////////////////////
@@ -270,6 +829,7 @@ void MFRC522::PCD_Init() {
 	
 		if (digitalRead(_resetPowerDownPin) == LOW) {	// The MFRC522 chip is in power down mode.
 			digitalWrite(_resetPowerDownPin, HIGH);		// Exit power down mode. This triggers a hard reset.
+			PCD_InvalidateShadow();						// All registers are back at their reset values.
 			// Section 8.8.2 in the datasheet says the oscillator start-up time is the start up time of the crystal + 37,74μs. Let us be generous: 50ms.
 			delay(50);
 			hardReset = true;
@@ -280,6 +840,11 @@ void MFRC522::PCD_Init() {
 		PCD_Reset();
 	}
 	
+	// Find the fastest reliable SPI clock if asked to. Done before the configuration below, as it uses scratch registers.
+	if (_spiClockMax > 0) {
+		PCD_CalibrateSPIClock(_spiClockMax);
+	}
+	
 	// Reset baud rates
 	PCD_WriteRegister(TxModeReg, 0x00);
 	PCD_WriteRegister(RxModeReg, 0x00);
@@ -287,12 +852,8 @@ void MFRC522::PCD_Init() {
 	PCD_WriteRegister(ModWidthReg, 0x26);
 
 	// When communicating with a PICC we need a timeout if something goes wrong.
-	// f_timer = 13.56 MHz / (2*TPreScaler+1) where TPreScaler = [TPrescaler_Hi:TPrescaler_Lo].
-	// TPrescaler_Hi are the four low bits in TModeReg. TPrescaler_Lo is TPrescalerReg.
-	PCD_WriteRegister(TModeReg, 0x80);			// TAuto=1; timer starts automatically at the end of the transmission in all communication modes at all speeds
-	PCD_WriteRegister(TPrescalerReg, 0xA9);		// TPreScaler = TModeReg[3..0]:TPrescalerReg, ie 0x0A9 = 169 => f_timer=40kHz, ie a timer period of 25μs.
-	PCD_WriteRegister(TReloadRegH, 0x03);		// Reload timer with 0x3E8 = 1000, ie 25ms before timeout.
-	PCD_WriteRegister(TReloadRegL, 0xE8);
+	// Each command may pick a shorter or longer one, see PCD_SetTimeoutProfile().
+	PCD_ProgramTimer(MFRC522_TIMEOUT_DEFAULT_US);
 	
 	PCD_WriteRegister(TxASKReg, 0x40);		// Default 0x00. Force a 100 % ASK modulation independent of the ModGsPReg register setting
 	PCD_WriteRegister(ModeReg, 0x3D);		// Default 0x3F. Set the preset value for the CRC coprocessor for the CalcCRC command to 0x6363 (ISO 14443-3 part 6.2.4)
@@ -328,6 +889,7 @@ void MFRC522::PCD_Init(	byte chipSelectPin,		///< Arduino pin connected to MFRC5
  */
 void MFRC522::PCD_Reset() {
 	PCD_WriteRegister(CommandReg, PCD_SoftReset);	// Issue the SoftReset command.
+	PCD_InvalidateShadow();							// All registers are back at their reset values.
 	// The datasheet does not mention how long the SoftRest command takes to complete.
 	// But the MFRC522 might have been in soft power-down mode (triggered by bit 4 of CommandReg) 
 	// Section 8.8.2 in the datasheet says the oscillator start-up time is the start up time of the crystal + 37,74μs. Let us be generous: 50ms.
@@ -338,6 +900,94 @@ void MFRC522::PCD_Reset() {
 	}
 } // End PCD_Reset()
 
+/**
+ * Makes PCD_Init() calibrate the SPI clock, see PCD_CalibrateSPIClock().
+ */
+void MFRC522::PCD_SetSPIClockCalibration(	uint32_t maxClock	///< Highest SPI clock in Hz to try. 0 disables the calibration.
+										) {
+	_spiClockMax = maxClock;
+} // End PCD_SetSPIClockCalibration()
+
+/**
+ * Finds the fastest SPI clock at which the MFRC522 can be talked to reliably.
+ * Starting at the current clock, the clock is raised one step at a time while a write/readback pattern test on
+ * the scratch registers WaterLevelReg and TReloadReg keeps passing. The clock then settles on the last passing
+ * step, one notch below the first failure. If the current clock already fails, the lowest step is used.
+ * A failing clock may have garbled any write of the probe, its address too, so then the MFRC522 is soft reset at the
+ * selected clock and the shadow copy is forgotten: configure the chip afterwards, as PCD_Init() does.
+ * The scratch registers are left at their reset values.
+ * 
+ * @return The SPI clock in Hz that was selected.
+ */
+uint32_t MFRC522::PCD_CalibrateSPIClock(	uint32_t maxClock	///< Highest SPI clock in Hz to try. The MFRC522 accepts up to 10 MHz.
+										) {
+	// Clock steps to try, in Hz. The spidev driver rounds to the nearest divider the SPI controller supports.
+	static const uint32_t steps[] = { 500000, 1000000, 2000000, 4000000, 5000000, 8000000, 10000000 };
+	const byte stepCount = sizeof(steps) / sizeof(steps[0]);
+	uint32_t current = _transport->GetSpeed();
+	uint32_t selected = steps[0];
+	bool failed = true;
+	
+	if (maxClock > MFRC522_SPICLOCK_MAX) {
+		maxClock = MFRC522_SPICLOCK_MAX;
+	}
+	
+	if (PCD_TestSPIClock()) {
+		selected = current;
+		failed = false;
+		for (byte i = 0; i < stepCount; i++) {
+			if (steps[i] <= current) {
+				continue;
+			}
+			if (steps[i] > maxClock || !_transport->SetSpeed(steps[i])) {
+				break;
+			}
+			if (!PCD_TestSPIClock()) {
+				failed = true;
+				break;
+			}
+			selected = steps[i];
+		}
+	}
+	_transport->SetSpeed(selected);
+	if (failed) {
+		PCD_Reset();	// Also forgets the shadow copy, which holds what the failed probe meant to write
+	}
+	
+	// Back to the reset value and the programmed timeout
+	PCD_WriteRegister(WaterLevelReg, 0x08);
+	PCD_ProgramTimer(_timeoutUs);
+	return selected;
+} // End PCD_CalibrateSPIClock()
+
+/**
+ * Write/readback pattern test at the current SPI clock.
+ * The values are read back with a register program, so the shadow copy is bypassed and the bus is really exercised.
+ * 
+ * @return true if every pattern was read back unchanged.
+ */
+bool MFRC522::PCD_TestSPIClock() {
+	static const byte patterns[] = { 0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x3C, 0xC3, 0x01, 0x80 };
+	RegisterProgram program;
+	byte readback[3];
+	
+	for (byte i = 0; i < sizeof(patterns); i++) {
+		byte pattern = patterns[i];
+		program.Clear();
+		program.WriteRegister(WaterLevelReg, pattern & 0x3F);	// WaterLevel[5:0], bits 7..6 are reserved
+		program.WriteRegister(TReloadRegH, pattern);
+		program.WriteRegister(TReloadRegL, ~pattern);
+		program.ReadRegister(WaterLevelReg, &readback[0]);
+		program.ReadRegister(TReloadRegH, &readback[1]);
+		program.ReadRegister(TReloadRegL, &readback[2]);
+		PCD_RunProgram(&program);
+		if ((readback[0] & 0x3F) != (pattern & 0x3F) || readback[1] != pattern || readback[2] != (byte)~pattern) {
+			return false;
+		}
+	}
+	return true;
+} // End PCD_TestSPIClock()
+
 /**
  * Turns the antenna on by enabling pins TX1 and TX2.
  * After a reset these pins are disabled.
@@ -427,41 +1077,76 @@ MFRC522::StatusCode MFRC522::PCD_CommunicateWithPICC(	byte command,		///< The co
 	// Prepare values for BitFramingReg
 	byte txLastBits = validBits ? *validBits : 0;
 	byte bitFraming = (rxAlign << 4) + txLastBits;		// RxAlign = BitFramingReg[6..4]. TxLastBits = BitFramingReg[2..0]
+	_exchanges++;
+	
+	// The timer registers go out with the preamble below, if the profile changed them.
+	PCD_ApplyTimeoutProfile();
+	
+	// In auto CRC mode the MFRC522 appends and checks the CRC_A itself, as declared with PCD_SetFrameClass().
+	bool rxCRC = false;
+	if (_autoCRC) {
+		rxCRC = (_frameClass == FRAME_TXRX_CRC);
+		PCD_ApplyFrameClass();
+	}
 	
-	PCD_WriteRegister(CommandReg, PCD_Idle);			// Stop any active command.
-	PCD_WriteRegister(ComIrqReg, 0x7F);					// Clear all seven interrupt request bits
-	PCD_WriteRegister(FIFOLevelReg, 0x80);				// FlushBuffer = 1, FIFO initialization
-	PCD_WriteRegister(FIFODataReg, sendLen, sendData);	// Write sendData to the FIFO
-	PCD_WriteRegister(BitFramingReg, bitFraming);		// Bit adjustments
-	PCD_WriteRegister(CommandReg, command);				// Execute the command
+	// The whole preamble is one bus transaction. Its fixed part is recorded once, see PCD_InitPrograms().
+	_transceiveProgram.Truncate(3);										// CommandReg=Idle, ComIrqReg=0x7F, FIFOLevelReg=0x80
+	if (_irq) {
+		// The completion bits and the timer drive the IRQ pin. Enabled after the clear above, so no stale request raises it.
+		_transceiveProgram.WriteRegister(ComIEnReg, 0x80 | waitIRq | 0x01);	// IRqInv, waitIRq, TimerIEn
+		_transceiveProgram.WriteRegister(DivIEnReg, 0x80);					// IRQPushPull, no DivIrqReg sources
+		_irq->Arm();
+	}
+	_transceiveProgram.WriteRegister(FIFODataReg, sendLen, sendData);	// Write sendData to the FIFO
+	_transceiveProgram.WriteRegister(BitFramingReg, bitFraming);		// Bit adjustments
+	_transceiveProgram.WriteRegister(CommandReg, command);				// Execute the command
 	if (command == PCD_Transceive) {
-		PCD_SetRegisterBitMask(BitFramingReg, 0x80);	// StartSend=1, transmission of data starts
+		// StartSend=1, transmission of data starts. The rest of BitFramingReg is what we wrote above, so no read-modify-write is needed.
+		_transceiveProgram.WriteRegister(BitFramingReg, 0x80 | bitFraming);
 	}
+	PCD_RunProgram(&_transceiveProgram);
 	
 	// Wait for the command to complete.
 	// In PCD_Init() we set the TAuto flag in TModeReg. This means the timer automatically starts when the PCD stops transmitting.
-	// Each iteration of the do-while-loop takes 17.86μs.
-	// TODO check/modify for other architectures than Arduino Uno 16bit
-	uint16_t i;
-	for (i = 2000; i > 0; i--) {
+	// Each poll reads ComIrqReg together with the registers needed afterwards, so completion costs no extra bus transaction.
+	// The timer normally ends the wait. The host side bound only catches an MFRC522 that stopped responding, it follows the
+	// programmed timeout at a bit more than 18μs per iteration.
+	uint32_t hostTimeoutUs = _timeoutUs + MFRC522_TIMEOUT_MARGIN_US;
+	uint32_t i;
+	if (_irq) {
+		// Sleep until the IRQ pin signals completion or the timer. The poll after each wake-up catches lost and spurious edges.
+		bool fired;
+		for (i = 2000; i > 0; i--) {
+			fired = _irq->Wait(hostTimeoutUs);
+			PCD_RunProgram(&_pollProgram);
+			if (_pollResult[0] & waitIRq) {
+				break;
+			}
+			if ((_pollResult[0] & 0x01) || !fired) {	// Timer interrupt, or the IRQ pin stayed quiet
+				return STATUS_TIMEOUT;
+			}
+		}
+	}
+	else for (i = hostTimeoutUs / 18; i > 0; i--) {
 		delayMicroseconds(18);
-		byte n = PCD_ReadRegister(ComIrqReg);	// ComIrqReg[7..0] bits are: Set1 TxIRq RxIRq IdleIRq HiAlertIRq LoAlertIRq ErrIRq TimerIRq
+		PCD_RunProgram(&_pollProgram);
+		byte n = _pollResult[0];			// ComIrqReg[7..0] bits are: Set1 TxIRq RxIRq IdleIRq HiAlertIRq LoAlertIRq ErrIRq TimerIRq
 		if (n & waitIRq) {					// One of the interrupts that signal success has been set.
 			break;
 		}
-		if (n & 0x01) {						// Timer interrupt - nothing received in 25ms
+		if (n & 0x01) {						// Timer interrupt - nothing received before the timeout
 			//printf("Timeout %X %X\n",n,waitIRq );
 			return STATUS_TIMEOUT;
 		}
 	}
-	// 35.7ms and nothing happend. Communication with the MFRC522 might be down.
+	// Well past the timeout and nothing happend. Communication with the MFRC522 might be down.
 	if (i == 0) {
 		//printf("Timeout2\n");
 		return STATUS_TIMEOUT;
 	}
 	
 	// Stop now if any errors except collisions were detected.
-	byte errorRegValue = PCD_ReadRegister(ErrorReg); // ErrorReg[7..0] bits are: WrErr TempErr reserved BufferOvfl CollErr CRCErr ParityErr ProtocolErr
+	byte errorRegValue = _pollResult[1]; // ErrorReg[7..0] bits are: WrErr TempErr reserved BufferOvfl CollErr CRCErr ParityErr ProtocolErr
 	if (errorRegValue & 0x13) {	 // BufferOvfl ParityErr ProtocolErr
 		return STATUS_ERROR;
 	}
@@ -470,13 +1155,13 @@ MFRC522::StatusCode MFRC522::PCD_CommunicateWithPICC(	byte command,		///< The co
 	
 	// If the caller wants data back, get it from the MFRC522.
 	if (backData && backLen) {
-		byte n = PCD_ReadRegister(FIFOLevelReg);	// Number of bytes in the FIFO
+		byte n = _pollResult[2];	// Number of bytes in the FIFO
 		if (n > *backLen) {
 			return STATUS_NO_ROOM;
 		}
 		*backLen = n;											// Number of bytes returned
 		PCD_ReadRegister(FIFODataReg, n, backData, rxAlign);	// Get received data from FIFO
-		_validBits = PCD_ReadRegister(ControlReg) & 0x07;		// RxLastBits[2:0] indicates the number of valid bits in the last received byte. If this value is 000b, the whole byte is valid.
+		_validBits = _pollResult[3] & 0x07;		// RxLastBits[2:0] indicates the number of valid bits in the last received byte. If this value is 000b, the whole byte is valid.
 		if (validBits) {
 			*validBits = _validBits;
 		}
@@ -487,6 +1172,17 @@ MFRC522::StatusCode MFRC522::PCD_CommunicateWithPICC(	byte command,		///< The co
 		return STATUS_COLLISION;
 	}
 	
+	// The MFRC522 checked the CRC_A and removed it from the FIFO. There is nothing left for the caller to check.
+	if (rxCRC) {
+		if (backData && backLen && *backLen == 1 && _validBits == 4) {	// A MIFARE Classic NAK carries no CRC_A.
+			return checkCRC ? STATUS_MIFARE_NACK : STATUS_OK;
+		}
+		if (errorRegValue & 0x04) {		// CRCErr
+			return STATUS_CRC_WRONG;
+		}
+		return STATUS_OK;
+	}
+	
 	// Perform CRC_A validation if requested.
 	if (backData && backLen && checkCRC) {
 		// In this case a MIFARE Classic NAK is not OK.
@@ -511,6 +1207,156 @@ MFRC522::StatusCode MFRC522::PCD_CommunicateWithPICC(	byte command,		///< The co
 	return STATUS_OK;
 } // End PCD_CommunicateWithPICC()
 
+/**
+ * Executes the Transceive command for frames that do not fit into the 64 byte FIFO, eg ISO-DEP blocks with FSD=256.
+ * The FIFO is refilled while transmitting and drained while receiving. WaterLevelReg sets the thresholds: the FIFO is
+ * refilled when LoAlert says at most MFRC522_FIFO_WATERLEVEL bytes are left, and drained when HiAlert says at most
+ * MFRC522_FIFO_WATERLEVEL bytes are free. With an IRQ line LoAlertIRq and HiAlertIRq wake the host, otherwise FIFOLevelReg
+ * is polled together with ComIrqReg.
+ * At 106kbit/s a byte takes about 80μs on air, so a refill has to come within about a millisecond.
+ * rxAlign is not supported, this is not meant for anticollision.
+ * CRC validation can only be done if backData and backLen are specified. Without auto CRC it is done on the host.
+ *
+ * @return STATUS_OK on success, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode MFRC522::PCD_TransceiveStream(	byte *sendData,		///< Pointer to the data to transmit. May be the same buffer as backData.
+													uint16_t sendLen,	///< Number of bytes to transmit.
+													byte *backData,		///< NULL or pointer to buffer if data should be read back after executing the command.
+													uint16_t *backLen,	///< In: Max number of bytes to write to *backData. Out: The number of bytes returned.
+													byte *validBits,	///< In/Out: The number of valid bits in the last byte. 0 for 8 valid bits. Default NULL.
+													bool checkCRC		///< In: True => The last two bytes of the response is assumed to be a CRC_A that must be validated.
+								 ) {
+	const byte waitIRq = 0x30;		// RxIRq and IdleIRq
+	byte txLastBits = validBits ? *validBits : 0;
+	uint16_t sent = (sendLen < FIFO_SIZE) ? sendLen : FIFO_SIZE;
+	uint16_t received = 0;
+	bool txDone = false;
+	_exchanges++;
+	
+	PCD_ApplyTimeoutProfile();
+	bool rxCRC = false;
+	if (_autoCRC) {
+		rxCRC = (_frameClass == FRAME_TXRX_CRC);
+		PCD_ApplyFrameClass();
+	}
+	PCD_DeferWriteRegister(WaterLevelReg, MFRC522_FIFO_WATERLEVEL);
+	
+	// Same preamble as PCD_CommunicateWithPICC(), with the first FIFO load.
+	_transceiveProgram.Truncate(3);										// CommandReg=Idle, ComIrqReg=0x7F, FIFOLevelReg=0x80
+	if (_irq) {
+		// While transmitting LoAlertIRq asks for a refill. After the last refill TxIRq signals the end of the transmission.
+		_transceiveProgram.WriteRegister(ComIEnReg, 0x80 | waitIRq | 0x01 | (sent < sendLen ? 0x04 : 0x40));
+		_transceiveProgram.WriteRegister(DivIEnReg, 0x80);
+		_irq->Arm();
+	}
+	_transceiveProgram.WriteRegister(FIFODataReg, sent, sendData);
+	_transceiveProgram.WriteRegister(BitFramingReg, txLastBits);
+	_transceiveProgram.WriteRegister(CommandReg, PCD_Transceive);
+	_transceiveProgram.WriteRegister(BitFramingReg, 0x80 | txLastBits);	// StartSend=1
+	PCD_RunProgram(&_transceiveProgram);
+	
+	// The timer only starts at the end of the transmission and stops at the first received bit, so the host side bound
+	// also covers the time on air, about 100μs per byte in both directions.
+	uint32_t hostTimeoutUs = _timeoutUs + MFRC522_TIMEOUT_MARGIN_US + ((uint32_t)sendLen + (backLen ? *backLen : 0)) * 100;
+	uint32_t i;
+	for (i = hostTimeoutUs / 18; i > 0; i--) {
+		bool quiet = false;
+		if (_irq) {
+			quiet = !_irq->Wait(hostTimeoutUs);
+		}
+		else {
+			delayMicroseconds(18);
+		}
+		PCD_RunProgram(&_pollProgram);		// Also sends the refills and interrupt clears deferred by the previous iteration
+		byte n = _pollResult[0];			// ComIrqReg[7..0] bits are: Set1 TxIRq RxIRq IdleIRq HiAlertIRq LoAlertIRq ErrIRq TimerIRq
+		byte level = _pollResult[2] & 0x7F;	// Number of bytes in the FIFO
+		bool progress = false;
+		
+		if (_pollResult[1] & 0x13) {		// BufferOvfl ParityErr ProtocolErr
+			return STATUS_ERROR;
+		}
+		if (!txDone) {
+			if (n & 0x40) {					// TxIRq - the last bit went out, the FIFO now fills with the response
+				txDone = true;
+				PCD_DeferWriteRegister(ComIrqReg, 0x0C);	// Clear HiAlertIRq and LoAlertIRq, the transmission set them
+				if (_irq) {
+					PCD_DeferWriteRegister(ComIEnReg, 0x80 | waitIRq | 0x01 | 0x08);
+				}
+				progress = true;
+			}
+			else if (sent < sendLen && level <= MFRC522_FIFO_WATERLEVEL) {
+				uint16_t chunk = FIFO_SIZE - level;
+				if (chunk > sendLen - sent) {
+					chunk = sendLen - sent;
+				}
+				PCD_DeferWriteRegister(FIFODataReg, chunk, &sendData[sent]);
+				PCD_DeferWriteRegister(ComIrqReg, 0x04);	// Clear LoAlertIRq
+				sent += chunk;
+				if (_irq && sent == sendLen) {
+					PCD_DeferWriteRegister(ComIEnReg, 0x80 | waitIRq | 0x01 | 0x40);
+				}
+				progress = true;
+			}
+		}
+		if (txDone) {
+			bool done = (n & waitIRq);
+			if (!done && (n & 0x01)) {		// Timer interrupt - nothing received before the timeout
+				return STATUS_TIMEOUT;
+			}
+			if (backData && backLen && (done || level >= FIFO_SIZE - MFRC522_FIFO_WATERLEVEL)) {
+				if (received + level > *backLen) {
+					return STATUS_NO_ROOM;
+				}
+				PCD_ReadRegister(FIFODataReg, level, &backData[received]);
+				received += level;
+				if (!done) {
+					PCD_DeferWriteRegister(ComIrqReg, 0x08);	// Clear HiAlertIRq
+				}
+				progress = true;
+			}
+			if (done) {
+				break;
+			}
+		}
+		if (_irq) {
+			PCD_FlushBatch();				// The next wait sleeps, so nothing may be left queued
+			if (quiet && !progress) {
+				return STATUS_TIMEOUT;
+			}
+		}
+	}
+	if (i == 0) {
+		return STATUS_TIMEOUT;
+	}
+	
+	byte errorRegValue = _pollResult[1];
+	byte _validBits = _pollResult[3] & 0x07;
+	if (backData && backLen) {
+		*backLen = received;
+		if (validBits) {
+			*validBits = _validBits;
+		}
+	}
+	if (errorRegValue & 0x08) {		// CollErr
+		return STATUS_COLLISION;
+	}
+	if (rxCRC) {
+		return (errorRegValue & 0x04) ? STATUS_CRC_WRONG : STATUS_OK;
+	}
+	if (backData && backLen && checkCRC) {
+		if (received < 2 || _validBits != 0) {
+			return STATUS_CRC_WRONG;
+		}
+		// The coprocessor only sees one FIFO load, so frames of any length are checked on the host.
+		byte controlBuffer[2];
+		CRC_A(backData, received - 2, controlBuffer);
+		if ((backData[received - 2] != controlBuffer[0]) || (backData[received - 1] != controlBuffer[1])) {
+			return STATUS_CRC_WRONG;
+		}
+	}
+	return STATUS_OK;
+} // End PCD_TransceiveStream()
+
 /**
  * Transmits a REQuest command, Type A. Invites PICCs in state IDLE to go to READY and prepare for anticollision or selection. 7 bit frame.
  * Beware: When two PICCs are in the field at the same time I often get STATUS_TIMEOUT - probably due do bad antenna design.
@@ -551,8 +1397,12 @@ MFRC522::StatusCode MFRC522::PICC_REQA_or_WUPA(	byte command, 		///< The command
 	if (bufferATQA == NULL || *bufferSize < 2) {	// The ATQA response is 2 bytes long.
 		return STATUS_NO_ROOM;
 	}
-	PCD_ClearRegisterBitMask(CollReg, 0x80);		// ValuesAfterColl=1 => Bits received after collision are cleared.
+	// ValuesAfterColl=1 => Bits received after collision are cleared. The other CollReg bits are read-only, so a plain
+	// write does the job of a read-modify-write. It goes out with the transceive preamble.
+	PCD_DeferWriteRegister(CollReg, 0x00);
+	PCD_SetBitRate(BITRATE_106, BITRATE_106);		// PICCs in IDLE or HALT only listen at 106 kbit/s
 	validBits = 7;									// For REQA and WUPA we need the short frame format - transmit only 7 bits of the last (and only) byte. TxLastBits = BitFramingReg[2..0]
+	PCD_SetTimeoutProfile(TIMEOUT_SHORT);			// An empty field must not cost the full default timeout
 	status = PCD_TransceiveData(&command, 1, bufferATQA, bufferSize, &validBits);
 	if (status != STATUS_OK) {
 		//printf("PICC status not okay %d\n", status);
@@ -630,7 +1480,7 @@ MFRC522::StatusCode MFRC522::PICC_Select(	Uid *uid,			///< Pointer to Uid struct
 	}
 	
 	// Prepare MFRC522
-	PCD_ClearRegisterBitMask(CollReg, 0x80);		// ValuesAfterColl=1 => Bits received after collision are cleared.
+	PCD_DeferWriteRegister(CollReg, 0x00);		// ValuesAfterColl=1 => Bits received after collision are cleared. See PICC_REQA_or_WUPA().
 	
 	// Repeat Cascade Level loop until we have a complete UID.
 	uidComplete = false;
@@ -694,13 +1544,20 @@ MFRC522::StatusCode MFRC522::PICC_Select(	Uid *uid,			///< Pointer to Uid struct
 				buffer[1] = 0x70; // NVB - Number of Valid Bits: Seven whole bytes
 				// Calculate BCC - Block Check Character
 				buffer[6] = buffer[2] ^ buffer[3] ^ buffer[4] ^ buffer[5];
-				// Calculate CRC_A
-				result = PCD_CalculateCRC(buffer, 7, &buffer[7]);
-				if (result != STATUS_OK) {
-					return result;
-				}
 				txLastBits		= 0; // 0 => All 8 bits are valid.
-				bufferUsed		= 9;
+				if (_autoCRC) {
+					// The MFRC522 appends the CRC_A and checks the one of the SAK
+					PCD_SetFrameClass(FRAME_TXRX_CRC);
+					bufferUsed		= 7;
+				}
+				else {
+					// Calculate CRC_A
+					result = PCD_CalculateCRC(buffer, 7, &buffer[7]);
+					if (result != STATUS_OK) {
+						return result;
+					}
+					bufferUsed		= 9;
+				}
 				// Store response in the last 3 bytes of buffer (BCC and CRC_A - not needed after tx)
 				responseBuffer	= &buffer[6];
 				responseLength	= 3;
@@ -717,11 +1574,11 @@ MFRC522::StatusCode MFRC522::PICC_Select(	Uid *uid,			///< Pointer to Uid struct
 				responseLength	= sizeof(buffer) - index;
 			}
 			
-			// Set bit adjustments
+			// Set bit adjustments. PCD_CommunicateWithPICC() writes them to BitFramingReg as part of its preamble.
 			rxAlign = txLastBits;											// Having a separate variable is overkill. But it makes the next line easier to read.
-			PCD_WriteRegister(BitFramingReg, (rxAlign << 4) + txLastBits);	// RxAlign = BitFramingReg[6..4]. TxLastBits = BitFramingReg[2..0]
 			
 			// Transmit the buffer and receive the response.
+			PCD_SetTimeoutProfile(TIMEOUT_SHORT);
 			result = PCD_TransceiveData(buffer, bufferUsed, responseBuffer, &responseLength, &txLastBits, rxAlign);
 			if (result == STATUS_COLLISION) { // More than one PICC in the field => collision.
 				byte valueOfCollReg = PCD_ReadRegister(CollReg); // CollReg[7..0] bits are: ValuesAfterColl reserved CollPosNotValid CollPos[4:0]
@@ -738,7 +1595,7 @@ MFRC522::StatusCode MFRC522::PICC_Select(	Uid *uid,			///< Pointer to Uid struct
 				// Choose the PICC with the bit set.
 				currentLevelKnownBits = collisionPos;
 				count			= (currentLevelKnownBits - 1) % 8; // The bit to modify
-				index			= 1 + (currentLevelKnownBits / 8) + (count ? 1 : 0); // First byte is index 0.
+				index			= 2 + (currentLevelKnownBits - 1) / 8; // The byte holding bit collisionPos, UID bits start at buffer[2].
 				buffer[index]	|= (1 << count);
 			}
 			else if (result != STATUS_OK) {
@@ -767,16 +1624,23 @@ MFRC522::StatusCode MFRC522::PICC_Select(	Uid *uid,			///< Pointer to Uid struct
 		}
 		
 		// Check response SAK (Select Acknowledge)
-		if (responseLength != 3 || txLastBits != 0) { // SAK must be exactly 24 bits (1 byte + CRC_A).
-			return STATUS_ERROR;
-		}
-		// Verify CRC_A - do our own calculation and store the control in buffer[2..3] - those bytes are not needed anymore.
-		result = PCD_CalculateCRC(responseBuffer, 1, &buffer[2]);
-		if (result != STATUS_OK) {
-			return result;
+		if (_autoCRC) {
+			if (responseLength != 1 || txLastBits != 0) { // SAK must be exactly 8 bits, the MFRC522 checked and removed the CRC_A.
+				return STATUS_ERROR;
+			}
 		}
-		if ((buffer[2] != responseBuffer[1]) || (buffer[3] != responseBuffer[2])) {
-			return STATUS_CRC_WRONG;
+		else {
+			if (responseLength != 3 || txLastBits != 0) { // SAK must be exactly 24 bits (1 byte + CRC_A).
+				return STATUS_ERROR;
+			}
+			// Verify CRC_A - do our own calculation and store the control in buffer[2..3] - those bytes are not needed anymore.
+			result = PCD_CalculateCRC(responseBuffer, 1, &buffer[2]);
+			if (result != STATUS_OK) {
+				return result;
+			}
+			if ((buffer[2] != responseBuffer[1]) || (buffer[3] != responseBuffer[2])) {
+				return STATUS_CRC_WRONG;
+			}
 		}
 		if (responseBuffer[0] & 0x04) { // Cascade bit set - UID not complete yes
 			cascadeLevel++;
@@ -805,18 +1669,26 @@ MFRC522::StatusCode MFRC522::PICC_HaltA() {
 	// Build command buffer
 	buffer[0] = PICC_CMD_HLTA;
 	buffer[1] = 0;
-	// Calculate CRC_A
-	result = PCD_CalculateCRC(buffer, 2, &buffer[2]);
-	if (result != STATUS_OK) {
-		return result;
+	byte bufferUsed = sizeof(buffer);
+	if (_autoCRC) {
+		PCD_SetFrameClass(FRAME_TX_CRC);	// The MFRC522 appends the CRC_A
+		bufferUsed = 2;
+	}
+	else {
+		// Calculate CRC_A
+		result = PCD_CalculateCRC(buffer, 2, &buffer[2]);
+		if (result != STATUS_OK) {
+			return result;
+		}
 	}
 	
 	// Send the command.
 	// The standard says:
 	//		If the PICC responds with any modulation during a period of 1 ms after the end of the frame containing the
 	//		HLTA command, this response shall be interpreted as 'not acknowledge'.
-	// We interpret that this way: Only STATUS_TIMEOUT is a success.
-	result = PCD_TransceiveData(buffer, sizeof(buffer), NULL, 0);
+	// We interpret that this way: Only STATUS_TIMEOUT is a success. So the timer is set to exactly that 1ms.
+	PCD_SetTimeoutProfile(TIMEOUT_SHORT);
+	result = PCD_TransceiveData(buffer, bufferUsed, NULL, 0);
 	if (result == STATUS_TIMEOUT) {
 		return STATUS_OK;
 	}
@@ -826,6 +1698,87 @@ MFRC522::StatusCode MFRC522::PICC_HaltA() {
 	return result;
 } // End PICC_HaltA()
 
+/**
+ * Wakes a known PICC from the IDLE or HALT state and selects it again, eg after a failed MIFARE authentication.
+ * All UID bits are known, so every cascade level is a plain SELECT without anticollision. Only that PICC answers it.
+ * 
+ * @return STATUS_OK if the PICC is ACTIVE again, STATUS_??? otherwise. STATUS_TIMEOUT if it left the field.
+ */
+MFRC522::StatusCode MFRC522::PICC_Reselect(const Uid *uid	///< The UID of the PICC, as returned by PICC_Select().
+										) {
+	byte bufferATQA[2];
+	byte bufferSize = sizeof(bufferATQA);
+	Uid selected = *uid;
+	
+	StatusCode result = PICC_WakeupA(bufferATQA, &bufferSize);
+	if (result != STATUS_OK && result != STATUS_COLLISION) {	// Other PICCs may answer the WUPA too
+		return result;
+	}
+	return PICC_Select(&selected, selected.size * 8);
+} // End PICC_Reselect()
+
+/**
+ * Finds all PICCs in the field, not just the one PICC_Select() settles on.
+ * Each round sends REQA, selects one PICC and halts it. The anticollision always takes the branch with the bit set, so
+ * every round walks down to a different leaf of the UID tree: the PICCs found earlier are in state HALT and no longer
+ * answer REQA. The inventory is complete once REQA gets no answer.
+ * A failed selection (noise, a PICC leaving the field) is retried, up to MFRC522_INVENTORY_RETRIES times in a row.
+ * On return all PICCs found are in state HALT, use PICC_WakeupA() to talk to them again. The type of each is
+ * PICC_GetType(uids[i].sak).
+ * 
+ * @return STATUS_OK once the field is empty, STATUS_NO_ROOM if uids[] is full while PICCs are left, STATUS_??? otherwise.
+ */
+MFRC522::StatusCode MFRC522::PICC_Inventory(	Uid *uids,			///< Array to store the UIDs of the PICCs found in
+												byte *uidCount		///< In: Number of entries in uids[]. Out: Number of PICCs found, also if an error is returned.
+											) {
+	MFRC522::StatusCode result;
+	byte bufferATQA[2];
+	byte bufferSize;
+	byte found = 0;
+	byte failures = 0;
+	
+	if (uids == NULL || uidCount == NULL) {
+		return STATUS_INVALID;
+	}
+	
+	while (true) {
+		bufferSize = sizeof(bufferATQA);
+		result = PICC_RequestA(bufferATQA, &bufferSize);
+		if (result == STATUS_TIMEOUT) {		// No PICC left in state IDLE
+			result = STATUS_OK;
+			break;
+		}
+		// PICCs of different types answer with different ATQAs, a collision there just means there are several.
+		if (result == STATUS_OK || result == STATUS_COLLISION) {
+			if (found == *uidCount) {
+				result = STATUS_NO_ROOM;
+				break;
+			}
+			result = PICC_Select(&uids[found]);
+		}
+		if (result == STATUS_OK) {
+			// A PICC that missed the HLTA answers again, do not count it twice.
+			bool known = false;
+			for (byte i = 0; i < found && !known; i++) {
+				known = uids[i].size == uids[found].size && memcmp(uids[i].uidByte, uids[found].uidByte, uids[found].size) == 0;
+			}
+			PICC_HaltA();
+			if (!known) {
+				found++;
+				failures = 0;
+				continue;
+			}
+			result = STATUS_ERROR;
+		}
+		if (++failures >= MFRC522_INVENTORY_RETRIES) {
+			break;
+		}
+	}
+	
+	*uidCount = found;
+	return result;
+} // End PICC_Inventory()
+
 /////////////////////////////////////////////////////////////////////////////////////
 // Functions for communicating with MIFARE PICCs
 /////////////////////////////////////////////////////////////////////////////////////
@@ -865,6 +1818,7 @@ MFRC522::StatusCode MFRC522::PCD_Authenticate(byte command,		///< PICC_CMD_MF_AU
 	}
 	
 	// Start the authentication.
+	PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
 	return PCD_CommunicateWithPICC(PCD_MFAuthent, waitIRq, &sendData[0], sizeof(sendData));
 } // End PCD_Authenticate()
 
@@ -874,7 +1828,9 @@ MFRC522::StatusCode MFRC522::PCD_Authenticate(byte command,		///< PICC_CMD_MF_AU
  */
 void MFRC522::PCD_StopCrypto1() {
 	// Clear MFCrypto1On bit
-	PCD_ClearRegisterBitMask(Status2Reg, 0x08); // Status2Reg[7..0] bits are: TempSensClear I2CForceHS reserved reserved MFCrypto1On ModemState[2:0]
+	// Status2Reg[7..0] bits are: TempSensClear I2CForceHS reserved reserved MFCrypto1On ModemState[2:0]
+	// ModemState is read-only and this library never sets TempSensClear or I2CForceHS, so a plain write replaces the read-modify-write.
+	PCD_WriteRegister(Status2Reg, 0x00);
 } // End PCD_StopCrypto1()
 
 /**
@@ -890,6 +1846,7 @@ void MFRC522::PCD_StopCrypto1() {
  * 
  * The buffer must be at least 18 bytes because a CRC_A is also returned.
  * Checks the CRC_A before returning STATUS_OK.
+ * In auto CRC mode (see PCD_SetAutoCRC()) the MFRC522 removes the CRC_A and only the 16 data bytes are returned.
  * 
  * @return STATUS_OK on success, STATUS_??? otherwise.
  */
@@ -907,6 +1864,12 @@ MFRC522::StatusCode MFRC522::MIFARE_Read(	byte blockAddr, 	///< MIFARE Classic:
 	// Build command buffer
 	buffer[0] = PICC_CMD_MF_READ;
 	buffer[1] = blockAddr;
+	if (_autoCRC) {
+		// The MFRC522 appends the CRC_A and checks and removes the one of the response. 16 bytes are returned.
+		PCD_SetFrameClass(FRAME_TXRX_CRC);
+		PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
+		return PCD_TransceiveData(buffer, 2, buffer, bufferSize, NULL, 0, true);
+	}
 	// Calculate CRC_A
 	result = PCD_CalculateCRC(buffer, 2, &buffer[2]);
 	if (result != STATUS_OK) {
@@ -914,6 +1877,7 @@ MFRC522::StatusCode MFRC522::MIFARE_Read(	byte blockAddr, 	///< MIFARE Classic:
 	}
 	
 	// Transmit the buffer and receive the response, validate CRC_A.
+	PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
 	return PCD_TransceiveData(buffer, 4, buffer, bufferSize, NULL, 0, true);
 } // End MIFARE_Read()
 
@@ -1184,6 +2148,382 @@ MFRC522::StatusCode MFRC522::PCD_NTAG216_AUTH(byte* passWord, byte pACK[]) //Aut
 	return STATUS_OK;
 } // End PCD_NTAG216_AUTH()
 
+/**
+ * Returns the number of sectors of a MIFARE Classic PICC type.
+ * 
+ * @return 5, 16 or 40. 0 if the type has no MIFARE Classic sectors.
+ */
+byte MFRC522::MIFARE_GetSectorCount(PICC_Type piccType	///< One of the PICC_Type enums.
+									) {
+	switch (piccType) {
+		case PICC_TYPE_MIFARE_MINI:	return 5;
+		case PICC_TYPE_MIFARE_1K:	return 16;
+		case PICC_TYPE_MIFARE_4K:	return 40;
+		default:					return 0;
+	}
+} // End MIFARE_GetSectorCount()
+
+/**
+ * Returns the sector of a MIFARE Classic block.
+ */
+byte MFRC522::MIFARE_GetSector(byte blockAddr	///< Block number, 0-255.
+								) {
+	return blockAddr < 128 ? blockAddr / 4 : 32 + (blockAddr - 128) / 16;
+} // End MIFARE_GetSector()
+
+/**
+ * Returns the first block of a MIFARE Classic sector.
+ * Sectors 0-31 have 4 blocks, sectors 32-39 (above 2KB on MIFARE 4K) have 16.
+ */
+byte MFRC522::MIFARE_GetSectorFirstBlock(byte sector	///< Sector number, 0-39.
+										) {
+	return sector < 32 ? sector * 4 : 128 + (sector - 32) * 16;
+} // End MIFARE_GetSectorFirstBlock()
+
+/**
+ * Returns the number of blocks of a MIFARE Classic sector, the last one is the sector trailer.
+ */
+byte MFRC522::MIFARE_GetSectorBlockCount(byte sector	///< Sector number, 0-39.
+										) {
+	return sector < 32 ? 4 : 16;
+} // End MIFARE_GetSectorBlockCount()
+
+/**
+ * Calculates the access bits of a sector trailer (bytes 6 to 8) from the access conditions of its block groups.
+ * Each condition is C1 C2 C3 as a 3 bit number, C1 is bit 2. In sectors of 4 blocks a group is one block, in the 16
+ * block sectors of MIFARE 4K groups 0-2 are 5 blocks each. Group 3 is the sector trailer.
+ */
+void MFRC522::MIFARE_SetAccessBits(	byte *accessBitBuffer,	///< Out: Pointer to byte 6 in the sector trailer. Bytes [6..8] will be set.
+									byte g0,				///< Access bits [C1 C2 C3] for block group 0
+									byte g1,				///< Access bits [C1 C2 C3] for block group 1
+									byte g2,				///< Access bits [C1 C2 C3] for block group 2
+									byte g3					///< Access bits [C1 C2 C3] for the sector trailer
+								) {
+	byte c1 = ((g3 & 4) << 1) | ((g2 & 4) << 0) | ((g1 & 4) >> 1) | ((g0 & 4) >> 2);
+	byte c2 = ((g3 & 2) << 2) | ((g2 & 2) << 1) | ((g1 & 2) << 0) | ((g0 & 2) >> 1);
+	byte c3 = ((g3 & 1) << 3) | ((g2 & 1) << 2) | ((g1 & 1) << 1) | ((g0 & 1) << 0);
+	
+	accessBitBuffer[0] = (~c2 & 0xF) << 4 | (~c1 & 0xF);
+	accessBitBuffer[1] =          c1 << 4 | (~c3 & 0xF);
+	accessBitBuffer[2] =          c3 << 4 | c2;
+} // End MIFARE_SetAccessBits()
+
+/**
+ * Decodes the access bits of a sector trailer (bytes 6 to 8), see MIFARE_SetAccessBits().
+ * 
+ * @return false if the inverted copies do not match. The PICC treats such a sector as blocked.
+ */
+bool MFRC522::MIFARE_GetAccessBits(	const byte *accessBitBuffer,	///< Pointer to byte 6 in the sector trailer.
+									byte *groups					///< Out: Access bits [C1 C2 C3] of block groups 0-3, 4 bytes.
+								) {
+	byte c1 = accessBitBuffer[1] >> 4;
+	byte c2 = accessBitBuffer[2] & 0xF;
+	byte c3 = accessBitBuffer[2] >> 4;
+	if ((accessBitBuffer[0] & 0xF) != (~c1 & 0xF) || (accessBitBuffer[0] >> 4) != (~c2 & 0xF) || (accessBitBuffer[1] & 0xF) != (~c3 & 0xF)) {
+		return false;
+	}
+	for (byte g = 0; g < 4; g++) {
+		groups[g] = ((c1 >> g) & 1) << 2 | ((c2 >> g) & 1) << 1 | ((c3 >> g) & 1);
+	}
+	return true;
+} // End MIFARE_GetAccessBits()
+
+/**
+ * Tells if the access bits of a sector trailer (bytes 6 to 8) let key A read key B. Key A never reads back.
+ * 
+ * @return true for the trailer access conditions 000, 010 and 001, false for the others or invalid access bits.
+ */
+bool MFRC522::MIFARE_IsKeyBReadable(const byte *accessBitBuffer	///< Pointer to byte 6 in the sector trailer.
+									) {
+	byte groups[4];
+	if (!MIFARE_GetAccessBits(accessBitBuffer, groups)) {
+		return false;
+	}
+	return groups[3] == 0 || groups[3] == 2 || groups[3] == 1;
+} // End MIFARE_IsKeyBReadable()
+
+/**
+ * Returns the access bit group of a block within its sector: 0-2 for data blocks, 3 for the sector trailer.
+ */
+byte MFRC522::MIFARE_GetAccessGroup(byte blockAddr	///< Block number, 0-255.
+									) {
+	byte sector = MIFARE_GetSector(blockAddr);
+	byte offset = blockAddr - MIFARE_GetSectorFirstBlock(sector);
+	byte blockCount = MIFARE_GetSectorBlockCount(sector);
+	if (offset == blockCount - 1) {
+		return 3;
+	}
+	return blockCount == 4 ? offset : offset / 5;
+} // End MIFARE_GetAccessGroup()
+
+/**
+ * Reads consecutive sectors of a MIFARE Classic PICC into one image.
+ * 
+ * Each sector is authenticated once and all its blocks are read back to back while Crypto1 stays on. The key used
+ * takes the place of the unreadable key A (or key B) in the sector trailer. A sector that cannot be authenticated or
+ * read is zeroed in the image; the PICC dropped out of the ACTIVE state then, so it is woken and selected again
+ * before the next sector is tried.
+ * The PICC must be selected - ie in state ACTIVE - before calling this function.
+ * Remember to call PCD_StopCrypto1() afterwards, Crypto1 may still be on.
+ * 
+ * @return STATUS_OK if every sector was read, otherwise the status of the first sector that failed.
+ */
+MFRC522::StatusCode MFRC522::MIFARE_ReadSectors(byte firstSector,			///< The first sector to read.
+												byte sectorCount,			///< Number of sectors to read.
+												byte command,				///< PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+												MIFARE_Key *key,			///< The key of all sectors.
+												Uid *uid,					///< The UID of the selected PICC.
+												byte *image,				///< Out: The blocks of all sectors, 16 bytes each, in block order.
+												StatusCode *sectorStatus	///< Out: The result of each sector. NULL if not needed.
+											) {
+	StatusCode first = STATUS_OK;
+	byte imageStart = MIFARE_GetSectorFirstBlock(firstSector);
+	byte buffer[18];
+	
+	for (byte s = 0; s < sectorCount; s++) {
+		byte sector = firstSector + s;
+		byte block = MIFARE_GetSectorFirstBlock(sector);
+		byte blockCount = MIFARE_GetSectorBlockCount(sector);
+		byte *sectorImage = &image[(block - imageStart) * 16];
+		
+		StatusCode result = PCD_Authenticate(command, block + blockCount - 1, key, uid);
+		for (byte i = 0; i < blockCount && result == STATUS_OK; i++) {
+			// Same exchange as MIFARE_Read(), with the CRC_A of the request always calculated on the host
+			byte bufferSize = sizeof(buffer);
+			byte sendLen = 2;
+			buffer[0] = PICC_CMD_MF_READ;
+			buffer[1] = block + i;
+			if (_autoCRC) {
+				PCD_SetFrameClass(FRAME_TXRX_CRC);
+			}
+			else {
+				CRC_A(buffer, 2, &buffer[2]);
+				sendLen = 4;
+			}
+			PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
+			result = PCD_TransceiveData(buffer, sendLen, buffer, &bufferSize, NULL, 0, true);
+			if (result == STATUS_OK && bufferSize < 16) {
+				result = STATUS_ERROR;
+			}
+			if (result == STATUS_OK) {
+				memcpy(&sectorImage[i * 16], buffer, 16);
+			}
+		}
+		if (sectorStatus) {
+			sectorStatus[s] = result;
+		}
+		if (result == STATUS_OK) {
+			// Key A of the trailer reads as zeros, so does key B unless the access bits allow reading it. The key that
+			// authenticated the sector is known, the image holds it instead.
+			memcpy(&sectorImage[(blockCount - 1) * 16 + (command == PICC_CMD_MF_AUTH_KEY_A ? 0 : 10)], key->keyByte, MF_KEY_SIZE);
+			continue;
+		}
+		
+		// The PICC left the ACTIVE state. Wake and select it again for the next sector.
+		if (first == STATUS_OK) {
+			first = result;
+		}
+		memset(sectorImage, 0, blockCount * 16);
+		PCD_StopCrypto1();
+		if (s + 1 == sectorCount) {
+			break;
+		}
+		result = PICC_Reselect(uid);
+		if (result != STATUS_OK) {
+			// The PICC is gone, so are the remaining sectors
+			for (s++; s < sectorCount; s++) {
+				block = MIFARE_GetSectorFirstBlock(firstSector + s);
+				memset(&image[(block - imageStart) * 16], 0, MIFARE_GetSectorBlockCount(firstSector + s) * 16);
+				if (sectorStatus) {
+					sectorStatus[s] = result;
+				}
+			}
+			break;
+		}
+	}
+	return first;
+} // End MIFARE_ReadSectors()
+
+/**
+ * Reads a whole MIFARE Classic Mini, 1K or 4K into a card image, see MIFARE_ReadSectors().
+ * The card type follows from uid->sak. All sectors are read with the same key.
+ * Remember to call PCD_StopCrypto1() afterwards.
+ * 
+ * @return STATUS_OK if every sector was read, STATUS_INVALID for other PICC types, STATUS_NO_ROOM if image or
+ * sectorStatus is too small, otherwise the status of the first sector that failed.
+ */
+MFRC522::StatusCode MFRC522::MIFARE_ReadCard(	byte command,				///< PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+												MIFARE_Key *key,			///< The key of all sectors.
+												Uid *uid,					///< The UID of the selected PICC.
+												byte *image,				///< Out: The card image, 16 bytes per block.
+												uint16_t *imageSize,		///< In: Size of image, at most 4096 bytes are used. Out: Number of bytes stored.
+												StatusCode *sectorStatus,	///< Out: The result of each sector. NULL if not needed.
+												byte *sectorCount,			///< In: Size of sectorStatus, at most 40 are used. Out: Number of sectors. NULL if sectorStatus is.
+												uint32_t *dumpTimeUs		///< Out: Time the dump took in microseconds. NULL if not needed.
+											) {
+	byte sectors = MIFARE_GetSectorCount(PICC_GetType(uid->sak));
+	if (sectors == 0) {
+		return STATUS_INVALID;
+	}
+	uint16_t size = (MIFARE_GetSectorFirstBlock(sectors - 1) + MIFARE_GetSectorBlockCount(sectors - 1)) * 16;
+	if (*imageSize < size || (sectorStatus && *sectorCount < sectors)) {
+		return STATUS_NO_ROOM;
+	}
+	
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	StatusCode result = MIFARE_ReadSectors(0, sectors, command, key, uid, image, sectorStatus);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	*imageSize = size;
+	if (sectorCount) {
+		*sectorCount = sectors;
+	}
+	if (dumpTimeUs) {
+		*dumpTimeUs = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	}
+	return result;
+} // End MIFARE_ReadCard()
+
+/**
+ * Brings a MIFARE Classic Mini, 1K or 4K to a target image, writing only the blocks that differ.
+ * 
+ * Sector by sector: one authentication, all blocks are read, the masked bytes of the target are merged into them and
+ * only the blocks that change are written and read back. The sector trailer is written last, after the data blocks of
+ * its sector were verified, so new keys or access bits never lock out a pending data block.
+ * The trailers are compared as MIFARE_ReadSectors() returns them, with the key used to authenticate in place of the
+ * unreadable key, so an image from MIFARE_ReadCard() writes back unchanged. A key that does not read back is not known:
+ * a trailer that changes is only written if the mask covers every byte of such a key, so no key is merged from zeros.
+ * Of a written trailer the access bits, byte 9 and a readable key B are verified. Block 0, the manufacturer block, is
+ * never written.
+ * A sector that fails is skipped and the PICC selected again for the next one, like MIFARE_ReadSectors().
+ * The PICC must be selected - ie in state ACTIVE - before calling this function.
+ * Remember to call PCD_StopCrypto1() afterwards.
+ * 
+ * @return STATUS_OK if every sector holds the target now, STATUS_INVALID for other PICC types or a short image,
+ * otherwise the status of the first sector that failed. A sector whose trailer needs an unknown key is STATUS_INVALID.
+ */
+MFRC522::StatusCode MFRC522::MIFARE_WriteCardImage(	byte command,				///< PICC_CMD_MF_AUTH_KEY_A or PICC_CMD_MF_AUTH_KEY_B
+													MIFARE_Key *key,			///< The key of all sectors.
+													Uid *uid,					///< The UID of the selected PICC.
+													const byte *target,			///< The card image to write, 16 bytes per block.
+													const byte *mask,			///< Bits of target to write, same size as target. NULL: all of them.
+													uint16_t imageSize,			///< Size of target and mask, at least the size of the card.
+													StatusCode *sectorStatus,	///< Out: The result of each sector. NULL if not needed.
+													byte *sectorCount,			///< In: Size of sectorStatus. Out: Number of sectors. NULL if sectorStatus is.
+													uint16_t *blocksWritten		///< Out: Number of blocks written. NULL if not needed.
+												) {
+	byte sectors = MIFARE_GetSectorCount(PICC_GetType(uid->sak));
+	if (sectors == 0 || imageSize < (MIFARE_GetSectorFirstBlock(sectors - 1) + MIFARE_GetSectorBlockCount(sectors - 1)) * 16) {
+		return STATUS_INVALID;
+	}
+	if (sectorStatus && *sectorCount < sectors) {
+		return STATUS_NO_ROOM;
+	}
+	if (sectorCount) {
+		*sectorCount = sectors;
+	}
+	if (blocksWritten) {
+		*blocksWritten = 0;
+	}
+	
+	StatusCode first = STATUS_OK;
+	byte current[16 * 16];				// The largest sector
+	byte buffer[18];
+	for (byte sector = 0; sector < sectors; sector++) {
+		byte block = MIFARE_GetSectorFirstBlock(sector);
+		byte blockCount = MIFARE_GetSectorBlockCount(sector);
+		byte trailer = blockCount - 1;
+		
+		bool verified = true;				// false if a block did not read back as written, or was not written
+		StatusCode result = MIFARE_ReadSectors(sector, 1, command, key, uid, current);
+		// The key used is known, key B also if key A may read it. The others read as zeros.
+		bool keyAKnown = command == PICC_CMD_MF_AUTH_KEY_A;
+		bool keyBKnown = !keyAKnown || MIFARE_IsKeyBReadable(&current[trailer * 16 + 6]);
+		if (result == STATUS_OK && mask) {
+			// A trailer that changes must not get a key merged from zeros. Checked before any block of the sector is written.
+			const byte *wanted = &target[(block + trailer) * 16];
+			const byte *bits = &mask[(block + trailer) * 16];
+			const byte *data = &current[trailer * 16];
+			bool changed = false;
+			bool keysGiven = true;
+			for (byte j = 0; j < 16; j++) {
+				changed = changed || ((data[j] & ~bits[j]) | (wanted[j] & bits[j])) != data[j];
+				bool known = (j < MF_KEY_SIZE && keyAKnown) || (j >= 6 && j < 10) || (j >= 10 && keyBKnown);
+				keysGiven = keysGiven && (known || bits[j] == 0xFF);
+			}
+			if (changed && !keysGiven) {
+				result = STATUS_INVALID;
+				verified = false;			// Nothing was sent, the PICC is still ACTIVE
+			}
+		}
+		for (byte i = (block == 0 ? 1 : 0); i < blockCount && result == STATUS_OK; i++) {
+			// Data blocks first, the trailer is the last block of the sector
+			const byte *wanted = &target[(block + i) * 16];
+			byte *data = &current[i * 16];
+			bool changed = false;
+			for (byte j = 0; j < 16; j++) {
+				byte bits = mask ? mask[(block + i) * 16 + j] : 0xFF;
+				byte merged = (data[j] & ~bits) | (wanted[j] & bits);
+				changed = changed || merged != data[j];
+				data[j] = merged;
+			}
+			if (!changed) {
+				continue;
+			}
+			result = MIFARE_Write(block + i, data, 16);
+			if (result != STATUS_OK) {
+				break;
+			}
+			if (blocksWritten) {
+				(*blocksWritten)++;
+			}
+			byte bufferSize = sizeof(buffer);
+			result = MIFARE_Read(block + i, buffer, &bufferSize);
+			if (result != STATUS_OK) {
+				break;
+			}
+			// Key A of a trailer never reads back, key B only if the old and the new access bits let key A read it
+			bool same;
+			if (i != trailer) {
+				same = memcmp(buffer, data, 16) == 0;
+			}
+			else {
+				same = memcmp(&buffer[6], &data[6], 4) == 0;
+				if (same && keyAKnown && keyBKnown && MIFARE_IsKeyBReadable(&data[6])) {
+					same = memcmp(&buffer[10], &data[10], MF_KEY_SIZE) == 0;
+				}
+			}
+			if (!same) {
+				result = STATUS_ERROR;		// The PICC did not take the data
+				verified = false;
+			}
+		}
+		if (sectorStatus) {
+			sectorStatus[sector] = result;
+		}
+		if (result == STATUS_OK) {
+			continue;
+		}
+		if (first == STATUS_OK) {
+			first = result;
+		}
+		if (!verified) {
+			continue;						// The PICC answered, it is still ACTIVE
+		}
+		PCD_StopCrypto1();
+		result = PICC_Reselect(uid);
+		if (result != STATUS_OK) {
+			// The PICC is gone
+			for (sector++; sector < sectors && sectorStatus; sector++) {
+				sectorStatus[sector] = result;
+			}
+			break;
+		}
+	}
+	return first;
+} // End MIFARE_WriteCardImage()
+
 
 /////////////////////////////////////////////////////////////////////////////////////
 // Support functions
@@ -1209,16 +2549,22 @@ MFRC522::StatusCode MFRC522::PCD_MIFARE_Transceive(	byte *sendData,		///< Pointe
 	
 	// Copy sendData[] to cmdBuffer[] and add CRC_A
 	memcpy(cmdBuffer, sendData, sendLen);
-	result = PCD_CalculateCRC(cmdBuffer, sendLen, &cmdBuffer[sendLen]);
-	if (result != STATUS_OK) { 
-		return result;
+	if (_autoCRC) {
+		PCD_SetFrameClass(FRAME_TX_CRC);	// The MFRC522 appends the CRC_A. The response is a 4 bit ACK/NAK without CRC_A.
+	}
+	else {
+		result = PCD_CalculateCRC(cmdBuffer, sendLen, &cmdBuffer[sendLen]);
+		if (result != STATUS_OK) { 
+			return result;
+		}
+		sendLen += 2;
 	}
-	sendLen += 2;
 	
 	// Transceive the data, store the reply in cmdBuffer[]
 	byte waitIRq = 0x30;		// RxIRq and IdleIRq
 	byte cmdBufferSize = sizeof(cmdBuffer);
 	byte validBits = 0;
+	PCD_SetTimeoutProfile(TIMEOUT_MEDIUM);
 	result = PCD_CommunicateWithPICC(PCD_Transceive, waitIRq, cmdBuffer, sendLen, cmdBuffer, &cmdBufferSize, &validBits);
 	if (acceptTimeout && result == STATUS_TIMEOUT) {
 		return STATUS_OK;
@@ -1329,20 +2675,15 @@ void MFRC522::PCD_DumpVersionToSerial() {
 /**
  * Returns true if a PICC responds to PICC_CMD_REQA.
  * Only "new" cards in state IDLE are invited. Sleeping cards in state HALT are ignored.
+ * The answer is kept in the class variable atqa.
  * 
  * @return bool
  */
 bool MFRC522::PICC_IsNewCardPresent() {
-	byte bufferATQA[2];
-	byte bufferSize = sizeof(bufferATQA);
-
-	// Reset baud rates
-	PCD_WriteRegister(TxModeReg, 0x00);
-	PCD_WriteRegister(RxModeReg, 0x00);
-	// Reset ModWidthReg
-	PCD_WriteRegister(ModWidthReg, 0x26);
+	byte bufferSize = sizeof(atqa);
 
-	MFRC522::StatusCode result = PICC_RequestA(bufferATQA, &bufferSize);
+	// PICC_RequestA() returns to 106 kbit/s if a PPS raised the bit rate
+	MFRC522::StatusCode result = PICC_RequestA(atqa, &bufferSize);
 	return (result == STATUS_OK || result == STATUS_COLLISION);
 } // End PICC_IsNewCardPresent()
 
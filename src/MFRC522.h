@@ -45,7 +45,7 @@
  * 		Example: To read from block 10, first authenticate using a key from sector 3 (blocks 8-11).
  * 		All keys are set to FFFFFFFFFFFFh at chip delivery.
  * 		Warning: Please read section 8.7 "Memory Access". It includes this text: if the PICC detects a format violation the whole sector is irreversibly blocked.
- *		To use a block in "value block" mode (for Increment/Decrement operations) you need to change the sector trailer. Use PICC_SetAccessBits() to calculate the bit patterns.
+ *		To use a block in "value block" mode (for Increment/Decrement operations) you need to change the sector trailer. Use MIFARE_SetAccessBits() to calculate the bit patterns.
  * MIFARE Classic 4K (MF1S703x):
  * 		Has (32 sectors * 4 blocks/sector + 8 sectors * 16 blocks/sector) * 16 bytes/block = 4096 bytes.
  * 		The blocks are numbered 0-255.
@@ -83,10 +83,21 @@
 #include <cstring>
 #include <wiringPi.h>
 #include <wiringPiSPI.h>
+#include "SPITransport.h"
+#include "IRQLine.h"
 
 #define byte uint8_t
 
-#define MFRC522_SPICLOCK SPI_CLOCK_DIV4			// MFRC522 accept upto 10MHz
+#define MFRC522_SPICLOCK		1000000		// Default SPI clock in Hz
+#define MFRC522_SPICLOCK_MAX	10000000	// MFRC522 accept upto 10MHz
+#define MFRC522_TIMEOUT_MARGIN_US	11000	// Host side slack on top of the RF timeout before the MFRC522 is considered unresponsive
+#define MFRC522_FIFO_WATERLEVEL		32		// PCD_TransceiveStream() refills the FIFO at <= 32 bytes and drains it at >= 32 bytes, about 2.5ms of air time either way
+#define MFRC522_INVENTORY_RETRIES	3		// Consecutive failed selections before PICC_Inventory() gives up on the PICCs still in the field
+
+// RF timeouts of the PCD_TimeoutProfile enums, in microseconds. The MFRC522 timer starts at the end of the transmission.
+#define MFRC522_TIMEOUT_SHORT_US	1000	// REQA, WUPA, anticollision, SELECT, HLTA. The PICC answers within about 100µs (ISO 14443-3 FDT), HLTA waits 1ms.
+#define MFRC522_TIMEOUT_MEDIUM_US	10000	// MIFARE Classic authentication, READ, WRITE and value operations, RATS
+#define MFRC522_TIMEOUT_DEFAULT_US	25000	// Everything else. The fixed timeout PCD_Init() used to program.
 
 // Firmware data for self-test
 // Reference values based on firmware version
@@ -282,7 +293,32 @@ public:
 	// MIFARE constants that does not fit anywhere else
 	enum MIFARE_Misc {
 		MF_ACK					= 0xA,		// The MIFARE Classic uses a 4 bit ACK/NAK. Any other value than 0xA is NAK.
-		MF_KEY_SIZE				= 6			// A Mifare Crypto1 key is 6 bytes.
+		MF_KEY_SIZE				= 6,		// A Mifare Crypto1 key is 6 bytes.
+		MF_MAX_SECTORS			= 40,		// Sectors of a MIFARE Classic 4K, the largest layout
+		MF_MAX_IMAGE_SIZE		= 4096		// Bytes of a MIFARE Classic 4K card image, see MIFARE_ReadCard()
+	};
+	
+	// How the CRC_A of a frame is handled in auto CRC mode, see PCD_SetAutoCRC().
+	enum PCD_FrameClass : byte {
+		FRAME_NO_CRC			,	// No CRC_A: REQA, WUPA, anticollision, MIFARE authentication.
+		FRAME_TX_CRC			,	// CRC_A on the request only: HLTA, MIFARE Classic WRITE and value steps (4 bit ACK/NAK response).
+		FRAME_TXRX_CRC				// CRC_A on request and response: SELECT, READ, RATS, PPS, ISO-DEP blocks.
+	};
+	
+	// Timer profiles, see PCD_SetTimeoutProfile().
+	enum PCD_TimeoutProfile : byte {
+		TIMEOUT_DEFAULT			,	// MFRC522_TIMEOUT_DEFAULT_US
+		TIMEOUT_SHORT			,	// MFRC522_TIMEOUT_SHORT_US
+		TIMEOUT_MEDIUM			,	// MFRC522_TIMEOUT_MEDIUM_US
+		TIMEOUT_FWT					// ISO-DEP frame waiting time, see PCD_SetFrameWaitingTime()
+	};
+	
+	// Bit rates of TxModeReg.TxSpeed and RxModeReg.RxSpeed, see PCD_SetBitRate(). Also the DSI and DRI of a PPS.
+	enum PCD_BitRate : byte {
+		BITRATE_106				= 0x00,	// 106 kbit/s, the rate of activation
+		BITRATE_212				= 0x01,
+		BITRATE_424				= 0x02,
+		BITRATE_848				= 0x03
 	};
 	
 	// PICC types we can detect. Remember to update PICC_GetTypeName() if you add more.
@@ -327,8 +363,31 @@ public:
 		byte		keyByte[MF_KEY_SIZE];
 	} MIFARE_Key;
 	
+	// A recorded sequence of register accesses that is sent to the MFRC522 as a single bus transaction by PCD_RunProgram().
+	// Record the fixed part of a sequence once, then Truncate() back to it and append the parts that change.
+	class RegisterProgram {
+	public:
+		RegisterProgram() : _count(0), _used(0) {};
+		void Clear() { _count = 0; _used = 0; };
+		void Truncate(byte count);
+		bool WriteRegister(PCD_Register reg, byte value);
+		bool WriteRegister(PCD_Register reg, byte count, const byte *values);
+		bool ReadRegister(PCD_Register reg, byte *value);
+		byte GetOpCount() const { return _count; };
+		
+	protected:
+		friend class MFRC522;
+		SPI_Transfer _ops[SPI_MAX_BATCH];
+		byte *_results[SPI_MAX_BATCH];	// Where to store the value of each register read, NULL for writes
+		byte _txData[160];				// Room for a full FIFO write plus the usual preamble
+		byte _rxData[160];
+		byte _count;
+		uint16_t _used;
+	};
+	
 	// Member variables
 	Uid uid;								// Used by PICC_ReadCardSerial().
+	byte atqa[2];							// Set by PICC_IsNewCardPresent(), the ATQA of the last PICC that answered
 	
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Functions for setting up the Arduino
@@ -336,7 +395,9 @@ public:
 	MFRC522();
 	DEPRECATED_MSG("use MFRC522(byte chipSelectPin, byte resetPowerDownPin)")
 	MFRC522(byte resetPowerDownPin);
-	MFRC522(byte chipSelectPin, byte resetPowerDownPin);
+	MFRC522(byte chipSelectPin, byte resetPowerDownPin, uint32_t spiClock = MFRC522_SPICLOCK);
+	MFRC522(SPITransport *transport, byte resetPowerDownPin);
+	virtual ~MFRC522();
 	
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Basic interface functions for communicating with the MFRC522
@@ -347,7 +408,26 @@ public:
 	void PCD_ReadRegister(PCD_Register reg, byte count, byte *values, byte rxAlign = 0);
 	void PCD_SetRegisterBitMask(PCD_Register reg, byte mask);
 	void PCD_ClearRegisterBitMask(PCD_Register reg, byte mask);
+	void PCD_BeginBatch();
+	void PCD_EndBatch();
+	void PCD_DeferWriteRegister(PCD_Register reg, byte value);
+	void PCD_DeferWriteRegister(PCD_Register reg, byte count, byte *values);
+	void PCD_RunProgram(RegisterProgram *program);
+	void PCD_InvalidateShadow();
+	static bool PCD_IsShadowed(PCD_Register reg);
 	StatusCode PCD_CalculateCRC(byte *data, byte length, byte *result);
+	StatusCode PCD_CalculateCRC_Coprocessor(byte *data, byte length, byte *result);
+	void PCD_SetHostCRC(bool enable);
+	static void CRC_A(const byte *data, size_t length, byte *result);
+	void PCD_SetAutoCRC(bool enable);
+	bool PCD_GetAutoCRC() const { return _autoCRC; };
+	void PCD_SetFrameClass(PCD_FrameClass frameClass);
+	void PCD_SetIRQLine(IRQLine *irq);
+	void PCD_SetTimeoutProfile(PCD_TimeoutProfile profile);
+	void PCD_SetFrameWaitingTime(byte fwi);
+	void PCD_SetBitRate(PCD_BitRate txRate, PCD_BitRate rxRate);
+	uint32_t PCD_GetTimeout() const { return _timeoutUs; };
+	uint32_t PCD_GetExchangeCount() const { return _exchanges; };
 	
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Functions for manipulating the MFRC522
@@ -357,6 +437,9 @@ public:
 	void PCD_Init(byte resetPowerDownPin);
 	void PCD_Init(byte chipSelectPin, byte resetPowerDownPin);
 	void PCD_Reset();
+	void PCD_SetSPIClockCalibration(uint32_t maxClock);
+	uint32_t PCD_CalibrateSPIClock(uint32_t maxClock = MFRC522_SPICLOCK_MAX);
+	bool PCD_TestSPIClock();
 	void PCD_AntennaOn();
 	void PCD_AntennaOff();
 	byte PCD_GetAntennaGain();
@@ -367,11 +450,14 @@ public:
 	/////////////////////////////////////////////////////////////////////////////////////
 	StatusCode PCD_TransceiveData(byte *sendData, byte sendLen, byte *backData, byte *backLen, byte *validBits = NULL, byte rxAlign = 0, bool checkCRC = false);
 	StatusCode PCD_CommunicateWithPICC(byte command, byte waitIRq, byte *sendData, byte sendLen, byte *backData = NULL, byte *backLen = NULL, byte *validBits = NULL, byte rxAlign = 0, bool checkCRC = false);
+	StatusCode PCD_TransceiveStream(byte *sendData, uint16_t sendLen, byte *backData, uint16_t *backLen, byte *validBits = NULL, bool checkCRC = false);
 	StatusCode PICC_RequestA(byte *bufferATQA, byte *bufferSize);
 	StatusCode PICC_WakeupA(byte *bufferATQA, byte *bufferSize);
 	StatusCode PICC_REQA_or_WUPA(byte command, byte *bufferATQA, byte *bufferSize);
 	virtual StatusCode PICC_Select(Uid *uid, byte validBits = 0);
 	StatusCode PICC_HaltA();
+	StatusCode PICC_Reselect(const Uid *uid);
+	StatusCode PICC_Inventory(Uid *uids, byte *uidCount);
 
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Functions for communicating with MIFARE PICCs
@@ -388,6 +474,17 @@ public:
 	StatusCode MIFARE_GetValue(byte blockAddr, int32_t *value);
 	StatusCode MIFARE_SetValue(byte blockAddr, int32_t value);
 	StatusCode PCD_NTAG216_AUTH(byte *passWord, byte pACK[]);
+	static byte MIFARE_GetSectorCount(PICC_Type piccType);
+	static byte MIFARE_GetSector(byte blockAddr);
+	static byte MIFARE_GetSectorFirstBlock(byte sector);
+	static byte MIFARE_GetSectorBlockCount(byte sector);
+	static void MIFARE_SetAccessBits(byte *accessBitBuffer, byte g0, byte g1, byte g2, byte g3);
+	static bool MIFARE_GetAccessBits(const byte *accessBitBuffer, byte *groups);
+	static bool MIFARE_IsKeyBReadable(const byte *accessBitBuffer);
+	static byte MIFARE_GetAccessGroup(byte blockAddr);
+	StatusCode MIFARE_ReadSectors(byte firstSector, byte sectorCount, byte command, MIFARE_Key *key, Uid *uid, byte *image, StatusCode *sectorStatus = NULL);
+	StatusCode MIFARE_ReadCard(byte command, MIFARE_Key *key, Uid *uid, byte *image, uint16_t *imageSize, StatusCode *sectorStatus, byte *sectorCount, uint32_t *dumpTimeUs = NULL);
+	StatusCode MIFARE_WriteCardImage(byte command, MIFARE_Key *key, Uid *uid, const byte *target, const byte *mask, uint16_t imageSize, StatusCode *sectorStatus, byte *sectorCount, uint16_t *blocksWritten = NULL);
 	
 	/////////////////////////////////////////////////////////////////////////////////////
 	// Support functions
@@ -410,10 +507,42 @@ public:
 	virtual bool PICC_ReadCardSerial();
 	
 protected:
-	int _fd;
+	SPITransport *_transport;	// Bus backend used for all register accesses
+	bool _ownsTransport;		// True if _transport was created by the constructor and must be deleted
+	bool _batching;				// True between PCD_BeginBatch() and PCD_EndBatch()
+	SPI_Transfer _batch[SPI_MAX_BATCH];	// Register writes queued for the next bus transaction
+	byte _batchData[160];		// Storage for the queued SPI frames. Room for a full FIFO write plus the usual preamble.
+	byte _batchCount;
+	uint16_t _batchUsed;
+	RegisterProgram _transceiveProgram;	// Preamble of PCD_CommunicateWithPICC()
+	RegisterProgram _pollProgram;		// Completion poll of PCD_CommunicateWithPICC()
+	RegisterProgram _crcProgram;		// Preamble of PCD_CalculateCRC()
+	RegisterProgram _crcResultProgram;	// Result fetch of PCD_CalculateCRC()
+	byte _pollResult[4];				// ComIrqReg, ErrorReg, FIFOLevelReg, ControlReg
+	byte _crcResult[2];					// CRCResultRegL, CRCResultRegH
+	byte _shadow[64];					// Write-through copy of the configuration registers, indexed by address, see PCD_IsShadowed()
+	uint64_t _shadowValid;				// One bit per register address: _shadow holds the current value
+	uint32_t _spiClockMax;				// Upper bound for the SPI clock calibration in PCD_Init(). 0 means no calibration.
+	bool _hostCRC;						// PCD_CalculateCRC() runs on the host instead of the CRC coprocessor
+	bool _autoCRC;						// The MFRC522 generates and checks CRC_A, see PCD_SetAutoCRC()
+	PCD_FrameClass _frameClass;			// CRC handling of the next frame in auto CRC mode
+	IRQLine *_irq;						// Completion source connected to the IRQ pin. NULL: poll over SPI.
+	PCD_TimeoutProfile _timeoutProfile;	// Timer profile of the next command
+	uint32_t _timeoutUs;				// RF timeout currently programmed into the timer
+	uint32_t _fwtUs;					// ISO-DEP frame waiting time of the selected PICC, used by TIMEOUT_FWT
+	uint32_t _exchanges;				// Commands run on the PICC, one per RF round trip, see PCD_GetExchangeCount()
 	byte _chipSelectPin;		// Arduino pin connected to MFRC522's SPI slave select input (Pin 24, NSS, active low)
 	byte _resetPowerDownPin;	// Arduino pin connected to MFRC522's reset and power down input (Pin 6, NRSTPD, active low)
 	StatusCode MIFARE_TwoStepHelper(byte command, byte blockAddr, int32_t data);
+	void PCD_FlushBatch();
+	void PCD_InitPrograms();
+	void PCD_ApplyFrameClass();
+	void PCD_ApplyTimeoutProfile();
+	void PCD_ProgramTimer(uint32_t timeoutUs);
+	void PCD_UpdateShadow(PCD_Register reg, byte value);
+	bool PCD_ShadowValid(PCD_Register reg) { return (_shadowValid >> (reg >> 1)) & 1; };
+	void PCD_QueueTransfer(byte *data, uint16_t len);
+	void PCD_ExecuteTransfer(byte *data, uint16_t len);
 };
 
 #endif
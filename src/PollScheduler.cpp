@@ -0,0 +1,119 @@
+/*
+* PollScheduler.cpp - Decides when to look for the next card.
+* NOTE: Please also check the comments in PollScheduler.h.
+* Released into the public domain.
+*/
+
+#include <algorithm>
+#include <time.h>
+#include "PollScheduler.h"
+
+/**
+ * Constructor.
+ */
+PollScheduler::PollScheduler(	uint32_t fastIntervalUs,	///< Poll interval right after a card came or went.
+								uint32_t slowIntervalUs,	///< Poll interval once the field is idle. Bounds the latency of the first tap.
+								uint32_t idleAfterUs,		///< Time without activity before the interval starts to grow.
+								uint8_t cpuBudget			///< Percent of one CPU polling may use, 1..100.
+							) {
+	_fastIntervalUs = fastIntervalUs;
+	_slowIntervalUs = std::max(slowIntervalUs, fastIntervalUs);
+	_idleAfterUs = idleAfterUs;
+	_cpuBudget = std::min(std::max(cpuBudget, (uint8_t)1), (uint8_t)100);
+	_intervalUs = _fastIntervalUs;
+	_lastActivity = Now();
+	_pollStart = _pollEnd = _previousPollEnd = _lastActivity;
+	_pollCpuStart = 0;
+	_pollCpuUs = 0;
+	_sampleCount = 0;
+} // End constructor
+
+/**
+ * Monotonic clock in microseconds.
+ */
+uint64_t PollScheduler::Now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} // End Now()
+
+/**
+ * CPU time used by the calling thread in microseconds. Time spent sleeping in the SPI or GPIO drivers does not count.
+ */
+uint64_t PollScheduler::ThreadCPUTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} // End ThreadCPUTime()
+
+/**
+ * Call right before looking for a card.
+ */
+void PollScheduler::PollStarted() {
+	_pollStart = Now();
+	_pollCpuStart = ThreadCPUTime();
+} // End PollStarted()
+
+/**
+ * Call right after looking for a card.
+ */
+void PollScheduler::PollFinished(	bool activity	///< A card is in the field, or one just left.
+								) {
+	uint32_t cpu = ThreadCPUTime() - _pollCpuStart;
+	// Moving average over about 8 polls, so a single slow anticollision does not throttle the next polls.
+	_pollCpuUs = _pollCpuUs ? (_pollCpuUs * 7 + cpu) / 8 : cpu;
+	_previousPollEnd = _pollEnd;
+	_pollEnd = Now();
+	if (activity) {
+		_lastActivity = _pollEnd;
+	}
+} // End PollFinished()
+
+/**
+ * Time to wait before the next poll.
+ * The fast interval applies while the field was active within idleAfterUs. After that the interval doubles with every
+ * poll until it reaches the slow interval. The CPU budget stretches the interval if a poll costs too much.
+ *
+ * @return The interval in microseconds, counted from the end of the last poll.
+ */
+uint32_t PollScheduler::NextInterval() {
+	if (_pollEnd - _lastActivity < _idleAfterUs) {
+		_intervalUs = _fastIntervalUs;
+	}
+	else if (_intervalUs < _slowIntervalUs) {
+		_intervalUs = std::min(_intervalUs * 2, _slowIntervalUs);
+	}
+	// cpu / (cpu + sleep) <= budget  =>  sleep >= cpu * (100 - budget) / budget
+	uint32_t minimum = (uint32_t)((uint64_t)_pollCpuUs * (100 - _cpuBudget) / _cpuBudget);
+	return std::max(_intervalUs, minimum);
+} // End NextInterval()
+
+/**
+ * Records the latency of one delivered event.
+ */
+void PollScheduler::RecordLatency(	uint64_t sinceUs	///< The earliest time the event can have happened, see GetEventBound().
+								) {
+	uint64_t now = Now();
+	_samples[_sampleCount % POLL_LATENCY_SAMPLES] = (now > sinceUs) ? (uint32_t)(now - sinceUs) : 0;
+	_sampleCount++;
+} // End RecordLatency()
+
+/**
+ * Latency percentile over the last POLL_LATENCY_SAMPLES events.
+ * The latency of an event is counted from the end of the poll before the one that saw it, to the delivery. That is
+ * the longest the event can have waited, so the figures are an upper bound.
+ *
+ * @return The latency in microseconds, 0 if nothing was recorded yet.
+ */
+uint32_t PollScheduler::GetLatency(	uint8_t percentile	///< 0..100, eg 50 for the median.
+								) {
+	uint32_t count = std::min(_sampleCount, (uint32_t)POLL_LATENCY_SAMPLES);
+	uint32_t sorted[POLL_LATENCY_SAMPLES];
+	if (count == 0) {
+		return 0;
+	}
+	std::copy(_samples, _samples + count, sorted);
+	uint32_t rank = (uint32_t)((uint64_t)(count - 1) * std::min(percentile, (uint8_t)100) / 100);
+	std::nth_element(sorted, sorted + rank, sorted + count);
+	return sorted[rank];
+} // End GetLatency()
@@ -0,0 +1,63 @@
+/**
+ * PollScheduler.h - Decides when to look for the next card.
+ *
+ * Polling the field at a fixed rate trades latency against CPU: slow polling makes taps wait, fast polling burns a core
+ * on small boards. PollScheduler polls at the fast interval while cards come and go, backs off towards the slow interval
+ * once the field has been idle for a while, and never lets polling use more than a share of one CPU.
+ * It also keeps the tap-to-callback latency of recent events, so the effect of the settings can be measured.
+ *
+ * Not thread safe, but split in two halves that share no state: the reader thread drives the polling side, while
+ * RecordLatency(), GetLatency() and GetSampleCount() belong to the thread that delivers the events. Neither needs a lock
+ * against the other, each half just must stay on its own thread.
+ *
+ * Released into the public domain.
+ */
+#ifndef POLLSCHEDULER_h
+#define POLLSCHEDULER_h
+
+#include <stdint.h>
+
+#define POLL_FAST_INTERVAL_US	5000		// Poll interval right after activity
+#define POLL_SLOW_INTERVAL_US	20000		// Poll interval once the field is idle
+#define POLL_IDLE_AFTER_US		2000000		// Time without activity before backing off
+#define POLL_CPU_BUDGET			10			// Percent of one CPU polling may use
+#define POLL_LATENCY_SAMPLES	256			// Number of recent events the latency percentiles are taken from
+
+class PollScheduler {
+public:
+	PollScheduler(	uint32_t fastIntervalUs = POLL_FAST_INTERVAL_US,
+					uint32_t slowIntervalUs = POLL_SLOW_INTERVAL_US,
+					uint32_t idleAfterUs = POLL_IDLE_AFTER_US,
+					uint8_t cpuBudget = POLL_CPU_BUDGET);
+
+	void PollStarted();
+	void PollFinished(bool activity);
+	uint32_t NextInterval();
+	uint64_t GetEventBound() const { return _previousPollEnd; };
+
+	void RecordLatency(uint64_t sinceUs);
+	uint32_t GetLatency(uint8_t percentile);
+	uint32_t GetSampleCount() const { return _sampleCount; };
+	uint32_t GetPollCost() const { return _pollCpuUs; };
+
+	static uint64_t Now();
+
+protected:
+	uint32_t _fastIntervalUs;
+	uint32_t _slowIntervalUs;
+	uint32_t _idleAfterUs;
+	uint8_t _cpuBudget;
+	uint32_t _intervalUs;			// Current interval, between fast and slow
+	uint64_t _lastActivity;			// Monotonic time of the last poll that saw activity
+	uint64_t _pollStart;
+	uint64_t _pollEnd;
+	uint64_t _previousPollEnd;		// End of the poll before the current one. Anything the current poll sees happened after it.
+	uint64_t _pollCpuStart;
+	uint32_t _pollCpuUs;			// Moving average of the CPU time of one poll
+	uint32_t _samples[POLL_LATENCY_SAMPLES];
+	uint32_t _sampleCount;			// Total number of samples recorded. The last POLL_LATENCY_SAMPLES are kept.
+
+	static uint64_t ThreadCPUTime();
+};
+
+#endif
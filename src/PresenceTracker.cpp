@@ -0,0 +1,130 @@
+/*
+* PresenceTracker.cpp - Follows one card from arrival to removal.
+* NOTE: Please also check the comments in PresenceTracker.h.
+* Released into the public domain.
+*/
+
+#include <time.h>
+#include "PresenceTracker.h"
+
+/**
+ * Constructor.
+ */
+PresenceTracker::PresenceTracker(	MFRC522 *reader,	///< The initialized reader.
+									byte removeAfter	///< Consecutive missed polls before EVENT_REMOVED, at least 1.
+								) {
+	_reader = reader;
+	_removeAfter = removeAfter ? removeAfter : 1;
+	Reset();
+} // End constructor
+
+/**
+ * Forgets the tracked card without reporting its removal.
+ */
+void PresenceTracker::Reset() {
+	_present = false;
+	_misses = 0;
+	_rewakePolls = 0;
+	_arrived = _lastSeen = 0;
+	_eventTime = 0;
+	_status = MFRC522::STATUS_OK;
+	memset(&_uid, 0, sizeof(_uid));
+	memset(_atqa, 0, sizeof(_atqa));
+} // End Reset()
+
+/**
+ * Monotonic clock in nanoseconds, the unit of GetEventTime().
+ */
+uint64_t PresenceTracker::Now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} // End Now()
+
+/**
+ * Looks at the field once.
+ * Without a tracked card: REQA, and on an answer the full anticollision. With a tracked card: WUPA, SELECT of the
+ * known UID, HLTA. The tracked card is left in HALT, so REQA in the next poll only sees other cards. For
+ * PRESENCE_REWAKE_POLLS polls after a removal, a REQA without answer is followed by WUPA and SELECT of the removed card,
+ * which finds it if it stayed in the field halted.
+ *
+ * @return What changed.
+ */
+PresenceTracker::Event PresenceTracker::Poll() {
+	if (_present) {
+		_status = CheckKnownCard();
+		_eventTime = Now();
+		if (_status == MFRC522::STATUS_OK) {
+			_misses = 0;
+			_lastSeen = millis();
+			return EVENT_NONE;
+		}
+		if (++_misses < _removeAfter) {
+			return EVENT_NONE;
+		}
+		_present = false;
+		_rewakePolls = PRESENCE_REWAKE_POLLS;
+		return EVENT_REMOVED;
+	}
+
+	if (_reader->PICC_IsNewCardPresent() && _reader->PICC_ReadCardSerial()) {
+		_uid = _reader->uid;
+		memcpy(_atqa, _reader->atqa, sizeof(_atqa));
+	}
+	else if (_rewakePolls > 0) {
+		// The removed card may be halted in the field, only WUPA reaches it. Its UID and ATQA are still known.
+		_rewakePolls--;
+		if (_reader->PICC_Reselect(&_uid) != MFRC522::STATUS_OK) {
+			return EVENT_NONE;
+		}
+		_reader->uid = _uid;
+	}
+	else {
+		return EVENT_NONE;
+	}
+	_eventTime = Now();
+	_status = MFRC522::STATUS_OK;
+	_rewakePolls = 0;
+	_present = true;
+	_misses = 0;
+	_arrived = _lastSeen = millis();
+	_reader->PICC_HaltA();
+	return EVENT_ARRIVED;
+} // End Poll()
+
+/**
+ * Time the card spent in the field: from the arrival to the last poll it answered.
+ * While the card is present, that is the time so far.
+ *
+ * @return The dwell time in milliseconds.
+ */
+uint32_t PresenceTracker::GetDwellTime() const {
+	return _lastSeen - _arrived;
+} // End GetDwellTime()
+
+/**
+ * Wakes and selects the tracked card by its UID and leaves it in state ACTIVE, eg to run commands on it.
+ * Halt it again with PICC_HaltA() when done, so the next Poll() finds it where it expects it.
+ *
+ * @return STATUS_OK if the tracked card answered, the failed step's status otherwise.
+ */
+MFRC522::StatusCode PresenceTracker::Activate() {
+	if (!_present) {
+		return MFRC522::STATUS_TIMEOUT;
+	}
+	return _reader->PICC_Reselect(&_uid);
+} // End Activate()
+
+/**
+ * Wakes and selects the tracked card by its UID, then halts it again.
+ *
+ * @return STATUS_OK if the tracked card answered, the failed step's status otherwise.
+ */
+MFRC522::StatusCode PresenceTracker::CheckKnownCard() {
+	MFRC522::StatusCode result = Activate();
+	if (result != MFRC522::STATUS_OK) {
+		return result;
+	}
+	_reader->PICC_HaltA();
+	return MFRC522::STATUS_OK;
+} // End CheckKnownCard()
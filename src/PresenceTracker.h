@@ -0,0 +1,60 @@
+/**
+ * PresenceTracker.h - Follows one card from arrival to removal.
+ *
+ * Finding a card takes REQA and a full anticollision. Checking that a known card is still there does not: once the UID
+ * is known, PresenceTracker halts the card and on each poll wakes it with WUPA, selects it directly with all UID bits
+ * supplied (no anticollision rounds), and halts it again. A card that does not answer is only reported as removed
+ * after a number of consecutive misses, so a short RF dropout does not produce a remove/arrive pair.
+ * A card reported as removed may still be in the field, halted by the last check that reached it, where REQA cannot see
+ * it. For a few polls after a removal the card is also woken with WUPA and selected by its UID, and reported as arrived
+ * again if it answers.
+ *
+ * Released into the public domain.
+ */
+#ifndef PRESENCETRACKER_h
+#define PRESENCETRACKER_h
+
+#include "MFRC522.h"
+
+#define PRESENCE_REMOVE_AFTER	3		// Consecutive missed polls before a card counts as removed
+#define PRESENCE_REWAKE_POLLS	5		// Polls after a removal that also look for the removed card with WUPA
+
+class PresenceTracker {
+public:
+	enum Event : byte {
+		EVENT_NONE		,	// Nothing changed
+		EVENT_ARRIVED	,	// A card was selected, see GetUid()
+		EVENT_REMOVED		// The tracked card left the field, see GetUid() and GetDwellTime()
+	};
+
+	PresenceTracker(MFRC522 *reader, byte removeAfter = PRESENCE_REMOVE_AFTER);
+
+	Event Poll();
+	void Reset();
+	MFRC522::StatusCode Activate();
+	bool IsPresent() const { return _present; };
+	const MFRC522::Uid &GetUid() const { return _uid; };
+	const byte *GetAtqa() const { return _atqa; };
+	uint32_t GetDwellTime() const;
+	uint64_t GetEventTime() const { return _eventTime; };
+	MFRC522::StatusCode GetStatus() const { return _status; };
+
+	static uint64_t Now();
+
+protected:
+	MFRC522 *_reader;
+	MFRC522::Uid _uid;			// The tracked card
+	byte _atqa[2];				// Its answer to the REQA
+	bool _present;
+	byte _removeAfter;
+	byte _misses;				// Consecutive polls the tracked card did not answer
+	byte _rewakePolls;			// Polls left that also look for the removed card, _uid, with WUPA
+	uint32_t _arrived;			// millis() of the arrival
+	uint32_t _lastSeen;			// millis() of the last poll the card answered
+	uint64_t _eventTime;		// Now() when the SELECT of the last poll completed
+	MFRC522::StatusCode _status;	// Result of that SELECT
+
+	MFRC522::StatusCode CheckKnownCard();
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*
+* SPITransport.cpp - Bus backends used by the MFRC522 register accessors.
+* NOTE: Please also check the comments in SPITransport.h.
+* Released into the public domain.
+*/
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <wiringPiSPI.h>
+#include "SPITransport.h"
+
+/////////////////////////////////////////////////////////////////////////////////////
+// wiringPi backend
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Constructor.
+ */
+WiringPiSPITransport::WiringPiSPITransport(	int channel,	///< The wiringPi SPI channel, 0 or 1.
+											uint32_t speed	///< SPI clock in Hz.
+										) {
+	_channel = channel;
+	_speed = speed;
+	_fd = wiringPiSPISetup(channel, speed);
+} // End constructor
+
+/**
+ * Executes the transfers one by one.
+ *
+ * @return false if one of the transfers failed or is longer than SPI_MAX_TRANSFER.
+ */
+bool WiringPiSPITransport::Transfer(	SPI_Transfer *transfers,	///< The transfers to execute.
+										uint8_t count				///< Number of transfers.
+									) {
+	for (uint8_t i = 0; i < count; i++) {
+		if (transfers[i].len > sizeof(_buffer)) {
+			return false;
+		}
+		memcpy(_buffer, transfers[i].tx, transfers[i].len);
+		_transactions++;
+		if (wiringPiSPIDataRW(_channel, _buffer, transfers[i].len) < 0) {
+			return false;
+		}
+		if (transfers[i].rx) {
+			memcpy(transfers[i].rx, _buffer, transfers[i].len);
+		}
+	}
+	return true;
+} // End Transfer()
+
+/**
+ * Changes the SPI clock. wiringPi only takes the speed at setup, so the channel is opened again.
+ *
+ * @return false if the channel could not be opened with the new speed.
+ */
+bool WiringPiSPITransport::SetSpeed(	uint32_t speed	///< SPI clock in Hz.
+									) {
+	if (_fd >= 0) {
+		close(_fd);
+	}
+	_speed = speed;
+	_fd = wiringPiSPISetup(_channel, speed);
+	return _fd >= 0;
+} // End SetSpeed()
+
+/////////////////////////////////////////////////////////////////////////////////////
+// spidev backend
+/////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Constructor.
+ * Opens the spidev node and configures SPI mode 0, 8 bits per word.
+ */
+SpidevTransport::SpidevTransport(	const char *device,	///< Path to the spidev node, eg "/dev/spidev0.0".
+									uint32_t speed		///< SPI clock in Hz.
+								) {
+	uint8_t mode = SPI_MODE_0;
+	uint8_t bits = 8;
+
+	_speed = speed;
+	_fd = open(device, O_RDWR);
+	if (_fd < 0) {
+		return;
+	}
+	if (ioctl(_fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+		ioctl(_fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+		ioctl(_fd, SPI_IOC_WR_MAX_SPEED_HZ, &_speed) < 0) {
+		close(_fd);
+		_fd = -1;
+	}
+} // End constructor
+
+/**
+ * Destructor.
+ */
+SpidevTransport::~SpidevTransport() {
+	if (_fd >= 0) {
+		close(_fd);
+	}
+} // End destructor
+
+/**
+ * Changes the SPI clock. The new speed is used for all following transfers.
+ *
+ * @return false if the driver rejected the speed.
+ */
+bool SpidevTransport::SetSpeed(	uint32_t speed	///< SPI clock in Hz.
+								) {
+	if (_fd >= 0 && ioctl(_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+		return false;
+	}
+	_speed = speed;
+	return true;
+} // End SetSpeed()
+
+/**
+ * Executes all transfers as a single SPI_IOC_MESSAGE.
+ * The chip select is released between transfers (cs_change) so the MFRC522 sees each one as a separate register access.
+ *
+ * @return false if the kernel rejected the message.
+ */
+bool SpidevTransport::Transfer(	SPI_Transfer *transfers,	///< The transfers to execute.
+								uint8_t count				///< Number of transfers, at most SPI_MAX_BATCH.
+							) {
+	struct spi_ioc_transfer message[SPI_MAX_BATCH];
+
+	if (count == 0) {
+		return true;
+	}
+	if (count > SPI_MAX_BATCH) {
+		return false;
+	}
+
+	memset(message, 0, sizeof(message[0]) * count);
+	for (uint8_t i = 0; i < count; i++) {
+		message[i].tx_buf			= (unsigned long)transfers[i].tx;
+		message[i].rx_buf			= (unsigned long)transfers[i].rx;
+		message[i].len				= transfers[i].len;
+		message[i].speed_hz			= _speed;
+		message[i].bits_per_word	= 8;
+		message[i].cs_change		= (i + 1 < count) ? 1 : 0;	// Deselect between register accesses, not after the last one.
+	}
+
+	_transactions++;
+	return SubmitMessage(message, count) >= 0;
+} // End Transfer()
+
+/**
+ * Sends a prepared message to the spidev driver.
+ *
+ * @return The ioctl result, negative on error.
+ */
+int SpidevTransport::SubmitMessage(	struct spi_ioc_transfer *transfers,	///< The prepared message.
+									uint8_t count						///< Number of transfers in the message.
+								) {
+	return ioctl(_fd, SPI_IOC_MESSAGE(count), transfers);
+} // End SubmitMessage()
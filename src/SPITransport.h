@@ -0,0 +1,86 @@
+/**
+ * SPITransport.h - Bus backends used by the MFRC522 register accessors.
+ *
+ * The MFRC522 does not care how its SPI frames reach it, only that every register access is framed
+ * by its own chip select (datasheet section 8.1.2). SPITransport hides the host side of that:
+ *  - WiringPiSPITransport keeps the original behaviour; one wiringPiSPIDataRW() call per register access.
+ *  - SpidevTransport talks to /dev/spidevX.Y directly and sends a whole sequence of register accesses
+ *    with a single SPI_IOC_MESSAGE(n) ioctl, toggling chip select between them.
+ *
+ * Released into the public domain.
+ */
+#ifndef SPITRANSPORT_h
+#define SPITRANSPORT_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Maximum number of chip-select framed transfers in one batch.
+#define SPI_MAX_BATCH 32
+// Maximum length of one transfer: an address byte and up to 255 data bytes, the most a register access carries.
+#define SPI_MAX_TRANSFER 256
+
+// A single chip-select framed transfer. The bus is full duplex: len bytes are sent from tx while len bytes are received into rx.
+// rx may be NULL if the received bytes are not needed, or equal to tx to exchange the data in place.
+typedef struct {
+	const uint8_t	*tx;
+	uint8_t			*rx;
+	uint16_t		len;
+} SPI_Transfer;
+
+class SPITransport {
+public:
+	SPITransport() : _transactions(0), _speed(0) {};
+	virtual ~SPITransport() {};
+
+	// Executes count transfers in order. Returns false if the bus reported an error.
+	virtual bool Transfer(SPI_Transfer *transfers, uint8_t count) = 0;
+	
+	// Changes the SPI clock. Returns false if the backend could not apply it.
+	virtual bool SetSpeed(uint32_t speed) = 0;
+	uint32_t GetSpeed() const { return _speed; };
+
+	// Number of bus transactions (syscalls) issued so far. Used to measure the cost of the register protocol.
+	uint32_t GetTransactionCount() const { return _transactions; };
+	void ResetTransactionCount() { _transactions = 0; };
+
+protected:
+	uint32_t _transactions;
+	uint32_t _speed;		// SPI clock in Hz
+};
+
+/**
+ * The original wiringPi backend. Every transfer is a separate ioctl.
+ */
+class WiringPiSPITransport : public SPITransport {
+public:
+	WiringPiSPITransport(int channel = 0, uint32_t speed = 1000000);
+	virtual bool Transfer(SPI_Transfer *transfers, uint8_t count);
+	virtual bool SetSpeed(uint32_t speed);
+
+protected:
+	int _channel;
+	int _fd;
+	uint8_t _buffer[SPI_MAX_TRANSFER];	// wiringPi exchanges the data in place, tx stays untouched
+};
+
+struct spi_ioc_transfer;
+
+/**
+ * Native Linux spidev backend. A batch of transfers is sent as one SPI_IOC_MESSAGE(n) ioctl.
+ */
+class SpidevTransport : public SPITransport {
+public:
+	SpidevTransport(const char *device = "/dev/spidev0.0", uint32_t speed = 1000000);
+	virtual ~SpidevTransport();
+	virtual bool Transfer(SPI_Transfer *transfers, uint8_t count);
+	virtual bool SetSpeed(uint32_t speed);
+	bool IsOpen() const { return _fd >= 0; };
+
+protected:
+	int _fd;
+	// Hands a prepared message to the kernel. Override to run against an in-process fake SPI device.
+	virtual int SubmitMessage(struct spi_ioc_transfer *transfers, uint8_t count);
+};
+
+#endif
@@ -0,0 +1,85 @@
+/*
+* TapRing.cpp - Hands tap records from the reader thread to a consumer without locks.
+* NOTE: Please also check the comments in TapRing.h.
+* Released into the public domain.
+*/
+
+#include "TapRing.h"
+
+/**
+ * Constructor.
+ */
+TapRing::TapRing(	uint32_t capacity,		///< Number of records the ring holds, rounded up to a power of two. At least 2.
+					Overflow overflow		///< What to lose when the ring is full.
+				) : _head(0), _tail(0), _dropped(0) {
+	uint32_t size = 2;
+	while (size < capacity && size < 0x80000000u) {
+		size <<= 1;
+	}
+	_slots = new TapRecord[size];
+	_mask = size - 1;
+	_overflow = overflow;
+} // End constructor
+
+/**
+ * Destructor.
+ */
+TapRing::~TapRing() {
+	delete[] _slots;
+} // End destructor
+
+/**
+ * Appends a record. Producer thread only, never blocks.
+ *
+ * @return false if the ring was full and the record was dropped (OVERFLOW_DROP_NEWEST).
+ */
+bool TapRing::Push(const TapRecord &record) {
+	uint32_t head = _head.load(std::memory_order_relaxed);
+	uint32_t tail = _tail.load(std::memory_order_acquire);
+
+	if (head - tail > _mask) {		// Full
+		if (_overflow == OVERFLOW_DROP_NEWEST) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		// Take the oldest record away from the consumer. If the consumer moved the tail in the meantime, it made room
+		// itself and nothing is lost.
+		if (_tail.compare_exchange_strong(tail, tail + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	_slots[head & _mask] = record;
+	_head.store(head + 1, std::memory_order_release);
+	return true;
+} // End Push()
+
+/**
+ * Takes up to maxRecords of the oldest records out of the ring. Consumer thread only, never blocks.
+ *
+ * The records are copied first and then claimed by moving the tail. If the producer dropped the oldest record while
+ * they were copied, its slot may have been overwritten mid-copy; the tail moved, the claim fails and the copy is redone.
+ *
+ * @return The number of records stored in records[], 0 if the ring is empty.
+ */
+uint32_t TapRing::Pop(	TapRecord *records,		///< Out: Array for the records, oldest first
+						uint32_t maxRecords		///< Size of records[]
+					) {
+	uint32_t tail = _tail.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t head = _head.load(std::memory_order_acquire);
+		uint32_t count = head - tail;
+		if (count > maxRecords) {
+			count = maxRecords;
+		}
+		if (count > _mask + 1) {	// tail is stale, the claim below fails anyway
+			count = _mask + 1;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			records[i] = _slots[(tail + i) & _mask];
+		}
+		if (_tail.compare_exchange_weak(tail, tail + count, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return count;
+		}
+		// tail now holds the current value, try again
+	}
+} // End Pop()
@@ -0,0 +1,68 @@
+/**
+ * TapRing.h - Hands tap records from the reader thread to a consumer without locks.
+ *
+ * The reader thread must keep its RF timing no matter how long the consumer takes to handle an event. TapRing is a
+ * fixed-capacity single-producer/single-consumer ring of plain TapRecord structs: the reader thread pushes one record
+ * per event, the consumer drains them in batches whenever it gets to it. Neither side ever waits for the other.
+ * When the consumer falls behind and the ring is full, the overflow policy decides which record is lost, either the
+ * oldest one in the ring or the new one; every lost record is counted.
+ *
+ * Exactly one thread may call Push() and exactly one thread may call Pop().
+ *
+ * Released into the public domain.
+ */
+#ifndef TAPRING_h
+#define TAPRING_h
+
+#include <stdint.h>
+#include <atomic>
+
+#define TAPRING_CAPACITY	64		// Default number of records, rounded up to a power of two
+
+// One event of the reader thread. Plain data, so it can be copied around freely.
+struct TapRecord {
+	uint64_t timestamp;			// Monotonic clock in ns, taken when the SELECT that decided the event completed
+	uint64_t since;				// Earliest time the event can have happened, PollScheduler::Now() units, for the latency statistics
+	uint32_t dwell;				// ms the card stayed in the field, removals only
+	uint32_t readerId;			// Which reader saw the card, the readerId option of start()
+	uint8_t event;				// PresenceTracker::Event
+	uint8_t status;				// MFRC522::StatusCode of that SELECT, STATUS_OK for arrivals
+	uint8_t uidSize;			// Number of bytes in uidByte. 4, 7 or 10.
+	uint8_t uidByte[10];
+	uint8_t sak;
+	uint8_t atqa[2];
+};
+
+class TapRing {
+public:
+	enum Overflow : uint8_t {
+		OVERFLOW_DROP_OLDEST	,	// A full ring discards its oldest record to make room, the consumer sees the latest events
+		OVERFLOW_DROP_NEWEST		// A full ring rejects the new record, the consumer sees the first events
+	};
+
+	TapRing(uint32_t capacity = TAPRING_CAPACITY, Overflow overflow = OVERFLOW_DROP_OLDEST);
+	~TapRing();
+
+	// Producer side
+	bool Push(const TapRecord &record);
+
+	// Consumer side
+	uint32_t Pop(TapRecord *records, uint32_t maxRecords);
+
+	uint32_t GetCapacity() const { return _mask + 1; };
+	uint32_t GetDropped() const { return _dropped.load(std::memory_order_relaxed); };
+
+protected:
+	TapRecord *_slots;
+	uint32_t _mask;					// Capacity - 1, the capacity is a power of two
+	Overflow _overflow;
+	std::atomic<uint32_t> _head;	// Next slot the producer writes. Only the producer moves it.
+	std::atomic<uint32_t> _tail;	// Next slot the consumer reads. The consumer moves it, so does the producer when it drops the oldest record.
+	std::atomic<uint32_t> _dropped;	// Records lost to overflow
+
+private:
+	TapRing(const TapRing &);
+	TapRing &operator=(const TapRing &);
+};
+
+#endif
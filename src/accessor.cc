@@ -1,97 +1,1044 @@
 #include <node.h>
+#include <node_buffer.h>
 #include <v8.h>
+#include <uv.h>
 #include <unistd.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <iostream>
+#include <string>
+#include <string.h>
 #include <errno.h>
 #include <wiringPiSPI.h>
 #include <unistd.h>
-//#include "Desfire.h"
-#include "MFRC522.h"
+#include "Desfire.h"
+#include "CardOperation.h"
+#include "PollScheduler.h"
+#include "PresenceTracker.h"
+#include "TapRing.h"
 
 
-uint8_t initRfidReader(void);
-char uid[23];
-char last_uid[23];
-char *p;
+uint8_t initRfidReader(bool calibrate, int irqPin);
+void releaseRfidReader();
 
 using namespace v8;
 using namespace std;
 
 #define RST_PIN         6          // Configurable, see typical pin layout above
 #define SS_PIN          10         // Configurable, see typical pin layout above
+#define SPI_DEVICE      "/dev/spidev0.0"
 
-MFRC522 mfrc522(SS_PIN, RST_PIN);  // Create MFRC522 instance
+SpidevTransport *spi = NULL;	// Native spidev backend, batches register accesses into one ioctl. Opened by start().
+DESFire *mfrc522 = NULL;		// Created by the reader thread, once the options are known
+GpioChardevIRQLine *irq = NULL;	// IRQ pin of the MFRC522, if one is wired up
 
+// The reader runs on its own thread and hands the UIDs to the main thread through an uv_async_t.
+struct ReaderOptions {
+    uint32_t spiClock;
+    bool calibrate;
+    int irqPin;
+    uint32_t fastInterval;	// ms
+    uint32_t slowInterval;	// ms
+    uint32_t idleTimeout;	// ms
+    uint32_t cpuBudget;		// percent
+    uint32_t readerId;
+    uint32_t queueSize;		// records
+    TapRing::Overflow overflow;
+    bool binary;			// Deliver TapRecords in a Buffer instead of strings and objects
+    vector<KeyRing::Key> keys;	// Candidates of authenticate operations without a key
+    MFRC522::PCD_BitRate maxBitRate;	// Highest ISO/IEC 14443-4 bit rate of DESFire operations
+};
 
-void RunCallback(const FunctionCallbackInfo<Value>& args) {
+#define TAP_BATCH	16			// Records DeliverTaps() takes out of the ring at a time
+
+// Card operations submitted together. They run back to back in one session on the tracked card.
+struct OperationBatch {
+    vector<CardOperation> ops;
+    size_t executed;					// Operations run. All of them, or up to and including the one that failed.
+    MFRC522::StatusCode sessionStatus;	// Waking the card, STATUS_OK if the batch ran
+    bool stopped;						// The reader stopped before the batch ran
+    Persistent<Function> callback;
+};
+
+uv_thread_t readerThread;
+uv_async_t readerAsync;			// Initialised once in Init(), referenced only while the reader runs
+uv_mutex_t readerLock;			// Guards readerRunning, the poll side of readerScheduler and the operation lists
+uv_cond_t readerWakeup;			// Signalled by StopReader() to end the poll interval early
+TapRing *readerRing = NULL;		// Events waiting for delivery on the main thread. The reader thread never waits for it.
+PollScheduler *readerScheduler = NULL;
+uint32_t keyHits = 0;			// KeyRing counters of the reader thread, copied under readerLock
+uint32_t keyMisses = 0;
+uint32_t directoryHits = 0;		// DesfireDirectory counters of the reader thread, copied under readerLock
+uint32_t directoryMisses = 0;
+uint32_t savedFrames = 0;
+bool readerRunning = false;
+bool readerStarted = false;		// The thread and the callback exist, the async handles are referenced
+ReaderOptions readerOptions;
+Persistent<Function> readerCallback;
+Persistent<Object> readerSlab;		// Buffer of TAP_BATCH TapRecords, reused for every batch in binary mode
+uv_async_t operationAsync;
+vector<OperationBatch *> operationsPending;	// Submitted, waiting for the reader thread
+vector<OperationBatch *> operationsDone;	// Run, waiting for delivery on the main thread
+
+// JS names of the CardOperation types
+const char *operationNames[CardOperation::OP_COUNT] = {
+    "authenticate", "read", "write", "ultralightWrite", "increment", "decrement", "restore", "transfer",
+    "getValue", "setValue", "ntag216Auth", "readCard", "writeCard", "plan",
+    "desfireGetVersion", "desfireGetApplicationIds", "desfireSelectApplication", "desfireGetKeySettings",
+    "desfireGetKeyVersion", "desfireGetFileIds", "desfireGetFileSettings", "desfireReadData", "desfireGetValue",
+    "desfireAuthenticate"
+};
+
+// The block operations of a plan, in AccessPlanner::Operation order
+const char *stepNames[] = { "read", "write", "increment", "decrement", "restore", "transfer" };
+
+
+/**
+ * Formats a UID like the callback expects it, in hex.
+ */
+string FormatUid(const TapRecord &record) {
+    static const char digits[] = "0123456789ABCDEF";
+    char hex[2 * sizeof(record.uidByte) + 1];
+    char *p = hex;
+    for (byte i = 0; i < record.uidSize && i < sizeof(record.uidByte); i++) {
+        *p++ = digits[record.uidByte[i] >> 4];
+        *p++ = digits[record.uidByte[i] & 0x0F];
+    }
+    *p = 0;
+    return hex;
+}
+
+/**
+ * Packs what the tracker knows about its last event into a ring record.
+ */
+void FillTapRecord(TapRecord *record, const PresenceTracker &tracker, PresenceTracker::Event type, uint64_t since) {
+    const MFRC522::Uid &uid = tracker.GetUid();
+    record->timestamp = tracker.GetEventTime();
+    record->since = since;
+    record->dwell = type == PresenceTracker::EVENT_REMOVED ? tracker.GetDwellTime() : 0;
+    record->event = type;
+    record->status = tracker.GetStatus();
+    record->readerId = readerOptions.readerId;
+    record->uidSize = uid.size;
+    memcpy(record->uidByte, uid.uidByte, sizeof(record->uidByte));
+    record->sak = uid.sak;
+    memcpy(record->atqa, tracker.GetAtqa(), sizeof(record->atqa));
+}
+
+/**
+ * Runs submitted batches on the tracked card, each in a session of its own. Reader thread only.
+ */
+void RunOperations(vector<OperationBatch *> &batches, CardSession *session) {
+    for (size_t i = 0; i < batches.size(); i++) {
+        OperationBatch *batch = batches[i];
+        batch->executed = 0;
+        batch->sessionStatus = session->Begin();
+        if (batch->sessionStatus != MFRC522::STATUS_OK) {
+            continue;
+        }
+        while (batch->executed < batch->ops.size()) {
+            if (!session->Run(&batch->ops[batch->executed++])) {
+                break;
+            }
+        }
+        session->End();
+    }
+}
+
+/**
+ * Body of the reader thread. Never touches V8, the events are queued for DeliverTaps(), finished operations for
+ * DeliverOperations().
+ */
+void ReaderMain(void * /*arg*/) {
+    if (initRfidReader(readerOptions.calibrate, readerOptions.irqPin) != 0) {
+        releaseRfidReader();
+        return;
+    }
+    PresenceTracker tracker(mfrc522);	// Cheap WUPA + SELECT while a card stays, anticollision only for new ones
+    KeyRing keyRing(mfrc522);
+    for (size_t i = 0; i < readerOptions.keys.size(); i++) {
+        keyRing.AddKey(readerOptions.keys[i]);
+    }
+    DesfireDirectory directory(mfrc522);	// Structures of the DESFire cards seen, repeat taps skip their discovery
+    CardSession session(mfrc522, &tracker, &keyRing, &directory);
+    session.SetMaxBitRate(readerOptions.maxBitRate);
+
+    uv_mutex_lock(&readerLock);
+    while (readerRunning) {
+        uv_mutex_unlock(&readerLock);
+        readerScheduler->PollStarted();
+        PresenceTracker::Event type = tracker.Poll();
+        uv_mutex_lock(&readerLock);
+        readerScheduler->PollFinished(type != PresenceTracker::EVENT_NONE || tracker.IsPresent());
+        uv_mutex_unlock(&readerLock);
+
+        // The ring needs no lock, so the delivery on the main thread never holds up the RF timing
+        if (type != PresenceTracker::EVENT_NONE) {
+            TapRecord record;
+            FillTapRecord(&record, tracker, type, readerScheduler->GetEventBound());
+            readerRing->Push(record);
+            uv_async_send(&readerAsync);
+        }
+        uv_mutex_lock(&readerLock);
+
+        // Operations go between two polls, so they never overlap with the presence check.
+        if (!operationsPending.empty()) {
+            vector<OperationBatch *> batches;
+            batches.swap(operationsPending);
+            uv_mutex_unlock(&readerLock);
+            RunOperations(batches, &session);
+            uv_mutex_lock(&readerLock);
+            keyHits = keyRing.GetHits();
+            keyMisses = keyRing.GetMisses();
+            directoryHits = directory.GetHits();
+            directoryMisses = directory.GetMisses();
+            savedFrames = directory.GetSavedFrames();
+            operationsDone.insert(operationsDone.end(), batches.begin(), batches.end());
+            uv_async_send(&operationAsync);
+        }
+
+        if (readerRunning && operationsPending.empty()) {
+            uv_cond_timedwait(&readerWakeup, &readerLock, (uint64_t)readerScheduler->NextInterval() * 1000);
+        }
+    }
+    uv_mutex_unlock(&readerLock);
+
+    releaseRfidReader();
+}
+
+/**
+ * DeliverTaps() in binary mode: the ring is drained straight into the slab, and the callback gets (slab, count) once
+ * per batch. No strings are made, JS reads the records through the layout exported as tapLayout.
+ */
+void DeliverTapSlab(uv_async_t *handle) {
     Isolate* isolate = Isolate::GetCurrent();
     HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Function> callback = Local<Function>::New(isolate, readerCallback);
+    Local<Object> slab = Local<Object>::New(isolate, readerSlab);
+    TapRecord *taps = (TapRecord *)node::Buffer::Data(slab);
+    uint64_t since[TAP_BATCH];
+    uint32_t count;
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
-    const unsigned argc = 1;
-
-    for (;;) {
-    	usleep(500000);
-    	p = uid;
-		// Look for new cards, and select one if present
-		if ( ! mfrc522.PICC_IsNewCardPresent()){
-			//printf(">>>>>>>>>>>>>>nocard\n");
-			sprintf(uid, "nocard");
-		}else{
-
-			if (! mfrc522.PICC_ReadCardSerial()) {
-	//			printf(">>>>>>>>>>>>>>read error %d\n",c);
-				sprintf(uid, "nocard");
-			}else{
-				// Dump UID
-				for (byte i = 0; i < mfrc522.uid.size; i++) {
-					sprintf(p, "%02X", mfrc522.uid.uidByte[i]);
-					p += 2;
-				}			
-			}
-		
-		}
+    while ((count = readerRing->Pop(taps, TAP_BATCH)) > 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            since[i] = taps[i].since;	// The callback may scribble over the slab
+        }
+        Local<Value> argv[2] = { slab, Integer::NewFromUnsigned(isolate, count) };
+        bool threw = callback->Call(context, context->Global(), 2, argv).IsEmpty();
+        for (uint32_t i = 0; i < count; i++) {
+            readerScheduler->RecordLatency(since[i]);	// Main thread state, no lock needed
+        }
+        if (threw) {
+            uv_async_send(handle);	// Deliver the rest on the next loop iteration
+            return;	// The callback threw, leave the exception to node
+        }
+    }
+}
 
+/**
+ * Runs on the main thread whenever the reader thread queued events. Several sends may be coalesced into one call.
+ * The callback gets (type, uid, dwell, info) with type "arrive" or "remove", see Start().
+ * The ring is drained in batches; a slow callback only delays the delivery, never the polling.
+ */
+void DeliverTaps(uv_async_t *handle) {
+    if (!readerStarted) {
+        return;		// A send from before stop(), the callback is gone
+    }
+    if (readerOptions.binary) {
+        DeliverTapSlab(handle);
+        return;
+    }
 
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Function> callback = Local<Function>::New(isolate, readerCallback);
+    TapRecord taps[TAP_BATCH];
+    uint32_t count;
 
-		//printf("uid:%s  last_uid:%s %d\n", uid, last_uid, strcmp(last_uid, uid));
-		
-		mfrc522.PICC_IsNewCardPresent();    
-    
-    
-        // Only when the serial number of the currently detected tag differs from the
-        // recently detected tag the callback will be executed with the serial number
-        
-        
-        if (strcmp(last_uid, uid) != 0) {
-            Local<Value> argv[argc] = {
-                String::NewFromUtf8(isolate, &uid[0])
+    while ((count = readerRing->Pop(taps, TAP_BATCH)) > 0) {
+        for (uint32_t i = 0; i < count; i++) {
+            bool removed = (taps[i].event == PresenceTracker::EVENT_REMOVED);
+            Local<Object> info = Object::New(isolate);
+            Local<Array> atqa = Array::New(isolate, 2);
+            atqa->Set(context, 0, Integer::NewFromUnsigned(isolate, taps[i].atqa[0])).Check();
+            atqa->Set(context, 1, Integer::NewFromUnsigned(isolate, taps[i].atqa[1])).Check();
+            info->Set(context, String::NewFromUtf8(isolate, "sak", NewStringType::kNormal).ToLocalChecked(), Integer::NewFromUnsigned(isolate, taps[i].sak)).Check();
+            info->Set(context, String::NewFromUtf8(isolate, "atqa", NewStringType::kNormal).ToLocalChecked(), atqa).Check();
+            info->Set(context, String::NewFromUtf8(isolate, "readerId", NewStringType::kNormal).ToLocalChecked(), Integer::NewFromUnsigned(isolate, taps[i].readerId)).Check();
+            info->Set(context, String::NewFromUtf8(isolate, "status", NewStringType::kNormal).ToLocalChecked(), Integer::NewFromUnsigned(isolate, taps[i].status)).Check();
+            info->Set(context, String::NewFromUtf8(isolate, "timestamp", NewStringType::kNormal).ToLocalChecked(), BigInt::NewFromUnsigned(isolate, taps[i].timestamp)).Check();
+            Local<Value> argv[4] = {
+                String::NewFromUtf8(isolate, removed ? "remove" : "arrive", NewStringType::kNormal).ToLocalChecked(),
+                String::NewFromUtf8(isolate, FormatUid(taps[i]).c_str(), NewStringType::kNormal).ToLocalChecked(),
+                Number::New(isolate, taps[i].dwell),
+                info
             };
+            bool threw = callback->Call(context, context->Global(), 4, argv).IsEmpty();
+            readerScheduler->RecordLatency(taps[i].since);	// Main thread state, no lock needed
+            if (threw) {
+                uv_async_send(handle);	// Deliver the rest on the next loop iteration
+                return;	// The callback threw, leave the exception to node
+            }
+        }
+    }
+}
+
+/**
+ * Short, stable name of a StatusCode for JS, eg "TIMEOUT" for STATUS_TIMEOUT.
+ */
+const char *StatusCodeKey(MFRC522::StatusCode code) {
+    switch (code) {
+        case MFRC522::STATUS_OK:				return "OK";
+        case MFRC522::STATUS_ERROR:				return "ERROR";
+        case MFRC522::STATUS_COLLISION:			return "COLLISION";
+        case MFRC522::STATUS_TIMEOUT:			return "TIMEOUT";
+        case MFRC522::STATUS_NO_ROOM:			return "NO_ROOM";
+        case MFRC522::STATUS_INTERNAL_ERROR:	return "INTERNAL_ERROR";
+        case MFRC522::STATUS_INVALID:			return "INVALID";
+        case MFRC522::STATUS_CRC_WRONG:			return "CRC_WRONG";
+        case MFRC522::STATUS_MIFARE_NACK:		return "MIFARE_NACK";
+        default:								return "UNKNOWN";
+    }
+}
+
+void SetField(Isolate *isolate, Local<Object> object, const char *name, Local<Value> value) {
+    object->Set(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, name, NewStringType::kNormal).ToLocalChecked(), value).Check();
+}
+
+Local<Value> NewBuffer(Isolate *isolate, const vector<byte> &data) {
+    return node::Buffer::Copy(isolate, data.empty() ? "" : (const char *)&data[0], data.size()).ToLocalChecked();
+}
+
+/**
+ * Converts the outcome of one operation: { status, code, message, [desfireStatus, desfireMessage], <results> }.
+ * The results depend on the operation: data (Buffer), value (number), version or fileSettings (objects).
+ * A failed desfireReadData still has the data it read.
+ */
+Local<Object> OperationResult(Isolate *isolate, const CardOperation &op) {
+    Local<Object> result = Object::New(isolate);
+    SetField(isolate, result, "op", String::NewFromUtf8(isolate, operationNames[op.type], NewStringType::kNormal).ToLocalChecked());
+    SetField(isolate, result, "status", Integer::NewFromUnsigned(isolate, op.status));
+    SetField(isolate, result, "code", String::NewFromUtf8(isolate, StatusCodeKey(op.status), NewStringType::kNormal).ToLocalChecked());
+    SetField(isolate, result, "message", String::NewFromUtf8(isolate, MFRC522::GetStatusCodeName(op.status), NewStringType::kNormal).ToLocalChecked());
+    if (op.IsDesfire()) {
+        SetField(isolate, result, "desfireStatus", Integer::NewFromUnsigned(isolate, op.desfireStatus));
+        SetField(isolate, result, "desfireMessage", String::NewFromUtf8(isolate, DESFire::GetDesfireStatusCodeName(op.desfireStatus), NewStringType::kNormal).ToLocalChecked());
+    }
+    if (!op.Succeeded()) {
+        if (op.type == CardOperation::OP_DESFIRE_READ_DATA) {
+            SetField(isolate, result, "data", NewBuffer(isolate, op.data));    // What was read, offset + length resumes
+        }
+        return result;
+    }
+
+    switch (op.type) {
+        case CardOperation::OP_READ:
+        case CardOperation::OP_NTAG216_AUTH:
+        case CardOperation::OP_DESFIRE_GET_APPLICATION_IDS:
+        case CardOperation::OP_DESFIRE_GET_KEY_SETTINGS:
+        case CardOperation::OP_DESFIRE_GET_FILE_IDS:
+        case CardOperation::OP_DESFIRE_READ_DATA:
+            SetField(isolate, result, "data", NewBuffer(isolate, op.data));
+            break;
+
+        case CardOperation::OP_READ_CARD: {
+            Local<Array> sectors = Array::New(isolate, op.sectorStatus.size());
+            for (size_t i = 0; i < op.sectorStatus.size(); i++) {
+                sectors->Set(isolate->GetCurrentContext(), i, String::NewFromUtf8(isolate, StatusCodeKey(op.sectorStatus[i]), NewStringType::kNormal).ToLocalChecked()).Check();
+            }
+            SetField(isolate, result, "data", NewBuffer(isolate, op.data));
+            SetField(isolate, result, "sectors", sectors);
+            SetField(isolate, result, "dumpTime", Number::New(isolate, (uint32_t)op.value / 1000.0));
+            break;
+        }
+
+        case CardOperation::OP_WRITE_CARD: {
+            Local<Array> sectors = Array::New(isolate, op.sectorStatus.size());
+            for (size_t i = 0; i < op.sectorStatus.size(); i++) {
+                sectors->Set(isolate->GetCurrentContext(), i, String::NewFromUtf8(isolate, StatusCodeKey(op.sectorStatus[i]), NewStringType::kNormal).ToLocalChecked()).Check();
+            }
+            SetField(isolate, result, "sectors", sectors);
+            SetField(isolate, result, "blocksWritten", Integer::New(isolate, op.value));
+            break;
+        }
+
+        case CardOperation::OP_PLAN: {
+            Local<Array> steps = Array::New(isolate, op.steps.size());
+            for (size_t i = 0; i < op.steps.size(); i++) {
+                const AccessPlanner::Request &request = op.steps[i];
+                Local<Object> step = Object::New(isolate);
+                SetField(isolate, step, "op", String::NewFromUtf8(isolate, stepNames[request.op], NewStringType::kNormal).ToLocalChecked());
+                SetField(isolate, step, "block", Integer::NewFromUnsigned(isolate, request.block));
+                SetField(isolate, step, "code", String::NewFromUtf8(isolate, StatusCodeKey(request.status), NewStringType::kNormal).ToLocalChecked());
+                if (request.op == AccessPlanner::OP_READ && request.status == MFRC522::STATUS_OK) {
+                    SetField(isolate, step, "data", node::Buffer::Copy(isolate, (const char *)&op.data[i * 16], 16).ToLocalChecked());
+                }
+                steps->Set(isolate->GetCurrentContext(), i, step).Check();
+            }
+            SetField(isolate, result, "steps", steps);
+            SetField(isolate, result, "roundTrips", Integer::NewFromUnsigned(isolate, op.value));
+            SetField(isolate, result, "authentications", Integer::NewFromUnsigned(isolate, op.length));
+            break;
+        }
+
+        case CardOperation::OP_AUTHENTICATE:
+            if (op.useKeyRing) {
+                SetField(isolate, result, "keyIndex", Integer::New(isolate, op.value));
+            }
+            break;
+
+        case CardOperation::OP_GET_VALUE:
+        case CardOperation::OP_DESFIRE_GET_KEY_VERSION:
+        case CardOperation::OP_DESFIRE_GET_VALUE:
+            SetField(isolate, result, "value", Integer::New(isolate, op.value));
+            break;
+
+        case CardOperation::OP_DESFIRE_GET_VERSION: {
+            Local<Object> version = Object::New(isolate);
+            const DESFire::MIFARE_DESFIRE_Version_t &v = op.version;
+            for (int part = 0; part < 2; part++) {
+                const uint8_t *p = part == 0 ? &v.hardware.vendor_id : &v.software.vendor_id;
+                Local<Object> info = Object::New(isolate);
+                const char *names[] = { "vendorId", "type", "subtype", "versionMajor", "versionMinor", "storageSize", "protocol" };
+                for (int i = 0; i < 7; i++) {
+                    SetField(isolate, info, names[i], Integer::NewFromUnsigned(isolate, p[i]));
+                }
+                SetField(isolate, version, part == 0 ? "hardware" : "software", info);
+            }
+            SetField(isolate, version, "uid", node::Buffer::Copy(isolate, (const char *)v.uid, sizeof(v.uid)).ToLocalChecked());
+            SetField(isolate, version, "batchNumber", node::Buffer::Copy(isolate, (const char *)v.batch_number, sizeof(v.batch_number)).ToLocalChecked());
+            SetField(isolate, version, "productionWeek", Integer::NewFromUnsigned(isolate, v.production_week));
+            SetField(isolate, version, "productionYear", Integer::NewFromUnsigned(isolate, v.production_year));
+            SetField(isolate, result, "version", version);
+            break;
+        }
+
+        case CardOperation::OP_DESFIRE_GET_FILE_SETTINGS: {
+            Local<Object> settings = Object::New(isolate);
+            const DESFire::mifare_desfire_file_settings_t &f = op.fileSettings;
+            SetField(isolate, settings, "fileType", Integer::NewFromUnsigned(isolate, f.file_type));
+            SetField(isolate, settings, "communicationSettings", Integer::NewFromUnsigned(isolate, f.communication_settings));
+            SetField(isolate, settings, "accessRights", Integer::NewFromUnsigned(isolate, f.access_rights));
+            switch (f.file_type) {
+                case DESFire::MDFT_STANDARD_DATA_FILE:
+                case DESFire::MDFT_BACKUP_DATA_FILE:
+                    SetField(isolate, settings, "fileSize", Integer::NewFromUnsigned(isolate, f.settings.standard_file.file_size));
+                    break;
+                case DESFire::MDFT_VALUE_FILE_WITH_BACKUP:
+                    SetField(isolate, settings, "lowerLimit", Integer::New(isolate, f.settings.value_file.lower_limit));
+                    SetField(isolate, settings, "upperLimit", Integer::New(isolate, f.settings.value_file.upper_limit));
+                    SetField(isolate, settings, "limitedCreditValue", Integer::New(isolate, f.settings.value_file.limited_credit_value));
+                    SetField(isolate, settings, "limitedCreditEnabled", Boolean::New(isolate, f.settings.value_file.limited_credit_enabled != 0));
+                    break;
+                default:
+                    SetField(isolate, settings, "recordSize", Integer::NewFromUnsigned(isolate, f.settings.record_file.record_size));
+                    SetField(isolate, settings, "maxNumberOfRecords", Integer::NewFromUnsigned(isolate, f.settings.record_file.max_number_of_records));
+                    SetField(isolate, settings, "currentNumberOfRecords", Integer::NewFromUnsigned(isolate, f.settings.record_file.current_number_of_records));
+                    break;
+            }
+            SetField(isolate, result, "fileSettings", settings);
+            break;
+        }
+
+        default:
+            break;
+    }
+    return result;
+}
+
+/**
+ * Hands the finished batches to their callbacks: callback(error, results). error is null once the batch ran, also if an
+ * operation failed; see the status of the last result. Otherwise { code: "NO_CARD" | "STOPPED", status, message }.
+ * Main thread only.
+ */
+void FinishOperations(vector<OperationBatch *> &batches) {
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+
+    for (size_t i = 0; i < batches.size(); i++) {
+        OperationBatch *batch = batches[i];
+        Local<Value> error = Null(isolate);
+        Local<Array> results = Array::New(isolate, batch->executed);
+        if (batch->stopped || batch->sessionStatus != MFRC522::STATUS_OK) {
+            Local<Object> info = Object::New(isolate);
+            SetField(isolate, info, "code", String::NewFromUtf8(isolate, batch->stopped ? "STOPPED" : "NO_CARD", NewStringType::kNormal).ToLocalChecked());
+            SetField(isolate, info, "status", Integer::NewFromUnsigned(isolate, batch->sessionStatus));
+            SetField(isolate, info, "message", String::NewFromUtf8(isolate, batch->stopped ? "The reader was stopped." : "No card in the field.", NewStringType::kNormal).ToLocalChecked());
+            error = info;
+        }
+        for (size_t j = 0; j < batch->executed; j++) {
+            results->Set(context, j, OperationResult(isolate, batch->ops[j])).Check();
+        }
+        Local<Value> argv[2] = { error, results };
+        Local<Function> callback = Local<Function>::New(isolate, batch->callback);
+        batch->callback.Reset();
+        delete batch;
+        callback->Call(context, context->Global(), 2, argv).IsEmpty();	// An exception is left to node
+    }
+    batches.clear();
+}
+
+/**
+ * Runs on the main thread whenever the reader thread finished operations.
+ */
+void DeliverOperations(uv_async_t * /*handle*/) {
+    vector<OperationBatch *> batches;
+
+    uv_mutex_lock(&readerLock);
+    batches.swap(operationsDone);
+    uv_mutex_unlock(&readerLock);
+    FinishOperations(batches);
+}
+
+/**
+ * Stops the reader thread and waits for it. The async handles are unreferenced, so an idle reader no longer keeps node
+ * alive; they stay initialised for the next start().
+ * Operations that did not run yet fail with "STOPPED".
+ */
+void StopReader() {
+    if (!readerStarted) {
+        return;
+    }
+    uv_mutex_lock(&readerLock);
+    readerRunning = false;
+    uv_cond_signal(&readerWakeup);
+    uv_mutex_unlock(&readerLock);
+    uv_thread_join(&readerThread);
+
+    vector<OperationBatch *> batches;
+    batches.swap(operationsDone);
+    for (size_t i = 0; i < operationsPending.size(); i++) {
+        operationsPending[i]->executed = 0;
+        operationsPending[i]->sessionStatus = MFRC522::STATUS_OK;
+        operationsPending[i]->stopped = true;
+        batches.push_back(operationsPending[i]);
+    }
+    operationsPending.clear();
+    readerStarted = false;
+    uv_unref((uv_handle_t *)&readerAsync);
+    uv_unref((uv_handle_t *)&operationAsync);
+    readerCallback.Reset();
+    readerSlab.Reset();
+    FinishOperations(batches);
+}
 
-            callback->Call(isolate->GetCurrentContext()->Global(), argc, argv);
+/**
+ * Reads an unsigned integer option, leaves *result alone if it is missing.
+ */
+void GetUint32Option(Isolate *isolate, Local<Object> options, const char *name, uint32_t *result) {
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Value> value;
+    if (options->Get(context, String::NewFromUtf8(isolate, name, NewStringType::kNormal).ToLocalChecked()).ToLocal(&value) && value->IsUint32()) {
+        *result = value->Uint32Value(context).FromJust();
+    }
+}
+
+/**
+ * Reads the bytes of a Buffer option into *result, leaves it alone if the option is missing.
+ */
+void GetBufferOption(Isolate *isolate, Local<Object> options, const char *name, vector<byte> *result) {
+    Local<Value> value;
+    if (options->Get(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, name, NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)
+            && node::Buffer::HasInstance(value)) {
+        const byte *data = (const byte *)node::Buffer::Data(value);
+        result->assign(data, data + node::Buffer::Length(value));
+    }
+}
+
+/**
+ * start(callback, [options])
+ * Starts polling for cards on a native thread. The callback gets ("arrive", uid, 0, info) when a card enters the field
+ * and ("remove", uid, dwell, info) once it left, with the UID in hex and the dwell time in ms.
+ * info: { sak, atqa: [2 bytes], readerId, status: <StatusCode of the SELECT>, timestamp: <BigInt, monotonic ns of the SELECT> }
+ * options: { spiClock: <Hz>, calibrate: <bool>, irqPin: <GPIO line>,
+ *            fastInterval: <ms>, slowInterval: <ms>, idleTimeout: <ms>, cpuBudget: <percent>,
+ *            readerId: <number>, queueSize: <events>, overflow: "dropOldest" | "dropNewest", binary: <bool>,
+ *            keys: [<Buffer(6), key A and B> | { key: <Buffer(6)>, keyType: 0 = A | 1 = B }, ...],
+ *            maxBitRate: 106 | 212 | 424 | 848 <kbit/s> }
+ * The keys are the candidates of authenticate operations without a key, the factory key FFFFFFFFFFFF if there are none.
+ * With binary set the callback gets (slab, count) instead: a Buffer holding count TapRecords, laid out as described by
+ * tapLayout. The Buffer is reused for the next batch, so anything kept past the callback has to be copied.
+ * A running reader is stopped first, so start() also applies new options.
+ * Throws if the SPI device cannot be opened, eg it is missing or access is denied; the reader does not start then.
+ */
+void Start(const FunctionCallbackInfo<Value>& args) {
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+
+    if (args.Length() < 1 || !args[0]->IsFunction()) {
+        isolate->ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "start() needs a callback", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+    StopReader();
+
+    readerOptions.spiClock = MFRC522_SPICLOCK;
+    readerOptions.calibrate = false;
+    readerOptions.irqPin = -1;
+    readerOptions.fastInterval = POLL_FAST_INTERVAL_US / 1000;
+    readerOptions.slowInterval = POLL_SLOW_INTERVAL_US / 1000;
+    readerOptions.idleTimeout = POLL_IDLE_AFTER_US / 1000;
+    readerOptions.cpuBudget = POLL_CPU_BUDGET;
+    readerOptions.readerId = 0;
+    readerOptions.queueSize = TAPRING_CAPACITY;
+    readerOptions.overflow = TapRing::OVERFLOW_DROP_OLDEST;
+    readerOptions.binary = false;
+    readerOptions.keys.clear();
+    readerOptions.maxBitRate = MFRC522::BITRATE_848;
+    MFRC522::MIFARE_Key factoryKey;
+    memset(factoryKey.keyByte, 0xFF, sizeof(factoryKey.keyByte));
+    if (args.Length() > 1 && args[1]->IsObject()) {
+        Local<Context> context = isolate->GetCurrentContext();
+        Local<Object> options = args[1]->ToObject(context).ToLocalChecked();
+        Local<Value> value;
+        uint32_t irqPin = UINT32_MAX;
+        GetUint32Option(isolate, options, "spiClock", &readerOptions.spiClock);
+        if (options->Get(context, String::NewFromUtf8(isolate, "calibrate", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)) {
+            readerOptions.calibrate = value->BooleanValue(isolate);
         }
+        GetUint32Option(isolate, options, "irqPin", &irqPin);
+        if (irqPin != UINT32_MAX) {
+            readerOptions.irqPin = irqPin;
+        }
+        GetUint32Option(isolate, options, "fastInterval", &readerOptions.fastInterval);
+        GetUint32Option(isolate, options, "slowInterval", &readerOptions.slowInterval);
+        GetUint32Option(isolate, options, "idleTimeout", &readerOptions.idleTimeout);
+        GetUint32Option(isolate, options, "cpuBudget", &readerOptions.cpuBudget);
+        GetUint32Option(isolate, options, "readerId", &readerOptions.readerId);
+        GetUint32Option(isolate, options, "queueSize", &readerOptions.queueSize);
+        uint32_t maxBitRate = 848;
+        GetUint32Option(isolate, options, "maxBitRate", &maxBitRate);
+        readerOptions.maxBitRate = maxBitRate >= 848 ? MFRC522::BITRATE_848 : maxBitRate >= 424 ? MFRC522::BITRATE_424
+                                 : maxBitRate >= 212 ? MFRC522::BITRATE_212 : MFRC522::BITRATE_106;
+        if (options->Get(context, String::NewFromUtf8(isolate, "overflow", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)
+                && value->StrictEquals(String::NewFromUtf8(isolate, "dropNewest", NewStringType::kNormal).ToLocalChecked())) {
+            readerOptions.overflow = TapRing::OVERFLOW_DROP_NEWEST;
+        }
+        if (options->Get(context, String::NewFromUtf8(isolate, "binary", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)) {
+            readerOptions.binary = value->BooleanValue(isolate);
+        }
+        if (options->Get(context, String::NewFromUtf8(isolate, "keys", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value) && value->IsArray()) {
+            Local<Array> keys = Local<Array>::Cast(value);
+            for (uint32_t i = 0; i < keys->Length(); i++) {
+                // A Buffer is tried as key A and B, { key, keyType } as the given one
+                Local<Value> entry;
+                uint32_t keyType = 2;
+                vector<byte> bytes;
+                if (!keys->Get(context, i).ToLocal(&entry)) {
+                    continue;
+                }
+                if (node::Buffer::HasInstance(entry)) {
+                    bytes.assign(node::Buffer::Data(entry), node::Buffer::Data(entry) + node::Buffer::Length(entry));
+                }
+                else if (entry->IsObject()) {
+                    GetBufferOption(isolate, entry->ToObject(context).ToLocalChecked(), "key", &bytes);
+                    keyType = 0;
+                    GetUint32Option(isolate, entry->ToObject(context).ToLocalChecked(), "keyType", &keyType);
+                }
+                if (bytes.size() != MFRC522::MF_KEY_SIZE) {
+                    continue;
+                }
+                KeyRing::Key key;
+                memcpy(key.key.keyByte, &bytes[0], MFRC522::MF_KEY_SIZE);
+                if (keyType != 1) {
+                    key.command = MFRC522::PICC_CMD_MF_AUTH_KEY_A;
+                    readerOptions.keys.push_back(key);
+                }
+                if (keyType != 0) {
+                    key.command = MFRC522::PICC_CMD_MF_AUTH_KEY_B;
+                    readerOptions.keys.push_back(key);
+                }
+            }
+        }
+    }
+    if (readerOptions.keys.empty()) {
+        KeyRing::Key key = { factoryKey, MFRC522::PICC_CMD_MF_AUTH_KEY_A };
+        readerOptions.keys.push_back(key);
+        key.command = MFRC522::PICC_CMD_MF_AUTH_KEY_B;
+        readerOptions.keys.push_back(key);
+    }
 
-        // Preserves the current detected serial number, so that it can be used
-        // for future evaluations
-        strcpy(last_uid, uid);
-        *(p++) = 0;
+    // Opened here rather than on the reader thread, so that a missing or inaccessible device is reported to the caller
+    spi = new SpidevTransport(SPI_DEVICE, readerOptions.spiClock);
+    if (!spi->IsOpen()) {
+        string message = string("start(): cannot open ") + SPI_DEVICE + ": " + strerror(errno);
+        delete spi;
+        spi = NULL;
+        isolate->ThrowException(Exception::Error(
+            String::NewFromUtf8(isolate, message.c_str(), NewStringType::kNormal).ToLocalChecked()));
+        return;
     }
 
+    delete readerScheduler;
+    readerScheduler = new PollScheduler(readerOptions.fastInterval * 1000, readerOptions.slowInterval * 1000,
+                                        readerOptions.idleTimeout * 1000, readerOptions.cpuBudget > 100 ? 100 : readerOptions.cpuBudget);
+    delete readerRing;
+    readerRing = new TapRing(readerOptions.queueSize, readerOptions.overflow);
+    if (readerOptions.binary) {
+        readerSlab.Reset(isolate, node::Buffer::New(isolate, TAP_BATCH * sizeof(TapRecord)).ToLocalChecked());
+    }
+
+    readerCallback.Reset(isolate, Local<Function>::Cast(args[0]));
+    uv_ref((uv_handle_t *)&readerAsync);
+    uv_ref((uv_handle_t *)&operationAsync);
+    readerRunning = true;
+    readerStarted = true;
+    uv_thread_create(&readerThread, ReaderMain, NULL);
 }
 
-void Init(Handle<Object> exports, Handle<Object> module) {
-    initRfidReader();
-    NODE_SET_METHOD(module, "exports", RunCallback);
+/**
+ * stop()
+ * Stops the reader thread. No callback is made after stop() returned, pending operations fail with "STOPPED" first.
+ */
+void Stop(const FunctionCallbackInfo<Value>& /*args*/) {
+    StopReader();
 }
 
-uint8_t initRfidReader(void) {
+/**
+ * Reads the keys and steps of a plan operation: { keyA: <Buffer(6)>, keyB: <Buffer(6)>,
+ * steps: [{ op: <name, see stepNames>, block, data: <Buffer(16)>, value }, ...] }. Without keys the factory default
+ * key is taken as key A and key B.
+ */
+bool ParsePlan(Isolate *isolate, Local<Object> object, CardOperation *op) {
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Value> value;
+    vector<byte> keyA, keyB;
+
+    GetBufferOption(isolate, object, "keyA", &keyA);
+    GetBufferOption(isolate, object, "keyB", &keyB);
+    op->keys = (keyA.size() == MFRC522::MF_KEY_SIZE ? 1 : 0) | (keyB.size() == MFRC522::MF_KEY_SIZE ? 2 : 0);
+    if (op->keys == 0) {
+        keyA.assign(MFRC522::MF_KEY_SIZE, 0xFF);	// Factory default key
+        keyB = keyA;
+        op->keys = 3;
+    }
+    keyA.resize(MFRC522::MF_KEY_SIZE);
+    keyB.resize(MFRC522::MF_KEY_SIZE);
+    memcpy(op->key.keyByte, &keyA[0], MFRC522::MF_KEY_SIZE);
+    memcpy(op->keyB.keyByte, &keyB[0], MFRC522::MF_KEY_SIZE);
+
+    if (!object->Get(context, String::NewFromUtf8(isolate, "steps", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value) || !value->IsArray()) {
+        return false;
+    }
+    Local<Array> steps = Local<Array>::Cast(value);
+    op->steps.resize(steps->Length());
+    op->data.assign(steps->Length() * 16, 0);
+    for (uint32_t i = 0; i < steps->Length(); i++) {
+        AccessPlanner::Request *request = &op->steps[i];
+        if (!steps->Get(context, i).ToLocal(&value) || !value->IsObject()) {
+            return false;
+        }
+        Local<Object> step = value->ToObject(context).ToLocalChecked();
+        if (!step->Get(context, String::NewFromUtf8(isolate, "op", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)) {
+            return false;
+        }
+        String::Utf8Value name(isolate, value);
+        size_t type = 0;
+        while (*name != NULL && type < sizeof(stepNames) / sizeof(stepNames[0]) && strcmp(*name, stepNames[type]) != 0) {
+            type++;
+        }
+        if (*name == NULL || type == sizeof(stepNames) / sizeof(stepNames[0])) {
+            return false;
+        }
+        request->op = (AccessPlanner::Operation)type;
+        uint32_t number = 0;
+        GetUint32Option(isolate, step, "block", &number);
+        request->block = number;
+        request->value = 0;
+        if (step->Get(context, String::NewFromUtf8(isolate, "value", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value) && value->IsInt32()) {
+            request->value = value->Int32Value(context).FromJust();
+        }
+        vector<byte> data;
+        GetBufferOption(isolate, step, "data", &data);
+        if (request->op == AccessPlanner::OP_WRITE && data.size() != 16) {
+            return false;
+        }
+        if (!data.empty()) {
+            memcpy(&op->data[i * 16], &data[0], data.size() < 16 ? data.size() : 16);
+        }
+        request->data = NULL;			// Points into op->data once the operation runs, the vector may still move
+        request->status = MFRC522::STATUS_OK;
+    }
+    return true;
+}
+
+/**
+ * The key type of desfireAuthenticate: keyType "des" | "2k3des" | "3k3des" | "aes", or by the size of the key in data,
+ * 8 bytes DES, 16 bytes 2K3DES and 24 bytes 3K3DES. AES keys need the keyType.
+ *
+ * @return false if keyType is unknown or does not fit the key.
+ */
+bool ParseDesfireKeyType(Isolate *isolate, Local<Object> object, CardOperation *op) {
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Value> value;
+    const char *names[] = { "des", "2k3des", "3k3des", "aes" };
+    vector<byte> key;
+
+    GetBufferOption(isolate, object, "data", &key);
+    if (object->Get(context, String::NewFromUtf8(isolate, "keyType", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)
+            && value->IsString()) {
+        String::Utf8Value name(isolate, value);
+        byte type = 0;
+        while (*name != NULL && type < sizeof(names) / sizeof(names[0]) && strcmp(*name, names[type]) != 0) {
+            type++;
+        }
+        op->keyType = type;
+    }
+    else {
+        op->keyType = key.size() == 24 ? DesfireCipher::KEY_3K3DES : key.size() == 16 ? DesfireCipher::KEY_2K3DES : DesfireCipher::KEY_DES;
+    }
+    return op->keyType <= DesfireCipher::KEY_AES && key.size() == DesfireCipher::GetKeySize((DesfireCipher::KeyType)op->keyType);
+}
+
+/**
+ * Converts { op, block, keyType, key, data, value, offset, length } into *op.
+ *
+ * @return false if op names no known operation.
+ */
+bool ParseOperation(Isolate *isolate, Local<Object> object, CardOperation *op) {
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Value> value;
+    uint32_t number;
+
+    if (!object->Get(context, String::NewFromUtf8(isolate, "op", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value)) {
+        return false;
+    }
+    String::Utf8Value name(isolate, value);
+    if (*name == NULL) {
+        return false;
+    }
+    int type = 0;
+    while (type < CardOperation::OP_COUNT && strcmp(*name, operationNames[type]) != 0) {
+        type++;
+    }
+    if (type == CardOperation::OP_COUNT) {
+        return false;
+    }
+    op->type = (CardOperation::Type)type;
+
+    number = 0;
+    GetUint32Option(isolate, object, "block", &number);
+    op->block = number;
+    if (op->type == CardOperation::OP_DESFIRE_AUTHENTICATE) {
+        if (!ParseDesfireKeyType(isolate, object, op)) {
+            return false;
+        }
+    }
+    else {
+        number = 0;
+        GetUint32Option(isolate, object, "keyType", &number);
+        op->keyType = number == 1 || number == MFRC522::PICC_CMD_MF_AUTH_KEY_B ? MFRC522::PICC_CMD_MF_AUTH_KEY_B : MFRC522::PICC_CMD_MF_AUTH_KEY_A;
+    }
+    vector<byte> key;
+    GetBufferOption(isolate, object, "key", &key);
+    op->useKeyRing = key.empty() && op->type == CardOperation::OP_AUTHENTICATE;
+    if (key.empty()) {
+        key.assign(MFRC522::MF_KEY_SIZE, 0xFF);		// Factory default key
+    }
+    key.resize(MFRC522::MF_KEY_SIZE);
+    memcpy(op->key.keyByte, &key[0], MFRC522::MF_KEY_SIZE);
+    GetBufferOption(isolate, object, "data", &op->data);
+    GetBufferOption(isolate, object, "mask", &op->mask);
+    op->value = 0;
+    if (object->Get(context, String::NewFromUtf8(isolate, "value", NewStringType::kNormal).ToLocalChecked()).ToLocal(&value) && value->IsInt32()) {
+        op->value = value->Int32Value(context).FromJust();
+    }
+    op->offset = 0;
+    GetUint32Option(isolate, object, "offset", &op->offset);
+    op->length = 0;
+    GetUint32Option(isolate, object, "length", &op->length);
+    if (op->type == CardOperation::OP_PLAN && !ParsePlan(isolate, object, op)) {
+        return false;
+    }
+    op->status = MFRC522::STATUS_OK;
+    op->desfireStatus = DESFire::MF_OPERATION_OK;
+    return true;
+}
+
+/**
+ * submit(operations, callback)
+ * Queues operations for the card in the field. The reader thread runs them between two polls, back to back in one
+ * session, stopping at the first that fails. The callback gets (error, results), see FinishOperations().
+ * operations: [{ op: <name, see operationNames>, block, keyType: "A" = 0 | "B" = 1, key: <Buffer(6)>, data: <Buffer>,
+ *               mask: <Buffer>, value, offset, length }, ...]
+ * A plan takes keyA, keyB and steps instead, see ParsePlan(). desfireAuthenticate takes the key number in block and
+ * the key in data, see ParseDesfireKeyType().
+ * An authenticate without key tries the keys of the start() options, see KeyRing.
+ */
+void Submit(const FunctionCallbackInfo<Value>& args) {
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+
+    if (args.Length() < 2 || !args[0]->IsArray() || !args[1]->IsFunction()) {
+        isolate->ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "submit() needs an array of operations and a callback", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+    if (!readerStarted) {
+        isolate->ThrowException(Exception::Error(
+            String::NewFromUtf8(isolate, "The reader is not started", NewStringType::kNormal).ToLocalChecked()));
+        return;
+    }
+
+    Local<Array> operations = Local<Array>::Cast(args[0]);
+    OperationBatch *batch = new OperationBatch();
+    batch->ops.resize(operations->Length());
+    for (uint32_t i = 0; i < operations->Length(); i++) {
+        Local<Value> value;
+        if (!operations->Get(context, i).ToLocal(&value) || !value->IsObject()
+                || !ParseOperation(isolate, value->ToObject(context).ToLocalChecked(), &batch->ops[i])) {
+            delete batch;
+            isolate->ThrowException(Exception::TypeError(
+                String::NewFromUtf8(isolate, "Unknown card operation", NewStringType::kNormal).ToLocalChecked()));
+            return;
+        }
+    }
+    batch->executed = 0;
+    batch->sessionStatus = MFRC522::STATUS_OK;
+    batch->stopped = false;
+    batch->callback.Reset(isolate, Local<Function>::Cast(args[1]));
+
+    uv_mutex_lock(&readerLock);
+    operationsPending.push_back(batch);
+    uv_cond_signal(&readerWakeup);
+    uv_mutex_unlock(&readerLock);
+}
+
+/**
+ * stats()
+ * Returns the scheduler figures: { p50: <ms>, p99: <ms>, events: <count>, pollCost: <ms of CPU per poll>,
+ * dropped: <events lost because the callback fell behind>, keyHits: <authentications the remembered key did on the first try>,
+ * keyMisses: <authentications that had to search the key ring>, directoryHits: <DESFire commands answered from the card directory>,
+ * directoryMisses: <DESFire commands the directory could not answer, discoveries included>, directoryHitRate: <hits / (hits + misses)>,
+ * savedFrames: <estimated response frames the hits saved>, cipher: <AES implementation of DESFire secure messaging> }.
+ * The latencies are upper bounds of the tap-to-callback time over the last events, see PollScheduler::GetLatency().
+ */
+void Stats(const FunctionCallbackInfo<Value>& args) {
+    Isolate* isolate = Isolate::GetCurrent();
+    HandleScope scope(isolate);
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> stats = Object::New(isolate);
+    double p50 = 0, p99 = 0, events = 0, pollCost = 0, dropped = 0, hits, misses, dirHits, dirMisses, frames;
+
+    if (readerScheduler) {
+        p50 = readerScheduler->GetLatency(50) / 1000.0;
+        p99 = readerScheduler->GetLatency(99) / 1000.0;
+        events = readerScheduler->GetSampleCount();
+    }
+    uv_mutex_lock(&readerLock);
+    if (readerScheduler) {
+        pollCost = readerScheduler->GetPollCost() / 1000.0;
+    }
+    if (readerRing) {
+        dropped = readerRing->GetDropped();
+    }
+    hits = keyHits;
+    misses = keyMisses;
+    dirHits = directoryHits;
+    dirMisses = directoryMisses;
+    frames = savedFrames;
+    uv_mutex_unlock(&readerLock);
+
+    stats->Set(context, String::NewFromUtf8(isolate, "p50", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, p50)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "p99", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, p99)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "events", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, events)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "pollCost", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, pollCost)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "dropped", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, dropped)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "keyHits", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, hits)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "keyMisses", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, misses)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "directoryHits", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, dirHits)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "directoryMisses", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, dirMisses)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "directoryHitRate", NewStringType::kNormal).ToLocalChecked(),
+               Number::New(isolate, dirHits + dirMisses > 0 ? dirHits / (dirHits + dirMisses) : 0)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "savedFrames", NewStringType::kNormal).ToLocalChecked(), Number::New(isolate, frames)).Check();
+    stats->Set(context, String::NewFromUtf8(isolate, "cipher", NewStringType::kNormal).ToLocalChecked(),
+               String::NewFromUtf8(isolate, DesfireCipher::GetImplementationName(), NewStringType::kNormal).ToLocalChecked()).Check();
+    args.GetReturnValue().Set(stats);
+}
+
+/**
+ * Describes a TapRecord for the binary mode: { size: <bytes per record>, <field>: <byte offset>, ..., removed: <event value> }.
+ * Multi-byte fields are in host byte order.
+ */
+Local<Object> TapLayout(Isolate *isolate) {
+    Local<Context> context = isolate->GetCurrentContext();
+    Local<Object> layout = Object::New(isolate);
+    const struct { const char *name; uint32_t value; } fields[] = {
+        { "size",       sizeof(TapRecord) },
+        { "timestamp",  offsetof(TapRecord, timestamp) },
+        { "dwell",      offsetof(TapRecord, dwell) },
+        { "event",      offsetof(TapRecord, event) },
+        { "status",     offsetof(TapRecord, status) },
+        { "readerId",   offsetof(TapRecord, readerId) },
+        { "uidSize",    offsetof(TapRecord, uidSize) },
+        { "uid",        offsetof(TapRecord, uidByte) },
+        { "sak",        offsetof(TapRecord, sak) },
+        { "atqa",       offsetof(TapRecord, atqa) },
+        { "removed",    PresenceTracker::EVENT_REMOVED }
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        layout->Set(context, String::NewFromUtf8(isolate, fields[i].name, NewStringType::kNormal).ToLocalChecked(),
+                    Integer::NewFromUnsigned(isolate, fields[i].value)).Check();
+    }
+    return layout;
+}
+
+void Init(Local<Object> exports) {
+    Isolate* isolate = Isolate::GetCurrent();
+    uv_mutex_init(&readerLock);
+    uv_cond_init(&readerWakeup);
+    // The handles live as long as the addon, start() and stop() only reference and unreference them
+    uv_async_init(uv_default_loop(), &readerAsync, DeliverTaps);
+    uv_async_init(uv_default_loop(), &operationAsync, DeliverOperations);
+    uv_unref((uv_handle_t *)&readerAsync);
+    uv_unref((uv_handle_t *)&operationAsync);
+    NODE_SET_METHOD(exports, "start", Start);
+    NODE_SET_METHOD(exports, "stop", Stop);
+    NODE_SET_METHOD(exports, "stats", Stats);
+    NODE_SET_METHOD(exports, "submit", Submit);
+    exports->Set(isolate->GetCurrentContext(), String::NewFromUtf8(isolate, "tapLayout", NewStringType::kNormal).ToLocalChecked(),
+                 TapLayout(isolate)).Check();
+}
+
+/**
+ * Sets up the MFRC522 behind the transport start() opened. Reader thread only.
+ *
+ * @return 0 if the reader is ready, 1 if the SPI transport is not open.
+ */
+uint8_t initRfidReader(bool calibrate, int irqPin) {
+    if (spi == NULL || !spi->IsOpen()) {
+        return 1;
+    }
     wiringPiSetup () ;
-	mfrc522.PCD_Init();   // Init MFRC522
-//	mfrc522.PCD_DumpVersionToSerial();  // Show details of PCD - MFRC522 Card Reader details
-	
+    mfrc522 = new DESFire(spi, RST_PIN);  // Create MFRC522 instance, with the DESFire commands
+    if (calibrate) {
+        mfrc522->PCD_SetSPIClockCalibration(MFRC522_SPICLOCK_MAX);	// Raise the clock as far as the wiring allows
+    }
+	mfrc522->PCD_Init();   // Init MFRC522
+	mfrc522->PCD_SetAutoCRC(true);	// CRC_A is generated and checked by the MFRC522, no CRC bytes on the bus
+	if (irqPin >= 0) {
+		irq = new GpioChardevIRQLine(irqPin);
+		if (irq->IsOpen()) {
+			mfrc522->PCD_SetIRQLine(irq);	// Sleep on the IRQ pin instead of polling ComIrqReg
+		}
+	}
+//	mfrc522->PCD_DumpVersionToSerial();  // Show details of PCD - MFRC522 Card Reader details
+
     return 0;
 }
 
-NODE_MODULE(rc522, Init)
\ No newline at end of file
+void releaseRfidReader() {
+    delete mfrc522;
+    mfrc522 = NULL;
+    delete irq;
+    irq = NULL;
+    delete spi;
+    spi = NULL;
+}
+
+NODE_MODULE(rc522, Init)
@@ -0,0 +1,40 @@
+/**
+ * bench_crc.cpp - Time of MFRC522::CRC_A() on the host, against the bus transactions the coprocessor needs.
+ */
+#include <chrono>
+#include <stdio.h>
+#include "FakeChip.h"
+#include "MFRC522.h"
+
+int main() {
+	const int iterations = 1000000;
+	const size_t lengths[] = {2, 7, 16, 18, 62};
+	byte data[64];
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = i * 37 + 5;
+	}
+
+	volatile byte sink = 0;
+	for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		byte result[2];
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			data[0] = i;
+			MFRC522::CRC_A(data, lengths[l], result);
+			sink ^= result[0];
+		}
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		printf("CRC_A %2zu bytes: %6.1f ns\n", lengths[l], elapsed.count() / iterations);
+	}
+
+	FakeChip chip;
+	MFRC522 mfrc522(&chip, UINT8_MAX);
+	mfrc522.PCD_Init();
+	for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		byte result[2];
+		chip.ResetTransactionCount();
+		mfrc522.PCD_CalculateCRC_Coprocessor(data, lengths[l], result);
+		printf("coprocessor %2zu bytes: %u bus transactions\n", lengths[l], chip.GetTransactionCount());
+	}
+	return 0;
+}
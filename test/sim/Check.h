@@ -0,0 +1,26 @@
+/**
+ * Check.h - The assertion of the host tests: reports a failed check and counts it, the test goes on.
+ *
+ * Released into the public domain.
+ */
+#ifndef CHECK_h
+#define CHECK_h
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+#define CHECK(condition) do { \
+		if (!(condition)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			checkFailures++; \
+		} \
+	} while (0)
+
+// The exit code of a test: 0 if all checks passed
+inline int CheckResult(const char *test) {
+	printf("%s: %s\n", test, checkFailures ? "FAILED" : "ok");
+	return checkFailures ? 1 : 0;
+}
+
+#endif
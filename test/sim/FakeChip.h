@@ -0,0 +1,559 @@
+/**
+ * FakeChip.h - A simulated MFRC522 with ISO/IEC 14443 Type A PICCs in its field, behind an SPITransport.
+ *
+ * FakeChip decodes the register accesses of the SPI frames (datasheet section 8.1.2) and keeps a register file and a
+ * 64 byte FIFO. It runs the commands the library uses: Idle, CalcCRC, MFAuthent, Transceive and SoftReset. Transceive
+ * hands the frame to the simulated field, which answers REQA/WUPA, anticollision, SELECT, HLTA and MIFARE READ/WRITE,
+ * and passes any other frame to onOther.
+ * MFAuthent takes every key, or with checkKeys only key A or key B of the block's sector trailer. A PICC that refuses
+ * the key does not answer and falls back to IDLE, like a real one.
+ * By default a Transceive completes within the register write that starts it. With streamRate set, bytes move between
+ * the FIFO and the air at streamRate bytes per bus transaction instead, with the water level alerts, like the real
+ * chip does for frames longer than the FIFO.
+ * The CRC_A here is computed bit by bit, independent of the table in MFRC522::CRC_A().
+ *
+ * Released into the public domain.
+ */
+#ifndef FAKECHIP_h
+#define FAKECHIP_h
+
+#include <deque>
+#include <functional>
+#include <vector>
+#include <string.h>
+#include "SPITransport.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+/**
+ * CRC_A of ISO/IEC 14443-3 annex B, bit by bit.
+ */
+inline uint16_t SimCRC_A(const uint8_t *data, size_t length) {
+	uint16_t crc = 0x6363;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+		}
+	}
+	return crc;
+}
+
+/**
+ * Appends the CRC_A, low byte first.
+ */
+inline void SimAppendCRC(Bytes &frame) {
+	uint16_t crc = SimCRC_A(frame.data(), frame.size());
+	frame.push_back(crc & 0xFF);
+	frame.push_back(crc >> 8);
+}
+
+/**
+ * Tells if the last two bytes are the CRC_A of the others.
+ */
+inline bool SimCheckCRC(const Bytes &frame) {
+	return frame.size() >= 2 && SimCRC_A(frame.data(), frame.size() - 2) == (frame[frame.size() - 2] | frame[frame.size() - 1] << 8);
+}
+
+/**
+ * A PICC with a 4 or 7 byte UID and 256 blocks of memory, block b filled with b * 16 + i.
+ */
+struct SimCard {
+	enum State { IDLE, READY, ACTIVE, HALT };
+
+	Bytes uid;
+	uint8_t sak;
+	State state;
+	int level;				// Cascade level of the anticollision in progress
+	uint8_t mem[256][16];
+
+	SimCard(const Bytes &uid, uint8_t sak) : uid(uid), sak(sak), state(IDLE), level(0) {
+		for (int b = 0; b < 256; b++) {
+			for (int i = 0; i < 16; i++) {
+				mem[b][i] = b * 16 + i;
+			}
+		}
+	}
+
+	// The four UID bytes of a cascade level, with the cascade tag on level 1 of a 7 byte UID
+	Bytes LevelBytes(int level) const {
+		if (uid.size() == 4) {
+			return uid;
+		}
+		if (level == 1) {
+			return Bytes{0x88, uid[0], uid[1], uid[2]};
+		}
+		return Bytes{uid[3], uid[4], uid[5], uid[6]};
+	}
+
+	// The SAK of a cascade level, with the cascade bit while the UID is not complete
+	uint8_t LevelSak(int level) const {
+		int levels = uid.size() == 4 ? 1 : 2;
+		return level < levels ? 0x04 : sak;
+	}
+};
+
+class FakeChip : public SPITransport {
+public:
+	enum Register {
+		CommandReg = 0x01, ComIEnReg = 0x02, DivIEnReg = 0x03, ComIrqReg = 0x04, DivIrqReg = 0x05, ErrorReg = 0x06,
+		Status2Reg = 0x08, FIFODataReg = 0x09, FIFOLevelReg = 0x0A, WaterLevelReg = 0x0B, ControlReg = 0x0C,
+		BitFramingReg = 0x0D, CollReg = 0x0E, TxModeReg = 0x12, RxModeReg = 0x13, TxControlReg = 0x14,
+		CRCResultRegH = 0x21, CRCResultRegL = 0x22, VersionReg = 0x37
+	};
+
+	uint8_t reg[64];
+	std::deque<uint8_t> fifo;
+	std::vector<SimCard *> cards;
+	int streamRate;			// Bytes on air per bus transaction, 0 to complete a Transceive at once
+	bool streamShort;		// With streamRate: also stream frames of up to 9 bytes (REQA, anticollision, SELECT)
+	int maxFifo;			// Highest FIFO level seen while streaming
+	uint32_t frames;		// Register accesses
+	bool hideKeys;			// MIFARE Classic trailers read like on a real PICC: key A as zeros, key B unless readable
+	bool checkKeys;			// MFAuthent needs a key of the sector trailer, instead of taking every key
+	std::vector<int> writeLog;	// Blocks written with MIFARE WRITE
+	std::vector<int> authLog;	// Blocks of the MFAuthent commands, failed ones too
+	Bytes authKeyLog;			// Their key commands, 0x60 key A or 0x61 key B
+	std::function<void()> onFieldOff;
+	std::function<void(int block)> onAuthent;	// Called before a MFAuthent is checked, eg to take the card away
+	// Frames the field does not know: tx with CRC, rx with CRC unless rxBits, any if a PICC answered
+	std::function<void(const Bytes &tx, Bytes &rx, int &rxBits, bool &any)> onOther;
+
+	FakeChip() : streamRate(0), streamShort(true), maxFifo(0), frames(0), hideKeys(false), checkKeys(false), _stream(STREAM_IDLE), _rxPos(0), _pendingWrite(-1) {
+		memset(reg, 0, sizeof(reg));
+		reg[VersionReg] = 0x92;
+	}
+
+	virtual bool SetSpeed(uint32_t speed) {
+		_speed = speed;
+		return true;
+	}
+
+	virtual bool Transfer(SPI_Transfer *transfers, uint8_t count) {
+		_transactions++;
+		for (uint8_t i = 0; i < count; i++) {
+			Bytes data(transfers[i].tx, transfers[i].tx + transfers[i].len);
+			Access(data.data(), data.size());
+			if (transfers[i].rx) {
+				memcpy(transfers[i].rx, data.data(), data.size());
+			}
+		}
+		if (streamRate) {
+			Step();
+		}
+		return true;
+	}
+
+	/**
+	 * One chip select framed register access, exchanged in place: the first byte is the address, bit 7 set for a read.
+	 * A read returns the register at the address of the byte before (datasheet section 8.1.2.1).
+	 */
+	void Access(uint8_t *data, size_t length) {
+		frames++;
+		if (data[0] & 0x80) {
+			Bytes addresses(data, data + length);
+			for (size_t i = 1; i < length; i++) {
+				data[i] = Read((addresses[i - 1] >> 1) & 0x3F);
+			}
+			data[0] = 0;
+			return;
+		}
+		for (size_t i = 1; i < length; i++) {
+			Write((data[0] >> 1) & 0x3F, data[i]);
+		}
+	}
+
+	/**
+	 * Moves streamRate bytes between the FIFO and the air. Called after every bus transaction while streaming.
+	 */
+	void Step() {
+		if (_stream == STREAM_SENDING) {
+			for (int k = 0; k < streamRate && !fifo.empty(); k++) {
+				_tx.push_back(fifo.front());
+				fifo.pop_front();
+			}
+			if (fifo.empty()) {
+				_stream = STREAM_RECEIVING;
+				reg[ComIrqReg] |= 0x40;		// TxIRq
+				if (reg[TxModeReg] & 0x80) {
+					SimAppendCRC(_tx);
+				}
+				_rx.clear();
+				_rxPos = 0;
+				int rxBits = 0;
+				bool any = false, collision = false;
+				int collisionPos = 0;
+				Respond(_tx, 0, _rx, rxBits, any, collision, collisionPos);
+				if (!any) {
+					reg[ComIrqReg] |= 0x01;		// TimerIRq
+					_stream = STREAM_IDLE;
+				}
+				else if (reg[RxModeReg] & 0x80) {
+					if (!SimCheckCRC(_rx)) {
+						reg[ErrorReg] |= 0x04;	// CRCErr
+					}
+					_rx.resize(_rx.size() >= 2 ? _rx.size() - 2 : 0);
+				}
+			}
+			Alerts();
+			return;
+		}
+		if (_stream == STREAM_RECEIVING) {
+			for (int k = 0; k < streamRate && _rxPos < _rx.size(); k++) {
+				if (fifo.size() >= 64) {
+					reg[ErrorReg] |= 0x10;		// BufferOvfl
+				}
+				else {
+					fifo.push_back(_rx[_rxPos]);
+				}
+				_rxPos++;
+			}
+			if (_rxPos >= _rx.size()) {
+				_stream = STREAM_IDLE;
+				reg[ComIrqReg] |= 0x30;		// RxIRq, IdleIRq
+				reg[ControlReg] = 0;
+			}
+			Alerts();
+		}
+	}
+
+protected:
+	enum StreamState { STREAM_IDLE, STREAM_SENDING, STREAM_RECEIVING };
+
+	StreamState _stream;
+	Bytes _tx, _rx;
+	size_t _rxPos;
+	int _pendingWrite;		// Block of a MIFARE WRITE waiting for its data, -1 for none
+
+	uint8_t Read(int address) {
+		if (address == FIFODataReg) {
+			if (fifo.empty()) {
+				return 0;
+			}
+			uint8_t value = fifo.front();
+			fifo.pop_front();
+			return value;
+		}
+		if (address == FIFOLevelReg) {
+			return fifo.size();
+		}
+		return reg[address];
+	}
+
+	void Write(int address, uint8_t value) {
+		switch (address) {
+			case FIFODataReg:
+				fifo.push_back(value);
+				return;
+			case FIFOLevelReg:
+				if (value & 0x80) {
+					fifo.clear();
+				}
+				return;
+			case ComIrqReg:
+			case DivIrqReg:
+				// Set1: bit 7 tells whether the marked bits are set or cleared
+				if (value & 0x80) {
+					reg[address] |= value & 0x7F;
+				}
+				else {
+					reg[address] &= ~(value & 0x7F);
+				}
+				return;
+			case CommandReg:
+				reg[address] = value;
+				Command(value & 0x0F);
+				return;
+			case BitFramingReg:
+				reg[address] = value & 0x7F;
+				if ((value & 0x80) && (reg[CommandReg] & 0x0F) == 0x0C) {	// StartSend during Transceive
+					if (streamRate && (streamShort || fifo.size() > 9)) {
+						_stream = STREAM_SENDING;
+						_tx.clear();
+						reg[ErrorReg] = 0;
+						reg[ControlReg] = 0;
+					}
+					else {
+						Transceive();
+					}
+				}
+				return;
+			default:
+				reg[address] = value;
+				if (address == TxControlReg && (value & 0x03) == 0) {	// Antenna off: every PICC resets
+					for (size_t i = 0; i < cards.size(); i++) {
+						cards[i]->state = SimCard::IDLE;
+					}
+					if (onFieldOff) {
+						onFieldOff();
+					}
+				}
+				return;
+		}
+	}
+
+	void Command(int command) {
+		if (command == 0x0F) {			// SoftReset
+			memset(reg, 0, sizeof(reg));
+			reg[VersionReg] = 0x92;
+			fifo.clear();
+		}
+		else if (command == 0x03) {		// CalcCRC
+			Bytes data(fifo.begin(), fifo.end());
+			uint16_t crc = SimCRC_A(data.data(), data.size());
+			reg[CRCResultRegL] = crc & 0xFF;
+			reg[CRCResultRegH] = crc >> 8;
+			reg[DivIrqReg] |= 0x04;		// CRCIRq
+		}
+		else if (command == 0x0E) {		// MFAuthent: command, block, key and UID in the FIFO
+			Bytes data(fifo.begin(), fifo.end());
+			fifo.clear();
+			if (data.size() != 12) {
+				return;
+			}
+			authLog.push_back(data[1]);
+			authKeyLog.push_back(data[0]);
+			if (onAuthent) {
+				onAuthent(data[1]);
+			}
+			SimCard *active = Active();
+			if (active && (!checkKeys || KeyMatches(active, data[0], data[1], &data[2]))) {
+				reg[ComIrqReg] |= 0x10;		// IdleIRq
+				reg[Status2Reg] |= 0x08;	// MFCrypto1On
+				return;
+			}
+			if (active) {
+				active->state = SimCard::IDLE;
+			}
+			reg[ComIrqReg] |= 0x01;			// TimerIRq, the PICC did not answer
+		}
+	}
+
+	void Transceive() {
+		Bytes tx(fifo.begin(), fifo.end());
+		fifo.clear();
+		int lastBits = reg[BitFramingReg] & 0x07;
+		if (reg[TxModeReg] & 0x80) {
+			SimAppendCRC(tx);
+		}
+		reg[ErrorReg] = 0;
+		reg[ControlReg] = 0;
+		reg[CollReg] = 0xA0;
+
+		Bytes rx;
+		int rxBits = 0;
+		bool any = false, collision = false;
+		int collisionPos = 0;
+		Respond(tx, lastBits, rx, rxBits, any, collision, collisionPos);
+		if (!any) {
+			reg[ComIrqReg] |= 0x01;		// TimerIRq
+			return;
+		}
+		if ((reg[RxModeReg] & 0x80) && rxBits == 0) {
+			if (!SimCheckCRC(rx)) {		// Also a response shorter than its CRC
+				reg[ErrorReg] |= 0x04;
+			}
+			else {
+				rx.resize(rx.size() - 2);
+			}
+		}
+		fifo.insert(fifo.end(), rx.begin(), rx.end());
+		reg[ControlReg] = rxBits;
+		if (collision) {
+			reg[ErrorReg] |= 0x08;		// CollErr
+			reg[CollReg] = 0x80 | (collisionPos & 0x1F);
+		}
+		reg[ComIrqReg] |= 0x70;			// TxIRq, RxIRq, IdleIRq
+	}
+
+	void Alerts() {
+		int waterLevel = reg[WaterLevelReg];
+		if ((int)fifo.size() <= waterLevel) {
+			reg[ComIrqReg] |= 0x04;		// LoAlertIRq
+		}
+		if (64 - (int)fifo.size() <= waterLevel) {
+			reg[ComIrqReg] |= 0x08;		// HiAlertIRq
+		}
+		if ((int)fifo.size() > maxFifo) {
+			maxFifo = fifo.size();
+		}
+	}
+
+	static bool IsTrailer(int block) {
+		return block < 128 ? block % 4 == 3 : block % 16 == 15;
+	}
+
+	SimCard *Active() const {
+		for (size_t i = 0; i < cards.size(); i++) {
+			if (cards[i]->state == SimCard::ACTIVE) {
+				return cards[i];
+			}
+		}
+		return NULL;
+	}
+
+	// Key A is the first 6 bytes of the trailer, key B the last 6
+	static bool KeyMatches(const SimCard *card, uint8_t command, int block, const uint8_t *key) {
+		int trailer = block < 128 ? block | 3 : block | 15;
+		return memcmp(&card->mem[trailer][command == 0x60 ? 0 : 10], key, 6) == 0;
+	}
+
+	// Key B reads back for the trailer access conditions C1 C2 C3 = 000, 010 and 001 (C1 bit 7 of byte 7, C2 bit 3 and
+	// C3 bit 7 of byte 8), key A never
+	static void HideKeys(Bytes &trailer) {
+		bool c1 = trailer[7] & 0x80, c2 = trailer[8] & 0x08, c3 = trailer[8] & 0x80;
+		memset(&trailer[0], 0, 6);
+		if (c1 || (c2 && c3)) {
+			memset(&trailer[10], 0, 6);
+		}
+	}
+
+	/**
+	 * The field: what the PICCs answer to a frame.
+	 */
+	void Respond(const Bytes &tx, int lastBits, Bytes &rx, int &rxBits, bool &any, bool &collision, int &collisionPos) {
+		// REQA, WUPA
+		if (tx.size() == 1 && lastBits == 7 && (tx[0] == 0x26 || tx[0] == 0x52)) {
+			for (size_t i = 0; i < cards.size(); i++) {
+				SimCard *card = cards[i];
+				if (card->state == SimCard::IDLE || (tx[0] == 0x52 && card->state == SimCard::HALT)) {
+					card->state = SimCard::READY;
+					card->level = 1;
+					any = true;
+				}
+				else if (card->state == SimCard::ACTIVE) {
+					card->state = SimCard::IDLE;
+				}
+			}
+			if (any) {
+				rx = Bytes{0x04, 0x00};
+			}
+			return;
+		}
+
+		// Anticollision and SELECT
+		if (tx.size() >= 2 && (tx[0] == 0x93 || tx[0] == 0x95 || tx[0] == 0x97)) {
+			int level = tx[0] == 0x93 ? 1 : tx[0] == 0x95 ? 2 : 3;
+			int nvb = tx[1];
+			if (nvb == 0x70 && tx.size() == 9) {
+				if (!SimCheckCRC(tx)) {
+					return;
+				}
+				for (size_t i = 0; i < cards.size(); i++) {
+					SimCard *card = cards[i];
+					if (card->state != SimCard::READY || card->level != level) {
+						continue;
+					}
+					Bytes levelBytes = card->LevelBytes(level);
+					if (memcmp(levelBytes.data(), &tx[2], 4) != 0) {
+						card->state = SimCard::IDLE;
+						continue;
+					}
+					uint8_t sak = card->LevelSak(level);
+					rx = Bytes{sak};
+					SimAppendCRC(rx);
+					any = true;
+					if (sak & 0x04) {
+						card->level++;
+					}
+					else {
+						card->state = SimCard::ACTIVE;
+					}
+				}
+				return;
+			}
+
+			// The PICCs whose UID matches the known bits answer the rest, bit collisions are marked
+			int knownBits = ((nvb >> 4) - 2) * 8 + (nvb & 0x0F);
+			std::vector<Bytes> answers;
+			for (size_t i = 0; i < cards.size(); i++) {
+				SimCard *card = cards[i];
+				if (card->state != SimCard::READY || card->level != level) {
+					continue;
+				}
+				Bytes levelBytes = card->LevelBytes(level);
+				levelBytes.push_back(levelBytes[0] ^ levelBytes[1] ^ levelBytes[2] ^ levelBytes[3]);
+				bool match = true;
+				for (int b = 0; b < knownBits && match; b++) {
+					match = ((levelBytes[b / 8] >> (b % 8)) & 1) == ((tx[2 + b / 8] >> (b % 8)) & 1);
+				}
+				if (match) {
+					answers.push_back(levelBytes);
+				}
+			}
+			if (answers.empty()) {
+				return;
+			}
+			any = true;
+			Bytes out(5, 0);
+			int first = -1;		// First colliding bit
+			for (int b = knownBits; b < 40; b++) {
+				int value = (answers[0][b / 8] >> (b % 8)) & 1;
+				bool differs = false;
+				for (size_t i = 1; i < answers.size(); i++) {
+					differs = differs || ((answers[i][b / 8] >> (b % 8)) & 1) != value;
+				}
+				if (differs && first < 0) {
+					first = b;
+				}
+				if (first >= 0) {
+					value = b == first ? 1 : 0;
+				}
+				out[b / 8] |= value << (b % 8);
+			}
+			rx.assign(out.begin() + knownBits / 8, out.end());
+			if (first >= 0) {
+				collision = true;
+				collisionPos = (first + 1) % 32;	// CollPos 0 means bit 32
+			}
+			return;
+		}
+
+		SimCard *active = Active();
+		if (!active) {
+			return;
+		}
+		if (tx.size() == 4 && tx[0] == 0x50 && tx[1] == 0) {		// HLTA
+			if (SimCheckCRC(tx)) {
+				active->state = SimCard::HALT;
+			}
+			return;
+		}
+		if (tx.size() == 4 && tx[0] == 0x30) {						// MIFARE READ
+			if (SimCheckCRC(tx)) {
+				rx.assign(active->mem[tx[1]], active->mem[tx[1]] + 16);
+				if (hideKeys && IsTrailer(tx[1])) {
+					HideKeys(rx);
+				}
+				SimAppendCRC(rx);
+				any = true;
+			}
+			return;
+		}
+		if (tx.size() == 4 && tx[0] == 0xA0) {						// MIFARE WRITE, first part
+			if (SimCheckCRC(tx)) {
+				_pendingWrite = tx[1];
+				rx = Bytes{0x0A};
+				rxBits = 4;
+				any = true;
+			}
+			return;
+		}
+		if (tx.size() == 18 && _pendingWrite >= 0) {				// MIFARE WRITE, the data
+			if (SimCheckCRC(tx)) {
+				memcpy(active->mem[_pendingWrite], tx.data(), 16);
+				writeLog.push_back(_pendingWrite);
+				_pendingWrite = -1;
+				rx = Bytes{0x0A};
+				rxBits = 4;
+				any = true;
+			}
+			return;
+		}
+		if (onOther) {
+			onOther(tx, rx, rxBits, any);
+		}
+	}
+};
+
+#endif
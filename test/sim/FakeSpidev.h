@@ -0,0 +1,49 @@
+/**
+ * FakeSpidev.h - A SpidevTransport whose messages go to a FakeChip instead of the kernel.
+ *
+ * Only SubmitMessage() is replaced, so everything SpidevTransport does to build the SPI_IOC_MESSAGE runs as it does
+ * on the target. Each spi_ioc_transfer is one register access of the chip, and the message is checked the way the
+ * spidev driver and the MFRC522 need it: the chip select released (cs_change) after every transfer but the last.
+ *
+ * Released into the public domain.
+ */
+#ifndef FAKESPIDEV_h
+#define FAKESPIDEV_h
+
+#include <linux/spi/spidev.h>
+#include "FakeChip.h"
+
+class FakeSpidev : public SpidevTransport {
+public:
+	FakeChip &chip;
+	uint32_t messages;			// SubmitMessage() calls
+	uint32_t transfers;			// spi_ioc_transfer entries in them
+	uint32_t badMessages;		// Messages with a wrong cs_change, speed or word size
+
+	FakeSpidev(FakeChip &chip) : SpidevTransport("/nonexistent/spidev", 4000000), chip(chip), messages(0), transfers(0), badMessages(0) {}
+
+protected:
+	virtual int SubmitMessage(struct spi_ioc_transfer *message, uint8_t count) {
+		messages++;
+		transfers += count;
+		for (uint8_t i = 0; i < count; i++) {
+			bool last = i + 1 == count;
+			if (message[i].cs_change != (last ? 0 : 1) || message[i].bits_per_word != 8 || message[i].speed_hz != _speed) {
+				badMessages++;
+			}
+			uint8_t *tx = (uint8_t *)(unsigned long)message[i].tx_buf;
+			uint8_t *rx = (uint8_t *)(unsigned long)message[i].rx_buf;
+			Bytes data(tx, tx + message[i].len);
+			chip.Access(data.data(), data.size());
+			if (rx) {
+				memcpy(rx, data.data(), data.size());
+			}
+		}
+		if (chip.streamRate) {
+			chip.Step();
+		}
+		return count;
+	}
+};
+
+#endif
@@ -0,0 +1,211 @@
+/**
+ * SimDesfireApp.h - The plain command set of a MIFARE DESFire EV1, as the application of a SimIsoDepCard.
+ *
+ * The PICC has one application, 11 22 33, with the files in files. It answers SelectApplication, GetVersion,
+ * GetApplicationIds, GetKeySettings, GetKeyVersion, GetFileIDs, GetFileSettings, ReadData and GetValue without secure
+ * messaging, and sends long responses in frames of up to frameMax data bytes, each but the last with status AF.
+ * GetVersion comes in frames of 7, 7 and 14 bytes like on the real PICC.
+ * There is no authentication: a file is only readable if its access rights grant free read access (key E).
+ * Commands in refuse are answered with the status given there instead. appGone removes the application.
+ *
+ * Released into the public domain.
+ */
+#ifndef SIMDESFIREAPP_h
+#define SIMDESFIREAPP_h
+
+#include <map>
+#include "SimIsoDepCard.h"
+
+class SimDesfireApp {
+public:
+	struct File {
+		uint8_t type;				// 0 standard data, 1 backup data, 2 value
+		uint8_t comm;				// Communication settings
+		uint16_t access;			// Access rights: read, write, read/write, change, one nibble each
+		Bytes data;
+		int32_t value;
+	};
+
+	std::map<uint8_t, File> files;
+	std::map<uint8_t, uint8_t> refuse;	// Command code -> the status it is answered with
+	bool appGone;
+	size_t frameMax;
+	Bytes commands;					// Command codes received, AF included
+	std::vector<std::pair<uint32_t, uint32_t> > reads;	// Offset and length of each ReadData
+
+	SimDesfireApp(SimIsoDepCard &picc) : appGone(false), frameMax(59), _selected(false), _pendingPos(0), _pendingStatus(0), _frameLimit(0) {
+		picc.app = [this](const Bytes &command) {
+			return Handle(command);
+		};
+	}
+
+	// A file with free access and data counting up from seed
+	void AddFile(uint8_t fid, size_t size, uint8_t seed = 0) {
+		File file = { 0, 0x00, 0xEEEE, Bytes(size), 0 };
+		for (size_t i = 0; i < size; i++) {
+			file.data[i] = (uint8_t)(i * 7 + seed + (i >> 8));
+		}
+		files[fid] = file;
+	}
+
+	size_t Count(uint8_t command) const {
+		return std::count(commands.begin(), commands.end(), command);
+	}
+
+protected:
+	bool _selected;					// The application is selected, not the PICC level
+	Bytes _pending;					// The response being sent in frames
+	size_t _pendingPos;
+	uint8_t _pendingStatus;
+	size_t _frameLimit;				// The first two frames of the pending response are this long, 0 if not limited
+
+	static uint32_t Get3(const Bytes &command, size_t at) {
+		return command[at] | command[at + 1] << 8 | command[at + 2] << 16;
+	}
+
+	static void Put3(Bytes &out, uint32_t value) {
+		out.push_back(value & 0xFF);
+		out.push_back((value >> 8) & 0xFF);
+		out.push_back((value >> 16) & 0xFF);
+	}
+
+	// The next frame of the pending response
+	Bytes Frame() {
+		size_t length = std::min(_frameLimit && _pendingPos < 2 * _frameLimit ? _frameLimit : frameMax, _pending.size() - _pendingPos);
+		Bytes frame;
+		frame.push_back(_pendingPos + length < _pending.size() ? 0xAF : _pendingStatus);
+		frame.insert(frame.end(), _pending.begin() + _pendingPos, _pending.begin() + _pendingPos + length);
+		_pendingPos += length;
+		return frame;
+	}
+
+	Bytes Respond(uint8_t status, const Bytes &data, size_t frameLimit = 0) {
+		_pending = data;
+		_pendingPos = 0;
+		_pendingStatus = status;
+		_frameLimit = frameLimit;
+		return Frame();
+	}
+
+	Bytes Fail(uint8_t status) {
+		_pending.clear();
+		_pendingPos = 0;
+		return Bytes{status};
+	}
+
+	// The file of a file command of the selected application, NULL after answering for a missing one
+	File *Find(uint8_t fid, Bytes &error) {
+		if (!_selected || !files.count(fid)) {
+			error = Fail(0xF0);
+			return NULL;
+		}
+		return &files[fid];
+	}
+
+	static bool FreeRead(const File &file) {
+		return ((file.access >> 12) & 0x0F) == 0x0E || ((file.access >> 4) & 0x0F) == 0x0E;
+	}
+
+	Bytes Handle(const Bytes &command) {
+		commands.push_back(command[0]);
+		if (command[0] == 0xAF) {
+			return _pendingPos < _pending.size() ? Frame() : Fail(0x1C);
+		}
+		if (refuse.count(command[0])) {
+			return Fail(refuse[command[0]]);
+		}
+		Bytes error;
+		switch (command[0]) {
+			case 0x5A: {							// SelectApplication
+				if (command.size() != 4) {
+					return Fail(0x7E);
+				}
+				bool picc = command[1] == 0 && command[2] == 0 && command[3] == 0;
+				bool known = command[1] == 0x11 && command[2] == 0x22 && command[3] == 0x33 && !appGone;
+				if (!picc && !known) {
+					return Fail(0xA0);
+				}
+				_selected = known;
+				return Respond(0x00, Bytes());
+			}
+			case 0x60:								// GetVersion: hardware, software, then UID and production data
+				return Respond(0x00, Bytes{0x04, 0x01, 0x01, 0x01, 0x00, 0x18, 0x05, 0x04, 0x01, 0x01, 0x01, 0x04, 0x18, 0x05,
+					0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x01, 0x02, 0x03, 0x04, 0x05, 0x20, 0x14}, 7);
+			case 0x6A:								// GetApplicationIds
+				return Respond(0x00, appGone ? Bytes() : Bytes{0x11, 0x22, 0x33});
+			case 0x45:								// GetKeySettings
+				return Respond(0x00, Bytes{0x0F, 0x05});
+			case 0x64:								// GetKeyVersion
+				return Respond(0x00, Bytes{0x42});
+			case 0x6F: {							// GetFileIDs
+				Bytes ids;
+				for (std::map<uint8_t, File>::const_iterator i = files.begin(); _selected && i != files.end(); ++i) {
+					ids.push_back(i->first);
+				}
+				return Respond(0x00, ids);
+			}
+			case 0xF5: {							// GetFileSettings
+				File *file = Find(command[1], error);
+				if (!file) {
+					return error;
+				}
+				// The access rights go out in the order MIFARE_DESFIRE_GetFileSettings() reads them
+				Bytes settings{file->type, file->comm, (uint8_t)(file->access >> 8), (uint8_t)(file->access & 0xFF)};
+				if (file->type == 2) {
+					settings.insert(settings.end(), 4, 0x00);		// Lower limit
+					settings.insert(settings.end(), {0xFF, 0xFF, 0xFF, 0x7F});
+					settings.insert(settings.end(), 5, 0x00);		// Limited credit value, not enabled
+				}
+				else {
+					Put3(settings, file->data.size());
+				}
+				return Respond(0x00, settings);
+			}
+			case 0xBD: {							// ReadData: file, offset, length
+				if (command.size() != 8) {
+					return Fail(0x7E);
+				}
+				File *file = Find(command[1], error);
+				if (!file) {
+					return error;
+				}
+				if (file->type == 2) {
+					return Fail(0x9E);
+				}
+				if (!FreeRead(*file)) {
+					return Fail(0x9D);
+				}
+				uint32_t offset = Get3(command, 2), length = Get3(command, 5);
+				reads.push_back(std::make_pair(offset, length));
+				if (offset > file->data.size() || length > file->data.size() - offset) {
+					return Fail(0xBE);
+				}
+				if (length == 0) {
+					length = file->data.size() - offset;
+				}
+				return Respond(0x00, Bytes(file->data.begin() + offset, file->data.begin() + offset + length));
+			}
+			case 0x6C: {							// GetValue
+				File *file = Find(command[1], error);
+				if (!file) {
+					return error;
+				}
+				if (file->type != 2) {
+					return Fail(0x9E);
+				}
+				if (!FreeRead(*file)) {
+					return Fail(0x9D);
+				}
+				Bytes value;
+				for (int i = 0; i < 4; i++) {
+					value.push_back(((uint32_t)file->value >> (8 * i)) & 0xFF);
+				}
+				return Respond(0x00, value);
+			}
+			default:
+				return Fail(0x1C);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * SimIRQLine.h - The IRQ pin of a FakeChip.
+ *
+ * The pin is active while an interrupt request bit is set whose source is enabled: ComIrqReg & ComIEnReg, or the
+ * CRCIRq and MfinActIRq bits of DivIrqReg & DivIEnReg (datasheet section 9.3.1.3 and 9.3.1.4). Wait() returns at once
+ * if it is; a streaming chip gets the time on air it needs, one Step() at a time, before Wait() gives up.
+ *
+ * Released into the public domain.
+ */
+#ifndef SIMIRQLINE_h
+#define SIMIRQLINE_h
+
+#include "FakeChip.h"
+#include "IRQLine.h"
+
+class SimIRQLine : public IRQLine {
+public:
+	FakeChip &chip;
+	uint32_t arms;
+	uint32_t waits;
+
+	SimIRQLine(FakeChip &chip) : chip(chip), arms(0), waits(0) {}
+
+	bool IsActive() const {
+		return (chip.reg[FakeChip::ComIrqReg] & chip.reg[FakeChip::ComIEnReg] & 0x7F) != 0 ||
+			(chip.reg[FakeChip::DivIrqReg] & chip.reg[FakeChip::DivIEnReg] & 0x14) != 0;
+	}
+
+	virtual void Arm() {
+		arms++;
+	}
+
+	virtual bool Wait(uint32_t /*timeoutUs*/) {
+		waits++;
+		for (int step = 0; step < 1000; step++) {
+			if (IsActive()) {
+				_events++;
+				return true;
+			}
+			if (!chip.streamRate) {
+				break;
+			}
+			chip.Step();
+		}
+		return false;
+	}
+};
+
+#endif
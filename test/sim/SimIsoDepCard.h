@@ -0,0 +1,226 @@
+/**
+ * SimIsoDepCard.h - A simulated ISO/IEC 14443-4 PICC in the field of a FakeChip.
+ *
+ * The PICC has a 7 byte UID and SAK 0x20. It answers RATS with its ATS, and PPS. After that it runs the half-duplex
+ * block protocol with the PICC rules of ISO/IEC 14443-4 section 7.5.4: chaining both ways, R(ACK)/R(NAK) handling,
+ * S(WTX) and S(DESELECT).
+ * Its application either comes from the app hook, or is a small built in one:
+ *  - 01 and 02 echo their data after a 00 status byte, 02 after wtxBefore waiting time extensions,
+ *  - 03 LL HH answers 00 and LLHH bytes counting up,
+ *  - 5A answers 00, 6A answers 00 11 22 33 (GetApplicationIds), anything else 1C.
+ * Frames can be lost on the way in (dropRx) or out (dropTx), or garbled on the way out (corruptTx), by their number
+ * in frameNumber. A PPS only takes effect when the chip runs at the new rates afterwards; flakyEvery loses frames
+ * at or above flakyRate, and refusePps ignores that many PPS requests.
+ *
+ * Released into the public domain.
+ */
+#ifndef SIMISODEPCARD_h
+#define SIMISODEPCARD_h
+
+#include <algorithm>
+#include <set>
+#include "FakeChip.h"
+
+class SimIsoDepCard {
+public:
+	FakeChip &chip;
+	SimCard card;
+	Bytes ats;						// FSCI 5 (64 bytes), FWI 8, CID supported
+	bool cidIn;						// Blocks sent to the PCD carry a CID
+	int frameNumber;				// Frames received so far
+	std::set<int> dropRx, dropTx, corruptTx;
+	std::vector<Bytes> log;			// Frames received, without CRC_A
+	int wtxBefore;					// S(WTX) requests before the answer to command 02
+	int dsi, dri;					// Bit rates agreed with PPS
+	int ppsCount;
+	int refusePps;
+	bool refusedPpsSwitches;		// A refused PPS still switches the PICC to the new rates
+	int flakyRate, flakyEvery;
+	std::function<Bytes(const Bytes &command)> app;
+
+	SimIsoDepCard(FakeChip &chip) : chip(chip), card(Bytes{0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66}, 0x20),
+			ats{0x06, 0x75, 0x77, 0x81, 0x02, 0x80}, cidIn(true), frameNumber(0), wtxBefore(0), dsi(0), dri(0), ppsCount(0),
+			refusePps(0), refusedPpsSwitches(false), flakyRate(99), flakyEvery(0), _fsd(256), _blockNumber(1),
+			_active(false), _responsePos(0), _wtxLeft(0) {
+		chip.cards.push_back(&card);
+		chip.onFieldOff = [this]() {
+			_active = false;
+			dsi = dri = 0;
+		};
+		chip.onOther = [this](const Bytes &tx, Bytes &rx, int &/*rxBits*/, bool &any) {
+			Handle(tx, rx, any);
+		};
+	}
+
+protected:
+	int _fsd;
+	int _blockNumber;
+	bool _active;
+	Bytes _last;					// The last block sent, for retransmission
+	Bytes _command;					// The command being received in chained blocks
+	Bytes _response;
+	size_t _responsePos;			// The part of _response sent so far
+	int _wtxLeft;
+
+	// The chip runs at the rates the PICC agreed to
+	bool RatesMatch() const {
+		return ((chip.reg[FakeChip::TxModeReg] >> 4) & 7) == dri && ((chip.reg[FakeChip::RxModeReg] >> 4) & 7) == dsi;
+	}
+
+	Bytes Block(uint8_t pcb, const Bytes &inf) const {
+		Bytes block;
+		block.push_back(pcb | (cidIn ? 0x08 : 0));
+		if (cidIn) {
+			block.push_back(0);
+		}
+		block.insert(block.end(), inf.begin(), inf.end());
+		return block;
+	}
+
+	// The next I-block of the response, chained if more follows
+	Bytes NextChunk() {
+		size_t maxInf = _fsd - (cidIn ? 2 : 1) - 2;
+		size_t length = std::min(maxInf, _response.size() - _responsePos);
+		Bytes inf(_response.begin() + _responsePos, _response.begin() + _responsePos + length);
+		_responsePos += length;
+		return Block(0x02 | _blockNumber | (_responsePos < _response.size() ? 0x10 : 0), inf);
+	}
+
+	void Process() {
+		_response.clear();
+		_responsePos = 0;
+		if (app) {
+			_response = app(_command);
+			return;
+		}
+		switch (_command[0]) {
+			case 0x01:
+			case 0x02:
+				_response.push_back(0x00);
+				_response.insert(_response.end(), _command.begin() + 1, _command.end());
+				break;
+			case 0x03:
+				_response.push_back(0x00);
+				for (int i = 0; i < (_command[1] | _command[2] << 8); i++) {
+					_response.push_back(i);
+				}
+				break;
+			case 0x5A:
+				_response = Bytes{0x00};
+				break;
+			case 0x6A:
+				_response = Bytes{0x00, 0x11, 0x22, 0x33};
+				break;
+			default:
+				_response = Bytes{0x1C};
+				break;
+		}
+		if (_command[0] == 0x02) {
+			_wtxLeft = wtxBefore;
+		}
+	}
+
+	Bytes Answer() {
+		if (_wtxLeft > 0) {
+			_wtxLeft--;
+			return Block(0xF2, Bytes{0x03});
+		}
+		return NextChunk();
+	}
+
+	void Handle(const Bytes &frame, Bytes &rx, bool &any) {
+		if (!SimCheckCRC(frame)) {
+			return;
+		}
+		Bytes tx(frame.begin(), frame.end() - 2);
+		int number = frameNumber++;
+		log.push_back(tx);
+		if (dropRx.count(number) || !RatesMatch()) {
+			return;
+		}
+		if (flakyEvery && std::max(dsi, dri) >= flakyRate && number % flakyEvery == 0) {
+			return;
+		}
+
+		Bytes out;
+		if (tx[0] == 0xE0) {											// RATS
+			_active = true;
+			_blockNumber = 1;
+			_fsd = 256;
+			dsi = dri = 0;
+			out = ats;
+		}
+		else if (_active && (tx[0] & 0xF0) == 0xD0 && tx.size() == 3) {	// PPS
+			ppsCount++;
+			if (refusePps) {
+				refusePps--;
+				if (refusedPpsSwitches) {
+					dsi = (tx[2] >> 2) & 3;
+					dri = tx[2] & 3;
+				}
+				return;
+			}
+			rx = Bytes{tx[0]};
+			SimAppendCRC(rx);
+			any = true;
+			dsi = (tx[2] >> 2) & 3;
+			dri = tx[2] & 3;
+			return;
+		}
+		else if (!_active) {
+			return;
+		}
+		else {
+			uint8_t pcb = tx[0];
+			size_t header = pcb & 0x08 ? 2 : 1;
+			if ((pcb & 0xC0) == 0x00) {									// I-block, rule C: take its block number
+				_blockNumber = pcb & 1;
+				_command.insert(_command.end(), tx.begin() + header, tx.end());
+				if (pcb & 0x10) {
+					out = Block(0xA2 | _blockNumber, Bytes());
+				}
+				else {
+					Process();
+					_command.clear();
+					out = Answer();
+				}
+			}
+			else if ((pcb & 0xC0) == 0x80) {							// R-block
+				if ((pcb & 1) == _blockNumber) {
+					out = _last;										// Rule 11
+				}
+				else if (pcb & 0x10) {
+					out = Block(0xA2 | _blockNumber, Bytes());			// Rule 12
+				}
+				else {
+					_blockNumber ^= 1;									// Rule 13
+					out = NextChunk();
+				}
+			}
+			else if ((pcb & 0xF7) == 0xF2) {							// S(WTX) response
+				out = Answer();
+			}
+			else if ((pcb & 0xF7) == 0xC2) {							// S(DESELECT)
+				_active = false;
+				out = tx;
+				card.state = SimCard::HALT;
+				dsi = dri = 0;
+			}
+			else {
+				return;
+			}
+		}
+		_last = out;
+		if (dropTx.count(number)) {
+			return;
+		}
+		SimAppendCRC(out);
+		if (corruptTx.count(number)) {
+			out.back() ^= 0x5A;
+		}
+		rx = out;
+		any = true;
+	}
+};
+
+#endif
@@ -0,0 +1,55 @@
+/*
+* wiringPi.cpp - Host stand-in for wiringPi.
+* NOTE: Please also check the comments in wiringPi.h.
+*/
+
+#include "wiringPi.h"
+#include "wiringPiSPI.h"
+
+static unsigned long long stubMicros = 0;	// The simulated clock
+
+int wiringPiSetup(void) {
+	return 0;
+}
+
+void pinMode(int /*pin*/, int /*mode*/) {
+}
+
+int digitalRead(int /*pin*/) {
+	return HIGH;		// The reset pin: not in power down
+}
+
+void digitalWrite(int /*pin*/, int /*value*/) {
+}
+
+void delay(unsigned int ms) {
+	stubMicros += (unsigned long long)ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+	stubMicros += us;
+}
+
+unsigned int millis(void) {
+	return (unsigned int)(stubMicros / 1000);
+}
+
+void StubAdvanceMillis(unsigned int ms) {
+	stubMicros += (unsigned long long)ms * 1000;
+}
+
+int wiringPiSPIGetFd(int /*channel*/) {
+	return -1;
+}
+
+int wiringPiSPIDataRW(int /*channel*/, unsigned char * /*data*/, int /*len*/) {
+	return -1;
+}
+
+int wiringPiSPISetup(int /*channel*/, int /*speed*/) {
+	return -1;
+}
+
+int wiringPiSPISetupMode(int /*channel*/, int /*speed*/, int /*mode*/) {
+	return -1;
+}
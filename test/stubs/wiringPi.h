@@ -0,0 +1,25 @@
+/**
+ * wiringPi.h - Host stand-in for the wiringPi GPIO and timing functions the library uses.
+ *
+ * The tests run on any Linux host, without GPIO. Time is simulated: delay() and delayMicroseconds() return at once and
+ * advance the clock millis() reads, and a test can advance it with StubAdvanceMillis().
+ */
+#ifndef WIRINGPI_STUB_h
+#define WIRINGPI_STUB_h
+
+#define INPUT	0
+#define OUTPUT	1
+#define LOW		0
+#define HIGH	1
+
+int wiringPiSetup(void);
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+void delay(unsigned int ms);
+void delayMicroseconds(unsigned int us);
+unsigned int millis(void);
+
+void StubAdvanceMillis(unsigned int ms);
+
+#endif
@@ -0,0 +1,13 @@
+/**
+ * wiringPiSPI.h - Host stand-in for the wiringPi SPI functions. There is no bus: the tests give the library a
+ * simulated SPITransport instead.
+ */
+#ifndef WIRINGPISPI_STUB_h
+#define WIRINGPISPI_STUB_h
+
+int wiringPiSPIGetFd(int channel);
+int wiringPiSPIDataRW(int channel, unsigned char *data, int len);
+int wiringPiSPISetup(int channel, int speed);
+int wiringPiSPISetupMode(int channel, int speed, int mode);
+
+#endif
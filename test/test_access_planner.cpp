@@ -0,0 +1,187 @@
+/**
+ * test_access_planner.cpp - AccessPlanner key choice, checked against the access condition tables of the MIFARE
+ * Classic datasheets, and a Run() on a simulated MIFARE Classic 1K.
+ *
+ * The tables below are written out from the datasheets, independent of the ones in AccessPlanner.cpp. Key B counts as
+ * data while the trailer leaves it readable (trailer conditions 000, 001 and 010), and a key that is not known is
+ * never chosen.
+ */
+#include "FakeChip.h"
+#include "Check.h"
+#include "AccessPlanner.h"
+
+// AllowedKeys() and the key sets are protected
+struct Probe : public AccessPlanner {
+	enum { N = KEY_NONE, A = KEY_A, B = KEY_B, AB = KEY_AB };
+
+	Probe(MFRC522 *reader, MFRC522::MIFARE_Key *keyA, MFRC522::MIFARE_Key *keyB) : AccessPlanner(reader, keyA, keyB) {}
+
+	// Sets the conditions of sector 1: g0 for block 4, g3 for the trailer, block 5 and 6 get 000
+	void Set(byte g0, byte g3) {
+		byte bits[3];
+		MFRC522::MIFARE_SetAccessBits(bits, g0, 0, 0, g3);
+		CHECK(SetAccessBits(1, bits));
+	}
+
+	byte Keys(Operation op, byte block) const {
+		Request request = { op, block, NULL, 0, MFRC522::STATUS_OK };
+		return AllowedKeys(&request);
+	}
+};
+
+// Data blocks: read, write, increment, decrement/transfer/restore
+static const byte dataTable[8][4] = {
+	{ Probe::AB,	Probe::AB,	Probe::AB,	Probe::AB },	// 000 transport configuration
+	{ Probe::AB,	Probe::N,	Probe::N,	Probe::AB },	// 001 value block, decrement only
+	{ Probe::AB,	Probe::N,	Probe::N,	Probe::N },		// 010 read only
+	{ Probe::B,		Probe::B,	Probe::N,	Probe::N },		// 011
+	{ Probe::AB,	Probe::B,	Probe::N,	Probe::N },		// 100
+	{ Probe::B,		Probe::N,	Probe::N,	Probe::N },		// 101
+	{ Probe::AB,	Probe::B,	Probe::B,	Probe::AB },	// 110 value block
+	{ Probe::N,		Probe::N,	Probe::N,	Probe::N }		// 111 never
+};
+
+// Trailer: read and write of the access bits
+static const byte trailerTable[8][2] = {
+	{ Probe::A,		Probe::N },		// 000
+	{ Probe::A,		Probe::A },		// 001 transport configuration
+	{ Probe::A,		Probe::N },		// 010
+	{ Probe::AB,	Probe::B },		// 011
+	{ Probe::AB,	Probe::N },		// 100
+	{ Probe::AB,	Probe::B },		// 101
+	{ Probe::AB,	Probe::N },		// 110
+	{ Probe::AB,	Probe::N }		// 111
+};
+
+static const AccessPlanner::Operation dataOps[4] = {
+	AccessPlanner::OP_READ, AccessPlanner::OP_WRITE, AccessPlanner::OP_INCREMENT, AccessPlanner::OP_DECREMENT
+};
+
+static void Tables() {
+	FakeChip chip;
+	MFRC522 reader(&chip, UINT8_MAX);
+	MFRC522::MIFARE_Key keyA, keyB;
+	Probe planner(&reader, &keyA, &keyB);
+
+	// Data conditions under trailer condition 011, where key B is a key
+	for (byte c = 0; c < 8; c++) {
+		planner.Set(c, 3);
+		for (int op = 0; op < 4; op++) {
+			if (planner.Keys(dataOps[op], 4) != dataTable[c][op]) {
+				printf("data condition %d, operation %d: keys %d, expected %d\n", c, op, planner.Keys(dataOps[op], 4), dataTable[c][op]);
+				CHECK(false);
+			}
+		}
+		CHECK(planner.Keys(AccessPlanner::OP_RESTORE, 4) == dataTable[c][3]);
+		CHECK(planner.Keys(AccessPlanner::OP_TRANSFER, 4) == dataTable[c][3]);
+	}
+
+	// Trailer conditions; under 000, 001 and 010 key B is readable, so the data blocks lose it too
+	for (byte c = 0; c < 8; c++) {
+		planner.Set(0, c);
+		if (planner.Keys(AccessPlanner::OP_READ, 7) != trailerTable[c][0] || planner.Keys(AccessPlanner::OP_WRITE, 7) != trailerTable[c][1]) {
+			printf("trailer condition %d: keys %d %d, expected %d %d\n", c, planner.Keys(AccessPlanner::OP_READ, 7),
+				planner.Keys(AccessPlanner::OP_WRITE, 7), trailerTable[c][0], trailerTable[c][1]);
+			CHECK(false);
+		}
+		CHECK(planner.Keys(AccessPlanner::OP_INCREMENT, 7) == Probe::N);
+		CHECK(planner.Keys(AccessPlanner::OP_WRITE, 4) == (c <= 2 ? Probe::A : Probe::AB));
+	}
+
+	// Block 0 is read only whatever its condition
+	byte bits[3];
+	MFRC522::MIFARE_SetAccessBits(bits, 0, 0, 0, 3);
+	CHECK(planner.SetAccessBits(0, bits));
+	CHECK(planner.Keys(AccessPlanner::OP_READ, 0) == Probe::AB);
+	CHECK(planner.Keys(AccessPlanner::OP_WRITE, 0) == Probe::N);
+	CHECK(planner.Keys(AccessPlanner::OP_WRITE, 1) == Probe::AB);
+
+	// Malformed access bits are refused
+	bits[0] ^= 0x01;
+	CHECK(!planner.SetAccessBits(2, bits));
+
+	// A key that is not known is never allowed
+	Probe onlyA(&reader, &keyA, NULL);
+	onlyA.Set(4, 3);
+	CHECK(onlyA.Keys(AccessPlanner::OP_READ, 4) == Probe::A);
+	CHECK(onlyA.Keys(AccessPlanner::OP_WRITE, 4) == Probe::N);
+	Probe onlyB(&reader, NULL, &keyB);
+	onlyB.Set(4, 3);
+	CHECK(onlyB.Keys(AccessPlanner::OP_READ, 4) == Probe::B);
+	CHECK(onlyB.Keys(AccessPlanner::OP_WRITE, 4) == Probe::B);
+}
+
+// A run over two sectors of a simulated card
+static void Plan() {
+	FakeChip chip;
+	SimCard card(Bytes{0x12, 0x34, 0x56, 0x78}, 0x08);
+	MFRC522 reader(&chip, UINT8_MAX);
+	MFRC522::MIFARE_Key keyA, keyB;
+	memset(keyA.keyByte, 0xA1, sizeof(keyA.keyByte));
+	memset(keyB.keyByte, 0xB2, sizeof(keyB.keyByte));
+	chip.hideKeys = true;
+	chip.checkKeys = true;
+	chip.cards.push_back(&card);
+	for (int sector = 0; sector < 16; sector++) {
+		byte *trailer = card.mem[sector * 4 + 3];
+		memcpy(trailer, keyA.keyByte, 6);
+		MFRC522::MIFARE_SetAccessBits(&trailer[6], 4, 0, 2, 3);		// Block 0 read AB write B, block 2 read only
+		memcpy(&trailer[10], keyB.keyByte, 6);
+	}
+	for (int block = 4; block < 12; block++) {
+		if (block % 4 != 3) {
+			memset(card.mem[block], block, 16);
+		}
+	}
+	reader.PCD_Init();
+	CHECK(reader.PICC_IsNewCardPresent() && reader.PICC_ReadCardSerial());
+
+	// Sector 1 given, sector 2 read from the card. Alternating reads and writes: a planner choosing per request would
+	// authenticate with A, B, A, B; key B does them all.
+	AccessPlanner planner(&reader, &keyA, &keyB);
+	CHECK(planner.SetAccessBits(1, &card.mem[7][6]));
+	byte data[6][16];
+	byte written[16];
+	memset(written, 0x5C, sizeof(written));
+	memcpy(data[1], written, 16);
+	memcpy(data[4], written, 16);
+	AccessPlanner::Request requests[] = {
+		{ AccessPlanner::OP_READ,	4,	data[0],	0, MFRC522::STATUS_OK },
+		{ AccessPlanner::OP_WRITE,	4,	data[1],	0, MFRC522::STATUS_OK },
+		{ AccessPlanner::OP_READ,	6,	data[2],	0, MFRC522::STATUS_OK },
+		{ AccessPlanner::OP_READ,	8,	data[3],	0, MFRC522::STATUS_OK },
+		{ AccessPlanner::OP_WRITE,	8,	data[4],	0, MFRC522::STATUS_OK },
+		{ AccessPlanner::OP_WRITE,	6,	data[5],	0, MFRC522::STATUS_OK }		// Read only: never sent
+	};
+	chip.authLog.clear();
+	chip.authKeyLog.clear();
+	CHECK(planner.Run(&reader.uid, requests, 6) == MFRC522::STATUS_INVALID);
+	reader.PCD_StopCrypto1();
+	for (int i = 0; i < 5; i++) {
+		CHECK(requests[i].status == MFRC522::STATUS_OK);
+	}
+	CHECK(requests[5].status == MFRC522::STATUS_INVALID);
+	CHECK(memcmp(data[0], (Bytes(16, 4)).data(), 16) == 0 && memcmp(data[2], (Bytes(16, 6)).data(), 16) == 0);
+	CHECK(memcmp(card.mem[4], written, 16) == 0 && memcmp(card.mem[8], written, 16) == 0);
+	CHECK(memcmp(card.mem[6], (Bytes(16, 6)).data(), 16) == 0);
+	// Sector 1: key B once. Sector 2: key A reads the trailer and block 8, key B writes it.
+	CHECK(planner.GetAuthentications() == 3);
+	CHECK((chip.authLog == std::vector<int>{7, 11, 11}));
+	CHECK((chip.authKeyLog == Bytes{0x61, 0x60, 0x61}));
+
+	// The same card again: the learned access bits are kept, sector 2 needs key B only
+	AccessPlanner::Request again[] = {
+		{ AccessPlanner::OP_READ,	8,	data[3],	0, MFRC522::STATUS_OK },
+		{ AccessPlanner::OP_WRITE,	8,	data[4],	0, MFRC522::STATUS_OK }
+	};
+	chip.authKeyLog.clear();
+	CHECK(planner.Run(&reader.uid, again, 2) == MFRC522::STATUS_OK);
+	reader.PCD_StopCrypto1();
+	CHECK(planner.GetAuthentications() == 1 && (chip.authKeyLog == Bytes{0x61}));
+}
+
+int main() {
+	Tables();
+	Plan();
+	return CheckResult("test_access_planner");
+}
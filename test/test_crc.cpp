@@ -0,0 +1,83 @@
+/**
+ * test_crc.cpp - MFRC522::CRC_A() on the host against the CRC coprocessor of a simulated chip.
+ *
+ * The simulated coprocessor computes the CRC bit by bit, independent of the table driven CRC_A(). Random frames of
+ * every length up to the FIFO size must give the same result both ways, and with host CRC enabled a SELECT and a
+ * READ must not need the coprocessor round trips any more.
+ */
+#include <random>
+#include "FakeChip.h"
+#include "Check.h"
+#include "MFRC522.h"
+
+/**
+ * Bus transactions of a SELECT and a READ of block 4.
+ */
+static void CountTransactions(bool hostCRC, uint32_t *select, uint32_t *read) {
+	FakeChip chip;
+	SimCard card(Bytes{1, 2, 3, 4}, 0x08);
+	chip.cards.push_back(&card);
+	MFRC522 mfrc522(&chip, UINT8_MAX);
+	mfrc522.PCD_Init();
+	mfrc522.PCD_SetHostCRC(hostCRC);
+
+	byte atqa[2];
+	byte size = sizeof(atqa);
+	CHECK(mfrc522.PICC_RequestA(atqa, &size) == MFRC522::STATUS_OK);
+	uint32_t start = chip.GetTransactionCount();
+	MFRC522::Uid uid;
+	CHECK(mfrc522.PICC_Select(&uid) == MFRC522::STATUS_OK);
+	*select = chip.GetTransactionCount() - start;
+	start = chip.GetTransactionCount();
+	byte block[18];
+	size = sizeof(block);
+	CHECK(mfrc522.MIFARE_Read(4, block, &size) == MFRC522::STATUS_OK && block[0] == 4 * 16);
+	*read = chip.GetTransactionCount() - start;
+}
+
+int main() {
+	FakeChip chip;
+	MFRC522 mfrc522(&chip, UINT8_MAX);
+	mfrc522.PCD_Init();
+
+	// Known values of ISO/IEC 14443-3 annex B
+	byte result[2];
+	byte zeros[2] = {0x00, 0x00};
+	MFRC522::CRC_A(zeros, 2, result);
+	CHECK(result[0] == 0xA0 && result[1] == 0x1E);
+	byte bytes[4] = {0x12, 0x34};
+	MFRC522::CRC_A(bytes, 2, result);
+	CHECK(result[0] == 0x26 && result[1] == 0xCF);
+	MFRC522::CRC_A(bytes, 0, result);
+	CHECK(result[0] == 0x63 && result[1] == 0x63);
+
+	std::mt19937 random(1);
+	int mismatches = 0;
+	for (int i = 0; i < 2000; i++) {
+		byte data[64];
+		byte length = i < 64 ? i : random() % 64;
+		for (byte j = 0; j < length; j++) {
+			data[j] = random();
+		}
+		byte host[2], coprocessor[2];
+		MFRC522::CRC_A(data, length, host);
+		CHECK(mfrc522.PCD_CalculateCRC_Coprocessor(data, length, coprocessor) == MFRC522::STATUS_OK);
+		uint16_t independent = SimCRC_A(data, length);
+		if (host[0] != coprocessor[0] || host[1] != coprocessor[1] || host[0] != (independent & 0xFF) || host[1] != (independent >> 8)) {
+			mismatches++;
+		}
+		mfrc522.PCD_SetHostCRC(i & 1);
+		CHECK(mfrc522.PCD_CalculateCRC(data, length, coprocessor) == MFRC522::STATUS_OK);
+		CHECK(host[0] == coprocessor[0] && host[1] == coprocessor[1]);
+	}
+	CHECK(mismatches == 0);
+
+	uint32_t selectChip, readChip, selectHost, readHost;
+	CountTransactions(false, &selectChip, &readChip);
+	CountTransactions(true, &selectHost, &readHost);
+	printf("transactions with coprocessor CRC: SELECT %u READ %u, with host CRC: SELECT %u READ %u\n", selectChip, readChip, selectHost, readHost);
+	CHECK(selectHost < selectChip);
+	CHECK(readHost < readChip);
+
+	return CheckResult("test_crc");
+}
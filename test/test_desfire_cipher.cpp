@@ -0,0 +1,151 @@
+/**
+ * test_desfire_cipher.cpp - DesfireCipher against published known-answer vectors.
+ *
+ * AES-128 from FIPS-197 appendices B and C.1, AES CBC from NIST SP 800-38A, AES CMAC from RFC 4493, DES from FIPS 46
+ * worked examples, 2K3DES and 3K3DES CBC and 3K3DES CMAC as OpenSSL computes them, and the CRC32 check value of
+ * "123456789". The AES vectors go through the class, whichever implementation it picked, and through the portable
+ * functions directly, which is why this test includes DesfireCipher.cpp instead of linking the library.
+ */
+#include <random>
+#include <string>
+#include <vector>
+#include "Check.h"
+#include "DesfireCipher.cpp"
+
+typedef std::vector<uint8_t> Bytes;
+
+static Bytes Hex(const char *hex) {
+	Bytes bytes;
+	for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+		unsigned value;
+		sscanf(&hex[i], "%2x", &value);
+		bytes.push_back(value);
+	}
+	return bytes;
+}
+
+// The key schedule is protected
+struct Probe : public DesfireCipher {
+	using DesfireCipher::_schedule;
+};
+
+// An AES block through the class, and through the portable code with the class's key schedule
+static bool AesBlock(const char *key, const char *plain, const char *cipher) {
+	Probe aes;
+	CHECK(aes.SetKey(DesfireCipher::KEY_AES, Hex(key).data()));
+	Bytes in = Hex(plain), expected = Hex(cipher);
+	uint8_t out[16], back[16], portable[16], portableBack[16];
+	aes.EncryptBlock(in.data(), out);
+	aes.DecryptBlock(out, back);
+	AesEncryptPortable(aes._schedule.aes.encrypt, in.data(), portable);
+	AesDecryptPortable(aes._schedule.aes.encrypt, portable, portableBack);
+	return memcmp(out, expected.data(), 16) == 0 && memcmp(back, in.data(), 16) == 0
+		&& memcmp(portable, expected.data(), 16) == 0 && memcmp(portableBack, in.data(), 16) == 0;
+}
+
+static bool DesBlock(DesfireCipher::KeyType type, const char *key, const char *plain, const char *cipher) {
+	DesfireCipher des;
+	CHECK(des.SetKey(type, Hex(key).data()));
+	Bytes in = Hex(plain), expected = Hex(cipher);
+	uint8_t out[8], back[8];
+	des.EncryptBlock(in.data(), out);
+	des.DecryptBlock(out, back);
+	return des.GetBlockSize() == 8 && memcmp(out, expected.data(), 8) == 0 && memcmp(back, in.data(), 8) == 0;
+}
+
+// CBC with the IV handed over between two calls, and back
+static bool Cbc(DesfireCipher::KeyType type, const char *key, const char *iv, const char *plain, const char *cipher) {
+	DesfireCipher c;
+	CHECK(c.SetKey(type, Hex(key).data()));
+	Bytes in = Hex(plain), expected = Hex(cipher), chain = Hex(iv);
+	Bytes out(in.size()), back(in.size());
+	size_t half = in.size() / 2 / c.GetBlockSize() * c.GetBlockSize();
+	c.EncryptCBC(chain.data(), in.data(), out.data(), half);
+	c.EncryptCBC(chain.data(), in.data() + half, out.data() + half, in.size() - half);
+	bool ok = out == expected && memcmp(chain.data(), &expected[expected.size() - chain.size()], chain.size()) == 0;
+	chain = Hex(iv);
+	c.DecryptCBC(chain.data(), out.data(), back.data(), out.size());
+	return ok && back == in;
+}
+
+static bool Cmac(DesfireCipher::KeyType type, const char *key, const char *message, const char *mac) {
+	DesfireCipher c;
+	CHECK(c.SetKey(type, Hex(key).data()));
+	Bytes data = Hex(message), expected = Hex(mac);
+	uint8_t iv[DESFIRE_MAX_BLOCK_SIZE] = { 0 };
+	c.Cmac(iv, data.data(), data.size());
+	return memcmp(iv, expected.data(), c.GetBlockSize()) == 0;
+}
+
+int main() {
+	printf("AES: %s\n", DesfireCipher::GetImplementationName());
+
+	// FIPS-197 appendix C.1 and appendix B
+	CHECK(AesBlock("000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a"));
+	CHECK(AesBlock("2b7e151628aed2a6abf7158809cf4f3c", "3243f6a8885a308d313198a2e0370734", "3925841d02dc09fbdc118597196a0b32"));
+
+	// The instructions, if the CPU has them, and the portable code agree on random keys and blocks
+	std::mt19937 random(4493);
+	bool same = true;
+	for (int n = 0; n < 1000; n++) {
+		uint8_t key[16], in[16], out[16], portable[16];
+		for (int i = 0; i < 16; i++) {
+			key[i] = random();
+			in[i] = random();
+		}
+		Probe aes;
+		aes.SetKey(DesfireCipher::KEY_AES, key);
+		aes.EncryptBlock(in, out);
+		AesEncryptPortable(aes._schedule.aes.encrypt, in, portable);
+		same = same && memcmp(out, portable, 16) == 0;
+		aes.DecryptBlock(in, out);
+		AesDecryptPortable(aes._schedule.aes.encrypt, in, portable);
+		same = same && memcmp(out, portable, 16) == 0;
+	}
+	CHECK(same);
+
+	// RFC 4493 section 4: AES-CMAC of 0, 16, 40 and 64 bytes
+	const char *rfcKey = "2b7e151628aed2a6abf7158809cf4f3c";
+	const char *rfcMessage = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+	CHECK(Cmac(DesfireCipher::KEY_AES, rfcKey, "", "bb1d6929e95937287fa37d129b756746"));
+	CHECK(Cmac(DesfireCipher::KEY_AES, rfcKey, std::string(rfcMessage, 32).c_str(), "070a16b46b4d4144f79bdd9dd04a287c"));
+	CHECK(Cmac(DesfireCipher::KEY_AES, rfcKey, std::string(rfcMessage, 80).c_str(), "dfa66747de9ae63030ca32611497c827"));
+	CHECK(Cmac(DesfireCipher::KEY_AES, rfcKey, rfcMessage, "51f0bebf7e3b9d92fc49741779363cfe"));
+
+	// DES: the worked example of FIPS 46 tutorials and a key that maps 8787878787878787 to zeros
+	CHECK(DesBlock(DesfireCipher::KEY_DES, "133457799bbcdff1", "0123456789abcdef", "85e813540f0ab405"));
+	CHECK(DesBlock(DesfireCipher::KEY_DES, "0e329232ea6d0d73", "8787878787878787", "0000000000000000"));
+	// 2K3DES with K1 = K2 and 3K3DES with K1 = K2 = K3 are single DES
+	CHECK(DesBlock(DesfireCipher::KEY_2K3DES, "133457799bbcdff1133457799bbcdff1", "0123456789abcdef", "85e813540f0ab405"));
+	CHECK(DesBlock(DesfireCipher::KEY_3K3DES, "133457799bbcdff1133457799bbcdff1133457799bbcdff1", "0123456789abcdef", "85e813540f0ab405"));
+
+	// 2K3DES and 3K3DES CBC (openssl enc -des-ede-cbc / -des-ede3-cbc -nopad)
+	const char *plain = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51";
+	CHECK(Cbc(DesfireCipher::KEY_2K3DES, "0123456789abcdef23456789abcdef01", "f69f2445df4f9b17", plain,
+		"7401ce1eab6d003caff84bf47b36cc2154f0238f9ffecd8f6acf118392b45581"));
+	CHECK(Cbc(DesfireCipher::KEY_3K3DES, "0123456789abcdef23456789abcdef01456789abcdef0123", "f69f2445df4f9b17", plain,
+		"2079c3d53aa763e193b79e2569ab5262516570481f25b50f73c0bda85c8e0da7"));
+	// AES CBC, NIST SP 800-38A F.2.1
+	CHECK(Cbc(DesfireCipher::KEY_AES, rfcKey, "000102030405060708090a0b0c0d0e0f", plain,
+		"7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"));
+
+	// 3K3DES CMAC (openssl mac -cipher DES-EDE3-CBC CMAC), key of NIST SP 800-38B's TDEA examples
+	const char *tdeaKey = "8aa83bf8cbda10620bc1bf19fbb6cd58bc313d4a371ca8b5";
+	CHECK(Cmac(DesfireCipher::KEY_3K3DES, tdeaKey, "", "b7a688e122ffaf95"));
+	CHECK(Cmac(DesfireCipher::KEY_3K3DES, tdeaKey, "6bc1bee22e409f96e93d7e117393172a", "286d394673448197"));
+
+	// Legacy sending of one block is the decryption function
+	DesfireCipher des;
+	CHECK(des.SetKey(DesfireCipher::KEY_DES, Hex("133457799bbcdff1").data()));
+	uint8_t sent[8];
+	des.LegacySend(Hex("85e813540f0ab405").data(), sent, 8);
+	CHECK(memcmp(sent, Hex("0123456789abcdef").data(), 8) == 0);
+
+	// CRC32 (IEEE 802.3) check value CBF43926, DESFire leaves out the final inversion; it continues over split data
+	const uint8_t check[] = "123456789";
+	CHECK(DesfireCipher::Crc32(check, 9) == (uint32_t)~0xCBF43926);
+	CHECK(DesfireCipher::Crc32(check + 4, 5, DesfireCipher::Crc32(check, 4)) == (uint32_t)~0xCBF43926);
+
+	return CheckResult("test_desfire_cipher");
+}
@@ -0,0 +1,188 @@
+/**
+ * test_desfire_directory.cpp - DesfireDirectory in a CardSession, against a simulated DESFire.
+ *
+ * The first tap of a card discovers it. On a repeat tap SelectApplication is answered from the directory and goes to
+ * the card with the next command, a ReadData of the whole file takes its size from the directory: the card sees the
+ * select and the read only. A missing file or application drops the entry, so does a length error of a read whose file
+ * settings came from the directory; the next tap discovers the card again. Past DESFIRE_DIRECTORY_SIZE cards the least
+ * recently used one is replaced.
+ */
+#include "SimDesfireApp.h"
+#include "Check.h"
+#include "CardOperation.h"
+#include "DesfireDirectory.h"
+
+#define FILE_SIZE	200
+
+struct DirectoryTest {
+	FakeChip chip;
+	SimIsoDepCard picc;
+	SimDesfireApp app;
+	DESFire reader;
+	PresenceTracker tracker;
+	DesfireDirectory directory;
+	CardSession session;
+
+	DirectoryTest() : picc(chip), app(picc), reader(&chip, UINT8_MAX), tracker(&reader), directory(&reader),
+			session(&reader, &tracker, NULL, &directory) {
+		app.AddFile(1, FILE_SIZE);
+		reader.PCD_Init();
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	}
+
+	// One tap: SelectApplication 11 22 33 and a ReadData of all of file 1 in a session of their own
+	CardOperation Tap() {
+		CardOperation select = CardOperation();
+		select.type = CardOperation::OP_DESFIRE_SELECT_APPLICATION;
+		select.data = Bytes{0x11, 0x22, 0x33};
+		CardOperation read = CardOperation();
+		read.type = CardOperation::OP_DESFIRE_READ_DATA;
+		read.block = 1;
+		app.commands.clear();
+		CHECK(session.Begin() == MFRC522::STATUS_OK);
+		if (session.Run(&select)) {
+			session.Run(&read);
+		}
+		else {
+			read = select;
+		}
+		session.End();
+		return read;
+	}
+
+	// The DESFire commands of the last tap, without the AF frames
+	Bytes Commands() const {
+		Bytes commands;
+		for (size_t i = 0; i < app.commands.size(); i++) {
+			if (app.commands[i] != 0xAF) {
+				commands.push_back(app.commands[i]);
+			}
+		}
+		return commands;
+	}
+
+	// The card leaves and comes back with another UID
+	void NewCard(byte last) {
+		chip.cards.clear();
+		for (int i = 0; i < PRESENCE_REMOVE_AFTER; i++) {
+			tracker.Poll();
+		}
+		CHECK(!tracker.IsPresent());
+		picc.card.uid.back() = last;
+		picc.card.state = SimCard::IDLE;
+		chip.cards.push_back(&picc.card);
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	}
+};
+
+static void RepeatTap() {
+	DirectoryTest test;
+
+	// The first tap discovers the card
+	CardOperation op = test.Tap();
+	CHECK(op.status == MFRC522::STATUS_OK && op.data == test.app.files[1].data);
+	CHECK(test.directory.GetCount() == 1 && test.app.Count(0x60) == 1 && test.app.Count(0xF5) == 1);
+
+	// The repeat tap: the deferred select and the read, with the length from the directory
+	uint32_t hits = test.directory.GetHits();
+	op = test.Tap();
+	CHECK(op.status == MFRC522::STATUS_OK && op.data == test.app.files[1].data);
+	CHECK((test.Commands() == Bytes{0x5A, 0xBD}));
+	CHECK(test.app.reads.back() == std::make_pair(0u, (uint32_t)FILE_SIZE));
+	CHECK(test.directory.GetHits() == hits + 2 && test.directory.GetSavedFrames() > 0);
+}
+
+static void Invalidation() {
+	DirectoryTest test;
+	MFRC522::Uid uid = test.tracker.GetUid();
+	test.Tap();
+	CHECK(test.directory.Find(&uid) != NULL);
+
+	// The file is gone: MF_FILE_NOT_FOUND drops the entry, the next tap discovers the card again
+	Bytes data = test.app.files[1].data;
+	test.app.files.erase(1);
+	CardOperation op = test.Tap();
+	CHECK(op.status == MFRC522::STATUS_OK && op.desfireStatus == DESFire::MF_FILE_NOT_FOUND);
+	CHECK((test.Commands() == Bytes{0x5A, 0xBD}));
+	CHECK(test.directory.Find(&uid) == NULL && test.directory.GetCount() == 0);
+	test.app.AddFile(1, FILE_SIZE);
+	op = test.Tap();
+	CHECK(op.status == MFRC522::STATUS_OK && op.data == data && test.app.Count(0x60) == 1);
+	CHECK(test.directory.Find(&uid) != NULL);
+
+	// The application is gone: the deferred select fails with MF_APPLICATION_NOT_FOUND when it goes to the card
+	test.app.appGone = true;
+	op = test.Tap();
+	CHECK(op.status == MFRC522::STATUS_OK && op.desfireStatus == DESFire::MF_APPLICATION_NOT_FOUND);
+	CHECK((test.Commands() == Bytes{0x5A}));
+	CHECK(test.directory.Find(&uid) == NULL);
+	test.app.appGone = false;
+	test.Tap();
+	CHECK(test.app.Count(0x60) == 1 && test.directory.Find(&uid) != NULL);
+
+	// A length error of a read that took the file size from the directory: the size changed, the entry goes
+	test.app.refuse[0xBD] = 0x7E;
+	op = test.Tap();
+	CHECK(op.status == MFRC522::STATUS_OK && op.desfireStatus == DESFire::MF_LENGTH_ERROR);
+	CHECK(test.app.Count(0xF5) == 0 && test.directory.Find(&uid) == NULL);
+	test.app.refuse.clear();
+
+	// The same error with the settings read from the card says nothing about the directory
+	test.Tap();
+	CHECK(test.directory.Find(&uid) != NULL);
+	test.app.refuse[0xBD] = 0x7E;
+	CardOperation select = CardOperation();
+	select.type = CardOperation::OP_DESFIRE_SELECT_APPLICATION;
+	select.data = Bytes{0x11, 0x22, 0x33};
+	CardOperation read = CardOperation();
+	read.type = CardOperation::OP_DESFIRE_READ_DATA;
+	read.block = 1;
+	read.length = 10;
+	CHECK(test.session.Begin() == MFRC522::STATUS_OK);
+	CHECK(test.session.Run(&select));
+	CHECK(!test.session.Run(&read) && read.desfireStatus == DESFire::MF_LENGTH_ERROR);
+	test.session.End();
+	CHECK(test.directory.Find(&uid) != NULL);
+}
+
+static void Replacement() {
+	DirectoryTest test;
+	std::vector<MFRC522::Uid> uids;
+	for (int i = 0; i < DESFIRE_DIRECTORY_SIZE; i++) {
+		test.NewCard(i);
+		uids.push_back(test.tracker.GetUid());
+		test.Tap();
+	}
+	CHECK(test.directory.GetCount() == DESFIRE_DIRECTORY_SIZE && test.app.Count(0x60) == 1);
+
+	// The first card again: answered from the directory, which makes the second card the least recently used
+	test.NewCard(0);
+	test.Tap();
+	CHECK(test.app.Count(0x60) == 0);
+
+	// One card more replaces the second one
+	test.NewCard(DESFIRE_DIRECTORY_SIZE);
+	test.Tap();
+	CHECK(test.app.Count(0x60) == 1 && test.directory.GetCount() == DESFIRE_DIRECTORY_SIZE);
+	MFRC522::Uid uid = test.tracker.GetUid();
+	CHECK(test.directory.Find(&uid) != NULL);
+	CHECK(test.directory.Find(&uids[1]) == NULL);
+	for (int i = 0; i < DESFIRE_DIRECTORY_SIZE; i++) {
+		if (i != 1 && !test.directory.Find(&uids[i])) {
+			printf("card %d was replaced\n", i);
+			CHECK(false);
+		}
+	}
+
+	// The second card comes back: it is discovered again
+	test.NewCard(1);
+	test.Tap();
+	CHECK(test.app.Count(0x60) == 1 && test.directory.GetCount() == DESFIRE_DIRECTORY_SIZE);
+}
+
+int main() {
+	RepeatTap();
+	Invalidation();
+	Replacement();
+	return CheckResult("test_desfire_directory");
+}
@@ -0,0 +1,151 @@
+/**
+ * test_desfire_read.cpp - MIFARE_DESFIRE_ReadDataStream() and OP_DESFIRE_READ_DATA against a simulated DESFire.
+ *
+ * A read longer than MIFARE_DESFIRE_READ_WINDOW goes out as one ReadData per window, into the sink's buffer or, for a
+ * sink without one, in pieces of at most a window. When frames get lost in a later window, *done counts what the sink
+ * got and a read from there completes the file. A CardSession resumes such a read by itself after lowering the bit
+ * rate, from where the first run stopped. Lengths and offsets that do not fit the 3 byte fields fail without a
+ * command to the card.
+ */
+#include "SimDesfireApp.h"
+#include "Check.h"
+#include "CardOperation.h"
+
+#define FILE_SIZE	5000
+
+// A sink without a buffer of its own: the data comes from the staging buffer
+struct PieceSink : public DesfireSink {
+	Bytes data;
+	std::vector<size_t> pieces;
+
+	virtual bool Write(const byte *piece, size_t length) {
+		data.insert(data.end(), piece, piece + length);
+		pieces.push_back(length);
+		return true;
+	}
+};
+
+struct ReadTest {
+	FakeChip chip;
+	SimIsoDepCard picc;
+	SimDesfireApp app;
+	DESFire reader;
+	DESFire::mifare_desfire_tag tag;
+
+	ReadTest() : picc(chip), app(picc), reader(&chip, UINT8_MAX) {
+		app.AddFile(1, FILE_SIZE);
+		reader.PCD_Init();
+		memset(&tag, 0, sizeof(tag));
+	}
+
+	bool Activate() {
+		DESFire::mifare_desfire_aid_t aid = {{0x11, 0x22, 0x33}};
+		return reader.PICC_IsNewCardPresent() && reader.PICC_ReadCardSerial() && reader.PICC_ActivateIsoDep(&tag) == MFRC522::STATUS_OK
+			&& reader.IsStatusCodeOK(reader.MIFARE_DESFIRE_SelectApplication(&tag, &aid));
+	}
+
+	bool Matches(const byte *data, uint32_t offset, uint32_t length) const {
+		return memcmp(data, &app.files.at(1).data[offset], length) == 0;
+	}
+};
+
+// Frames of a window: the command and the AF frames that follow, 59 data bytes each
+static int Frames(uint32_t window) {
+	return (window + 58) / 59;
+}
+
+static void Stream() {
+	ReadTest test;
+	CHECK(test.Activate());
+
+	// Three windows straight into the buffer
+	Bytes buffer(3000 + MIFARE_DESFIRE_READ_SLACK);
+	DesfireBufferSink sink(buffer.data(), buffer.size());
+	uint32_t done = 0;
+	test.app.reads.clear();
+	CHECK(test.reader.IsStatusCodeOK(test.reader.MIFARE_DESFIRE_ReadDataStream(&test.tag, 1, 100, 3000, &sink, DESFire::MDCM_PLAIN, &done)));
+	CHECK(done == 3000 && sink.GetLength() == 3000 && test.Matches(buffer.data(), 100, 3000));
+	CHECK(test.app.reads.size() == 3 && test.app.reads[0] == std::make_pair(100u, 1024u) && test.app.reads[1] == std::make_pair(1124u, 1024u)
+		&& test.app.reads[2] == std::make_pair(2148u, 952u));
+
+	// Without a sink buffer: pieces of at most one window
+	PieceSink pieces;
+	CHECK(test.reader.IsStatusCodeOK(test.reader.MIFARE_DESFIRE_ReadDataStream(&test.tag, 1, 0, FILE_SIZE, &pieces, DESFire::MDCM_PLAIN, &done)));
+	CHECK(done == FILE_SIZE && pieces.data == test.app.files[1].data);
+	CHECK((pieces.pieces == std::vector<size_t>{1024, 1024, 1024, 1024, 904}));
+
+	// A sink that is too small stops the read after the windows that fit
+	DesfireBufferSink small(buffer.data(), 1500 + MIFARE_DESFIRE_READ_SLACK);
+	CHECK(test.reader.MIFARE_DESFIRE_ReadDataStream(&test.tag, 1, 0, 3000, &small, DESFire::MDCM_PLAIN, &done).mfrc522 == MFRC522::STATUS_NO_ROOM);
+	CHECK(done == 1024 && small.GetLength() == 1024);
+	CHECK(test.reader.MIFARE_DESFIRE_ReadDataStream(&test.tag, 1, 0, 0, &pieces, DESFire::MDCM_PLAIN, &done).mfrc522 == MFRC522::STATUS_INVALID);
+
+	// The sixth frame of the second window lost more often than the retries allow: the sink keeps the five before it
+	PieceSink partial;
+	int base = test.picc.frameNumber;
+	for (int i = 0; i <= MIFARE_ISODEP_RETRIES; i++) {
+		test.picc.dropRx.insert(base + Frames(1024) + 5 + i);
+	}
+	DESFire::StatusCode result = test.reader.MIFARE_DESFIRE_ReadDataStream(&test.tag, 1, 0, FILE_SIZE, &partial, DESFire::MDCM_PLAIN, &done);
+	test.picc.dropRx.clear();
+	CHECK(!test.reader.IsStatusCodeOK(result));
+	CHECK(done == 1024 + 5 * 59 && partial.data.size() == done && test.Matches(partial.data.data(), 0, done));
+
+	// A new activation and a read from there complete the file
+	uint32_t more = 0;
+	test.reader.PICC_HaltA();
+	test.picc.card.state = SimCard::IDLE;
+	CHECK(test.Activate());
+	CHECK(test.reader.IsStatusCodeOK(test.reader.MIFARE_DESFIRE_ReadDataStream(&test.tag, 1, done, FILE_SIZE - done, &partial, DESFire::MDCM_PLAIN, &more)));
+	CHECK(done + more == FILE_SIZE && partial.data == test.app.files[1].data);
+}
+
+static void Session() {
+	ReadTest test;
+	PresenceTracker tracker(&test.reader);
+	CardSession session(&test.reader, &tracker);
+	test.reader.PCD_Init();
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	CHECK(session.Begin() == MFRC522::STATUS_OK);
+
+	CardOperation select = CardOperation();
+	select.type = CardOperation::OP_DESFIRE_SELECT_APPLICATION;
+	select.data = Bytes{0x11, 0x22, 0x33};
+	CHECK(session.Run(&select));
+
+	// Lengths and offsets beyond 3 bytes: nothing is sent
+	size_t commands = test.app.commands.size();
+	CardOperation op = CardOperation();
+	op.type = CardOperation::OP_DESFIRE_READ_DATA;
+	op.block = 1;
+	op.length = MIFARE_DESFIRE_MAX_DATA + 1;
+	CHECK(!session.Run(&op) && op.status == MFRC522::STATUS_INVALID);
+	op.length = 10;
+	op.offset = MIFARE_DESFIRE_MAX_DATA + 1;
+	CHECK(!session.Run(&op) && op.status == MFRC522::STATUS_INVALID);
+	CHECK(test.app.commands.size() == commands);
+
+	// The whole file, with a frame of the third window lost at 848 kbit/s: the session lowers the rate, activates the
+	// card again and reads on from where it stopped, once
+	op.offset = 0;
+	op.length = 0;
+	test.app.reads.clear();
+	int base = test.picc.frameNumber + 1;	// After GetFileSettings
+	for (int i = 0; i <= MIFARE_ISODEP_RETRIES; i++) {
+		test.picc.dropRx.insert(base + 2 * Frames(1024) + 3 + i);
+	}
+	CHECK(session.Run(&op));
+	test.picc.dropRx.clear();
+	CHECK(op.data == test.app.files[1].data);
+	CHECK(test.picc.ppsCount == 2 && test.picc.dri == MFRC522::BITRATE_424);
+	// The third window got 3 frames before the loss; the second run asks for the file settings again and goes on there
+	CHECK(test.app.reads.size() == 6 && test.app.reads[3] == std::make_pair(2048u + 3 * 59, 1024u));
+	CHECK(test.app.Count(0xF5) == 2);
+	session.End();
+}
+
+int main() {
+	Stream();
+	Session();
+	return CheckResult("test_desfire_read");
+}
@@ -0,0 +1,80 @@
+/**
+ * test_inventory.cpp - PICC_Inventory() on random fields of simulated PICCs.
+ *
+ * Fields of 0-6 PICCs with mixed 4 and 7 byte UIDs, a third of them with 4 byte UIDs sharing their first two bytes,
+ * must be enumerated exactly, with the coprocessor and with the host computing the CRC_A. An array too short for the
+ * field must give STATUS_NO_ROOM, filled with PICCs of the field.
+ */
+#include <memory>
+#include <random>
+#include <set>
+#include "FakeChip.h"
+#include "Check.h"
+#include "MFRC522.h"
+
+int main() {
+	std::mt19937 random(7);
+	int failed = 0;
+	for (int autoCRC = 0; autoCRC < 2; autoCRC++) {
+		for (int trial = 0; trial < 300; trial++) {
+			FakeChip chip;
+			std::vector<std::unique_ptr<SimCard> > cards;
+			std::set<Bytes> expected;
+			for (int i = 0; i < trial % 7; i++) {
+				size_t size = random() % 2 ? 4 : 7;
+				Bytes uid(size);
+				for (size_t k = 0; k < size; k++) {
+					uid[k] = random();
+				}
+				// 0x88 is the cascade tag, no PICC has it in its place
+				if (uid[size == 4 ? 0 : 3] == 0x88) {
+					uid[size == 4 ? 0 : 3] = 0x89;
+				}
+				if (size == 4 && trial % 3 == 0) {
+					uid[0] = 0x11;
+					uid[1] = 0x22;
+				}
+				if (expected.insert(uid).second) {
+					cards.push_back(std::unique_ptr<SimCard>(new SimCard(uid, size == 4 ? 0x08 : 0x00)));
+					chip.cards.push_back(cards.back().get());
+				}
+			}
+
+			MFRC522 mfrc522(&chip, UINT8_MAX);
+			mfrc522.PCD_Init();
+			mfrc522.PCD_SetAutoCRC(autoCRC);
+			MFRC522::Uid uids[8];
+			byte count = 8;
+			MFRC522::StatusCode status = mfrc522.PICC_Inventory(uids, &count);
+			std::set<Bytes> found;
+			for (byte i = 0; i < count; i++) {
+				found.insert(Bytes(uids[i].uidByte, uids[i].uidByte + uids[i].size));
+			}
+			if (status != MFRC522::STATUS_OK || found != expected || count != expected.size()) {
+				printf("autoCRC=%d trial %d: %zu PICCs, status %d, %d found\n", autoCRC, trial, expected.size(), status, count);
+				failed++;
+			}
+		}
+	}
+	CHECK(failed == 0);
+
+	// More PICCs than room
+	FakeChip chip;
+	SimCard a(Bytes{1, 2, 3, 4}, 0x08), b(Bytes{5, 6, 7, 8}, 0x08), c(Bytes{9, 9, 9, 9}, 0x08);
+	chip.cards = {&a, &b, &c};
+	MFRC522 mfrc522(&chip, UINT8_MAX);
+	mfrc522.PCD_Init();
+	MFRC522::Uid uids[2];
+	byte count = 2;
+	CHECK(mfrc522.PICC_Inventory(uids, &count) == MFRC522::STATUS_NO_ROOM);
+	CHECK(count == 2);
+	CHECK(uids[0].size == 4 && uids[1].size == 4 && uids[0].uidByte[0] != uids[1].uidByte[0]);
+	CHECK(mfrc522.PICC_GetType(uids[0].sak) == MFRC522::PICC_TYPE_MIFARE_1K);
+
+	// An empty field
+	chip.cards.clear();
+	count = 2;
+	CHECK(mfrc522.PICC_Inventory(uids, &count) == MFRC522::STATUS_OK && count == 0);
+
+	return CheckResult("test_inventory");
+}
@@ -0,0 +1,163 @@
+/**
+ * test_irq_line.cpp - Command completion on the IRQ pin of a simulated MFRC522.
+ *
+ * With an IRQ line set, REQA, SELECT, READ, HLTA, the coprocessor CRC and the no-card timeout must give the same results
+ * as with polling, with fewer bus transactions, and the preambles must enable only the sources the command ends with.
+ * Frames larger than the FIFO, moved a few bytes per bus transaction, must round-trip when the water level alerts wake
+ * the host.
+ */
+#include "SimIRQLine.h"
+#include "Check.h"
+#include "MFRC522.h"
+
+struct Session {
+	MFRC522::StatusCode request, select, read, crc, halt, noCard;
+	byte sak;
+	byte block[18];
+	byte crcResult[2];
+	uint32_t requestTransactions, noCardTransactions;
+};
+
+static Session RunSession(bool useIRQ) {
+	Session session;
+	FakeChip chip;
+	SimCard card(Bytes{0xDE, 0xAD, 0xBE, 0xEF}, 0x08);
+	chip.cards.push_back(&card);
+	SimIRQLine irq(chip);
+	MFRC522 mfrc522(&chip, UINT8_MAX);
+	mfrc522.PCD_Init();
+	if (useIRQ) {
+		mfrc522.PCD_SetIRQLine(&irq);
+	}
+
+	chip.ResetTransactionCount();
+	byte atqa[2];
+	byte size = sizeof(atqa);
+	session.request = mfrc522.PICC_RequestA(atqa, &size);
+	session.requestTransactions = chip.GetTransactionCount();
+	if (useIRQ) {
+		CHECK(irq.GetEventCount() == 1);
+		CHECK((chip.reg[FakeChip::ComIEnReg] & 0x7F) == 0x31);		// IdleIEn, RxIEn, TimerIEn
+	}
+	MFRC522::Uid uid;
+	session.select = mfrc522.PICC_Select(&uid);
+	session.sak = uid.sak;
+	size = sizeof(session.block);
+	session.read = mfrc522.MIFARE_Read(4, session.block, &size);
+
+	mfrc522.PCD_SetHostCRC(false);
+	byte data[4] = {1, 2, 3, 4};
+	session.crc = mfrc522.PCD_CalculateCRC(data, sizeof(data), session.crcResult);
+	if (useIRQ) {
+		CHECK(chip.reg[FakeChip::DivIEnReg] == 0x84);		// IRQPushPull, CRCIEn
+		CHECK((chip.reg[FakeChip::ComIEnReg] & 0x7F) == 0);
+	}
+	mfrc522.PCD_SetHostCRC(true);
+	session.halt = mfrc522.PICC_HaltA();
+	CHECK(card.state == SimCard::HALT);
+
+	chip.cards.clear();
+	chip.ResetTransactionCount();
+	size = sizeof(atqa);
+	session.noCard = mfrc522.PICC_RequestA(atqa, &size);
+	session.noCardTransactions = chip.GetTransactionCount();
+	return session;
+}
+
+/**
+ * A frame of len bytes out and a longer one back, streamed at rate bytes per bus transaction.
+ */
+static bool StreamRoundTrip(bool useIRQ, bool autoCRC, int rate, int len, int *maxFifo) {
+	FakeChip chip;
+	chip.streamRate = rate;
+	SimCard card(Bytes{0xDE, 0xAD, 0xBE, 0xEF}, 0x08);
+	card.state = SimCard::ACTIVE;
+	chip.cards.push_back(&card);
+	SimIRQLine irq(chip);
+	MFRC522 mfrc522(&chip, UINT8_MAX);
+	mfrc522.PCD_Init();
+	mfrc522.PCD_SetAutoCRC(autoCRC);
+	if (useIRQ) {
+		mfrc522.PCD_SetIRQLine(&irq);
+	}
+
+	int responseLen = len + len % 7;
+	Bytes received;
+	chip.onOther = [&](const Bytes &tx, Bytes &rx, int &/*rxBits*/, bool &any) {
+		received = tx;
+		rx.clear();
+		for (int i = 0; i < responseLen; i++) {
+			rx.push_back(i * 3 + 1);
+		}
+		SimAppendCRC(rx);
+		any = true;
+	};
+
+	byte buffer[300];
+	for (int i = 0; i < len; i++) {
+		buffer[i] = 0x40 + i % 50;
+	}
+	Bytes sent(buffer, buffer + len);
+	uint16_t sendLen = len;
+	if (autoCRC) {
+		mfrc522.PCD_SetFrameClass(MFRC522::FRAME_TXRX_CRC);
+	}
+	else {
+		MFRC522::CRC_A(buffer, len, buffer + len);
+		sendLen += 2;
+	}
+	uint16_t backLen = sizeof(buffer);
+	MFRC522::StatusCode status = mfrc522.PCD_TransceiveStream(buffer, sendLen, buffer, &backLen, NULL, !autoCRC);
+	*maxFifo = chip.maxFifo;
+
+	bool ok = status == MFRC522::STATUS_OK && backLen == responseLen + (autoCRC ? 0 : 2);
+	ok = ok && received.size() == (size_t)len + 2 && memcmp(received.data(), sent.data(), len) == 0;
+	for (int i = 0; i < responseLen && ok; i++) {
+		ok = buffer[i] == (byte)(i * 3 + 1);
+	}
+	if (useIRQ && irq.GetEventCount() == 0) {
+		ok = false;
+	}
+	return ok;
+}
+
+int main() {
+	Session polled = RunSession(false);
+	Session woken = RunSession(true);
+
+	CHECK(polled.request == MFRC522::STATUS_OK && woken.request == MFRC522::STATUS_OK);
+	CHECK(woken.requestTransactions == 3);
+	CHECK(woken.requestTransactions <= polled.requestTransactions);
+	CHECK(polled.select == MFRC522::STATUS_OK && woken.select == MFRC522::STATUS_OK && woken.sak == polled.sak);
+	CHECK(polled.read == MFRC522::STATUS_OK && woken.read == MFRC522::STATUS_OK);
+	CHECK(memcmp(woken.block, polled.block, 16) == 0 && woken.block[0] == 4 * 16);
+	CHECK(polled.crc == MFRC522::STATUS_OK && woken.crc == MFRC522::STATUS_OK);
+	byte data[4] = {1, 2, 3, 4};
+	byte expected[2];
+	MFRC522::CRC_A(data, sizeof(data), expected);
+	CHECK(memcmp(woken.crcResult, expected, 2) == 0 && memcmp(polled.crcResult, expected, 2) == 0);
+	CHECK(polled.halt == MFRC522::STATUS_OK && woken.halt == MFRC522::STATUS_OK);
+	CHECK(polled.noCard == MFRC522::STATUS_TIMEOUT && woken.noCard == MFRC522::STATUS_TIMEOUT);
+	printf("REQA: %u transactions polled, %u with IRQ; no card: %u polled, %u with IRQ\n",
+		polled.requestTransactions, woken.requestTransactions, polled.noCardTransactions, woken.noCardTransactions);
+
+	const int rates[] = {1, 4, 8, 16};
+	const int lengths[] = {10, 64, 100, 250};
+	int failed = 0;
+	for (int useIRQ = 0; useIRQ < 2; useIRQ++) {
+		for (int autoCRC = 0; autoCRC < 2; autoCRC++) {
+			for (int r = 0; r < 4; r++) {
+				for (int l = 0; l < 4; l++) {
+					int maxFifo;
+					if (!StreamRoundTrip(useIRQ, autoCRC, rates[r], lengths[l], &maxFifo) || maxFifo > 64) {
+						printf("stream irq=%d autoCRC=%d rate=%d len=%d failed\n", useIRQ, autoCRC, rates[r], lengths[l]);
+						failed++;
+					}
+				}
+			}
+		}
+	}
+	CHECK(failed == 0);
+
+	return CheckResult("test_irq_line");
+}
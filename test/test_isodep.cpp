@@ -0,0 +1,302 @@
+/**
+ * test_isodep.cpp - PICC_ActivateIsoDep() and PICC_IsoDepTransceive() against a simulated ISO/IEC 14443-4 PICC.
+ *
+ * With the coprocessor and with the host computing the CRC_A: the ATS is parsed, requests longer than the FSC go out
+ * chained, chained responses are collected, lost and garbled blocks are recovered from up to the retry limit, S(WTX)
+ * is answered, and a PICC without CID support gets blocks without one.
+ * Bit rates: PICC_SelectBitRate() takes the highest rates TA(1) offers up to the limit and the ceiling that
+ * PICC_LowerBitRate() leaves. In a CardSession a refused PPS ends in a field reset and 106 kbit/s, a rate that loses
+ * frames is lowered, and both stick to the card over later taps until another card comes.
+ */
+#include "SimIsoDepCard.h"
+#include "Check.h"
+#include "Desfire.h"
+#include "CardOperation.h"
+
+struct IsoDepTest {
+	FakeChip chip;
+	SimIsoDepCard picc;
+	DESFire reader;
+	DESFire::mifare_desfire_tag tag;
+
+	IsoDepTest(bool autoCRC) : picc(chip), reader(&chip, UINT8_MAX) {
+		reader.PCD_Init();
+		reader.PCD_SetAutoCRC(autoCRC);
+		memset(&tag, 0, sizeof(tag));
+	}
+
+	// Halts the PICC and selects it again, out of the ISO/IEC 14443-4 protocol state
+	bool Reselect() {
+		chip.streamRate = 0;
+		reader.PICC_HaltA();
+		bool ok = reader.PICC_Reselect(&reader.uid) == MFRC522::STATUS_OK;
+		chip.streamRate = 16;
+		return ok;
+	}
+
+	// Command 01 with len data bytes, which the PICC echoes
+	bool Echo(int len, byte command = 0x01) {
+		Bytes request(len + 1);
+		request[0] = command;
+		for (int i = 0; i < len; i++) {
+			request[i + 1] = i * 7 + 3;
+		}
+		byte response[2048];
+		uint16_t responseLen = sizeof(response);
+		MFRC522::StatusCode status = reader.PICC_IsoDepTransceive(&tag, request.data(), request.size(), response, &responseLen);
+		return status == MFRC522::STATUS_OK && responseLen == len + 1 && response[0] == 0 && memcmp(response + 1, request.data() + 1, len) == 0;
+	}
+
+	// Command 03 for 600 bytes, which the PICC sends chained
+	MFRC522::StatusCode Count600(byte *response, uint16_t *responseLen) {
+		byte request[3] = {0x03, 0x58, 0x02};
+		return reader.PICC_IsoDepTransceive(&tag, request, sizeof(request), response, responseLen);
+	}
+};
+
+static void Run(bool autoCRC) {
+	IsoDepTest test(autoCRC);
+	FakeChip &chip = test.chip;
+	SimIsoDepCard &picc = test.picc;
+	DESFire &reader = test.reader;
+	DESFire::mifare_desfire_tag &tag = test.tag;
+
+	CHECK(reader.PICC_IsNewCardPresent());
+	CHECK(reader.PICC_ReadCardSerial());
+	chip.streamRate = 16;
+	byte ats[64];
+	byte atsLen = sizeof(ats);
+	CHECK(reader.PICC_ActivateIsoDep(&tag, ats, &atsLen) == MFRC522::STATUS_OK);
+	CHECK(atsLen == 6 && tag.fsc == 64 && tag.fwi == 8 && tag.cidSupported && !tag.nadSupported && tag.pcb == 0x0A);
+
+	// Chaining: a short request is one block, 200 bytes take 4 at FSC 64
+	size_t frames = picc.log.size();
+	CHECK(test.Echo(10));
+	CHECK(picc.log.size() - frames == 1);
+	frames = picc.log.size();
+	CHECK(test.Echo(200));
+	CHECK(picc.log.size() - frames == 4);
+
+	// PICC chaining: 600 bytes at FSD 256 take 3 blocks and 2 R(ACK)s
+	byte response[1024];
+	uint16_t responseLen = sizeof(response);
+	frames = picc.log.size();
+	CHECK(test.Count600(response, &responseLen) == MFRC522::STATUS_OK && responseLen == 601);
+	bool counted = true;
+	for (int i = 0; i < 600; i++) {
+		counted = counted && response[i + 1] == (byte)i;
+	}
+	CHECK(counted);
+	CHECK(picc.log.size() - frames == 3);
+	responseLen = 100;
+	CHECK(test.Count600(response, &responseLen) == MFRC522::STATUS_NO_ROOM);
+	// The PICC is left in the middle of the chain, a new activation resets it
+	CHECK(test.Reselect());
+	CHECK(reader.PICC_ActivateIsoDep(&tag) == MFRC522::STATUS_OK);
+
+	// A lost request block: R(NAK), R(ACK) with the other block number, the block again
+	int base = picc.frameNumber;
+	picc.dropRx = {base + 1};
+	CHECK(test.Echo(200));
+	CHECK(tag.retransmissions == 2);
+	// Lost acknowledgements
+	base = picc.frameNumber;
+	picc.dropRx.clear();
+	picc.dropTx = {base, base + 2};
+	CHECK(test.Echo(200));
+	// Garbled response blocks while the PICC chains
+	base = picc.frameNumber;
+	picc.dropTx.clear();
+	picc.corruptTx = {base, base + 2};
+	responseLen = sizeof(response);
+	CHECK(test.Count600(response, &responseLen) == MFRC522::STATUS_OK && responseLen == 601 && response[600] == (byte)599);
+	// Two errors on one block
+	base = picc.frameNumber;
+	picc.corruptTx = {base};
+	picc.dropTx = {base + 1};
+	CHECK(test.Echo(5));
+	// Too many errors on one block
+	base = picc.frameNumber;
+	picc.corruptTx.clear();
+	picc.dropTx = {base, base + 1, base + 2, base + 3};
+	CHECK(!test.Echo(5));
+	picc.dropTx.clear();
+	CHECK(test.Reselect());
+	CHECK(reader.PICC_ActivateIsoDep(&tag) == MFRC522::STATUS_OK);
+
+	// Waiting time extensions
+	picc.wtxBefore = 2;
+	CHECK(test.Echo(30, 0x02));
+	CHECK(tag.waitingTimeExtensions == 2);
+	picc.wtxBefore = 0;
+
+	// A DESFire command through the block exchange
+	DESFire::mifare_desfire_aid_t aids[MIFARE_MAX_APPLICATION_COUNT];
+	byte count = 0;
+	CHECK(reader.IsStatusCodeOK(reader.MIFARE_DESFIRE_GetApplicationIds(&tag, aids, &count)));
+	CHECK(count == 1 && aids[0].data[0] == 0x11 && aids[0].data[2] == 0x33);
+
+	// No CID: the PICC says so in TC(1)
+	picc.ats = Bytes{0x06, 0x75, 0x77, 0x81, 0x00, 0x80};
+	picc.cidIn = false;
+	CHECK(test.Reselect());
+	CHECK(reader.PICC_ActivateIsoDep(&tag) == MFRC522::STATUS_OK);
+	CHECK(tag.pcb == 0x02 && !tag.cidSupported);
+	frames = picc.log.size();
+	CHECK(test.Echo(100));
+	CHECK(picc.log[frames][0] == 0x12);		// Chained I-block without CID
+
+	CHECK(reader.PICC_Deselect(0) == MFRC522::STATUS_OK);
+	CHECK(picc.card.state == SimCard::HALT);
+}
+
+// The rates the chip runs at, as PPS1: DSI << 2 | DRI
+static byte ChipRate(const FakeChip &chip) {
+	return ((chip.reg[FakeChip::RxModeReg] >> 4) & 3) << 2 | ((chip.reg[FakeChip::TxModeReg] >> 4) & 3);
+}
+
+// Selects the rate after a fresh activation and checks that the PICC, the chip and the tag agree on pps1
+static bool SelectsRate(IsoDepTest &test, byte pps1, MFRC522::PCD_BitRate maxRate = MFRC522::BITRATE_848) {
+	test.reader.PICC_Deselect(test.tag.cid);		// Back to 106 kbit/s, if activated
+	if (!test.Reselect() || test.reader.PICC_ActivateIsoDep(&test.tag) != MFRC522::STATUS_OK) {
+		return false;
+	}
+	int ppsCount = test.picc.ppsCount;
+	if (test.reader.PICC_SelectBitRate(&test.tag, maxRate) != MFRC522::STATUS_OK) {
+		return false;
+	}
+	// The new rates reach the chip with the next frame
+	return test.tag.bitRate == pps1 && (test.picc.dsi << 2 | test.picc.dri) == pps1 && test.picc.ppsCount == ppsCount + (pps1 != 0)
+		&& test.Echo(100) && ChipRate(test.chip) == pps1;
+}
+
+static void BitRates() {
+	IsoDepTest test(true);
+	CHECK(test.reader.PICC_IsNewCardPresent());
+	CHECK(test.reader.PICC_ReadCardSerial());
+
+	// TA(1) 77: 212, 424 and 848 kbit/s both ways
+	CHECK(SelectsRate(test, 0x0F));
+	CHECK(SelectsRate(test, 0x0A, MFRC522::BITRATE_424));
+	CHECK(SelectsRate(test, 0x00, MFRC522::BITRATE_106));
+	// TA(1) 13: DS 212, DR 212 and 424. With b8 set both ways must be the same.
+	test.picc.ats = Bytes{0x06, 0x75, 0x13, 0x81, 0x02, 0x80};
+	CHECK(SelectsRate(test, 0x06));
+	test.picc.ats = Bytes{0x06, 0x75, 0x93, 0x81, 0x02, 0x80};
+	CHECK(SelectsRate(test, 0x05));
+	// TA(1) 00: 106 kbit/s only, no PPS
+	test.picc.ats = Bytes{0x06, 0x75, 0x00, 0x81, 0x02, 0x80};
+	CHECK(SelectsRate(test, 0x00));
+
+	// Each PICC_LowerBitRate() takes the next selection one step down, until 106 kbit/s
+	test.picc.ats = Bytes{0x06, 0x75, 0x77, 0x81, 0x02, 0x80};
+	CHECK(SelectsRate(test, 0x0F));
+	CHECK(DESFire::PICC_LowerBitRate(&test.tag) && test.tag.rateCeiling == MFRC522::BITRATE_424 + 1);
+	CHECK(SelectsRate(test, 0x0A));
+	CHECK(DESFire::PICC_LowerBitRate(&test.tag));
+	CHECK(SelectsRate(test, 0x05));
+	CHECK(DESFire::PICC_LowerBitRate(&test.tag));
+	CHECK(SelectsRate(test, 0x00));
+	CHECK(!DESFire::PICC_LowerBitRate(&test.tag));
+
+	// A refused PPS: the PICC does not answer, the chip goes back to 106 kbit/s
+	test.tag.rateCeiling = 0;
+	CHECK(test.reader.PICC_Deselect(test.tag.cid) == MFRC522::STATUS_OK);
+	CHECK(test.Reselect() && test.reader.PICC_ActivateIsoDep(&test.tag) == MFRC522::STATUS_OK);
+	test.picc.refusePps = 1;
+	CHECK(test.reader.PICC_SelectBitRate(&test.tag) != MFRC522::STATUS_OK);
+	CHECK(test.tag.bitRate == 0 && ChipRate(test.chip) == 0);
+}
+
+struct SessionTest {
+	FakeChip chip;
+	SimIsoDepCard picc;
+	DESFire reader;
+	PresenceTracker tracker;
+	CardSession session;
+	int fieldResets;
+	int dsi, dri;			// The rates of the last command, the PICC is back at 106 kbit/s after the DESELECT
+
+	SessionTest() : picc(chip), reader(&chip, UINT8_MAX), tracker(&reader), session(&reader, &tracker), fieldResets(0),
+			dsi(-1), dri(-1) {
+		reader.PCD_Init();
+		picc.app = [this](const Bytes &command) {
+			dsi = picc.dsi;
+			dri = picc.dri;
+			return Bytes{0x00, 0x11, 0x22, 0x33};
+		};
+		std::function<void()> reset = chip.onFieldOff;
+		chip.onFieldOff = [this, reset]() {
+			fieldResets++;
+			reset();
+		};
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	}
+
+	// One tap: GetApplicationIds in a session of its own
+	bool Tap() {
+		CardOperation op = CardOperation();
+		op.type = CardOperation::OP_DESFIRE_GET_APPLICATION_IDS;
+		bool ok = session.Begin() == MFRC522::STATUS_OK && session.Run(&op) && op.data.size() == 3 && op.data[0] == 0x11;
+		session.End();
+		return ok;
+	}
+
+	// The card leaves and comes back with another UID
+	void NewCard() {
+		chip.cards.clear();
+		for (int i = 0; i < PRESENCE_REMOVE_AFTER; i++) {
+			tracker.Poll();
+		}
+		CHECK(!tracker.IsPresent());
+		picc.card.uid.back() ^= 0xFF;
+		picc.card.state = SimCard::IDLE;
+		chip.cards.push_back(&picc.card);
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	}
+};
+
+static void SessionRates() {
+	// 848 kbit/s on every tap
+	{
+		SessionTest test;
+		CHECK(test.Tap() && test.picc.ppsCount == 1 && test.dsi == 3 && test.dri == 3);
+		CHECK(test.Tap() && test.picc.ppsCount == 2 && test.fieldResets == 0);
+	}
+
+	// The PICC switches without answering the PPS: it misses the DESELECT at 106 kbit/s, so the field is reset and
+	// the card activated again without PPS. Later taps of the card skip the PPS, a new card gets one.
+	{
+		SessionTest test;
+		test.picc.refusePps = 1;
+		test.picc.refusedPpsSwitches = true;
+		CHECK(test.Tap());
+		CHECK(test.picc.ppsCount == 1 && test.fieldResets == 1);
+		CHECK(test.dsi == 0 && test.dri == 0 && ChipRate(test.chip) == 0);
+		CHECK(test.Tap() && test.picc.ppsCount == 1 && test.fieldResets == 1);
+		test.NewCard();
+		CHECK(test.Tap() && test.picc.ppsCount == 2 && test.dri == 3);
+	}
+
+	// Every frame at 848 kbit/s is lost: the operation fails, the rate goes down to 424 kbit/s and the operation runs
+	// again there. The next tap of the card starts at 424 kbit/s, a new card at 848 again.
+	{
+		SessionTest test;
+		test.picc.flakyRate = 3;
+		test.picc.flakyEvery = 1;
+		CHECK(test.Tap());
+		CHECK(test.picc.ppsCount == 2 && test.dsi == 2 && test.dri == 2 && test.fieldResets == 1);	// The DESELECT at 848 was lost too
+		CHECK(test.Tap() && test.picc.ppsCount == 3 && test.dsi == 2 && test.dri == 2);
+		test.picc.flakyEvery = 0;
+		test.NewCard();
+		CHECK(test.Tap() && test.picc.ppsCount == 4 && test.dsi == 3 && test.dri == 3);
+	}
+}
+
+int main() {
+	Run(false);
+	Run(true);
+	BitRates();
+	SessionRates();
+	return CheckResult("test_isodep");
+}
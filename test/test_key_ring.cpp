@@ -0,0 +1,112 @@
+/**
+ * test_key_ring.cpp - KeyRing on simulated MIFARE Classic 1K cards with a different key per sector.
+ *
+ * The first tap searches the candidates, selecting the card again after every refused key. A repeat tap, and a new
+ * card of the same family, authenticate every sector on the first try. A sector whose key was changed drops its
+ * remembered key, falls back to the candidates and learns the new one.
+ */
+#include "FakeChip.h"
+#include "Check.h"
+#include "KeyRing.h"
+
+#define KEYS		4
+#define SECTORS		8
+
+struct KeyRingTest {
+	FakeChip chip;
+	SimCard card, sibling;
+	MFRC522 reader;
+	KeyRing ring;
+	MFRC522::MIFARE_Key keys[KEYS];
+
+	KeyRingTest() : card(Bytes{0x10, 0x20, 0x30, 0x40}, 0x08), sibling(Bytes{0x50, 0x60, 0x70, 0x80}, 0x08),
+			reader(&chip, UINT8_MAX), ring(&reader) {
+		chip.checkKeys = true;
+		for (int k = 0; k < KEYS; k++) {
+			memset(keys[k].keyByte, 0xA0 + k, sizeof(keys[k].keyByte));
+			ring.AddKey(keys[k], MFRC522::PICC_CMD_MF_AUTH_KEY_A);
+		}
+		for (int s = 0; s < 16; s++) {
+			SetKey(&card, s, s % KEYS);
+			SetKey(&sibling, s, s % KEYS);
+		}
+		reader.PCD_Init();
+	}
+
+	void SetKey(SimCard *target, int sector, int key) {
+		memcpy(target->mem[sector * 4 + 3], keys[key].keyByte, 6);
+	}
+
+	// Puts a card alone in the field and selects it
+	bool Tap(SimCard *target) {
+		chip.cards.clear();
+		card.state = sibling.state = SimCard::IDLE;
+		chip.cards.push_back(target);
+		ring.ResetCounters();
+		return reader.PICC_IsNewCardPresent() && reader.PICC_ReadCardSerial();
+	}
+
+	// Authenticates the sector, tells which candidate worked, -1 if none
+	int Authenticate(int sector) {
+		byte keyIndex = 0xFF;
+		MFRC522::StatusCode status = ring.Authenticate(&reader.uid, sector * 4, &keyIndex);
+		reader.PCD_StopCrypto1();
+		return status == MFRC522::STATUS_OK ? keyIndex : -1;
+	}
+};
+
+int main() {
+	KeyRingTest test;
+
+	// First tap: sector s needs s % KEYS + 1 tries, the card is selected again after each refused key
+	CHECK(test.Tap(&test.card));
+	bool found = true;
+	for (int s = 0; s < SECTORS; s++) {
+		found = found && test.Authenticate(s) == s % KEYS;
+	}
+	CHECK(found);
+	CHECK(test.ring.GetHits() == 0 && test.ring.GetMisses() == SECTORS);
+	CHECK(test.ring.GetAttempts() == 2 * (1 + 2 + 3 + 4));
+	CHECK(test.card.state == SimCard::ACTIVE);
+
+	// Second tap: every sector on the first try
+	CHECK(test.Tap(&test.card));
+	found = true;
+	for (int s = 0; s < SECTORS; s++) {
+		found = found && test.Authenticate(s) == s % KEYS;
+	}
+	CHECK(found);
+	CHECK(test.ring.GetHits() == SECTORS && test.ring.GetMisses() == 0 && test.ring.GetAttempts() == SECTORS);
+
+	// A new card of the same family: the family entries know its keys
+	CHECK(test.Tap(&test.sibling));
+	found = true;
+	for (int s = 0; s < SECTORS; s++) {
+		found = found && test.Authenticate(s) == s % KEYS;
+	}
+	CHECK(found);
+	CHECK(test.ring.GetHits() == SECTORS && test.ring.GetAttempts() == SECTORS);
+
+	// Sector 3 of the first card changed from key 3 to key 1: the remembered key fails and is dropped, the candidates
+	// are searched from the start and the new key is learned
+	test.SetKey(&test.card, 3, 1);
+	CHECK(test.Tap(&test.card));
+	CHECK(test.Authenticate(3) == 1);
+	CHECK(test.ring.GetHits() == 0 && test.ring.GetMisses() == 1);
+	CHECK(test.ring.GetAttempts() == 3);		// Key 3, then keys 0 and 1
+	CHECK(test.card.state == SimCard::ACTIVE);
+	test.ring.ResetCounters();
+	CHECK(test.Authenticate(3) == 1);
+	CHECK(test.ring.GetHits() == 1 && test.ring.GetAttempts() == 1);
+	// The other sectors kept their keys
+	CHECK(test.Authenticate(2) == 2 && test.ring.GetHits() == 2 && test.ring.GetAttempts() == 2);
+
+	// No candidate works: every one is tried once, the card stays selectable
+	memset(test.card.mem[5 * 4 + 3], 0x99, 6);
+	CHECK(test.Tap(&test.card));
+	CHECK(test.Authenticate(5) == -1);
+	CHECK(test.ring.GetMisses() == 1 && test.ring.GetAttempts() == KEYS);
+	CHECK(test.card.state == SimCard::ACTIVE);
+
+	return CheckResult("test_key_ring");
+}
@@ -0,0 +1,85 @@
+/**
+ * test_presence.cpp - PresenceTracker on a simulated field.
+ *
+ * A card is reported once on arrival, kept through fewer missed polls than PRESENCE_REMOVE_AFTER, and reported
+ * removed after that many. A card that missed its checks but stayed in the field is halted, where REQA does not see
+ * it: it must be found again with WUPA within PRESENCE_REWAKE_POLLS polls of its removal.
+ */
+#include "FakeChip.h"
+#include "Check.h"
+#include "PresenceTracker.h"
+
+int main() {
+	FakeChip chip;
+	SimCard card(Bytes{0xDE, 0xAD, 0xBE, 0xEF}, 0x08);
+	SimCard other(Bytes{0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}, 0x00);
+	MFRC522 reader(&chip, UINT8_MAX);
+	reader.PCD_Init();
+	PresenceTracker tracker(&reader);
+
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	chip.cards.push_back(&card);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	CHECK(tracker.IsPresent() && tracker.GetUid().size == 4 && tracker.GetUid().uidByte[0] == 0xDE);
+	CHECK(tracker.GetAtqa()[0] == 0x04);
+	CHECK(card.state == SimCard::HALT);
+	for (int i = 0; i < 5; i++) {
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	}
+
+	// A short dropout
+	chip.cards.clear();
+	for (int i = 1; i < PRESENCE_REMOVE_AFTER; i++) {
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	}
+	chip.cards.push_back(&card);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE && tracker.IsPresent());
+
+	// A longer one: removed, while the card stays halted in the field
+	chip.cards.clear();
+	for (int i = 1; i < PRESENCE_REMOVE_AFTER; i++) {
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	}
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_REMOVED && !tracker.IsPresent());
+	chip.cards.push_back(&card);
+	CHECK(card.state == SimCard::HALT);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	CHECK(tracker.IsPresent() && tracker.GetUid().uidByte[3] == 0xEF && tracker.GetAtqa()[0] == 0x04);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE && tracker.IsPresent());
+
+	// Removed for good: WUPA only for the first polls after the removal
+	chip.cards.clear();
+	for (int i = 0; i < PRESENCE_REMOVE_AFTER; i++) {
+		tracker.Poll();
+	}
+	CHECK(!tracker.IsPresent());
+	for (int i = 0; i < PRESENCE_REWAKE_POLLS; i++) {
+		CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	}
+	chip.ResetTransactionCount();
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	uint32_t requestOnly = chip.GetTransactionCount();
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	CHECK(chip.GetTransactionCount() == 2 * requestOnly);
+
+	// The removed card halted past the window is not seen, a new one is
+	chip.cards.push_back(&card);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_NONE);
+	chip.cards.push_back(&other);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	CHECK(tracker.GetUid().size == 7 && tracker.GetUid().uidByte[0] == 0x01);
+
+	// Within the window a new card is found by REQA first
+	chip.cards.clear();
+	for (int i = 0; i < PRESENCE_REMOVE_AFTER; i++) {
+		tracker.Poll();
+	}
+	card.state = SimCard::IDLE;
+	other.state = SimCard::HALT;
+	chip.cards.push_back(&card);
+	chip.cards.push_back(&other);
+	CHECK(tracker.Poll() == PresenceTracker::EVENT_ARRIVED);
+	CHECK(tracker.GetUid().size == 4 && tracker.GetUid().uidByte[0] == 0xDE);
+
+	return CheckResult("test_presence");
+}
@@ -0,0 +1,147 @@
+/**
+ * test_read_card.cpp - MIFARE_ReadCard() of a simulated MIFARE Classic 4K.
+ *
+ * The 4K layout has 32 sectors of 4 blocks and 8 of 16 (sectors 32-39), 4096 bytes in all. Every sector takes exactly
+ * one authentication, at its trailer. A sector whose key is refused is zeroed in the image and the card is selected
+ * again for the next one; once the card left the field, it and all sectors after it are zeroed.
+ */
+#include "FakeChip.h"
+#include "Check.h"
+#include "MFRC522.h"
+
+#define SECTORS		40
+#define IMAGE_SIZE	4096
+
+static const byte KEY[6] = {0x4B, 0x45, 0x59, 0x30, 0x31, 0x32};
+static const byte OTHER_KEY[6] = {0x6F, 0x74, 0x68, 0x65, 0x72, 0x21};
+
+struct ReadTest {
+	FakeChip chip;
+	SimCard card;
+	MFRC522 reader;
+	byte image[IMAGE_SIZE];
+	MFRC522::StatusCode sectors[SECTORS];
+	byte sectorCount;
+	uint16_t imageSize;
+
+	ReadTest() : card(Bytes{0xC4, 0x4B, 0x00, 0x01}, 0x18), reader(&chip, UINT8_MAX) {
+		chip.hideKeys = true;
+		chip.checkKeys = true;
+		chip.cards.push_back(&card);
+		for (int s = 0; s < SECTORS; s++) {
+			SetKey(s, KEY);
+		}
+		reader.PCD_Init();
+		CHECK(reader.PICC_IsNewCardPresent());
+		CHECK(reader.PICC_ReadCardSerial());
+	}
+
+	static int Trailer(int sector) {
+		return sector < 32 ? sector * 4 + 3 : 128 + (sector - 32) * 16 + 15;
+	}
+
+	// Key A of the sector, the transport access bits, key B readable
+	void SetKey(int sector, const byte *key) {
+		byte *trailer = card.mem[Trailer(sector)];
+		memcpy(trailer, key, 6);
+		MFRC522::MIFARE_SetAccessBits(&trailer[6], 0, 0, 0, 1);
+		trailer[9] = 0x69;
+		memset(&trailer[10], 0xB0 + sector % 16, 6);
+	}
+
+	MFRC522::StatusCode Read() {
+		MFRC522::MIFARE_Key key;
+		memcpy(key.keyByte, KEY, 6);
+		imageSize = sizeof(image);
+		sectorCount = SECTORS;
+		memset(image, 0xEE, sizeof(image));
+		chip.authLog.clear();
+		MFRC522::StatusCode status = reader.MIFARE_ReadCard(MFRC522::PICC_CMD_MF_AUTH_KEY_A, &key, &reader.uid, image, &imageSize, sectors, &sectorCount);
+		reader.PCD_StopCrypto1();
+		return status;
+	}
+
+	// The sector is in the image as the card holds it, with key A in its trailer
+	bool SectorRead(int sector) const {
+		int first = sector < 32 ? sector * 4 : 128 + (sector - 32) * 16;
+		for (int block = first; block <= Trailer(sector); block++) {
+			if (memcmp(&image[block * 16], card.mem[block], 16) != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool SectorZeroed(int sector) const {
+		int first = sector < 32 ? sector * 4 : 128 + (sector - 32) * 16;
+		for (int i = first * 16; i < (Trailer(sector) + 1) * 16; i++) {
+			if (image[i] != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+int main() {
+	// All sectors: 4096 bytes, one authentication per sector at its trailer
+	{
+		ReadTest test;
+		CHECK(test.reader.PICC_GetType(test.reader.uid.sak) == MFRC522::PICC_TYPE_MIFARE_4K);
+		CHECK(test.Read() == MFRC522::STATUS_OK);
+		CHECK(test.imageSize == IMAGE_SIZE && test.sectorCount == SECTORS);
+		CHECK(test.chip.authLog.size() == SECTORS);
+		bool trailers = true, read = true;
+		for (int s = 0; s < SECTORS && s < (int)test.chip.authLog.size(); s++) {
+			trailers = trailers && test.chip.authLog[s] == ReadTest::Trailer(s);
+			read = read && test.sectors[s] == MFRC522::STATUS_OK && test.SectorRead(s);
+		}
+		CHECK(trailers);
+		CHECK(read);
+		// A 16 block sector ends at its trailer: sector 39 is blocks 240 to 255
+		CHECK(ReadTest::Trailer(39) == 255 && memcmp(&test.image[240 * 16], test.card.mem[240], 16) == 0);
+	}
+
+	// Refused keys in a small and a large sector: both zeroed, the card is selected again and the others read
+	{
+		ReadTest test;
+		test.SetKey(5, OTHER_KEY);
+		test.SetKey(33, OTHER_KEY);
+		CHECK(test.Read() == MFRC522::STATUS_TIMEOUT);
+		CHECK(test.chip.authLog.size() == SECTORS);
+		CHECK(test.sectors[5] == MFRC522::STATUS_TIMEOUT && test.SectorZeroed(5));
+		CHECK(test.sectors[33] == MFRC522::STATUS_TIMEOUT && test.SectorZeroed(33));
+		bool others = true;
+		for (int s = 0; s < SECTORS; s++) {
+			if (s != 5 && s != 33) {
+				others = others && test.sectors[s] == MFRC522::STATUS_OK && test.SectorRead(s);
+			}
+		}
+		CHECK(others);
+	}
+
+	// The card leaves while sector 12 is authenticated: it and everything after it is zeroed, without more attempts
+	{
+		ReadTest test;
+		test.chip.onAuthent = [&test](int block) {
+			if (block == ReadTest::Trailer(12)) {
+				test.chip.cards.clear();
+			}
+		};
+		CHECK(test.Read() == MFRC522::STATUS_TIMEOUT);
+		CHECK(test.chip.authLog.size() == 13);
+		bool before = true, after = true;
+		for (int s = 0; s < SECTORS; s++) {
+			if (s < 12) {
+				before = before && test.sectors[s] == MFRC522::STATUS_OK && test.SectorRead(s);
+			}
+			else {
+				after = after && test.sectors[s] != MFRC522::STATUS_OK && test.SectorZeroed(s);
+			}
+		}
+		CHECK(before);
+		CHECK(after);
+	}
+
+	return CheckResult("test_read_card");
+}
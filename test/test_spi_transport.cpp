@@ -0,0 +1,95 @@
+/**
+ * test_spi_transport.cpp - SpidevTransport against a simulated MFRC522, through the SubmitMessage() seam.
+ *
+ * The same card session runs once on a FakeChip used as the transport and once through SpidevTransport with
+ * FakeSpidev in place of the kernel. Both must see the same results and the same number of bus transactions, every
+ * message must release the chip select between its transfers only, and register programs must arrive as one message.
+ */
+#include "FakeSpidev.h"
+#include "Check.h"
+#include "MFRC522.h"
+
+struct SessionResult {
+	MFRC522::StatusCode request, select, read, write, halt;
+	MFRC522::Uid uid;
+	byte block[18];
+	byte written;
+	SimCard::State state;
+	uint32_t transactions;
+};
+
+/**
+ * REQA, SELECT, READ, WRITE and HLTA on a card with a 4 byte UID.
+ */
+static SessionResult RunSession(FakeChip &chip, SPITransport *transport) {
+	SessionResult result;
+	SimCard card(Bytes{0xDE, 0xAD, 0xBE, 0xEF}, 0x08);
+	chip.cards.assign(1, &card);
+	MFRC522 mfrc522(transport, UINT8_MAX);
+	mfrc522.PCD_Init();
+	transport->ResetTransactionCount();
+
+	byte atqa[2];
+	byte size = sizeof(atqa);
+	result.request = mfrc522.PICC_RequestA(atqa, &size);
+	result.select = mfrc522.PICC_Select(&result.uid);
+	size = sizeof(result.block);
+	result.read = mfrc522.MIFARE_Read(4, result.block, &size);
+	byte data[16];
+	memset(data, 0x5A, sizeof(data));
+	result.write = mfrc522.MIFARE_Write(5, data, sizeof(data));
+	result.halt = mfrc522.PICC_HaltA();
+	result.written = card.mem[5][0];
+	result.state = card.state;
+	result.transactions = transport->GetTransactionCount();
+	chip.cards.clear();
+	return result;
+}
+
+int main() {
+	FakeChip direct;
+	SessionResult expected = RunSession(direct, &direct);
+	CHECK(expected.request == MFRC522::STATUS_OK);
+	CHECK(expected.select == MFRC522::STATUS_OK);
+	CHECK(expected.uid.size == 4 && expected.uid.sak == 0x08 && expected.uid.uidByte[0] == 0xDE);
+	CHECK(expected.read == MFRC522::STATUS_OK && expected.block[0] == 4 * 16);
+	CHECK(expected.write == MFRC522::STATUS_OK && expected.written == 0x5A);
+	CHECK(expected.state == SimCard::HALT);
+
+	FakeChip chip;
+	FakeSpidev spidev(chip);
+	CHECK(!spidev.IsOpen());
+	SessionResult result = RunSession(chip, &spidev);
+	CHECK(result.request == expected.request);
+	CHECK(result.select == expected.select);
+	CHECK(result.uid.size == expected.uid.size && memcmp(result.uid.uidByte, expected.uid.uidByte, expected.uid.size) == 0);
+	CHECK(result.read == expected.read && memcmp(result.block, expected.block, 16) == 0);
+	CHECK(result.write == expected.write && result.written == expected.written);
+	CHECK(result.state == expected.state);
+	CHECK(result.transactions == expected.transactions);
+	printf("session: %u bus transactions, %u register accesses\n", result.transactions, spidev.transfers);
+
+	// One message per transaction, several register accesses in most of them, chip select framed correctly
+	CHECK(spidev.messages >= result.transactions);
+	CHECK(spidev.transfers > spidev.messages);
+	CHECK(spidev.badMessages == 0);
+
+	// A batch is one message with one transfer per register access
+	uint32_t messages = spidev.messages;
+	uint32_t frames = chip.frames;
+	uint8_t write[2] = {FakeChip::WaterLevelReg << 1, 0x20};
+	uint8_t read[2] = {0x80 | (FakeChip::WaterLevelReg << 1), 0};
+	SPI_Transfer batch[2] = {{write, NULL, 2}, {read, read, 2}};
+	CHECK(spidev.Transfer(batch, 2));
+	CHECK(spidev.messages == messages + 1 && chip.frames == frames + 2);
+	CHECK(read[1] == 0x20);
+	CHECK(spidev.Transfer(batch, 0) && spidev.messages == messages + 1);
+	SPI_Transfer tooMany[SPI_MAX_BATCH + 1];
+	CHECK(!spidev.Transfer(tooMany, SPI_MAX_BATCH + 1));
+	CHECK(spidev.badMessages == 0);
+
+	CHECK(spidev.SetSpeed(8000000) && spidev.GetSpeed() == 8000000);
+	CHECK(spidev.Transfer(batch, 2) && spidev.badMessages == 0);
+
+	return CheckResult("test_spi_transport");
+}
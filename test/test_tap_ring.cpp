@@ -0,0 +1,115 @@
+/**
+ * test_tap_ring.cpp - TapRing with one producer and one consumer thread.
+ *
+ * Filled past its capacity without a consumer, the ring keeps the latest records (OVERFLOW_DROP_OLDEST) or the first
+ * ones (OVERFLOW_DROP_NEWEST) and counts the others as dropped. With a slow consumer on another thread, every record
+ * is either delivered once, in order and intact, or counted in GetDropped().
+ */
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "Check.h"
+#include "TapRing.h"
+
+#define RECORDS		100000
+
+// A record whose fields all derive from its sequence number, so a torn copy shows
+static TapRecord MakeRecord(uint32_t sequence) {
+	TapRecord record;
+	memset(&record, 0, sizeof(record));
+	record.timestamp = sequence;
+	record.since = (uint64_t)sequence * 3;
+	record.dwell = ~sequence;
+	record.readerId = sequence ^ 0x5A5A5A5A;
+	record.uidSize = 7;
+	memset(record.uidByte, sequence & 0xFF, sizeof(record.uidByte));
+	return record;
+}
+
+static bool IsIntact(const TapRecord &record) {
+	uint32_t sequence = (uint32_t)record.timestamp;
+	TapRecord expected = MakeRecord(sequence);
+	return memcmp(&record, &expected, sizeof(record)) == 0;
+}
+
+// Without a consumer: capacity 4, 6 records pushed
+static void Overflow(TapRing::Overflow overflow) {
+	TapRing ring(4, overflow);
+	CHECK(ring.GetCapacity() == 4);
+	for (uint32_t i = 0; i < 6; i++) {
+		bool pushed = ring.Push(MakeRecord(i));
+		CHECK(pushed == (overflow == TapRing::OVERFLOW_DROP_OLDEST || i < 4));
+	}
+	CHECK(ring.GetDropped() == 2);
+
+	TapRecord records[8];
+	CHECK(ring.Pop(records, 8) == 4);
+	uint32_t first = overflow == TapRing::OVERFLOW_DROP_OLDEST ? 2 : 0;
+	for (uint32_t i = 0; i < 4; i++) {
+		CHECK(records[i].timestamp == first + i && IsIntact(records[i]));
+	}
+	CHECK(ring.Pop(records, 8) == 0);
+
+	// Room again after the consumer caught up
+	CHECK(ring.Push(MakeRecord(6)));
+	CHECK(ring.Pop(records, 8) == 1 && records[0].timestamp == 6);
+	CHECK(ring.GetDropped() == 2);
+}
+
+// A producer outrunning a consumer that takes small batches
+static void Threads(TapRing::Overflow overflow) {
+	TapRing ring(16, overflow);
+	std::vector<TapRecord> received;
+	received.reserve(RECORDS);
+	std::atomic<bool> done(false);
+
+	std::thread producer([&]() {
+		for (uint32_t i = 0; i < RECORDS; i++) {
+			ring.Push(MakeRecord(i));
+			if (i % 64 == 0) {
+				std::this_thread::yield();	// Let the consumer in now and then, so that some records get through and some are dropped
+			}
+		}
+		done = true;
+	});
+	TapRecord batch[5];
+	while (true) {
+		bool finished = done;
+		uint32_t count = ring.Pop(batch, 5);
+		received.insert(received.end(), batch, batch + count);
+		if (finished && count == 0) {
+			break;
+		}
+		if (count == 0) {
+			std::this_thread::yield();
+		}
+	}
+	producer.join();
+
+	bool ordered = true, intact = true;
+	for (size_t i = 0; i < received.size(); i++) {
+		ordered = ordered && (i == 0 || received[i].timestamp > received[i - 1].timestamp);
+		intact = intact && IsIntact(received[i]);
+	}
+	CHECK(ordered);
+	CHECK(intact);
+	CHECK(received.size() + ring.GetDropped() == RECORDS);
+	CHECK(!received.empty());
+	if (overflow == TapRing::OVERFLOW_DROP_NEWEST) {
+		CHECK(received[0].timestamp == 0);					// The first record is never the one dropped
+	}
+	else {
+		CHECK(received.back().timestamp == RECORDS - 1);	// Nor is the last one
+	}
+	printf("%s: %zu delivered, %u dropped\n", overflow == TapRing::OVERFLOW_DROP_OLDEST ? "dropOldest" : "dropNewest",
+		received.size(), ring.GetDropped());
+}
+
+int main() {
+	Overflow(TapRing::OVERFLOW_DROP_OLDEST);
+	Overflow(TapRing::OVERFLOW_DROP_NEWEST);
+	Threads(TapRing::OVERFLOW_DROP_OLDEST);
+	Threads(TapRing::OVERFLOW_DROP_NEWEST);
+	return CheckResult("test_tap_ring");
+}
@@ -0,0 +1,132 @@
+/**
+ * test_write_image.cpp - MIFARE_WriteCardImage() on a simulated MIFARE Classic 1K whose trailers hide their keys.
+ *
+ * A masked write that changes a trailer must not merge the keys that read back as zeros into it: the sector is
+ * rejected with STATUS_INVALID before any of its blocks is written, unless the mask covers those key bytes.
+ */
+#include "FakeChip.h"
+#include "Check.h"
+#include "MFRC522.h"
+
+static const byte KEY_A[6] = {0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5};
+static const byte KEY_B[6] = {0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5};
+#define IMAGE_SIZE	1024
+#define TRAILER		7		// Sector 1
+
+struct WriteTest {
+	FakeChip chip;
+	SimCard card;
+	MFRC522 reader;
+	byte image[IMAGE_SIZE];
+	byte mask[IMAGE_SIZE];
+	MFRC522::StatusCode sectors[16];
+	uint16_t written;
+
+	WriteTest() : card(Bytes{1, 2, 3, 4}, 0x08), reader(&chip, UINT8_MAX) {
+		chip.hideKeys = true;
+		chip.cards.push_back(&card);
+		for (int block = 3; block < 64; block += 4) {
+			SetTrailer(block, 1);		// Transport configuration: key A reads key B
+		}
+		reader.PCD_Init();
+		byte atqa[2];
+		byte size = sizeof(atqa);
+		CHECK(reader.PICC_RequestA(atqa, &size) == MFRC522::STATUS_OK);
+		CHECK(reader.PICC_Select(&reader.uid) == MFRC522::STATUS_OK);
+	}
+
+	void SetTrailer(int block, byte g3) {
+		memcpy(card.mem[block], KEY_A, 6);
+		MFRC522::MIFARE_SetAccessBits(&card.mem[block][6], 0, 0, 0, g3);
+		card.mem[block][9] = 0x69;
+		memcpy(&card.mem[block][10], KEY_B, 6);
+	}
+
+	MFRC522::StatusCode Read(byte command, const byte *keyBytes) {
+		MFRC522::MIFARE_Key key;
+		memcpy(key.keyByte, keyBytes, 6);
+		uint16_t size = sizeof(image);
+		byte count = 16;
+		MFRC522::StatusCode status = reader.MIFARE_ReadCard(command, &key, &reader.uid, image, &size, sectors, &count);
+		reader.PCD_StopCrypto1();
+		memset(mask, 0, sizeof(mask));
+		return status;
+	}
+
+	MFRC522::StatusCode Write(byte command, const byte *keyBytes) {
+		MFRC522::MIFARE_Key key;
+		memcpy(key.keyByte, keyBytes, 6);
+		byte count = 16;
+		MFRC522::StatusCode status = reader.MIFARE_WriteCardImage(command, &key, &reader.uid, image, mask, sizeof(image), sectors, &count, &written);
+		reader.PCD_StopCrypto1();
+		return status;
+	}
+
+	// Changes the trailer access condition in the image, and marks the access bits to be written
+	void ChangeAccess(byte g3) {
+		MFRC522::MIFARE_SetAccessBits(&image[TRAILER * 16 + 6], 0, 0, 0, g3);
+		memset(&mask[TRAILER * 16 + 6], 0xFF, 3);
+	}
+
+	bool KeysKept() const {
+		return memcmp(card.mem[TRAILER], KEY_A, 6) == 0 && memcmp(&card.mem[TRAILER][10], KEY_B, 6) == 0;
+	}
+};
+
+int main() {
+	WriteTest test;
+	byte blocked[3];
+	MFRC522::MIFARE_SetAccessBits(blocked, 0, 0, 0, 3);
+
+	// Authenticated with key A while key B reads back: both keys are known, the access bits alone can change
+	CHECK(test.Read(MFRC522::PICC_CMD_MF_AUTH_KEY_A, KEY_A) == MFRC522::STATUS_OK);
+	CHECK(memcmp(&test.image[TRAILER * 16], KEY_A, 6) == 0 && memcmp(&test.image[TRAILER * 16 + 10], KEY_B, 6) == 0);
+	test.ChangeAccess(3);
+	CHECK(test.Write(MFRC522::PICC_CMD_MF_AUTH_KEY_A, KEY_A) == MFRC522::STATUS_OK);
+	CHECK(test.written == 1);
+	CHECK(memcmp(&test.card.mem[TRAILER][6], blocked, 3) == 0);
+	CHECK(test.KeysKept());
+
+	// Authenticated with key B: key A reads as zeros and must not be merged into the trailer
+	CHECK(test.Read(MFRC522::PICC_CMD_MF_AUTH_KEY_B, KEY_B) == MFRC522::STATUS_OK);
+	CHECK(test.image[TRAILER * 16] == 0 && memcmp(&test.image[TRAILER * 16 + 10], KEY_B, 6) == 0);
+	test.ChangeAccess(1);
+	test.image[5 * 16] ^= 0xFF;				// A data block of the same sector
+	test.mask[5 * 16] = 0xFF;
+	test.image[9 * 16] ^= 0xFF;				// And one of the next sector
+	test.mask[9 * 16] = 0xFF;
+	CHECK(test.Write(MFRC522::PICC_CMD_MF_AUTH_KEY_B, KEY_B) == MFRC522::STATUS_INVALID);
+	CHECK(test.sectors[1] == MFRC522::STATUS_INVALID && test.sectors[2] == MFRC522::STATUS_OK);
+	CHECK(test.written == 1);
+	CHECK(test.card.mem[5][0] == 5 * 16 && test.card.mem[9][0] == (byte)~(9 * 16));
+	CHECK(memcmp(&test.card.mem[TRAILER][6], blocked, 3) == 0);
+	CHECK(test.KeysKept());
+
+	// With key A given in the image and the mask the trailer is written
+	memcpy(&test.image[TRAILER * 16], KEY_A, 6);
+	memset(&test.mask[TRAILER * 16], 0xFF, 6);
+	CHECK(test.Write(MFRC522::PICC_CMD_MF_AUTH_KEY_B, KEY_B) == MFRC522::STATUS_OK);
+	CHECK(test.written == 2);
+	CHECK(test.card.mem[5][0] == (byte)~(5 * 16));
+	CHECK(test.KeysKept());
+
+	// Key A, key B hidden: the same holds for key B
+	test.SetTrailer(TRAILER, 3);
+	CHECK(test.Read(MFRC522::PICC_CMD_MF_AUTH_KEY_A, KEY_A) == MFRC522::STATUS_OK);
+	CHECK(test.image[TRAILER * 16 + 10] == 0);
+	test.ChangeAccess(1);
+	CHECK(test.Write(MFRC522::PICC_CMD_MF_AUTH_KEY_A, KEY_A) == MFRC522::STATUS_INVALID);
+	CHECK(test.written == 0 && test.KeysKept());
+
+	// No mask: the image gives every byte, key B included
+	memcpy(&test.image[TRAILER * 16 + 10], KEY_B, 6);
+	CHECK(test.Write(MFRC522::PICC_CMD_MF_AUTH_KEY_A, KEY_A) == MFRC522::STATUS_INVALID);
+	MFRC522::MIFARE_Key key;
+	memcpy(key.keyByte, KEY_A, 6);
+	byte count = 16;
+	CHECK(test.reader.MIFARE_WriteCardImage(MFRC522::PICC_CMD_MF_AUTH_KEY_A, &key, &test.reader.uid, test.image, NULL, IMAGE_SIZE,
+		test.sectors, &count, &test.written) == MFRC522::STATUS_OK);
+	CHECK(test.written == 1 && test.KeysKept());
+
+	return CheckResult("test_write_image");
+}